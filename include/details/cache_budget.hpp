@@ -0,0 +1,78 @@
+//
+// Copyright (C) 2011 Rim Zaidullin <creator@bash.org.ru>
+//
+// Licensed under the BSD 2-Clause License (the "License");
+// you may not use this file except in compliance with the License.
+//
+// Unless required by applicable law or agreed to in writing, software
+// distributed under the License is distributed on an "AS IS" BASIS,
+// WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+// See the License for the specific language governing permissions and
+// limitations under the License.
+//
+
+#ifndef _LSD_CACHE_BUDGET_HPP_INCLUDED_
+#define _LSD_CACHE_BUDGET_HPP_INCLUDED_
+
+#include <boost/function.hpp>
+#include <boost/utility.hpp>
+#include <boost/thread/mutex.hpp>
+#include <boost/thread/condition_variable.hpp>
+
+#include "lsd/structs.hpp"
+
+namespace lsd {
+
+// bytes taken by messages in ram against max_ram_limit. room is reserved
+// before a message is queued and released once it completes, expires or
+// is removed. reserving and releasing are lock-free, the mutex is only
+// taken by producers waiting for room and by releases while they wait.
+// watermark callback fires on the thread that moved usage over high
+// watermark or under low one, once per crossing. thread safe.
+class cache_budget : private boost::noncopyable {
+public:
+	typedef boost::function<void(enum cache_watermark_event, size_t)> watermark_callback_t;
+
+public:
+	explicit cache_budget(size_t max_size);
+	virtual ~cache_budget();
+
+	// fail fast, false if size doesn't fit under max size
+	bool try_reserve(size_t size);
+
+	// wait up to timeout seconds for room, timeout < 0 waits forever
+	bool reserve(size_t size, double timeout);
+
+	// take room regardless of max size, for messages that can't be refused
+	void force_reserve(size_t size);
+	void release(size_t size);
+
+	size_t used() const;
+	size_t max_size() const;
+
+	// high == 0 or empty callback turns watermarks off
+	void set_watermarks(size_t high, size_t low, const watermark_callback_t& callback);
+
+private:
+	void reserved(size_t used);
+	void invoke_watermark_callback(enum cache_watermark_event event, size_t used);
+
+private:
+	size_t max_size_;
+	volatile size_t used_;
+
+	// watermarks
+	size_t high_watermark_;
+	size_t low_watermark_;
+	volatile int is_over_high_watermark_;
+	watermark_callback_t watermark_callback_;
+
+	// producers blocked in reserve()
+	volatile size_t waiters_;
+	boost::mutex mutex_;
+	boost::condition_variable condition_;
+};
+
+} // namespace lsd
+
+#endif // _LSD_CACHE_BUDGET_HPP_INCLUDED_
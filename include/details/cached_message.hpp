@@ -15,17 +15,34 @@
 #define _LSD_CACHED_MESSAGE_HPP_INCLUDED_
 
 #include <string>
+#include <vector>
 #include <sys/time.h>
 
 #include <boost/shared_ptr.hpp>
+#include <boost/cstdint.hpp>
 #include <boost/thread/mutex.hpp>
 
 #include "lsd/structs.hpp"
 #include "details/data_container.hpp"
+#include "details/message_uuid.hpp"
 #include "details/time_value.hpp"
 
 namespace lsd {
 
+// delivery progress of a send_to_all_hosts message
+struct broadcast_state {
+	broadcast_state() : hosts_count(0), failed_hosts(0), error_code(0) {};
+
+	// hosts that haven't completed their response yet
+	std::vector<LT::ip_addr> pending_hosts;
+	size_t hosts_count;
+
+	// hosts that answered with an error, last error is kept
+	size_t failed_hosts;
+	int error_code;
+	std::string error_message;
+};
+
 class cached_message {
 public:
 	cached_message();
@@ -36,21 +53,66 @@ public:
 				   const void* data,
 				   size_t data_size_);
 
+	// message restored from persistent storage keeps its uuid
+	cached_message(const message_uuid& uuid,
+				   const message_path& path,
+				   const message_policy& policy,
+				   const void* data,
+				   size_t data_size_);
+
 	virtual ~cached_message();
 
 	const data_container& data() const;
 	size_t container_size() const;
 
+	// bytes reserved in cache budget for this message, copies don't own them.
+	// take_accounted_size() hands them out once, 0 afterwards.
+	void set_accounted_size(size_t size);
+	size_t take_accounted_size();
+
 	const message_path& path() const;
 	const message_policy& policy() const;
-	const std::string& uuid() const;
+	// string form is formatted on every call, keep it if needed more than once
+	std::string uuid() const;
+	const message_uuid& binary_uuid() const;
 
 	bool is_sent() const;
 	const time_value& sent_timestamp() const;
 
 	void mark_as_sent(bool value);
 
-	std::string json();
+	// bumped on every send, timers armed for older sends are stale
+	boost::uint32_t timer_generation() const;
+
+	// host started streaming the response, timeout no longer applies
+	bool is_response_started() const;
+	void mark_response_started();
+
+	int timeout_retries_count() const;
+	void increment_timeout_retries();
+
+	// host the message was last sent to, 0 if sent over shared socket
+	LT::ip_addr destination_host() const;
+	void set_destination_host(LT::ip_addr ip);
+
+	// host that answered MESSAGE_QUEUE_IS_FULL last time, 0 if none
+	LT::ip_addr rejected_host() const;
+	int resend_attempts() const;
+	void mark_as_rejected();
+
+	// broadcast delivery, hosts complete one by one.
+	// complete_broadcast_host() returns false if host was not waited for.
+	const broadcast_state& broadcast() const;
+	void start_broadcast(const std::vector<LT::ip_addr>& hosts);
+	bool complete_broadcast_host(LT::ip_addr ip, int error_code, const std::string& error_message);
+	bool is_broadcast_completed() const;
+
+	// aggregated result of completed broadcast, false if all hosts succeeded
+	bool broadcast_error(int& error_code, std::string& error_message) const;
+
+	// serialized envelope, built on first use and reused on resend.
+	// must only be called from the dispatching handle thread.
+	const std::string& envelope(enum envelope_encoding encoding);
 	bool is_expired();
 
 	cached_message& operator = (const cached_message& rhs);
@@ -63,19 +125,33 @@ public:
 private:
 	void gen_uuid();
 	void init();
+
+	void build_json_envelope();
+	void build_msgpack_envelope();
 	
 private:
 	// message data
 	data_container data_;
 	message_path path_;
 	message_policy policy_;
-	std::string uuid_;
+	message_uuid uuid_;
 
 	// metadata
 	bool is_sent_;
 	time_value sent_timestamp_;
+	LT::ip_addr destination_host_;
+	LT::ip_addr rejected_host_;
+	int resend_attempts_;
+	boost::uint32_t timer_generation_;
+	bool is_response_started_;
 	size_t container_size_;
+	volatile size_t accounted_size_;
 	int timeout_retries_count_;
+	broadcast_state broadcast_;
+
+	// cached envelopes
+	std::string json_envelope_;
+	std::string msgpack_envelope_;
 
 	// synchronization
 	boost::mutex mutex_;
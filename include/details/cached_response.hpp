@@ -17,6 +17,8 @@
 #include <string>
 #include <sys/time.h>
 
+#include <zmq.hpp>
+
 #include <boost/shared_ptr.hpp>
 #include <boost/thread/mutex.hpp>
 
@@ -35,6 +37,11 @@ public:
 					const void* data,
 					size_t data_size);
 
+	// takes ownership of received chunk, data() will point into the frame
+	cached_response(const std::string& uuid,
+					const message_path& path,
+					zmq::message_t& chunk);
+
 	cached_response(const std::string& uuid,
 					const message_path& path,
 					int error_code,
@@ -42,7 +49,8 @@ public:
 
 	virtual ~cached_response();
 
-	const data_container& data() const;
+	void* data() const;
+	size_t data_size() const;
 	size_t container_size() const;
 
 	const message_path& path() const;
@@ -67,6 +75,7 @@ private:
 	std::string uuid_;
 	message_path path_;
 	data_container data_;
+	boost::shared_ptr<zmq::message_t> frame_;
 
 	timeval received_timestamp_;
 	size_t container_size_;
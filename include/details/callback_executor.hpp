@@ -0,0 +1,92 @@
+//
+// Copyright (C) 2011 Rim Zaidullin <creator@bash.org.ru>
+//
+// Licensed under the BSD 2-Clause License (the "License");
+// you may not use this file except in compliance with the License.
+//
+// Unless required by applicable law or agreed to in writing, software
+// distributed under the License is distributed on an "AS IS" BASIS,
+// WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+// See the License for the specific language governing permissions and
+// limitations under the License.
+//
+
+
+#ifndef _LSD_CALLBACK_EXECUTOR_HPP_INCLUDED_
+#define _LSD_CALLBACK_EXECUTOR_HPP_INCLUDED_
+
+#include <deque>
+#include <vector>
+
+#include <boost/shared_ptr.hpp>
+#include <boost/function.hpp>
+#include <boost/utility.hpp>
+#include <boost/thread/thread.hpp>
+#include <boost/thread/mutex.hpp>
+#include <boost/thread/condition_variable.hpp>
+
+#include "details/smart_logger.hpp"
+
+namespace lsd {
+
+// small fixed pool running user callbacks off the reactor threads. tasks
+// are posted to serial queues: tasks of one queue run one at a time in
+// posting order, different queues run in parallel and take turns task by
+// task, so a slow callback holds up its own queue only. thread safe.
+class callback_executor : private boost::noncopyable {
+public:
+	typedef boost::function<void()> task_t;
+
+	class queue;
+	typedef boost::shared_ptr<queue> queue_ptr_t;
+
+	// threads == 0 means 1
+	callback_executor(size_t threads, boost::shared_ptr<base_logger> logger);
+	virtual ~callback_executor();
+
+	queue_ptr_t create_queue();
+
+	// tasks posted to closed queue are dropped
+	void post(const queue_ptr_t& queue, const task_t& task);
+
+	// drop pending tasks of queue and block until its running task is
+	// done, if any. must not be called from a task of that queue.
+	void close(const queue_ptr_t& queue);
+
+	size_t size() const;
+
+private:
+	void run();
+
+private:
+	boost::shared_ptr<base_logger> logger_;
+
+	// queues with pending tasks and no thread running them
+	std::deque<queue_ptr_t> ready_;
+
+	std::vector<boost::shared_ptr<boost::thread> > threads_;
+	bool is_running_;
+
+	boost::mutex mutex_;
+	boost::condition_variable ready_cond_;
+	boost::condition_variable done_cond_;
+};
+
+class callback_executor::queue : private boost::noncopyable {
+public:
+	queue();
+
+private:
+	friend class callback_executor;
+
+	std::deque<task_t> tasks_;
+
+	// queued in ready list or being run
+	bool is_scheduled_;
+	bool is_running_;
+	bool is_closed_;
+};
+
+} // namespace lsd
+
+#endif // _LSD_CALLBACK_EXECUTOR_HPP_INCLUDED_
@@ -28,6 +28,9 @@
 #include "details/context.hpp"
 #include "details/service.hpp"
 #include "details/heartbeats_collector.hpp"
+#include "details/spill_queue.hpp"
+#include "details/refresher.hpp"
+#include "details/progress_timer.hpp"
 
 namespace lsd {
 
@@ -54,6 +57,29 @@ public:
 							 const message_path& path,
 							 const message_policy& policy);
 
+	// send waiting for room in message cache, see client.hpp
+	bool try_send_message(const void* data,
+						  size_t size,
+						  const message_path& path,
+						  const message_policy& policy,
+						  std::string& uuid);
+
+	bool timed_send_message(const void* data,
+							size_t size,
+							const message_path& path,
+							const message_policy& policy,
+							double timeout,
+							std::string& uuid);
+
+	std::string blocking_send_message(const void* data,
+									  size_t size,
+									  const message_path& path,
+									  const message_policy& policy);
+
+	void set_cache_watermarks(size_t high_watermark,
+							  size_t low_watermark,
+							  boost::function<void(enum cache_watermark_event, size_t)> callback);
+
 	// send string data
 	std::string send_message(const std::string& data,
 							 const std::string& service_name,
@@ -70,22 +96,33 @@ public:
 							   const std::string& service_name,
 							   const std::string& handle_name);
 
-	size_t messages_cache_size() const;
+	size_t messages_cache_size();
 
 	boost::shared_ptr<base_logger> logger();
 	boost::shared_ptr<configuration> config();
 	boost::shared_ptr<lsd::context> context();
 
 private:
-	void update_messages_cache_size();
+	// timeout == 0 fails fast, timeout < 0 waits as long as it takes.
+	// false if there's no room in message cache (and spill) in time.
+	bool enqueue_message(const void* data,
+						 size_t size,
+						 const message_path& path,
+						 const message_policy& policy,
+						 double timeout,
+						 std::string& uuid);
+
+	// stream messages left in persistent storage by previous run and
+	// spilled messages back while cache is under refill watermark
+	void refill_queues();
+	void move_recovered_messages();
+	void move_spilled_messages();
 	void service_hosts_pinged_callback(const service_info_t& s_info, const std::vector<host_info_t>& hosts, const std::vector<handle_info_t>& handles);
 
 private:
 	typedef std::map<std::string, boost::shared_ptr<service_t> > services_map_t;
 
 private:
-	size_t messages_cache_size_;
-
 	// main lsd context
 	boost::shared_ptr<lsd::context> context_;
 
@@ -98,8 +135,25 @@ private:
 	// message response callback
 	boost::function<void(const std::string&, void* data, size_t size)> response_callback_;
 
-	// synchronization
+	// messages over max_ram_limit, empty when spilling is off
+	std::auto_ptr<spill_queue> spill_;
+
+	// set while spill_ has messages, new ones must queue up behind them.
+	// changed under mutex_, read without it by senders
+	volatile bool spilling_;
+
+	// orders spilling and refilling, normal sends don't take it
 	boost::mutex mutex_;
+
+	// recovery of previous run backlog, refresher thread only
+	bool recovering_;
+	size_t recovered_count_;
+	boost::uint64_t recovered_bytes_;
+	size_t recovery_dropped_;
+	progress_timer recovery_timer_;
+
+	// checks recovery and spill once a second, goes first on destruction
+	std::auto_ptr<refresher> refill_refresher_;
 };
 
 } // namespace lsd
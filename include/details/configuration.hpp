@@ -49,8 +49,22 @@ public:
 	unsigned int config_version() const;
 	unsigned long long message_timeout() const;
 	unsigned long long socket_poll_timeout() const;
+	size_t send_batch_messages() const;
+	size_t send_batch_bytes() const;
+	enum response_validation_level response_validation_level() const;
+	enum balancing_type balancing_type() const;
+	unsigned long long resend_base_delay() const;
+	unsigned long long resend_max_delay() const;
+	unsigned int max_resend_rate() const;
+	bool is_reactor_pool_enabled() const;
+	unsigned int reactor_threads() const;
+	unsigned int callback_threads() const;
 	size_t max_message_cache_size() const;
 	enum message_cache_type message_cache_type() const;
+	const std::string& spill_path() const;
+	boost::uint64_t max_spill_size() const;
+	bool use_hugepages() const;
+	size_t dedup_min_size() const;
 	
 	enum logger_type logger_type() const;
 	unsigned int logger_flags() const;
@@ -61,6 +75,8 @@ public:
 	std::string eblob_log_path() const;
 	unsigned int eblob_log_flags() const;
 	int eblob_sync_interval() const;
+	unsigned int eblob_max_gb() const;
+	size_t eblob_sync_bytes() const;
 	
 	enum autodiscovery_type autodiscovery_type() const;
 	std::string multicast_ip() const;
@@ -95,8 +111,22 @@ private:
 	// general
 	unsigned long long message_timeout_;
 	unsigned long long socket_poll_timeout_;
+	size_t send_batch_messages_;
+	size_t send_batch_bytes_;
+	enum response_validation_level response_validation_level_;
+	enum balancing_type balancing_type_;
+	unsigned long long resend_base_delay_;
+	unsigned long long resend_max_delay_;
+	unsigned int max_resend_rate_;
+	bool is_reactor_pool_enabled_;
+	unsigned int reactor_threads_;
+	unsigned int callback_threads_;
 	size_t max_message_cache_size_;
 	enum message_cache_type message_cache_type_;
+	std::string spill_path_;
+	boost::uint64_t max_spill_size_;
+	bool use_hugepages_;
+	size_t dedup_min_size_;
 	
 	// logger
 	enum logger_type logger_type_;
@@ -109,6 +139,8 @@ private:
 	std::string eblob_log_path_;
 	unsigned int eblob_log_flags_;
 	int eblob_sync_interval_;
+	unsigned int eblob_max_gb_;
+	size_t eblob_sync_bytes_;
 	
 	// autodiscovery
 	enum autodiscovery_type autodiscovery_type_;
@@ -25,7 +25,11 @@
 #include <boost/thread/mutex.hpp>
 
 #include "details/smart_logger.hpp"
+#include "details/cache_budget.hpp"
+#include "details/callback_executor.hpp"
 #include "details/configuration.hpp"
+#include "details/message_log.hpp"
+#include "details/reactor.hpp"
 #include "details/statistics_collector.hpp"
 
 namespace lsd {
@@ -40,11 +44,27 @@ public:
 	boost::shared_ptr<zmq::context_t> zmq_context();
 	boost::shared_ptr<statistics_collector> stats();
 
+	// shared dispatch threads, empty unless reactor_pool is enabled
+	boost::shared_ptr<reactor_pool> reactors();
+
+	// runs response callbacks of services, set along with reactors
+	boost::shared_ptr<callback_executor> callbacks();
+
+	// durable copy of enqueued messages, empty unless message cache is PERSISTANT
+	boost::shared_ptr<message_log> messages_log();
+
+	// bytes of queued messages against max_ram_limit
+	boost::shared_ptr<cache_budget> messages_budget();
+
 private:
 	boost::shared_ptr<zmq::context_t> zmq_context_;
 	boost::shared_ptr<base_logger> logger_;
 	boost::shared_ptr<configuration> config_;
 	boost::shared_ptr<statistics_collector> stats_;
+	boost::shared_ptr<reactor_pool> reactors_;
+	boost::shared_ptr<callback_executor> callbacks_;
+	boost::shared_ptr<message_log> messages_log_;
+	boost::shared_ptr<cache_budget> messages_budget_;
 
 	// synchronization
 	boost::mutex mutex_;
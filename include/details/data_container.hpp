@@ -18,14 +18,16 @@
 #include <stdexcept>
 #include <sys/time.h>
 
-#include <boost/shared_ptr.hpp>
-#include <boost/detail/atomic_count.hpp>
-#include <boost/thread/mutex.hpp>
+#include <boost/cstdint.hpp>
 
 #include "lsd/structs.hpp"
 
 namespace lsd {
 
+// immutable payload shared by copies. reference counter and data live in
+// one slab allocation, counting is lock-free, so copies are cheap and can
+// be made and dropped on any thread. a single instance is not meant to be
+// assigned from several threads at once.
 class data_container {
 
 public:
@@ -43,37 +45,52 @@ public:
 	bool empty() const;
 	void clear();
 
-private:
-	// sha1 size in bytes
-	static const size_t SHA1_SIZE = 20;
+	// takes a payload reference for a zmq frame built over data(),
+	// returned value is the hint for release_reference()
+	void* add_reference() const;
 
-	// sha1-encoded data chunk size - 512 kb
-	static const size_t SHA1_CHUNK_SIZE = 512 * 1024;
+	// zmq_free_fn compatible, drops a reference taken with add_reference()
+	static void release_reference(void* data, void* hint);
 
-	// max amount of data that does not need sha1 signature 1 mb
-	static const size_t SMALL_DATA_SIZE = 1024 * 1024;
+	// 64-bit hash of data, computed on first use and shared by copies
+	boost::uint64_t fingerprint() const;
 
-	typedef boost::detail::atomic_count reference_counter;
-	
-	void init();
-	void init_with_data(unsigned char* data, size_t size);
-	void swap(data_container& other);
-	void sign_data(unsigned char* data, size_t& size, unsigned char signature[SHA1_SIZE]);
+	// fast non-cryptographic hash (xxh64), equal data gives equal hash
+	static boost::uint64_t hash_data(const void* data, size_t size);
+
+	// payloads of min_size bytes and more with equal data share one
+	// buffer, 0 turns deduplication off
+	static void set_dedup_min_size(size_t min_size);
 
 private:
-	// data
-	unsigned char* data_;
-	size_t size_;
+	// data bigger than this is compared by fingerprint first - 1 mb
+	static const size_t SMALL_DATA_SIZE = 1024 * 1024;
+
+	enum buffer_state {
+		BUFFER_FINGERPRINTED = 1,
+		BUFFER_SHARED = 2 // registered in dedup store
+	};
+
+	// precedes payload in the same allocation, keeps it 16 byte aligned
+	struct buffer {
+		volatile long references;
+		size_t size;
+		volatile boost::uint64_t fingerprint;
+		volatile boost::uint32_t state;
+	};
 
-	// data sha1 signature
-	bool signed_;
-	unsigned char signature_[SHA1_SIZE];
+	void init();
+	void init_with_data(const unsigned char* data, size_t size);
+	void swap(data_container& other);
 
-	// data reference counter
-	boost::shared_ptr<reference_counter> ref_counter_;
+	static buffer* allocate_buffer(const unsigned char* data, size_t size);
+	static buffer* find_shared_buffer(const unsigned char* data, size_t size, boost::uint64_t fingerprint);
+	static bool try_add_reference(buffer* buff);
+	static void release_buffer(buffer* buff);
 
-	// synchronization
-	boost::mutex mutex_;
+private:
+	// shared reference counter and data, NULL when empty
+	buffer* buffer_;
 };
 
 } // namespace lsd
@@ -0,0 +1,61 @@
+//
+// Copyright (C) 2011 Rim Zaidullin <creator@bash.org.ru>
+//
+// Licensed under the BSD 2-Clause License (the "License");
+// you may not use this file except in compliance with the License.
+//
+// Unless required by applicable law or agreed to in writing, software
+// distributed under the License is distributed on an "AS IS" BASIS,
+// WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+// See the License for the specific language governing permissions and
+// limitations under the License.
+//
+
+#ifndef _LSD_ENVELOPE_PARSER_HPP_INCLUDED_
+#define _LSD_ENVELOPE_PARSER_HPP_INCLUDED_
+
+#include <cstddef>
+#include <string>
+
+namespace lsd {
+
+// response envelope fields, strings point into the scanned buffer
+struct response_envelope {
+	response_envelope() :
+		uuid(NULL),
+		uuid_size(0),
+		completed(false),
+		code(0),
+		message(NULL),
+		message_size(0),
+		message_escaped(false) {};
+
+	const char* uuid;
+	size_t uuid_size;
+	bool completed;
+	int code;
+	const char* message;
+	size_t message_size;
+	bool message_escaped;
+};
+
+// single pass json scanner for response envelopes, does no heap allocations.
+// returns false on anything it doesn't expect, callers should fall back
+// to a full json parser in that case.
+class envelope_parser {
+public:
+	static bool scan_json(const char* data, size_t size, response_envelope& envelope);
+
+	// decode escaped json string body (without quotes)
+	static bool unescape(const char* data, size_t size, std::string& result);
+
+private:
+	static const char* skip_whitespace(const char* pos, const char* end);
+	static const char* scan_string(const char* pos, const char* end, bool& escaped);
+	static const char* scan_integer(const char* pos, const char* end, int& value);
+	static const char* skip_value(const char* pos, const char* end);
+};
+
+} // namespace lsd
+
+#endif // _LSD_ENVELOPE_PARSER_HPP_INCLUDED_
@@ -15,15 +15,20 @@
 #define _LSD_HANDLE_HPP_INCLUDED_
 
 #include <string>
+#include <algorithm>
 #include <map>
+#include <vector>
 #include <memory>
 #include <cerrno>
+#include <cstdlib>
+#include <ctime>
 
 #include <zmq.hpp>
 
 #include <msgpack.hpp>
 
 #include <boost/shared_ptr.hpp>
+#include <boost/weak_ptr.hpp>
 #include <boost/utility.hpp>
 #include <boost/thread/thread.hpp>
 #include <boost/date_time.hpp>
@@ -39,24 +44,32 @@
 #include "details/host_info.hpp"
 #include "details/cached_message.hpp"
 #include "details/cached_response.hpp"
+#include "details/envelope_parser.hpp"
 #include "details/message_cache.hpp"
+#include "details/mpsc_queue.hpp"
+#include "details/mpsc_ring.hpp"
 #include "details/progress_timer.hpp"
+#include "details/reactor.hpp"
+#include "details/timing_wheel.hpp"
+#include "details/wakeup_signal.hpp"
 
 namespace lsd {
 
-#define CONTROL_MESSAGE_NOTHING 0
-#define CONTROL_MESSAGE_CONNECT 1
-#define CONTROL_MESSAGE_RECONNECT 2
-#define CONTROL_MESSAGE_DISCONNECT 3
-#define CONTROL_MESSAGE_CONNECT_NEW_HOSTS 4
-#define CONTROL_MESSAGE_KILL 5
+enum control_message_type {
+	CONTROL_MESSAGE_NOTHING = 0,
+	CONTROL_MESSAGE_CONNECT,
+	CONTROL_MESSAGE_RECONNECT,
+	CONTROL_MESSAGE_DISCONNECT,
+	CONTROL_MESSAGE_CONNECT_NEW_HOSTS,
+	CONTROL_MESSAGE_KILL
+};
 
 // predeclaration
 template <typename LSD_T> class handle;
 typedef handle<LT> handle_t;
 
 template <typename LSD_T>
-class handle : public boost::noncopyable {
+class handle : public boost::noncopyable, public reactor_handler {
 public:
 	typedef std::vector<host_info<LSD_T> > hosts_info_list_t;
 	typedef boost::shared_ptr<zmq::socket_t> socket_ptr_t;
@@ -64,6 +77,44 @@ public:
 	typedef boost::shared_ptr<cached_response> cached_response_prt_t;
 	typedef boost::function<void(cached_response_prt_t)> responce_callback_t;
 
+	// socket connected to a single host or, when balancing round robin, to all hosts.
+	// round robin mode keeps per-host sockets for broadcasts too, these are
+	// connected on first broadcast and have an empty socket till then.
+	struct host_connection {
+		host_connection() : ip(0), in_flight(0), weight(1.0), has_responses(false), is_broadcast_only(false) {};
+
+		typename LSD_T::ip_addr ip;
+		socket_ptr_t socket;
+		size_t in_flight;
+		double weight;
+		bool has_responses;
+		bool is_broadcast_only;
+	};
+
+	// map <host ip, last reported host load>
+	typedef std::map<typename LSD_T::ip_addr, host_load> hosts_load_map_t;
+
+	typedef std::vector<host_connection> connections_t;
+
+	// command handed over to dispatch thread, carries its hosts along
+	struct control_message {
+		control_message() : type(CONTROL_MESSAGE_NOTHING) {};
+		control_message(enum control_message_type type_, const hosts_info_list_t& hosts_) :
+			type(type_), hosts(hosts_) {};
+
+		enum control_message_type type;
+		hosts_info_list_t hosts;
+	};
+
+	// timeout or deadline timer of a sent message, stale once generation changes
+	struct message_timer {
+		message_timer() : generation(0), is_deadline(false) {};
+
+		boost::weak_ptr<cached_message> message;
+		boost::uint32_t generation;
+		bool is_deadline;
+	};
+
 public:
 	handle(const handle_info<LSD_T>& info,
 		   boost::shared_ptr<lsd::context> context,
@@ -80,26 +131,85 @@ public:
 	void reconnect(const hosts_info_list_t& hosts);
 	void disconnect();
 
+	// pick up hosts metadata (protocol version) refreshed by heartbeats
+	void refresh_hosts_info(const hosts_info_list_t& hosts);
+
 	void set_responce_callback(responce_callback_t callback);
+
+	// lock free unless pending ring is full, safe to call from any thread
 	void enqueue_message(boost::shared_ptr<cached_message> message);
 
+	// move enqueued messages into message cache, done by dispatch loop on
+	// every iteration and by owner before taking messages out of the cache
+	void flush_pending_messages();
+
+	// dispatch loop steps, driven by own thread or by a shared reactor
+	void dispatch_start();
+	void fill_poll_items(std::vector<zmq_pollitem_t>& items);
+	long poll_timeout();
+	bool process_events(const zmq_pollitem_t* items);
+	void dispatch_stop();
+
 private:
 	void kill();
 	void dispatch_messages();
 	void log_dispatch_start();
 
 	// working with control messages
-	void establish_control_conection(socket_ptr_t& control_socket);
-	int receive_control_messages(socket_ptr_t& control_socket);
-	void dispatch_control_messages(int type, socket_ptr_t& main_socket);
+	void send_control_message(enum control_message_type type,
+							  const hosts_info_list_t& hosts = hosts_info_list_t());
+	void dispatch_control_messages(control_message& message, connections_t& connections);
+
+	// working with connections
+	void update_connections(connections_t& connections,
+							hosts_info_list_t& hosts,
+							bool replace_hosts);
 
-	// working with messages
-	bool dispatch_next_available_message(socket_ptr_t main_socket);
 	void connect_zmq_socket_to_hosts(socket_ptr_t& socket,
 									 hosts_info_list_t& hosts);
 
-	bool check_for_responses(socket_ptr_t& main_socket);
-	void dispatch_responces(socket_ptr_t& main_socket);
+	host_connection& choose_connection(connections_t& connections,
+									   boost::shared_ptr<cached_message> message);
+	void refresh_in_flight_counts(connections_t& connections);
+	void refresh_connection_weights(connections_t& connections);
+	static double load_weight(const host_load& load);
+
+	// working with messages
+	size_t dispatch_next_available_messages(connections_t& connections);
+	bool send_cached_message(socket_ptr_t& main_socket, boost::shared_ptr<cached_message> message);
+
+	// send_to_all_hosts messages go to every host, sharing one payload buffer
+	bool send_broadcast_message(connections_t& connections, boost::shared_ptr<cached_message> message);
+	void complete_broadcast_message(boost::shared_ptr<cached_message> message);
+
+	// working with message timeouts and deadlines
+	void arm_message_timers(boost::shared_ptr<cached_message> message);
+	void process_expired_timers();
+	void expire_message(boost::shared_ptr<cached_message> message, const std::string& error_msg);
+
+	void dispatch_responces(host_connection& connection);
+	bool validate_response_chunk(zmq::message_t& chunk);
+
+	// envelope encoding every host understands
+	static enum envelope_encoding common_envelope_encoding(const hosts_info_list_t& hosts);
+
+	void parse_response_envelope(zmq::message_t& envelope,
+								 std::string& uuid,
+								 bool& is_completed,
+								 int& error_code,
+								 std::string& error_message);
+
+	void parse_json_envelope(zmq::message_t& envelope,
+							 std::string& uuid,
+							 bool& is_completed,
+							 int& error_code,
+							 std::string& error_message);
+
+	void parse_msgpack_envelope(zmq::message_t& envelope,
+								std::string& uuid,
+								bool& is_completed,
+								int& error_code,
+								std::string& error_message);
 
 	void enqueue_response(cached_response_prt_t response);
 
@@ -114,17 +224,54 @@ private:
 private:
 	handle_info<LSD_T> info_;
 	boost::shared_ptr<lsd::context> context_;
+	// hosts to connect to, dispatch thread only
 	hosts_info_list_t hosts_;
-	hosts_info_list_t new_hosts_;
 	boost::shared_ptr<message_cache> message_cache_;
 
 	boost::thread thread_;
+	reactor* reactor_;
 	boost::mutex mutex_;
 	volatile bool is_running_;
 	volatile bool is_connected_;
 
-	std::auto_ptr<zmq::socket_t> zmq_control_socket_;
-	bool receiving_control_socket_ok_;
+	// control messages from other threads
+	mpsc_queue<control_message> control_messages_;
+
+	// wakes dispatch thread up when new messages or control messages are enqueued
+	wakeup_signal wakeup_;
+
+	// messages from producers on their way to message cache. when ring is
+	// full they go to overflow queue, and keep going there until it's
+	// flushed, so that messages of one producer never overtake each other.
+	mpsc_ring<boost::shared_ptr<cached_message> > pending_messages_;
+	message_cache::message_queue_t overflow_messages_;
+	volatile size_t overflow_messages_count_;
+	boost::mutex overflow_mutex_;
+
+	// single consumer of pending messages at a time
+	boost::mutex flush_mutex_;
+
+	// envelope encoding for outgoing messages
+	volatile enum envelope_encoding envelope_encoding_;
+
+	// how messages are spread across hosts
+	enum balancing_type balancing_type_;
+	unsigned int random_seed_;
+
+	// dispatch thread state
+	connections_t connections_;
+
+	// reused by dispatch loop, connection index of every polled host socket
+	std::vector<zmq_pollitem_t> poll_items_;
+	std::vector<size_t> polled_connections_;
+
+	// timeouts and deadlines of sent messages, dispatch thread only
+	timing_wheel<message_timer> timers_;
+	std::vector<message_timer> expired_timers_;
+
+	// hosts load handed over from heartbeats, guarded by mutex_
+	hosts_load_map_t hosts_load_;
+	volatile bool hosts_load_changed_;
 
 	responce_callback_t response_callback_;
 
@@ -138,26 +285,34 @@ handle<LSD_T>::handle(const handle_info<LSD_T>& info,
 	info_(info),
 	context_(lsd_context),
 	hosts_(hosts),
+	reactor_(NULL),
 	is_running_(false),
 	is_connected_(false),
-	receiving_control_socket_ok_(false)
+	pending_messages_(PENDING_MESSAGES_RING_SIZE),
+	overflow_messages_count_(0),
+	envelope_encoding_(common_envelope_encoding(hosts)),
+	random_seed_((unsigned int)time(NULL) ^ (unsigned int)(size_t)this),
+	timers_(TIMERS_RESOLUTION / 1000.0, time_value::get_current_time().as_double()),
+	hosts_load_changed_(false)
 {
 	logger()->log(PLOG_DEBUG, "created service %s handle %s", info.service_name_.c_str(), info.name_.c_str());
 
+	balancing_type_ = config()->balancing_type();
+	refresh_hosts_info(hosts);
+
 	// create message cache
 	message_cache_.reset(new message_cache(context(), config()->message_cache_type()));
 
-	// create control socket
-	std::string conn_str = "inproc://service_control_" + info_.service_name_ + "_" + info_.name_;
-	zmq_control_socket_.reset(new zmq::socket_t(*(context()->zmq_context()), ZMQ_PAIR));
-
-	int timeout = 0;
-	zmq_control_socket_->setsockopt(ZMQ_LINGER, &timeout, sizeof(timeout));
-	zmq_control_socket_->bind(conn_str.c_str());
-
-	// run message dispatch thread
+	// run message dispatch thread or pin handle to one of shared reactors
 	is_running_ = true;
-	thread_ = boost::thread(&handle<LSD_T>::dispatch_messages, this);
+
+	if (context()->reactors()) {
+		reactor_ = context()->reactors()->assign();
+		reactor_->attach(this);
+	}
+	else {
+		thread_ = boost::thread(&handle<LSD_T>::dispatch_messages, this);
+	}
 
 	get_statistics();
 	update_statistics();
@@ -167,211 +322,304 @@ template <typename LSD_T>
 handle<LSD_T>::~handle() {
 	kill();
 
-	zmq_control_socket_->close();
-	zmq_control_socket_.reset(NULL);
+	// reactor stops handle on its own thread
+	if (reactor_) {
+		reactor_->wait_detached(this);
+	}
 
 	thread_.join();
 }
 
 template <typename LSD_T> void
 handle<LSD_T>::dispatch_messages() {
-	// establish connections
-	socket_ptr_t main_socket;
-	socket_ptr_t control_socket;
-
-	establish_control_conection(control_socket);
-	log_dispatch_start();
+	dispatch_start();
 
 	// process messages
 	while (is_running_) {
 
-		// receive control message
-		int control_message = receive_control_messages(control_socket);
+		// sleep until there's something to do
+		poll_items_.clear();
+		fill_poll_items(poll_items_);
 
-		// received kill message, finalize everything
-		if (control_message == CONTROL_MESSAGE_KILL) {
-			logger()->log(PLOG_DEBUG, "CONTROL_MESSAGE_KILL");
-			is_running_ = false;
-			break;
-		}
+		int socket_response = zmq_poll(&poll_items_[0], (int)poll_items_.size(), zmq_poll_timeout(poll_timeout()));
 
-		// process incoming control messages
-		if (control_message > 0) {
-			dispatch_control_messages(control_message, main_socket);
-		}
-	
-		// send new message if any
-		if (is_running_ && is_connected_) {
-			if (dispatch_next_available_message(main_socket)) {
-				++statistics_.sent_messages;
-			}
+		if (socket_response < 0 && zmq_errno() != EINTR) {
+			std::string sname = info_.service_name_;
+			std::string hname = info_.name_;
+			logger()->log(PLOG_ERROR, "poll failed on service: %s, handle %s", sname.c_str(), hname.c_str());
 		}
 
-		// check for message responces
-		bool received_response = false;
-		if (is_connected_ && is_running_) {
-			received_response = check_for_responses(main_socket);
+		if (!process_events(&poll_items_[0])) {
+			break;
 		}
+	}
 
-		// process received responce(s)
-		if (is_connected_ && is_running_ && received_response) {
-			dispatch_responces(main_socket);
-		}
+	dispatch_stop();
+}
 
-		/*
-		// check for expired messages
-		if (is_connected_ && is_running_) {
-			std::vector<std::pair<std::string, message_path> > expired;
-			messages_cache()->process_expired_messages(expired);
+template <typename LSD_T> void
+handle<LSD_T>::dispatch_start() {
+	log_dispatch_start();
+}
 
-			// put expired messages to response queue
-			for (size_t i = 0; i < expired.size(); ++i) {
-				// shortcuts
-				std::string& uuid = expired[i].first;
-				message_path& path = expired[i].second;
-				std::string error_msg = "the job has expired";
+template <typename LSD_T> void
+handle<LSD_T>::dispatch_stop() {
+	connections_.clear();
 
-				// create response
-				cached_response_prt_t response;
-				response.reset(new cached_response(uuid, path, EXPIRED_MESSAGE_ERROR, error_msg));
-				enqueue_response(response);
+	update_statistics();
+}
 
-				++statistics_.expired_responses;
-			}
-		}
-		*/
+template <typename LSD_T> bool
+handle<LSD_T>::process_events(const zmq_pollitem_t* items) {
+	if (!is_running_) {
+		return false;
+	}
 
-		update_statistics();
+	// new messages or control messages were enqueued, they will be picked up by this iteration
+	if ((ZMQ_POLLIN & items[0].revents) == ZMQ_POLLIN) {
+		wakeup_.drain();
 	}
 
-	control_socket.reset();
-	main_socket.reset();
+	for (size_t i = 0; i < polled_connections_.size(); ++i) {
+		host_connection& connection = connections_[polled_connections_[i]];
+		connection.has_responses = ((ZMQ_POLLIN & items[i + 1].revents) == ZMQ_POLLIN);
+	}
 
-	update_statistics();
-}
+	flush_pending_messages();
 
-template <typename LSD_T> void
-handle<LSD_T>::establish_control_conection(socket_ptr_t& control_socket) {
-	control_socket.reset(new zmq::socket_t(*(context()->zmq_context()), ZMQ_PAIR));
+	// process incoming control messages, queue is checked without waiting for the signal
+	control_message message;
+	while (control_messages_.pop(message)) {
 
-	if (control_socket.get()) {
-		std::string conn_str = "inproc://service_control_" + info_.service_name_ + "_" + info_.name_;
+		// received kill message, finalize everything
+		if (message.type == CONTROL_MESSAGE_KILL) {
+			logger()->log(PLOG_DEBUG, "CONTROL_MESSAGE_KILL");
+			is_running_ = false;
+			return false;
+		}
 
-		int timeout = 0;
-		control_socket->setsockopt(ZMQ_LINGER, &timeout, sizeof(timeout));
-		control_socket->connect(conn_str.c_str());
-		receiving_control_socket_ok_ = true;
+		dispatch_control_messages(message, connections_);
 	}
-}
 
-template <typename LSD_T> void
-handle<LSD_T>::enqueue_response(cached_response_prt_t response) {
-	if (response_callback_) {
-		response_callback_(response);
+	// send new messages if any
+	if (is_running_ && is_connected_) {
+		statistics_.sent_messages += dispatch_next_available_messages(connections_);
+	}
+
+	// process received responce(s)
+	if (is_connected_ && is_running_) {
+		for (size_t i = 0; i < connections_.size(); ++i) {
+			if (connections_[i].has_responses) {
+				dispatch_responces(connections_[i]);
+			}
+		}
+	}
+
+	// fire timeouts and deadlines of sent messages
+	if (is_connected_ && is_running_) {
+		process_expired_timers();
 	}
+
+	update_statistics();
+	return true;
 }
 
-template <typename LSD_T> int
-handle<LSD_T>::receive_control_messages(socket_ptr_t& control_socket) {
-	if (!is_running_) {
+template <typename LSD_T> long
+handle<LSD_T>::poll_timeout() {
+	// there's work to do already, just peek at the sockets
+	if (is_connected_ && messages_cache()->new_messages_count() > 0) {
 		return 0;
 	}
 
-	// poll for responce
-	zmq_pollitem_t poll_items[1];
-	poll_items[0].socket = *control_socket;
-	poll_items[0].fd = 0;
-	poll_items[0].events = ZMQ_POLLIN;
-	poll_items[0].revents = 0;
+	long timeout = (long)config()->socket_poll_timeout();
 
-	int socket_response = zmq_poll(poll_items, 1, 0);
+	// wake up in time for delayed resends
+	double retry_time = 0.0;
+	if (is_connected_ && messages_cache()->next_retry_time(retry_time)) {
+		double delay = retry_time - time_value::get_current_time().as_double();
+		long retry_timeout = (delay > 0.0) ? (long)(delay * 1000.0) + 1 : 0;
+		timeout = std::min(timeout, retry_timeout);
+	}
 
-	if (socket_response <= 0) {
-		return 0;
+	// and for the next message timeout or deadline
+	double timer_time = 0.0;
+	if (is_connected_ && timers_.next_expiry_time(timer_time)) {
+		double delay = timer_time - time_value::get_current_time().as_double();
+		long timer_timeout = (delay > 0.0) ? (long)(delay * 1000.0) + 1 : 0;
+		timeout = std::min(timeout, timer_timeout);
 	}
 
-	// in case we received control message
-    if ((ZMQ_POLLIN & poll_items[0].revents) == ZMQ_POLLIN) {
-    	int received_message = 0;
+	return timeout;
+}
 
-    	bool recv_failed = false;
-    	zmq::message_t reply;
+template <typename LSD_T> void
+handle<LSD_T>::fill_poll_items(std::vector<zmq_pollitem_t>& items) {
+	for (size_t i = 0; i < connections_.size(); ++i) {
+		connections_[i].has_responses = false;
+	}
 
-    	try {
-    		if (!control_socket->recv(&reply)) {
-    			recv_failed = true;
-    		}
-    		else {
-    			memcpy((void *)&received_message, reply.data(), reply.size());
-    			return received_message;
-    		}
-    	}
-    	catch (const std::exception& ex) {
-			std::string error_msg = "some very ugly shit happend while recv on socket at ";
-			error_msg += std::string(BOOST_CURRENT_FUNCTION);
-			error_msg += " details: " + std::string(ex.what());
-			throw error(error_msg);
-    	}
+	// wakeup signal and host sockets (if connected)
+	zmq_pollitem_t item;
+	item.socket = NULL;
+	item.fd = wakeup_.fd();
+	item.events = ZMQ_POLLIN;
+	item.revents = 0;
+	items.push_back(item);
 
-        if (recv_failed) {
-        	std::string sname = info_.service_name_;
-        	std::string hname = info_.name_;
-        	logger()->log("recv failed on service: %s, handle %s", sname.c_str(), hname.c_str());
-        }
-    }
+	polled_connections_.clear();
+
+	for (size_t i = 0; is_connected_ && i < connections_.size(); ++i) {
+		// broadcast socket that was never used
+		if (!connections_[i].socket) {
+			continue;
+		}
+
+		item.socket = *(connections_[i].socket);
+		item.fd = 0;
+		items.push_back(item);
+
+		polled_connections_.push_back(i);
+	}
+}
 
-    return 0;
+template <typename LSD_T> void
+handle<LSD_T>::enqueue_response(cached_response_prt_t response) {
+	if (response_callback_) {
+		response_callback_(response);
+	}
 }
 
 template <typename LSD_T> void
-handle<LSD_T>::dispatch_control_messages(int type, socket_ptr_t& main_socket) {
+handle<LSD_T>::dispatch_control_messages(control_message& message, connections_t& connections) {
 	if (!is_running_) {
 		return;
 	}
 
-	switch (type) {
+	switch (message.type) {
 		case CONTROL_MESSAGE_CONNECT:
 			logger()->log(PLOG_DEBUG, "CONTROL_MESSAGE_CONNECT");
 
-			// create new main socket in case we're not connected
+			// create host connections in case we're not connected
 			if (!is_connected_) {
-				main_socket.reset(new zmq::socket_t(*(context()->zmq_context()), ZMQ_DEALER));
-				connect_zmq_socket_to_hosts(main_socket, hosts_);
-				is_connected_ = true;
+				if (!message.hosts.empty()) {
+					hosts_.swap(message.hosts);
+				}
+
+				if (!hosts_.empty()) {
+					update_connections(connections, hosts_, true);
+					is_connected_ = true;
+				}
 			}
 			break;
 
 		case CONTROL_MESSAGE_RECONNECT:
 			logger()->log(PLOG_DEBUG, "CONTROL_MESSAGE_RECONNECT");
 
-			// kill old socket, create new
-			main_socket.reset(new zmq::socket_t(*(context()->zmq_context()), ZMQ_DEALER));
-			connect_zmq_socket_to_hosts(main_socket, hosts_);
+			// replace connections with ones to current hosts
+			hosts_.swap(message.hosts);
+			update_connections(connections, hosts_, true);
 			is_connected_ = true;
 			break;
 
 		case CONTROL_MESSAGE_DISCONNECT:
 			logger()->log(PLOG_DEBUG, "CONTROL_MESSAGE_DISCONNECT");
 
-			// kill socket
-			main_socket.reset();
+			// kill sockets
+			connections.clear();
 			is_connected_ = false;
 			break;
 
 		case CONTROL_MESSAGE_CONNECT_NEW_HOSTS:
 			logger()->log(PLOG_DEBUG, "CONTROL_MESSAGE_CONNECT_NEW_HOSTS");
 
-			// connect socket to new hosts
-			hosts_info_list_t new_hosts;
-			if (is_connected_ && !new_hosts_.empty()) {
-				new_hosts = new_hosts_;
-				new_hosts_.clear();
+			// remember new hosts for later connects, connect to them right away if connected
+			hosts_.insert(hosts_.end(), message.hosts.begin(), message.hosts.end());
 
-				if (!new_hosts.empty()) {
-					connect_zmq_socket_to_hosts(main_socket, new_hosts);
-				}
+			if (is_connected_) {
+				update_connections(connections, message.hosts, false);
 			}
 			break;
+
+		default:
+			break;
+	}
+}
+
+template <typename LSD_T> void
+handle<LSD_T>::update_connections(connections_t& connections,
+								  hosts_info_list_t& hosts,
+								  bool replace_hosts)
+{
+	// single socket balanced by zmq
+	if (balancing_type_ == BT_ROUND_ROBIN) {
+		if (replace_hosts || connections.empty()) {
+			connections.clear();
+			connections.push_back(host_connection());
+			connections.back().socket.reset(new zmq::socket_t(*(context()->zmq_context()), ZMQ_DEALER));
+		}
+
+		connect_zmq_socket_to_hosts(connections.front().socket, hosts);
+
+		// remember hosts for broadcasts, sockets are connected on first use
+		for (size_t i = 0; i < hosts.size(); ++i) {
+			bool found = false;
+			for (size_t j = 1; j < connections.size(); ++j) {
+				if (connections[j].ip == hosts[i].ip_) {
+					found = true;
+					break;
+				}
+			}
+
+			if (!found) {
+				host_connection connection;
+				connection.ip = hosts[i].ip_;
+				connection.is_broadcast_only = true;
+				connections.push_back(connection);
+			}
+		}
+
+		return;
+	}
+
+	// new sockets need their weights
+	hosts_load_changed_ = true;
+
+	// socket per host, keep sockets of hosts we already talk to
+	if (replace_hosts) {
+		connections_t alive_connections;
+
+		for (size_t i = 0; i < connections.size(); ++i) {
+			for (size_t j = 0; j < hosts.size(); ++j) {
+				if (connections[i].ip == hosts[j].ip_) {
+					alive_connections.push_back(connections[i]);
+					break;
+				}
+			}
+		}
+
+		connections.swap(alive_connections);
+	}
+
+	for (size_t i = 0; i < hosts.size(); ++i) {
+		bool found = false;
+		for (size_t j = 0; j < connections.size(); ++j) {
+			if (connections[j].ip == hosts[i].ip_) {
+				found = true;
+				break;
+			}
+		}
+
+		if (found) {
+			continue;
+		}
+
+		host_connection connection;
+		connection.ip = hosts[i].ip_;
+		connection.socket.reset(new zmq::socket_t(*(context()->zmq_context()), ZMQ_DEALER));
+
+		hosts_info_list_t host(1, hosts[i]);
+		connect_zmq_socket_to_hosts(connection.socket, host);
+		connections.push_back(connection);
 	}
 }
 
@@ -411,62 +659,168 @@ handle<LSD_T>::connect_zmq_socket_to_hosts(socket_ptr_t& socket,
 	}
 }
 
-template <typename LSD_T> bool
-handle<LSD_T>::dispatch_next_available_message(socket_ptr_t main_socket) {
-	// validate socket
-	if (!main_socket) {
+template <typename LSD_T> typename handle<LSD_T>::host_connection&
+handle<LSD_T>::choose_connection(connections_t& connections,
+								 boost::shared_ptr<cached_message> message)
+{
+	if (balancing_type_ == BT_ROUND_ROBIN || connections.size() == 1) {
+		return connections.front();
+	}
+
+	// fewest in-flight messages per unit of weight, ties are broken randomly.
+	// in least outstanding mode all weights are 1. a resent message avoids
+	// the host that rejected it.
+	LT::ip_addr rejected_host = message->rejected_host();
+
+	size_t best = connections.size();
+	size_t ties = 0;
+	double best_score = 0.0;
+
+	for (size_t i = 0; i < connections.size(); ++i) {
+		if (rejected_host != 0 && connections[i].ip == rejected_host) {
+			continue;
+		}
+
+		double score = (connections[i].in_flight + 1) / connections[i].weight;
+
+		if (best == connections.size() || score < best_score) {
+			best = i;
+			best_score = score;
+			ties = 1;
+		}
+		else if (score == best_score) {
+			++ties;
+
+			if ((size_t)rand_r(&random_seed_) % ties == 0) {
+				best = i;
+			}
+		}
+	}
+
+	// rejecting host is the only one left
+	if (best == connections.size()) {
+		return connections.front();
+	}
+
+	return connections[best];
+}
+
+template <typename LSD_T> void
+handle<LSD_T>::refresh_in_flight_counts(connections_t& connections) {
+	message_cache::in_flight_counts_t counts;
+	messages_cache()->get_in_flight_counts(counts);
+
+	for (size_t i = 0; i < connections.size(); ++i) {
+		message_cache::in_flight_counts_t::iterator it = counts.find(connections[i].ip);
+		connections[i].in_flight = (it == counts.end()) ? 0 : it->second;
+	}
+}
+
+template <typename LSD_T> void
+handle<LSD_T>::refresh_connection_weights(connections_t& connections) {
+	boost::mutex::scoped_lock lock(mutex_);
+	hosts_load_changed_ = false;
+
+	for (size_t i = 0; i < connections.size(); ++i) {
+		typename hosts_load_map_t::iterator it = hosts_load_.find(connections[i].ip);
+		connections[i].weight = (it == hosts_load_.end()) ? 1.0 : load_weight(it->second);
+	}
+}
+
+template <typename LSD_T> double
+handle<LSD_T>::load_weight(const host_load& load) {
+	// hosts that didn't report their load are treated as having one free worker
+	if (!load.is_reported) {
+		return 1.0;
+	}
+
+	// free workers (plus one so that saturated pools still get some traffic)
+	// divided by the backlog host already has
+	unsigned int free_workers = 0;
+	if (load.pool_total > load.pool_active) {
+		free_workers = load.pool_total - load.pool_active;
+	}
+
+	double backlog = 1.0 + load.queue + load.pending_jobs;
+	return (free_workers + 1.0) / backlog;
+}
+
+template <typename LSD_T> size_t
+handle<LSD_T>::dispatch_next_available_messages(connections_t& connections) {
+	// validate connections
+	if (connections.empty()) {
 		std::string error_msg = "service: " + info_.service_name_;
-		error_msg += ", handle: " + info_.name_ + " — empty socket object";
+		error_msg += ", handle: " + info_.name_ + " — no host connections";
 		error_msg += " at " + std::string(BOOST_CURRENT_FUNCTION);
 		throw error(error_msg);
 	}
 
-	// send new message if any
-	if (messages_cache()->new_messages_count() == 0) {
-		return false;
+	// take a batch of new messages under a single cache lock
+	message_cache::message_queue_t batch;
+	size_t batch_messages = config()->send_batch_messages();
+	size_t batch_bytes = config()->send_batch_bytes();
+
+	if (messages_cache()->get_new_messages(batch_messages, batch_bytes, batch) == 0) {
+		return 0;
 	}
 
-	try {
-		boost::shared_ptr<cached_message> new_msg = messages_cache()->get_new_message();
+	// in-flight counters follow the sent messages index
+	if (balancing_type_ != BT_ROUND_ROBIN) {
+		refresh_in_flight_counts(connections);
+	}
 
-		// send header
-		zmq::message_t empty_message(0);
-		if (true != main_socket->send(empty_message, ZMQ_SNDMORE)) {
-			++statistics_.bad_sent_messages;
-			return false;
-		}
+	if (balancing_type_ == BT_LOAD_AWARE && hosts_load_changed_) {
+		refresh_connection_weights(connections);
+	}
 
-		// send envelope
-		std::string msg_header = new_msg->json();
-		size_t header_size = msg_header.length();
-		zmq::message_t header(header_size);
-		memcpy((void *)header.data(), msg_header.c_str(), header_size);
+	message_cache::message_queue_t sent;
+	message_cache::message_queue_t unsent;
+	size_t i = 0;
 
-		if (true != main_socket->send(header, ZMQ_SNDMORE)) {
-			++statistics_.bad_sent_messages;
-			return false;
-		}
+	try {
+		for (; i < batch.size(); ++i) {
+			// deadline has passed while waiting in queue, don't bother hosts
+			if (batch[i]->is_expired()) {
+				expire_message(batch[i], "the job has expired");
+				continue;
+			}
 
-		// send data
-		size_t data_size = new_msg->data().size();
-		zmq::message_t message(data_size);
+			if (batch[i]->policy().send_to_all_hosts) {
+				if (!send_broadcast_message(connections, batch[i])) {
+					++statistics_.bad_sent_messages;
+					unsent.insert(unsent.end(), batch.begin() + i, batch.end());
+					break;
+				}
 
-		if (data_size > 0) {
-			memcpy((void *)message.data(), new_msg->data().data(), data_size);
-		}
+				batch[i]->set_destination_host(0);
+				batch[i]->mark_as_sent(true);
+				sent.push_back(batch[i]);
+				arm_message_timers(batch[i]);
+				continue;
+			}
 
-		if (true != main_socket->send(message)) {
-			++statistics_.bad_sent_messages;
-			return false;
-		}
+			host_connection& connection = choose_connection(connections, batch[i]);
 
-		// assign message flags
-		new_msg->mark_as_sent(true);
+			if (!send_cached_message(connection.socket, batch[i])) {
+				++statistics_.bad_sent_messages;
+				unsent.insert(unsent.end(), batch.begin() + i, batch.end());
+				break;
+			}
+
+			// assign message flags
+			batch[i]->set_destination_host(connection.ip);
+			batch[i]->mark_as_sent(true);
+			sent.push_back(batch[i]);
+			arm_message_timers(batch[i]);
 
-		// move message to sent
-		messages_cache()->move_new_message_to_sent();
+			++connection.in_flight;
+		}
 	}
 	catch (const std::exception& ex) {
+		// don't lose the rest of the batch
+		unsent.insert(unsent.end(), batch.begin() + i, batch.end());
+		messages_cache()->commit_sent_messages(sent, unsent);
+
 		std::string error_msg = " service: " + info_.service_name_;
 		error_msg += ", handle: " + info_.name_ + " — could not send message";
 		error_msg += " at " + std::string(BOOST_CURRENT_FUNCTION) + "reason: ";
@@ -474,79 +828,255 @@ handle<LSD_T>::dispatch_next_available_message(socket_ptr_t main_socket) {
 		throw error(error_msg);
 	}
 
+	// move sent messages to sent index in one pass
+	messages_cache()->commit_sent_messages(sent, unsent);
+
+	return sent.size();
+}
+
+template <typename LSD_T> bool
+handle<LSD_T>::send_cached_message(socket_ptr_t& main_socket, boost::shared_ptr<cached_message> message) {
+	// send header
+	zmq::message_t empty_message(0);
+	if (true != main_socket->send(empty_message, ZMQ_SNDMORE)) {
+		return false;
+	}
+
+	// send envelope
+	const std::string& msg_header = message->envelope(envelope_encoding_);
+	size_t header_size = msg_header.length();
+	zmq::message_t header(header_size);
+	memcpy((void *)header.data(), msg_header.data(), header_size);
+
+	if (true != main_socket->send(header, ZMQ_SNDMORE)) {
+		return false;
+	}
+
+	// send data without copying, frame holds a payload reference until zmq releases it
+	zmq::message_t data;
+	size_t data_size = message->data().size();
+
+	if (data_size > 0) {
+		const data_container& payload = message->data();
+		void* payload_ref = payload.add_reference();
+
+		try {
+			data.rebuild(payload.data(), data_size, &data_container::release_reference, payload_ref);
+		}
+		catch (...) {
+			data_container::release_reference(payload.data(), payload_ref);
+			throw;
+		}
+	}
+
+	if (true != main_socket->send(data)) {
+		return false;
+	}
+
+	return true;
+}
+
+template <typename LSD_T> bool
+handle<LSD_T>::send_broadcast_message(connections_t& connections, boost::shared_ptr<cached_message> message) {
+	std::vector<typename LSD_T::ip_addr> hosts;
+
+	for (size_t i = 0; i < connections.size(); ++i) {
+		host_connection& connection = connections[i];
+
+		// shared round robin socket
+		if (connection.ip == 0) {
+			continue;
+		}
+
+		if (!connection.socket) {
+			connection.socket.reset(new zmq::socket_t(*(context()->zmq_context()), ZMQ_DEALER));
+
+			hosts_info_list_t host(1, host_info<LSD_T>(connection.ip));
+			connect_zmq_socket_to_hosts(connection.socket, host);
+		}
+
+		// every copy references the same payload, see send_cached_message()
+		if (!send_cached_message(connection.socket, message)) {
+			++statistics_.bad_sent_messages;
+			continue;
+		}
+
+		++connection.in_flight;
+		hosts.push_back(connection.ip);
+	}
+
+	if (hosts.empty()) {
+		return false;
+	}
+
+	message->start_broadcast(hosts);
 	return true;
 }
 
 template <typename LSD_T> void
-handle<LSD_T>::dispatch_responces(socket_ptr_t& main_socket) {
+handle<LSD_T>::complete_broadcast_message(boost::shared_ptr<cached_message> message) {
+	messages_cache()->remove_message_from_cache(message->binary_uuid());
+	messages_cache()->complete_message(message);
+
+	cached_response_prt_t response;
+	int error_code = 0;
+	std::string error_msg;
+
+	if (!message->broadcast_error(error_code, error_msg)) {
+		response.reset(new cached_response(message->uuid(), message->path(), NULL, 0));
+		response->set_error(MESSAGE_CHOKE, "");
+		++statistics_.normal_responces;
+	}
+	else {
+		response.reset(new cached_response(message->uuid(), message->path(), error_code, error_msg));
+		++statistics_.err_responces;
+	}
+
+	enqueue_response(response);
+
+	++statistics_.all_responces;
+	update_statistics();
+}
+
+template <typename LSD_T> void
+handle<LSD_T>::arm_message_timers(boost::shared_ptr<cached_message> message) {
+	const message_policy& policy = message->policy();
+
+	if (policy.timeout <= 0.0 && policy.deadline <= 0.0) {
+		return;
+	}
+
+	message_timer timer;
+	timer.message = message;
+	timer.generation = message->timer_generation();
+
+	if (policy.timeout > 0.0) {
+		timer.is_deadline = false;
+		timers_.add(message->sent_timestamp().as_double() + policy.timeout, timer);
+	}
+
+	if (policy.deadline > 0.0) {
+		timer.is_deadline = true;
+		timers_.add(policy.deadline, timer);
+	}
+}
+
+template <typename LSD_T> void
+handle<LSD_T>::process_expired_timers() {
+	expired_timers_.clear();
+
+	if (timers_.advance(time_value::get_current_time().as_double(), expired_timers_) == 0) {
+		return;
+	}
+
+	for (size_t i = 0; i < expired_timers_.size(); ++i) {
+		boost::shared_ptr<cached_message> message = expired_timers_[i].message.lock();
+
+		// message was answered, resent or dropped since the timer was armed
+		if (!message || !message->is_sent() || message->timer_generation() != expired_timers_[i].generation) {
+			continue;
+		}
+
+		if (expired_timers_[i].is_deadline) {
+			expire_message(message, "the job has expired");
+			continue;
+		}
+
+		// host has started responding, leave it to the deadline
+		if (message->is_response_started()) {
+			continue;
+		}
+
+		++statistics_.timedout_responces;
+
+		// resending a broadcast would repeat it on hosts that are done with it
+		bool can_retry = !message->policy().send_to_all_hosts;
+
+		if (can_retry && message->timeout_retries_count() < message->policy().max_timeout_retries) {
+			message->increment_timeout_retries();
+			messages_cache()->move_sent_message_to_new_front(message->binary_uuid());
+			++statistics_.resent_messages;
+		}
+		else {
+			expire_message(message, "the job has timed out");
+		}
+	}
+
+	expired_timers_.clear();
+	update_statistics();
+}
+
+template <typename LSD_T> void
+handle<LSD_T>::expire_message(boost::shared_ptr<cached_message> message, const std::string& error_msg) {
+	messages_cache()->remove_message_from_cache(message->binary_uuid());
+	messages_cache()->complete_message(message);
+
+	cached_response_prt_t response;
+	response.reset(new cached_response(message->uuid(), message->path(), EXPIRED_MESSAGE_ERROR, error_msg));
+	enqueue_response(response);
+
+	++statistics_.expired_responses;
+	++statistics_.all_responces;
+}
+
+template <typename LSD_T> void
+handle<LSD_T>::dispatch_responces(host_connection& connection) {
+	socket_ptr_t& main_socket = connection.socket;
 	zmq::message_t reply;
 
+	// reused between responses to keep their buffers
+	std::string uuid;
+	std::string error_message;
+	message_uuid message_id;
+
 	// receive messages while we have any on the socket
 	while (true) {
-		std::string json_header;
-
 		try {
 			// receive reply header
 			if (!main_socket->recv(&reply, ZMQ_NOBLOCK)) {
 				break;
 			}
 
-			// receive json envelope
+			// receive envelope
 			if (!main_socket->recv(&reply)) {
 				logger()->log(PLOG_ERROR, "bad envelope");
 				break;
 			}
 
-			// get envelope json string
-			json_header = std::string((const char*)reply.data(), reply.size());
-			//logger()->log(PLOG_DEBUG, "received header: %s", json_header.c_str());
-
 			bool is_response_completed = false;
-			std::string uuid;
-			Json::Value envelope_val;
-			Json::Reader jreader;
 			int error_code = 0;
-			std::string error_message;
-
-			// parse envelope json
-			if (jreader.parse(json_header.c_str(), envelope_val)) {
-				uuid = envelope_val.get("uuid", "").asString();
-				is_response_completed = envelope_val.get("completed", false).asBool();
-				error_code = envelope_val.get("code", 0).asInt();
-				error_message = envelope_val.get("message", "").asString();
-
-				if (uuid.empty()) {
-					std::string error_msg = "service: " + info_.service_name_;
-					error_msg += ", handle: " + info_.name_ + " — uuid is empty in response envelope";
-					error_msg += " at " + std::string(BOOST_CURRENT_FUNCTION);
-					throw error(error_msg);
-				}
-			}
-			else {
-				std::string error_msg = "service: " + info_.service_name_;
-				error_msg += ", handle: " + info_.name_ + " — could not parse response envelope";
-				error_msg += " at " + std::string(BOOST_CURRENT_FUNCTION);
-				throw error(error_msg);
-			}
 
-			bool fetched_message = false;
+			parse_response_envelope(reply, uuid, is_response_completed, error_code, error_message);
 
-			// get message from sent cache
+			// get message from sent cache, responses that end the job
+			// take it out of sent index with the same lookup
+			bool is_final = (is_response_completed || error_code != 0);
 			boost::shared_ptr<cached_message> sent_msg;
-			try {
-				sent_msg = messages_cache()->get_sent_message(uuid);
-				fetched_message = true;
-			}
-			catch (...) {
+
+			if (message_id.parse(uuid)) {
+				if (is_final) {
+					sent_msg = messages_cache()->take_sent_message(message_id);
+				}
+				else {
+					sent_msg = messages_cache()->find_sent_message(message_id);
+				}
 			}
 
-			// just send message again
-			if (error_code == MESSAGE_QUEUE_IS_FULL) {
+			bool fetched_message = (sent_msg.get() != NULL);
+
+			bool is_broadcast = (fetched_message && sent_msg->policy().send_to_all_hosts);
+
+			// send message again later, with backoff.
+			// broadcast is not resent, full queue counts as host failure.
+			if (error_code == MESSAGE_QUEUE_IS_FULL && !is_broadcast) {
 				if (fetched_message) {
-					//messages_cache()->remove_message_from_cache(uuid);
-					messages_cache()->move_sent_message_to_new_front(uuid);
+					double delay = messages_cache()->schedule_message_retry(sent_msg);
+
 					++statistics_.resent_messages;
+					statistics_.resend_delay_sum += delay;
+					statistics_.resend_delay_max = std::max(statistics_.resend_delay_max, delay);
 					update_statistics();
+
 					continue;
 				}
 			}
@@ -554,15 +1084,25 @@ handle<LSD_T>::dispatch_responces(socket_ptr_t& main_socket) {
 			if (error_code != 0) {
 				logger()->log(PLOG_DEBUG, "error code: %d, message: %s", error_code, error_message.c_str());
 
+				// broadcast fails as a whole once every host has answered
+				if (is_broadcast) {
+					if (sent_msg->complete_broadcast_host(connection.ip, error_code, error_message) &&
+						sent_msg->is_broadcast_completed())
+					{
+						complete_broadcast_message(sent_msg);
+					}
+
+					continue;
+				}
+
 				// if we could not get message from cache, we assume, lsd has already processed it
 				// otherwise — make response!
 				if (fetched_message) {
+					messages_cache()->complete_message(sent_msg);
+
 					// create response object
 					cached_response_prt_t new_response;
 					new_response.reset(new cached_response(uuid, sent_msg->path(), error_code, error_message));
-
-					// remove message from cache
-					messages_cache()->remove_message_from_cache(uuid);
 					enqueue_response(new_response);
 
 					// statistics
@@ -592,30 +1132,44 @@ handle<LSD_T>::dispatch_responces(socket_ptr_t& main_socket) {
 					break;
 				}
 
-				msgpack::unpacked msg;
-				msgpack::unpack(&msg, (const char*)reply.data(), reply.size());
+				if (!validate_response_chunk(reply)) {
+					if (fetched_message) {
+						++statistics_.err_responces;
+						++statistics_.all_responces;
+						update_statistics();
+					}
 
-				msgpack::object obj = msg.get();
-				std::stringstream stream;
-				stream << obj;
-				//logger()->log(PLOG_DEBUG, "received data: %s", stream.str().c_str());
+					continue;
+				}
 
 				if (fetched_message) {
+					// host is working on it, per-send timeout no longer applies
+					sent_msg->mark_response_started();
+
 					++statistics_.normal_responces;
 					++statistics_.all_responces;
 					update_statistics();
 
+					// response takes over the received frame, no data copy
 					cached_response_prt_t new_response;
-					new_response.reset(new cached_response(uuid, sent_msg->path(), reply.data(), reply.size()));
+					new_response.reset(new cached_response(uuid, sent_msg->path(), reply));
 					new_response->set_error(MESSAGE_CHUNK, "");
 					enqueue_response(new_response);
 				}
 			}
+			else if (is_broadcast) {
+				// completed by one host, wait for the rest
+				if (sent_msg->complete_broadcast_host(connection.ip, 0, "") &&
+					sent_msg->is_broadcast_completed())
+				{
+					complete_broadcast_message(sent_msg);
+				}
+			}
 			else {
 				//logger()->log(PLOG_DEBUG, "responce completed");
-				messages_cache()->remove_message_from_cache(uuid);
-
 				if (fetched_message) {
+					messages_cache()->complete_message(sent_msg);
+
 					++statistics_.normal_responces;
 					++statistics_.all_responces;
 					update_statistics();
@@ -638,63 +1192,202 @@ handle<LSD_T>::dispatch_responces(socket_ptr_t& main_socket) {
 	}
 }
 
-template <typename LSD_T> handle_stats&
-handle<LSD_T>::get_statistics() {
+template <typename LSD_T> bool
+handle<LSD_T>::validate_response_chunk(zmq::message_t& chunk) {
+	enum response_validation_level level = config()->response_validation_level();
 
-	handle_stats tmp_stats;
-	if (context()->stats()->get_handle_stats(info_.service_name_,
-											 info_.name_,
-											 tmp_stats))
-	{
-		statistics_ = tmp_stats;
+	if (level == RVL_NONE) {
+		return true;
 	}
 
-	return statistics_;
+	try {
+		msgpack::unpacked msg;
+		msgpack::unpack(&msg, (const char*)chunk.data(), chunk.size());
+
+		if (level == RVL_MSGPACK_DUMP) {
+			std::stringstream stream;
+			stream << msg.get();
+			logger()->log(PLOG_DEBUG, "received data: %s", stream.str().c_str());
+		}
+	}
+	catch (const std::exception& ex) {
+		std::string error_msg = "service: " + info_.service_name_;
+		error_msg += ", handle: " + info_.name_ + " — dropped response chunk that is not valid msgpack";
+		error_msg += " at " + std::string(BOOST_CURRENT_FUNCTION) + " reason: ";
+		error_msg += ex.what();
+		logger()->log(PLOG_ERROR, error_msg);
+		return false;
+	}
+
+	return true;
+}
+
+template <typename LSD_T> enum envelope_encoding
+handle<LSD_T>::common_envelope_encoding(const hosts_info_list_t& hosts) {
+	// messages are balanced by one socket across all hosts,
+	// so use msgpack only if every host supports it
+	if (hosts.empty()) {
+		return JSON_ENVELOPE;
+	}
+
+	for (size_t i = 0; i < hosts.size(); ++i) {
+		if (hosts[i].protocol_version_ < MSGPACK_ENVELOPE_PROTOCOL_VERSION) {
+			return JSON_ENVELOPE;
+		}
+	}
+
+	return MSGPACK_ENVELOPE;
 }
 
 template <typename LSD_T> void
-handle<LSD_T>::update_statistics() {
-	statistics_.queue_status.pending = messages_cache()->new_messages_count();
-	statistics_.queue_status.sent = messages_cache()->sent_messages_count();
+handle<LSD_T>::parse_response_envelope(zmq::message_t& envelope,
+									   std::string& uuid,
+									   bool& is_completed,
+									   int& error_code,
+									   std::string& error_message)
+{
+	if (envelope.size() == 0) {
+		std::string error_msg = "service: " + info_.service_name_;
+		error_msg += ", handle: " + info_.name_ + " — empty response envelope";
+		error_msg += " at " + std::string(BOOST_CURRENT_FUNCTION);
+		throw error(error_msg);
+	}
 
-	context()->stats()->update_handle_stats(info_.service_name_,
-											info_.name_,
-											statistics_);
+	uuid.clear();
+	is_completed = false;
+	error_code = 0;
+	error_message.clear();
+
+	// json envelope is an object, msgpack one is a fixmap or map16/map32
+	unsigned char first_byte = *(static_cast<unsigned char*>(envelope.data()));
+
+	if ((first_byte & 0xf0) == 0x80 || first_byte == 0xde || first_byte == 0xdf) {
+		parse_msgpack_envelope(envelope, uuid, is_completed, error_code, error_message);
+	}
+	else {
+		parse_json_envelope(envelope, uuid, is_completed, error_code, error_message);
+	}
+
+	if (uuid.empty()) {
+		std::string error_msg = "service: " + info_.service_name_;
+		error_msg += ", handle: " + info_.name_ + " — uuid is empty in response envelope";
+		error_msg += " at " + std::string(BOOST_CURRENT_FUNCTION);
+		throw error(error_msg);
+	}
 }
 
-template <typename LSD_T> bool
-handle<LSD_T>::check_for_responses(socket_ptr_t& main_socket) {
-	if (!is_running_) {
-		return false;
+template <typename LSD_T> void
+handle<LSD_T>::parse_json_envelope(zmq::message_t& envelope,
+								   std::string& uuid,
+								   bool& is_completed,
+								   int& error_code,
+								   std::string& error_message)
+{
+	const char* begin = static_cast<const char*>(envelope.data());
+
+	// fast path, fields are read in place
+	response_envelope fields;
+	if (envelope_parser::scan_json(begin, envelope.size(), fields)) {
+		bool message_ok = true;
+
+		if (fields.message_escaped) {
+			message_ok = envelope_parser::unescape(fields.message, fields.message_size, error_message);
+		}
+		else {
+			error_message.assign(fields.message ? fields.message : "", fields.message_size);
+		}
+
+		if (message_ok) {
+			uuid.assign(fields.uuid ? fields.uuid : "", fields.uuid_size);
+			is_completed = fields.completed;
+			error_code = fields.code;
+			return;
+		}
 	}
 
-	// validate socket
-	if (!main_socket.get()) {
+	// unusual or malformed envelope, let jsoncpp sort it out
+	Json::Value envelope_val;
+	Json::Reader jreader;
+
+	if (!jreader.parse(begin, begin + envelope.size(), envelope_val)) {
 		std::string error_msg = "service: " + info_.service_name_;
-		error_msg += ", handle: " + info_.name_ + " — empty socket object";
+		error_msg += ", handle: " + info_.name_ + " — could not parse response envelope";
 		error_msg += " at " + std::string(BOOST_CURRENT_FUNCTION);
 		throw error(error_msg);
 	}
 
-	// poll for responce
-	zmq_pollitem_t poll_items[1];
-	poll_items[0].socket = *main_socket;
-	poll_items[0].fd = 0;
-	poll_items[0].events = ZMQ_POLLIN;
-	poll_items[0].revents = 0;
+	uuid = envelope_val.get("uuid", "").asString();
+	is_completed = envelope_val.get("completed", false).asBool();
+	error_code = envelope_val.get("code", 0).asInt();
+	error_message = envelope_val.get("message", "").asString();
+}
+
+template <typename LSD_T> void
+handle<LSD_T>::parse_msgpack_envelope(zmq::message_t& envelope,
+									  std::string& uuid,
+									  bool& is_completed,
+									  int& error_code,
+									  std::string& error_message)
+{
+	msgpack::unpacked msg;
+
+	try {
+		msgpack::unpack(&msg, static_cast<const char*>(envelope.data()), envelope.size());
+		const msgpack::object& root = msg.get();
 
-	int socket_response = zmq_poll(poll_items, 1, 0);
+		for (size_t i = 0; i < root.via.map.size; ++i) {
+			const msgpack::object_kv& kv = root.via.map.ptr[i];
 
-	if (socket_response <= 0) {
-		return false;
+			if (kv.key.type != msgpack::type::RAW) {
+				continue;
+			}
+
+			std::string key(kv.key.via.raw.ptr, kv.key.via.raw.size);
+
+			if (key == "uuid") {
+				kv.val.convert(&uuid);
+			}
+			else if (key == "completed") {
+				kv.val.convert(&is_completed);
+			}
+			else if (key == "code") {
+				kv.val.convert(&error_code);
+			}
+			else if (key == "message") {
+				kv.val.convert(&error_message);
+			}
+		}
+	}
+	catch (const std::exception& ex) {
+		std::string error_msg = "service: " + info_.service_name_;
+		error_msg += ", handle: " + info_.name_ + " — could not parse response envelope";
+		error_msg += " at " + std::string(BOOST_CURRENT_FUNCTION) + " reason: ";
+		error_msg += ex.what();
+		throw error(error_msg);
 	}
+}
 
-	// in case we received message response
-	if ((ZMQ_POLLIN & poll_items[0].revents) == ZMQ_POLLIN) {
-		return true;
+template <typename LSD_T> handle_stats&
+handle<LSD_T>::get_statistics() {
+
+	handle_stats tmp_stats;
+	if (context()->stats()->get_handle_stats(info_.service_name_,
+											 info_.name_,
+											 tmp_stats))
+	{
+		statistics_ = tmp_stats;
 	}
 
-    return false;
+	return statistics_;
+}
+
+template <typename LSD_T> void
+handle<LSD_T>::update_statistics() {
+	messages_cache()->get_queue_status(statistics_.queue_status);
+
+	context()->stats()->update_handle_stats(info_.service_name_,
+											info_.name_,
+											statistics_);
 }
 
 template <typename LSD_T> void
@@ -713,6 +1406,12 @@ handle<LSD_T>::info() const {
 	return info_;
 }
 
+template <typename LSD_T> void
+handle<LSD_T>::send_control_message(enum control_message_type type, const hosts_info_list_t& hosts) {
+	control_messages_.push(control_message(type, hosts));
+	wakeup_.notify();
+}
+
 template <typename LSD_T> void
 handle<LSD_T>::kill() {
 	logger()->log(PLOG_DEBUG, "kill");
@@ -722,10 +1421,7 @@ handle<LSD_T>::kill() {
 	}
 
 	// kill dispatch thread from the inside
-	int control_message = CONTROL_MESSAGE_KILL;
-	zmq::message_t message(sizeof(int));
-	memcpy((void *)message.data(), &control_message, sizeof(int));
-	zmq_control_socket_->send(message);
+	send_control_message(CONTROL_MESSAGE_KILL);
 }
 
 template <typename LSD_T> void
@@ -735,15 +1431,12 @@ handle<LSD_T>::connect() {
 	get_statistics();
 	update_statistics();
 
-	if (!is_running_ || hosts_.empty() || is_connected_) {
+	if (!is_running_ || is_connected_) {
 		return;
 	}
 
-	// connect to hosts
-	int control_message = CONTROL_MESSAGE_CONNECT;
-	zmq::message_t message(sizeof(int));
-	memcpy((void *)message.data(), &control_message, sizeof(int));
-	zmq_control_socket_->send(message);
+	// connect to known hosts
+	send_control_message(CONTROL_MESSAGE_CONNECT);
 }
 
 template <typename LSD_T> void
@@ -757,14 +1450,9 @@ handle<LSD_T>::connect(const hosts_info_list_t& hosts) {
 	if (!is_running_ || is_connected_ || hosts.empty()) {
 		return;
 	}
-	else {
-		// store new hosts
-		boost::mutex::scoped_lock lock(mutex_);
-		hosts_ = hosts;
-	}
 
-	// connect to hosts
-	connect();
+	// hosts replace known ones
+	send_control_message(CONTROL_MESSAGE_CONNECT, hosts);
 }
 
 template <typename LSD_T> void
@@ -778,17 +1466,8 @@ handle<LSD_T>::connect_new_hosts(const hosts_info_list_t& hosts) {
 	if (!is_running_ || hosts.empty()) {
 		return;
 	}
-	else {
-		// append new hosts
-		boost::mutex::scoped_lock lock(mutex_);
-		new_hosts_.insert(new_hosts_.end(), hosts.begin(), hosts.end());
-	}
 
-	// connect to new hosts
-	int control_message = CONTROL_MESSAGE_CONNECT_NEW_HOSTS;
-	zmq::message_t message(sizeof(int));
-	memcpy((void *)message.data(), &control_message, sizeof(int));
-	zmq_control_socket_->send(message);
+	send_control_message(CONTROL_MESSAGE_CONNECT_NEW_HOSTS, hosts);
 }
 
 template <typename LSD_T> void
@@ -802,22 +1481,34 @@ handle<LSD_T>::reconnect(const hosts_info_list_t& hosts) {
 	if (!is_running_ || hosts.empty()) {
 		return;
 	}
-	else {
-		// replace hosts with new hosts
-		boost::mutex::scoped_lock lock(mutex_);
-		hosts_ = hosts;
+
+	// replace hosts with new hosts
+	send_control_message(CONTROL_MESSAGE_RECONNECT, hosts);
+}
+
+template <typename LSD_T> void
+handle<LSD_T>::refresh_hosts_info(const hosts_info_list_t& hosts) {
+	// takes effect with the next sent message, already sent ones are
+	// answered in whatever encoding the host understands
+	envelope_encoding_ = common_envelope_encoding(hosts);
+
+	if (balancing_type_ != BT_LOAD_AWARE) {
+		return;
 	}
 
-	// reconnect to hosts
-	int control_message = CONTROL_MESSAGE_RECONNECT;
-	zmq::message_t message(sizeof(int));
-	memcpy((void *)message.data(), &control_message, sizeof(int));
-	zmq_control_socket_->send(message);
+	// weights are recalculated by dispatch thread before next send
+	boost::mutex::scoped_lock lock(mutex_);
+	hosts_load_.clear();
+
+	for (size_t i = 0; i < hosts.size(); ++i) {
+		hosts_load_[hosts[i].ip_] = hosts[i].load_;
+	}
+
+	hosts_load_changed_ = true;
 }
 
 template <typename LSD_T> void
 handle<LSD_T>::disconnect() {
-	boost::mutex::scoped_lock lock(mutex_);
 	logger()->log(PLOG_DEBUG, "disconnect");
 	
 	if (!is_running_) {
@@ -825,10 +1516,7 @@ handle<LSD_T>::disconnect() {
 	}
 
 	// disconnect from all hosts
-	std::string control_message = boost::lexical_cast<std::string>(CONTROL_MESSAGE_DISCONNECT);
-	zmq::message_t message(control_message.length());
-	memcpy((void *)message.data(), control_message.c_str(), control_message.length());
-	zmq_control_socket_->send(message);
+	send_control_message(CONTROL_MESSAGE_DISCONNECT);
 }
 
 template <typename LSD_T> boost::shared_ptr<message_cache>
@@ -851,9 +1539,40 @@ handle<LSD_T>::set_responce_callback(responce_callback_t callback) {
 
 template <typename LSD_T> void
 handle<LSD_T>::enqueue_message(boost::shared_ptr<cached_message> message) {
-	boost::mutex::scoped_lock lock(mutex_);
-	messages_cache()->enqueue(message);
+	if (overflow_messages_count_ > 0 || !pending_messages_.try_push(message)) {
+		boost::mutex::scoped_lock lock(overflow_mutex_);
+		overflow_messages_.push_back(message);
+		__sync_fetch_and_add(&overflow_messages_count_, 1);
+	}
+
+	// wake up dispatch thread
+	wakeup_.notify();
+}
+
+template <typename LSD_T> void
+handle<LSD_T>::flush_pending_messages() {
+	boost::mutex::scoped_lock flush_lock(flush_mutex_);
+
+	message_cache::message_queue_ptr_t queue(new message_cache::message_queue_t);
+	boost::shared_ptr<cached_message> message;
+
+	// ring first, overflowed messages were enqueued after ring filled up
+	while (pending_messages_.pop(message)) {
+		queue->push_back(message);
+	}
+
+	if (overflow_messages_count_ > 0) {
+		boost::mutex::scoped_lock lock(overflow_mutex_);
+		queue->insert(queue->end(), overflow_messages_.begin(), overflow_messages_.end());
+		overflow_messages_.clear();
+		__sync_lock_release(&overflow_messages_count_);
+	}
+
+	if (queue->empty()) {
+		return;
+	}
 
+	messages_cache()->append_message_queue(queue);
 	update_statistics();
 }
 
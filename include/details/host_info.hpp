@@ -33,6 +33,22 @@
 
 namespace lsd {
 
+// worker pool and queue state reported by host heartbeat
+struct host_load {
+	host_load() :
+		is_reported(false),
+		pool_active(0),
+		pool_total(0),
+		queue(0),
+		pending_jobs(0) {};
+
+	bool is_reported;
+	unsigned int pool_active;
+	unsigned int pool_total;
+	unsigned int queue;
+	unsigned int pending_jobs;
+};
+
 // predeclaration
 template <typename LSD_T> class host_info;
 typedef host_info<LT> host_info_t;
@@ -40,25 +56,26 @@ typedef host_info<LT> host_info_t;
 template<typename LSD_T>
 class host_info {
 public:
-	host_info() : ip_(0) {
+	host_info() : ip_(0), protocol_version_(JSON_ENVELOPE_PROTOCOL_VERSION) {
 	}
 	
 	explicit host_info(const typename LSD_T::ip_addr ip) :
-	ip_(ip) {
+	ip_(ip), protocol_version_(JSON_ENVELOPE_PROTOCOL_VERSION) {
 		hostname_ = hostname_for_ip(ip);
 	}
 	
-	explicit host_info(const std::string& ip) {
+	explicit host_info(const std::string& ip) :
+	protocol_version_(JSON_ENVELOPE_PROTOCOL_VERSION) {
 		ip_ = ip_from_string(ip);
 		hostname_ = hostname_for_ip(ip);
 	}
 
 	host_info(const host_info<LSD_T>& info) :
-	ip_(info.ip_), hostname_(info.hostname_) {
+	ip_(info.ip_), hostname_(info.hostname_), protocol_version_(info.protocol_version_), load_(info.load_) {
 	}
 	
 	host_info(const typename LSD_T::ip_addr ip, const std::string& hostname) :
-		ip_(ip), hostname_(hostname) {
+		ip_(ip), hostname_(hostname), protocol_version_(JSON_ENVELOPE_PROTOCOL_VERSION) {
 	}
 	
 	bool operator == (const host_info<LSD_T>& info) {
@@ -106,6 +123,12 @@ public:
 
 	typename LSD_T::ip_addr ip_;
 	std::string hostname_;
+
+	// lsd protocol version negotiated with host during heartbeat
+	int protocol_version_;
+
+	// load snapshot from the last heartbeat
+	host_load load_;
 };
 
 template <typename LSD_T>
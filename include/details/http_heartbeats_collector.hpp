@@ -52,7 +52,7 @@ private:
 	void ping_service_hosts(const service_info_t& s_info, std::vector<host_info_t>& hosts);
 
 	void parse_host_response(const service_info_t& s_info,
-							 LT::ip_addr ip,
+							 host_info_t& host,
 							 const std::string& response,
 							 std::vector<handle_info_t>& handles);
 
@@ -22,11 +22,12 @@
 #include <boost/shared_ptr.hpp>
 #include <boost/thread/mutex.hpp>
 
-#include <eblob/eblob.hpp>
-
 #include "lsd/structs.hpp"
 #include "details/context.hpp"
 #include "details/cached_message.hpp"
+#include "details/message_index.hpp"
+#include "details/message_scheduler.hpp"
+#include "details/retry_scheduler.hpp"
 
 namespace lsd {
 
@@ -36,8 +37,11 @@ public:
 	typedef std::deque<cached_message_ptr_t> message_queue_t;
 	typedef boost::shared_ptr<message_queue_t> message_queue_ptr_t;
 
-	// map <uuid, cached message>
-	typedef std::map<std::string, cached_message_ptr_t> messages_index_t;
+	// <binary uuid, cached message>
+	typedef message_index messages_index_t;
+
+	// map <host ip, messages sent to host and not answered yet>
+	typedef std::map<LT::ip_addr, size_t> in_flight_counts_t;
 
 public:
 	explicit message_cache(boost::shared_ptr<lsd::context> context,
@@ -50,18 +54,49 @@ public:
 
 	size_t new_messages_count();
 	size_t sent_messages_count();
+	void get_queue_status(msg_queue_status& status);
+	void get_in_flight_counts(in_flight_counts_t& counts);
 	cached_message_ptr_t get_new_message();
-	cached_message_ptr_t get_sent_message(const std::string& uuid);
+
+	// empty pointer if message is not in sent index
+	cached_message_ptr_t find_sent_message(const message_uuid& uuid);
+
+	// find and remove from sent index in one lookup, empty pointer if not found.
+	// broadcasts are only found, they leave with remove_message_from_cache().
+	cached_message_ptr_t take_sent_message(const message_uuid& uuid);
+
+	// take all pending messages out in sending order
 	message_queue_ptr_t new_messages();
 	void move_new_message_to_sent();
-	void move_sent_message_to_new(const std::string& uuid);
-	void move_sent_message_to_new_front(const std::string& uuid);
-	void remove_message_from_cache(const std::string& uuid);
+
+	// pop up to max_count messages (max_bytes of data) from pending queue
+	size_t get_new_messages(size_t max_count, size_t max_bytes, message_queue_t& messages);
+
+	// index sent messages, return unsent ones back to the front of pending queue
+	void commit_sent_messages(const message_queue_t& sent, const message_queue_t& unsent);
+	void move_sent_message_to_new(const message_uuid& uuid);
+	void move_sent_message_to_new_front(const message_uuid& uuid);
+
+	// delay resend of a rejected message taken from sent index with
+	// exponential backoff, returns the delay in seconds
+	double schedule_message_retry(cached_message_ptr_t msg);
+
+	// earliest time a delayed resend can happen, false if there are none
+	bool next_retry_time(double& retry_time);
+	void remove_message_from_cache(const message_uuid& uuid);
 	void make_all_messages_new();
-	void process_expired_messages(std::vector<std::pair<std::string, message_path> >& expired_uuids);
+
+	// message got its final response or expired, its ram goes back to cache budget
+	// and persistent copy is not needed anymore
+	void complete_message(cached_message_ptr_t msg);
 
 private:
-	static bool is_message_expired(cached_message_ptr_t msg);
+	// keep sent index and per host in-flight counts in sync
+	void index_sent_message(cached_message_ptr_t msg);
+	void unindex_sent_message(cached_message_ptr_t msg);
+
+	// move delayed resends to the front of their lanes
+	void release_all_retries();
 
 	boost::shared_ptr<lsd::context> context();
 	boost::shared_ptr<base_logger> logger();
@@ -72,7 +107,10 @@ private:
 	enum message_cache_type type_;
 
 	messages_index_t sent_messages_;
-	message_queue_ptr_t new_messages_;
+	in_flight_counts_t in_flight_counts_;
+	message_scheduler new_messages_;
+	retry_scheduler retries_;
+	unsigned int random_seed_;
 
 	boost::mutex mutex_;
 };
@@ -0,0 +1,73 @@
+//
+// Copyright (C) 2011 Rim Zaidullin <creator@bash.org.ru>
+//
+// Licensed under the BSD 2-Clause License (the "License");
+// you may not use this file except in compliance with the License.
+//
+// Unless required by applicable law or agreed to in writing, software
+// distributed under the License is distributed on an "AS IS" BASIS,
+// WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+// See the License for the specific language governing permissions and
+// limitations under the License.
+//
+
+#ifndef _LSD_MESSAGE_INDEX_HPP_INCLUDED_
+#define _LSD_MESSAGE_INDEX_HPP_INCLUDED_
+
+#include <vector>
+
+#include <boost/shared_ptr.hpp>
+#include <boost/utility.hpp>
+
+#include "details/cached_message.hpp"
+#include "details/message_uuid.hpp"
+
+namespace lsd {
+
+// messages by binary uuid: flat open addressing table with linear probing
+// and backward shift deletion, so there are no tombstones. keeps load
+// factor under 3/4 by doubling. not thread safe, owner provides locking.
+class message_index : private boost::noncopyable {
+public:
+	typedef boost::shared_ptr<cached_message> cached_message_ptr_t;
+
+public:
+	message_index();
+	virtual ~message_index();
+
+	// false if message with the same uuid is already indexed
+	bool insert(cached_message_ptr_t message);
+
+	// empty pointer if not found
+	cached_message_ptr_t find(const message_uuid& uuid) const;
+
+	// find and erase in one probe, empty pointer if not found
+	cached_message_ptr_t take(const message_uuid& uuid);
+
+	// append all messages and clear index
+	void take_all(std::vector<cached_message_ptr_t>& messages);
+
+	size_t size() const;
+	bool empty() const;
+
+private:
+	struct slot {
+		message_uuid uuid;
+		cached_message_ptr_t message;
+	};
+
+	static const size_t INITIAL_CAPACITY = 64;
+
+	size_t find_slot(const message_uuid& uuid) const;
+	void erase_slot(size_t index);
+	void grow();
+
+private:
+	std::vector<slot> slots_;
+	size_t mask_;
+	size_t size_;
+};
+
+} // namespace lsd
+
+#endif // _LSD_MESSAGE_INDEX_HPP_INCLUDED_
@@ -0,0 +1,234 @@
+//
+// Copyright (C) 2011 Rim Zaidullin <creator@bash.org.ru>
+//
+// Licensed under the BSD 2-Clause License (the "License");
+// you may not use this file except in compliance with the License.
+//
+// Unless required by applicable law or agreed to in writing, software
+// distributed under the License is distributed on an "AS IS" BASIS,
+// WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+// See the License for the specific language governing permissions and
+// limitations under the License.
+//
+
+#ifndef _LSD_MESSAGE_LOG_HPP_INCLUDED_
+#define _LSD_MESSAGE_LOG_HPP_INCLUDED_
+
+#include <string>
+#include <vector>
+#include <deque>
+#include <map>
+
+#include <boost/shared_ptr.hpp>
+#include <boost/cstdint.hpp>
+#include <boost/utility.hpp>
+#include <boost/function.hpp>
+#include <boost/thread/thread.hpp>
+#include <boost/thread/mutex.hpp>
+#include <boost/thread/condition_variable.hpp>
+#include <boost/thread/thread_time.hpp>
+
+#include "lsd/structs.hpp"
+#include "details/cached_message.hpp"
+#include "details/message_uuid.hpp"
+#include "details/smart_logger.hpp"
+
+namespace lsd {
+
+// durable storage of PERSISTANT message cache: append-only log split into
+// numbered segment files. enqueued messages are appended as records,
+// completed ones get a tombstone record. segments are only ever deleted
+// oldest first, once nothing in them is alive, so a tombstone never
+// outlives the message it kills. when disk usage would go over max_size,
+// oldest segments are compacted by moving their live records forward.
+// existing segments are scanned on open, records carry a sequence number
+// to restore the order they were appended in. segments are parsed in
+// parallel in batches of one segment per core and then merged in segment
+// order. the scan only builds the index of live records, their payloads
+// stay on disk until read_recovered_messages() streams them back.
+// writes go straight to the active segment, syncing them is left to
+// the committer thread: one fdatasync covers everything written since
+// the previous one (group commit). a commit is made every sync_interval
+// seconds, when sync_bytes of unsynced data pile up, or right away when
+// someone waits in wait_committed(). writers never sync themselves: rolled
+// segments are synced and closed by the committer, segments emptied by
+// compaction are unlinked once their moved records are committed.
+// thread safe.
+class message_log : private boost::noncopyable {
+public:
+	typedef boost::shared_ptr<cached_message> cached_message_ptr_t;
+	typedef boost::function<void(const commit_stats&)> commit_callback_t;
+
+public:
+	// max_size == 0 means unlimited, sync_bytes == 0 means commit by interval only
+	message_log(const std::string& path,
+				boost::uint64_t max_size,
+				double sync_interval,
+				size_t sync_bytes,
+				boost::shared_ptr<base_logger> logger,
+				boost::uint64_t segment_size = SEGMENT_SIZE);
+
+	virtual ~message_log();
+
+	// throws LSD_OVER_HDD_CAPACITY_ERROR if message doesn't fit under max_size,
+	// returns commit ticket of the record for wait_committed()
+	boost::uint64_t append(const cached_message& message);
+
+	// block until record with given ticket is synced to disk
+	void wait_committed(boost::uint64_t ticket);
+
+	// called by committer thread after every commit
+	void set_commit_callback(const commit_callback_t& callback);
+	commit_stats commit_statistics();
+
+	// tombstone a message, nothing is written for messages that are not logged
+	void remove(const message_uuid& uuid);
+
+	// next messages found alive on open, in original order, until about
+	// max_bytes of records are read (at least one message if any is left).
+	// messages completed meanwhile are skipped. returns amount of read.
+	size_t read_recovered_messages(size_t max_bytes, std::vector<cached_message_ptr_t>& messages);
+
+	// recovered messages not read yet
+	size_t recovered_messages_count();
+
+	boost::uint64_t disk_size();
+	size_t segments_count();
+	size_t live_messages_count();
+
+	static const boost::uint64_t SEGMENT_SIZE = 64 * 1024 * 1024; // bytes
+
+	// record body format, uuid is kept separately. empty pointer on malformed body.
+	static void serialize_message(const cached_message& message, std::string& body);
+	static cached_message_ptr_t deserialize_message(const message_uuid& uuid, const char* body, size_t size);
+
+private:
+	enum record_type {
+		RECORD_MESSAGE = 1,
+		RECORD_TOMBSTONE
+	};
+
+	// fixed part of every record, body follows
+	struct record_header {
+		boost::uint32_t magic;
+		boost::uint32_t type;
+		boost::uint32_t body_size;
+		boost::uint32_t checksum;
+		boost::uint64_t sequence;
+		unsigned char uuid[message_uuid::SIZE];
+	};
+
+	struct segment {
+		segment() : size(0), valid_size(0), live_count(0), live_bytes(0) {};
+
+		std::string path;
+		boost::uint64_t size;
+
+		// records up to here were read back fine, garbage may follow
+		boost::uint64_t valid_size;
+		size_t live_count;
+		boost::uint64_t live_bytes;
+	};
+
+	struct live_record {
+		boost::uint32_t segment_id;
+		boost::uint64_t offset;
+		boost::uint64_t size;
+		boost::uint64_t sequence;
+	};
+
+	// segment contents as read on open, before merging into live records
+	struct parsed_record {
+		boost::uint32_t type;
+		message_uuid uuid;
+		boost::uint64_t sequence;
+		boost::uint64_t offset;
+		boost::uint64_t size;
+	};
+
+	struct parsed_segment {
+		parsed_segment() : size(0), valid_size(0) {};
+
+		std::string path;
+		std::vector<parsed_record> records;
+		size_t size;
+		size_t valid_size;
+		std::string error;
+	};
+
+	typedef std::map<boost::uint32_t, segment> segments_t;
+	typedef std::map<message_uuid, live_record> live_records_t;
+
+	static const boost::uint32_t RECORD_MAGIC = 0x5244534c; // "LSDR"
+
+	void open();
+	void merge_segment(boost::uint32_t id, segment& seg, parsed_segment& parsed, bool is_last);
+
+	static void parse_segment(parsed_segment& parsed);
+	static void parse_segments(std::vector<parsed_segment>* batch, volatile size_t* next_index);
+
+	std::string segment_path(boost::uint32_t id) const;
+	void open_active_segment(boost::uint32_t id);
+	void roll_active_segment();
+
+	// returns offset of the record in active segment
+	boost::uint64_t write_record(enum record_type type, const message_uuid& uuid, boost::uint64_t sequence, const std::string& body);
+	void sync_all_segments();
+	void unlink_compacted_segments();
+
+	void committer();
+	bool is_commit_due() const;
+	void commit(boost::mutex::scoped_lock& lock);
+	void make_room(boost::uint64_t record_size);
+	void compact_oldest_segment();
+	void delete_dead_segments();
+
+	static boost::uint32_t checksum(const record_header& header, const char* body);
+
+private:
+	std::string path_;
+	boost::uint64_t max_size_;
+	boost::uint64_t segment_size_;
+	boost::shared_ptr<base_logger> logger_;
+
+	segments_t segments_;
+	live_records_t live_records_;
+	boost::uint64_t disk_size_;
+	boost::uint64_t live_bytes_;
+
+	int active_fd_;
+	boost::uint32_t active_id_;
+	boost::uint64_t next_sequence_;
+
+	// live on open, in append order, not read yet
+	std::deque<message_uuid> recovered_uuids_;
+
+	// rolled segments not synced yet, committer syncs and closes them
+	std::vector<int> rolled_fds_;
+
+	// <ticket, path> of compacted segments waiting for their moved records to be committed
+	std::vector<std::pair<boost::uint64_t, std::string> > compacted_segments_;
+
+	// group commit, records are counted by tickets: written_ is a ticket
+	// of the last written record, everything up to synced_ is on disk
+	double sync_interval_;
+	size_t sync_bytes_;
+	boost::uint64_t written_;
+	boost::uint64_t synced_;
+	size_t unsynced_records_;
+	boost::uint64_t unsynced_bytes_;
+	size_t waiters_;
+	boost::system_time last_commit_time_;
+	commit_stats commit_stats_;
+	commit_callback_t commit_callback_;
+	bool stopping_;
+
+	boost::mutex mutex_;
+	boost::condition_variable commit_condition_;
+	boost::condition_variable committed_condition_;
+	boost::thread committer_thread_;
+};
+
+} // namespace lsd
+
+#endif // _LSD_MESSAGE_LOG_HPP_INCLUDED_
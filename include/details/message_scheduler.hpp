@@ -0,0 +1,108 @@
+//
+// Copyright (C) 2011 Rim Zaidullin <creator@bash.org.ru>
+//
+// Licensed under the BSD 2-Clause License (the "License");
+// you may not use this file except in compliance with the License.
+//
+// Unless required by applicable law or agreed to in writing, software
+// distributed under the License is distributed on an "AS IS" BASIS,
+// WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+// See the License for the specific language governing permissions and
+// limitations under the License.
+//
+
+#ifndef _LSD_MESSAGE_SCHEDULER_HPP_INCLUDED_
+#define _LSD_MESSAGE_SCHEDULER_HPP_INCLUDED_
+
+#include <deque>
+#include <vector>
+
+#include <boost/shared_ptr.hpp>
+#include <boost/cstdint.hpp>
+#include <boost/utility.hpp>
+
+#include "details/cached_message.hpp"
+
+namespace lsd {
+
+// pending messages in sending order. urgent messages always go before
+// normal ones. within a lane messages go earliest deadline first. messages
+// without a deadline keep fifo order among themselves and get an implicit
+// deadline of enqueue time plus their timeout (MESSAGE_TIMEOUT if none),
+// so a steady stream of deadline messages can't starve them.
+// push and pop are O(log n) for deadline messages and O(1) otherwise.
+// not thread safe, owner provides locking.
+class message_scheduler : private boost::noncopyable {
+public:
+	typedef boost::shared_ptr<cached_message> cached_message_ptr_t;
+	typedef std::deque<cached_message_ptr_t> message_queue_t;
+
+public:
+	message_scheduler();
+	virtual ~message_scheduler();
+
+	void push_back(cached_message_ptr_t message);
+
+	// put message back in front of its lane, e.g. after a failed send.
+	// deadline messages simply return to their place in deadline order.
+	void push_front(cached_message_ptr_t message);
+
+	// keeps order of messages, queue[0] comes first
+	void push_front(const message_queue_t& messages);
+
+	cached_message_ptr_t front() const;
+	void pop_front();
+
+	// append all messages in sending order and clear scheduler
+	void pop_all(message_queue_t& messages);
+
+	size_t size() const;
+	size_t urgent_size() const;
+	bool empty() const;
+
+private:
+	struct entry {
+		double deadline;
+		boost::uint64_t sequence;
+		cached_message_ptr_t message;
+
+		// min-heap on top of std heap functions, fifo for equal deadlines
+		bool operator < (const entry& rhs) const {
+			if (deadline != rhs.deadline) {
+				return deadline > rhs.deadline;
+			}
+
+			return sequence > rhs.sequence;
+		}
+	};
+
+	struct lane {
+		std::vector<entry> deadlines;
+
+		// deadline of fifo entries is implicit, sequence is unused
+		std::deque<entry> fifo;
+
+		size_t size() const { return deadlines.size() + fifo.size(); };
+		bool empty() const { return deadlines.empty() && fifo.empty(); };
+	};
+
+	lane& lane_for(const cached_message_ptr_t& message);
+	const lane& front_lane() const;
+	lane& front_lane();
+
+	void push_deadline(lane& l, cached_message_ptr_t message, boost::uint64_t sequence);
+	static entry fifo_entry(cached_message_ptr_t message, double now);
+	static bool is_fifo_first(const lane& l);
+
+private:
+	lane urgent_;
+	lane normal_;
+
+	// orders deadline ties, messages put back go before the rest
+	boost::uint64_t back_sequence_;
+	boost::uint64_t front_sequence_;
+};
+
+} // namespace lsd
+
+#endif // _LSD_MESSAGE_SCHEDULER_HPP_INCLUDED_
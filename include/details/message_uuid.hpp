@@ -0,0 +1,67 @@
+//
+// Copyright (C) 2011 Rim Zaidullin <creator@bash.org.ru>
+//
+// Licensed under the BSD 2-Clause License (the "License");
+// you may not use this file except in compliance with the License.
+//
+// Unless required by applicable law or agreed to in writing, software
+// distributed under the License is distributed on an "AS IS" BASIS,
+// WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+// See the License for the specific language governing permissions and
+// limitations under the License.
+//
+
+#ifndef _LSD_MESSAGE_UUID_HPP_INCLUDED_
+#define _LSD_MESSAGE_UUID_HPP_INCLUDED_
+
+#include <string>
+#include <cstring>
+
+#include <boost/cstdint.hpp>
+
+namespace lsd {
+
+// binary form of message uuid, random (version 4) uuid layout
+struct message_uuid {
+	static const size_t SIZE = 16; // bytes
+	static const size_t STRING_SIZE = 36; // bytes, without terminating zero
+
+	message_uuid() {
+		memset(bytes, 0, SIZE);
+	};
+
+	bool operator == (const message_uuid& rhs) const {
+		return (memcmp(bytes, rhs.bytes, SIZE) == 0);
+	}
+
+	bool operator != (const message_uuid& rhs) const {
+		return !(*this == rhs);
+	}
+
+	bool operator < (const message_uuid& rhs) const {
+		return (memcmp(bytes, rhs.bytes, SIZE) < 0);
+	}
+
+	bool is_nil() const;
+
+	// uuids are random, folding both halves is enough
+	boost::uint64_t hash() const;
+
+	// canonical 8-4-4-4-12 hex form, false if string is not an uuid
+	bool parse(const char* data, size_t size);
+	bool parse(const std::string& str);
+	std::string as_string() const;
+
+	// writes STRING_SIZE chars, no terminating zero
+	void format(char* buffer) const;
+
+	// version 4 uuid from per-thread counter based generator, see
+	// message_uuid.cpp. uuids are unique, but not unpredictable.
+	static message_uuid generate();
+
+	unsigned char bytes[SIZE];
+};
+
+} // namespace lsd
+
+#endif // _LSD_MESSAGE_UUID_HPP_INCLUDED_
@@ -0,0 +1,119 @@
+//
+// Copyright (C) 2011 Rim Zaidullin <creator@bash.org.ru>
+//
+// Licensed under the BSD 2-Clause License (the "License");
+// you may not use this file except in compliance with the License.
+//
+// Unless required by applicable law or agreed to in writing, software
+// distributed under the License is distributed on an "AS IS" BASIS,
+// WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+// See the License for the specific language governing permissions and
+// limitations under the License.
+//
+
+#ifndef _LSD_MPSC_QUEUE_HPP_INCLUDED_
+#define _LSD_MPSC_QUEUE_HPP_INCLUDED_
+
+#include <boost/utility.hpp>
+
+namespace lsd {
+
+// unbounded multiple producers / single consumer queue (linked list with
+// a stub node). push never blocks and never fails, pop must only be called
+// from one thread. a pushed value becomes visible to the consumer once the
+// producer has linked it, a preempted producer may hide later values
+// until it's done.
+template <typename T>
+class mpsc_queue : private boost::noncopyable {
+public:
+	mpsc_queue();
+	virtual ~mpsc_queue();
+
+	void push(const T& value);
+
+	// false if queue is empty
+	bool pop(T& value);
+
+private:
+	struct node {
+		node() : next(NULL) {};
+		explicit node(const T& v) : next(NULL), value(v) {};
+
+		node* volatile next;
+		T value;
+	};
+
+	node* exchange_head(node* n);
+
+private:
+	// producers append at head, consumer takes from tail
+	node* volatile head_;
+	node* tail_;
+};
+
+template <typename T>
+mpsc_queue<T>::mpsc_queue() {
+	node* stub = new node();
+	head_ = stub;
+	tail_ = stub;
+}
+
+template <typename T>
+mpsc_queue<T>::~mpsc_queue() {
+	while (tail_) {
+		node* next = tail_->next;
+		delete tail_;
+		tail_ = next;
+	}
+}
+
+template <typename T> typename mpsc_queue<T>::node*
+mpsc_queue<T>::exchange_head(node* n) {
+	// full barrier, unlike __sync_lock_test_and_set
+	node* prev = head_;
+
+	while (true) {
+		node* current = __sync_val_compare_and_swap(&head_, prev, n);
+
+		if (current == prev) {
+			return prev;
+		}
+
+		prev = current;
+	}
+}
+
+template <typename T> void
+mpsc_queue<T>::push(const T& value) {
+	node* n = new node(value);
+	node* prev = exchange_head(n);
+
+	// link after the value is fully constructed
+	__sync_synchronize();
+	prev->next = n;
+}
+
+template <typename T> bool
+mpsc_queue<T>::pop(T& value) {
+	node* tail = tail_;
+	node* next = tail->next;
+
+	if (!next) {
+		return false;
+	}
+
+	__sync_synchronize();
+
+	// next becomes the new stub, don't keep its value alive
+	value = next->value;
+	next->value = T();
+
+	tail_ = next;
+	delete tail;
+
+	return true;
+}
+
+} // namespace lsd
+
+#endif // _LSD_MPSC_QUEUE_HPP_INCLUDED_
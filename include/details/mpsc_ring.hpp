@@ -0,0 +1,149 @@
+//
+// Copyright (C) 2011 Rim Zaidullin <creator@bash.org.ru>
+//
+// Licensed under the BSD 2-Clause License (the "License");
+// you may not use this file except in compliance with the License.
+//
+// Unless required by applicable law or agreed to in writing, software
+// distributed under the License is distributed on an "AS IS" BASIS,
+// WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+// See the License for the specific language governing permissions and
+// limitations under the License.
+//
+
+#ifndef _LSD_MPSC_RING_HPP_INCLUDED_
+#define _LSD_MPSC_RING_HPP_INCLUDED_
+
+#include <boost/cstdint.hpp>
+#include <boost/utility.hpp>
+
+namespace lsd {
+
+// bounded multiple producers / single consumer queue on top of a ring of
+// sequenced cells. producers claim a cell with a single CAS and publish it
+// by bumping its sequence, consumer never writes shared positions.
+// try_push fails instead of blocking when ring is full, pop must only be
+// called from one thread at a time. capacity is rounded up to power of 2.
+template <typename T>
+class mpsc_ring : private boost::noncopyable {
+public:
+	explicit mpsc_ring(size_t capacity);
+	virtual ~mpsc_ring();
+
+	// false if ring is full
+	bool try_push(const T& value);
+
+	// false if ring is empty
+	bool pop(T& value);
+
+	size_t capacity() const;
+
+private:
+	struct cell {
+		volatile size_t sequence;
+		T value;
+	};
+
+	static const size_t CACHE_LINE_SIZE = 64;
+
+private:
+	cell* cells_;
+	size_t mask_;
+
+	// producers and consumer positions live on separate cache lines
+	char pad0_[CACHE_LINE_SIZE];
+	volatile size_t enqueue_pos_;
+	char pad1_[CACHE_LINE_SIZE];
+	size_t dequeue_pos_;
+};
+
+template <typename T>
+mpsc_ring<T>::mpsc_ring(size_t capacity) :
+	cells_(NULL),
+	mask_(0),
+	enqueue_pos_(0),
+	dequeue_pos_(0)
+{
+	size_t size = 2;
+	while (size < capacity) {
+		size <<= 1;
+	}
+
+	cells_ = new cell[size];
+	mask_ = size - 1;
+
+	for (size_t i = 0; i < size; ++i) {
+		cells_[i].sequence = i;
+	}
+}
+
+template <typename T>
+mpsc_ring<T>::~mpsc_ring() {
+	delete[] cells_;
+}
+
+template <typename T> bool
+mpsc_ring<T>::try_push(const T& value) {
+	size_t pos = enqueue_pos_;
+
+	while (true) {
+		cell* c = &cells_[pos & mask_];
+		size_t sequence = c->sequence;
+		__sync_synchronize();
+
+		// cell is free for this lap
+		if (sequence == pos) {
+			size_t current = __sync_val_compare_and_swap(&enqueue_pos_, pos, pos + 1);
+
+			if (current == pos) {
+				c->value = value;
+
+				// publish value to consumer
+				__sync_synchronize();
+				c->sequence = pos + 1;
+				return true;
+			}
+
+			pos = current;
+		}
+		else if ((boost::intptr_t)(sequence - pos) < 0) {
+			// consumer hasn't freed the cell from previous lap yet
+			return false;
+		}
+		else {
+			// another producer took the cell, retry with fresh position
+			pos = enqueue_pos_;
+		}
+	}
+}
+
+template <typename T> bool
+mpsc_ring<T>::pop(T& value) {
+	cell* c = &cells_[dequeue_pos_ & mask_];
+	size_t sequence = c->sequence;
+	__sync_synchronize();
+
+	if (sequence != dequeue_pos_ + 1) {
+		return false;
+	}
+
+	// don't keep popped value alive in the ring
+	value = c->value;
+	c->value = T();
+
+	// hand the cell over to producers of the next lap
+	__sync_synchronize();
+	c->sequence = dequeue_pos_ + mask_ + 1;
+	++dequeue_pos_;
+
+	return true;
+}
+
+template <typename T> size_t
+mpsc_ring<T>::capacity() const {
+	return mask_ + 1;
+}
+
+} // namespace lsd
+
+#endif // _LSD_MPSC_RING_HPP_INCLUDED_
@@ -0,0 +1,121 @@
+//
+// Copyright (C) 2011 Rim Zaidullin <creator@bash.org.ru>
+//
+// Licensed under the BSD 2-Clause License (the "License");
+// you may not use this file except in compliance with the License.
+//
+// Unless required by applicable law or agreed to in writing, software
+// distributed under the License is distributed on an "AS IS" BASIS,
+// WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+// See the License for the specific language governing permissions and
+// limitations under the License.
+//
+
+#ifndef _LSD_REACTOR_HPP_INCLUDED_
+#define _LSD_REACTOR_HPP_INCLUDED_
+
+#include <set>
+#include <vector>
+
+#include <zmq.hpp>
+
+#include <boost/shared_ptr.hpp>
+#include <boost/utility.hpp>
+#include <boost/thread/thread.hpp>
+#include <boost/thread/mutex.hpp>
+#include <boost/thread/condition_variable.hpp>
+
+#include "details/smart_logger.hpp"
+#include "details/wakeup_signal.hpp"
+
+namespace lsd {
+
+// zmq_poll() timeout is in microseconds before zmq 3.x
+inline long
+zmq_poll_timeout(long milliseconds) {
+#if ZMQ_VERSION_MAJOR < 3
+	return milliseconds * 1000;
+#else
+	return milliseconds;
+#endif
+}
+
+// event loop steps of something a reactor can drive. all methods are
+// called from the thread that owns the handler sockets.
+class reactor_handler {
+public:
+	virtual ~reactor_handler() {};
+
+	// create sockets owned by the dispatching thread
+	virtual void dispatch_start() = 0;
+
+	// append poll items, process_events() gets them back with revents set
+	virtual void fill_poll_items(std::vector<zmq_pollitem_t>& items) = 0;
+
+	// milliseconds handler can sleep for
+	virtual long poll_timeout() = 0;
+
+	// returns false once handler is done and must be detached
+	virtual bool process_events(const zmq_pollitem_t* items) = 0;
+
+	virtual void dispatch_stop() = 0;
+};
+
+// single thread polling sockets of all attached handlers
+class reactor : private boost::noncopyable {
+public:
+	explicit reactor(boost::shared_ptr<base_logger> logger);
+	virtual ~reactor();
+
+	// handler is started on the reactor thread
+	void attach(reactor_handler* handler);
+
+	// block until handler was stopped and detached
+	void wait_detached(reactor_handler* handler);
+
+	size_t handlers_count();
+
+private:
+	void run();
+	void attach_pending_handlers();
+	void detach_handler(size_t index);
+
+private:
+	boost::shared_ptr<base_logger> logger_;
+
+	// reactor thread only
+	std::vector<reactor_handler*> handlers_;
+	std::vector<zmq_pollitem_t> poll_items_;
+	std::vector<size_t> poll_offsets_;
+
+	// handed over between threads, guarded by mutex_
+	std::vector<reactor_handler*> pending_handlers_;
+	std::set<reactor_handler*> detached_handlers_;
+	size_t handlers_count_;
+
+	wakeup_signal wakeup_;
+	volatile bool is_running_;
+
+	boost::thread thread_;
+	boost::mutex mutex_;
+	boost::condition_variable detached_;
+};
+
+// fixed set of reactors, handlers are pinned to the least loaded one
+class reactor_pool : private boost::noncopyable {
+public:
+	// threads == 0 means number of cores
+	reactor_pool(size_t threads, boost::shared_ptr<base_logger> logger);
+	virtual ~reactor_pool();
+
+	reactor* assign();
+	size_t size() const;
+
+private:
+	std::vector<boost::shared_ptr<reactor> > reactors_;
+	boost::mutex mutex_;
+};
+
+} // namespace lsd
+
+#endif // _LSD_REACTOR_HPP_INCLUDED_
@@ -0,0 +1,92 @@
+//
+// Copyright (C) 2011 Rim Zaidullin <creator@bash.org.ru>
+//
+// Licensed under the BSD 2-Clause License (the "License");
+// you may not use this file except in compliance with the License.
+//
+// Unless required by applicable law or agreed to in writing, software
+// distributed under the License is distributed on an "AS IS" BASIS,
+// WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+// See the License for the specific language governing permissions and
+// limitations under the License.
+//
+
+#ifndef _LSD_RETRY_SCHEDULER_HPP_INCLUDED_
+#define _LSD_RETRY_SCHEDULER_HPP_INCLUDED_
+
+#include <deque>
+#include <vector>
+
+#include <boost/shared_ptr.hpp>
+#include <boost/cstdint.hpp>
+#include <boost/utility.hpp>
+
+#include "details/cached_message.hpp"
+
+namespace lsd {
+
+// messages waiting for a delayed resend, ordered by due time.
+// releasing is capped by a token bucket (max_rate messages per second).
+// not thread safe, owner provides locking.
+class retry_scheduler : private boost::noncopyable {
+public:
+	typedef boost::shared_ptr<cached_message> cached_message_ptr_t;
+	typedef std::deque<cached_message_ptr_t> message_queue_t;
+
+public:
+	retry_scheduler();
+	virtual ~retry_scheduler();
+
+	// max_rate == 0 means unlimited
+	void set_rate_limit(double max_rate, double burst);
+
+	void schedule(cached_message_ptr_t message, double due_time);
+
+	// append up to max_count due messages, returns number of appended
+	size_t pop_due(double now, size_t max_count, message_queue_t& messages);
+
+	// append everything regardless of due time and rate limit
+	void pop_all(message_queue_t& messages);
+
+	// earliest time pop_due() can release a message, false if empty
+	bool next_release_time(double now, double& release_time) const;
+
+	size_t size() const;
+	bool empty() const;
+
+	// exponential backoff with jitter: uniformly random in [delay / 2, delay],
+	// delay = min(base_delay * 2^(attempt - 1), max_delay)
+	static double backoff_delay(int attempt, double base_delay, double max_delay, unsigned int* seed);
+
+private:
+	struct entry {
+		double due_time;
+		boost::uint64_t sequence;
+		cached_message_ptr_t message;
+
+		// min-heap on top of std heap functions, fifo for equal due times
+		bool operator < (const entry& rhs) const {
+			if (due_time != rhs.due_time) {
+				return due_time > rhs.due_time;
+			}
+
+			return sequence > rhs.sequence;
+		}
+	};
+
+	void refill_tokens(double now);
+
+private:
+	std::vector<entry> heap_;
+	boost::uint64_t sequence_;
+
+	// token bucket
+	double max_rate_;
+	double burst_;
+	double tokens_;
+	double last_refill_;
+};
+
+} // namespace lsd
+
+#endif // _LSD_RETRY_SCHEDULER_HPP_INCLUDED_
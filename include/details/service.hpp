@@ -19,12 +19,14 @@
 #include <map>
 #include <vector>
 #include <deque>
+#include <memory>
 
 #include <zmq.hpp>
 
 #include <boost/shared_ptr.hpp>
 #include <boost/utility.hpp>
 #include <boost/thread/thread.hpp>
+#include <boost/bind.hpp>
 #include <boost/function.hpp>
 
 #include "lsd/structs.hpp"
@@ -32,6 +34,8 @@
 #include "details/error.hpp"
 #include "details/handle.hpp"
 #include "details/context.hpp"
+#include "details/refresher.hpp"
+#include "details/callback_executor.hpp"
 #include "details/host_info.hpp"
 #include "details/handle_info.hpp"
 #include "details/service_info.hpp"
@@ -56,6 +60,7 @@ public:
 	typedef boost::shared_ptr<handle<LSD_T> > handle_ptr_t;
 	typedef std::map<typename LSD_T::ip_addr, std::string> hosts_map_t;
 	typedef std::map<std::string, handle_ptr_t> handles_map_t;
+	typedef boost::shared_ptr<const handles_map_t> handles_snapshot_t;
 
 	typedef boost::shared_ptr<cached_message> cached_message_prt_t;
 	typedef boost::shared_ptr<cached_response> cached_response_prt_t;
@@ -84,7 +89,10 @@ public:
 								   const std::vector<handle_info<LSD_T> >& handles);
 
 	void send_message(cached_message_prt_t message);
-	size_t cache_size() const;
+
+	// messages left from previous run, in original order. they wait in
+	// unhandled queues for create_new_handles() unless handle exists.
+	void recover_messages(const cached_messages_deque_t& messages);
 
 	bool register_responder_callback(registered_callback_t callback,
 									 const std::string& handle_name);
@@ -109,9 +117,14 @@ private:
 
 	void enqueue_responce_callback(cached_response_prt_t response);
 	void dispatch_responces();
+	void invoke_callback(registered_callback_t callback, cached_response_prt_t response);
 
 	// send collected statistics to global stats collector
 	void update_statistics();
+	void refresh_statistics();
+
+	// make current handles_ visible to senders, returns previous snapshot
+	handles_snapshot_t publish_handles();
 
 	boost::shared_ptr<base_logger> logger();
 	boost::shared_ptr<configuration> config();
@@ -127,6 +140,10 @@ private:
 	// handles map (handle name, handle ptr)
 	handles_map_t handles_;
 
+	// copy of handles_ for senders, replaced as a whole under mutex_ and
+	// read without it, see send_message()
+	handles_snapshot_t handles_snapshot_;
+
 	// service messages for non-existing handles <handle name, handle ptr>
 	unhandled_messages_map_t unhandled_messages_;
 
@@ -136,9 +153,6 @@ private:
 	// lsd context
 	boost::shared_ptr<lsd::context> context_;
 
-	// total cache size
-	size_t cache_size_;
-
 	// statistics
 	service_stats stats_;
 
@@ -146,27 +160,48 @@ private:
 	boost::mutex mutex_;
 	volatile bool is_running_;
 
+	// with shared reactors callbacks are handed to context callback executor
+	bool has_dispatch_thread_;
+	callback_executor::queue_ptr_t callbacks_queue_;
+
 	// responses callbacks
 	registered_callbacks_map_t responses_callbacks_map_;
+
+	// statistics are posted once a second instead of on every message
+	std::auto_ptr<refresher> stats_refresher_;
 };
 
 template <typename LSD_T>
 service<LSD_T>::service(const service_info<LSD_T>& info, boost::shared_ptr<lsd::context> context) :
 	info_(info),
+	handles_snapshot_(new handles_map_t),
 	context_(context),
-	cache_size_(0),
-	is_running_(false)
+	is_running_(false),
+	has_dispatch_thread_(!context->reactors())
 {
 	update_statistics();
+	stats_refresher_.reset(new refresher(boost::bind(&service<LSD_T>::refresh_statistics, this), 1));
 
 	// run response dispatch thread
 	is_running_ = true;
-	thread_ = boost::thread(&service<LSD_T>::dispatch_responces, this);
+
+	if (has_dispatch_thread_) {
+		thread_ = boost::thread(&service<LSD_T>::dispatch_responces, this);
+	}
+	else {
+		callbacks_queue_ = context->callbacks()->create_queue();
+	}
 }
 
 template <typename LSD_T>
 service<LSD_T>::~service() {
+	stats_refresher_.reset();
 	is_running_ = false;
+
+	if (callbacks_queue_) {
+		context()->callbacks()->close(callbacks_queue_);
+	}
+
 	thread_.join();
 }
 
@@ -187,23 +222,8 @@ service<LSD_T>::dispatch_responces() {
 				responces_deque_ptr_t handle_resp_queue = qit->second;
 
 				if (!handle_resp_queue->empty()) {
-					cached_response_prt_t resp_ptr = handle_resp_queue->front();
-					registered_callback_t callback = it->second;
-
-					// create simplified response
-					response resp;
-					resp.uuid = resp_ptr->uuid();
-					resp.data = resp_ptr->data().data();
-					resp.size = resp_ptr->data().size();
-
-					response_info resp_info;
-					resp_info.error = resp_ptr->error_code();
-					resp_info.error_msg = resp_ptr->error_message();
-					resp_info.service = resp_ptr->path().service_name;
-					resp_info.handle = resp_ptr->path().handle_name;
-
 					// invoke callback for given handle and response
-					callback(resp, resp_info);
+					invoke_callback(it->second, handle_resp_queue->front());
 
 					// remove processed response
 					handle_resp_queue->pop_front();
@@ -214,6 +234,23 @@ service<LSD_T>::dispatch_responces() {
 	}
 }
 
+template <typename LSD_T> void
+service<LSD_T>::invoke_callback(registered_callback_t callback, cached_response_prt_t resp_ptr) {
+	// create simplified response
+	response resp;
+	resp.uuid = resp_ptr->uuid();
+	resp.data = resp_ptr->data();
+	resp.size = resp_ptr->data_size();
+
+	response_info resp_info;
+	resp_info.error = resp_ptr->error_code();
+	resp_info.error_msg = resp_ptr->error_message();
+	resp_info.service = resp_ptr->path().service_name;
+	resp_info.handle = resp_ptr->path().handle_name;
+
+	callback(resp, resp_info);
+}
+
 template <typename LSD_T> boost::shared_ptr<lsd::context>
 service<LSD_T>::context() {
 	if (!context_.get()) {
@@ -297,6 +334,17 @@ service<LSD_T>::enqueue_responce_callback(cached_response_prt_t response) {
 		return;
 	}
 
+	// handle is pinned to a single reactor thread and service queue is
+	// serial, so responses keep their order
+	if (!has_dispatch_thread_) {
+		registered_callback_t callback = callback_it->second;
+		lock.unlock();
+
+		callback_executor::task_t task = boost::bind(&service<LSD_T>::invoke_callback, this, callback, response);
+		context()->callbacks()->post(callbacks_queue_, task);
+		return;
+	}
+
 	// get responces queue for response handle
 	responces_map_t::iterator it = received_responces_.find(path.handle_name);
 	responces_deque_ptr_t handle_resp_queue;
@@ -365,6 +413,18 @@ service<LSD_T>::update_statistics() {
 	context()->stats()->update_service_stats(info_.name_, stats_);
 }
 
+template <typename LSD_T> void
+service<LSD_T>::refresh_statistics() {
+	boost::mutex::scoped_lock lock(mutex_);
+	update_statistics();
+}
+
+template <typename LSD_T> typename service<LSD_T>::handles_snapshot_t
+service<LSD_T>::publish_handles() {
+	handles_snapshot_t snapshot(new handles_map_t(handles_));
+	return boost::atomic_exchange(&handles_snapshot_, snapshot);
+}
+
 template <typename LSD_T> void
 service<LSD_T>::refresh_hosts_and_handles(const hosts_info_list_t& hosts,
 										  const handles_info_list_t& handles)
@@ -387,10 +447,12 @@ service<LSD_T>::refresh_hosts_and_handles(const hosts_info_list_t& hosts,
 	// remove oustanding handles
 	remove_outstanding_handles(outstanding_handles);
 
-	// make list of hosts
-	hosts_info_list_t hosts_v;
-	for (typename hosts_map_t::iterator it = hosts_.begin(); it != hosts_.end(); ++it) {
-		hosts_v.push_back(host_info<LSD_T>(it->first, it->second));
+	// make list of hosts, keep metadata negotiated by heartbeats
+	const hosts_info_list_t& hosts_v = hosts;
+
+	// switch envelope encoding before any new host gets connected
+	for (typename handles_map_t::iterator it = handles_.begin(); it != handles_.end(); ++it) {
+		it->second->refresh_hosts_info(hosts_v);
 	}
 
 	// reconnect existing handles if we have outstanding hosts
@@ -491,6 +553,21 @@ service<LSD_T>::remove_outstanding_handles(const handles_info_list_t& handles) {
 
 	logger()->log("remove_outstanding_handles");
 
+	// take handles off the send path first and wait for senders holding
+	// previous snapshot, nothing can reach the handles once they are done
+	handles_map_t remaining_handles(handles_);
+	for (size_t i = 0; i < handles.size(); ++i) {
+		remaining_handles.erase(handles[i].name_);
+	}
+
+	handles_snapshot_t previous = boost::atomic_exchange(&handles_snapshot_, handles_snapshot_t(new handles_map_t(remaining_handles)));
+
+	while (!previous.unique()) {
+		boost::this_thread::yield();
+	}
+
+	previous.reset();
+
 	// destroy handles
 	for (size_t i = 0; i < handles.size(); ++i) {
 		typename handles_map_t::iterator it = handles_.find(handles[i].name_);
@@ -519,6 +596,7 @@ service<LSD_T>::remove_outstanding_handles(const handles_info_list_t& handles) {
 			}
 
 			// consolidate all handle messages
+			handle->flush_pending_messages();
 			msg_cache->make_all_messages_new();
 
 			// find corresponding unhandled msgs queue
@@ -612,6 +690,7 @@ service<LSD_T>::create_new_handles(const handles_info_list_t& handles, const hos
 
 		// add handle to storage and connect it
 		handles_[handles[i].name_] = handle_ptr;
+		publish_handles();
 
 		lock.unlock();
 		handles_[handles[i].name_]->connect(hosts);
@@ -623,8 +702,6 @@ service<LSD_T>::create_new_handles(const handles_info_list_t& handles, const hos
 
 template <typename LSD_T> void
 service<LSD_T>::send_message(cached_message_prt_t message) {
-	boost::mutex::scoped_lock lock(mutex_);
-
 	if (!message) {
 		std::string error_str = "message object is empty. service: " + info_.name_;
 		error_str += ". at " + std::string(BOOST_CURRENT_FUNCTION);
@@ -633,60 +710,86 @@ service<LSD_T>::send_message(cached_message_prt_t message) {
 
 	const std::string& handle_name = message->path().handle_name;
 
-	// find existing handle to enqueue message
-	typename handles_map_t::iterator it = handles_.find(handle_name);
-	if (it != handles_.end()) {
+	// find existing handle to enqueue message, without service lock
+	handles_snapshot_t handles = boost::atomic_load(&handles_snapshot_);
+	typename handles_map_t::const_iterator it = handles->find(handle_name);
+
+	if (it != handles->end()) {
 		handle_ptr_t handle_ptr = it->second;
 
 		// make sure we have valid handle
-		if (handle_ptr) {
-			handle_ptr->enqueue_message(message);
-			cache_size_ += message->container_size();
-		}
-		else {
+		if (!handle_ptr) {
 			std::string error_str = "handle object " + handle_name;
 			error_str += " for service: " + info_.name_ + " is empty.";
 			error_str += " at " + std::string(BOOST_CURRENT_FUNCTION);
 			throw error(error_str);
 		}
+
+		handle_ptr->enqueue_message(message);
+		return;
+	}
+
+	boost::mutex::scoped_lock lock(mutex_);
+
+	// handle could have been created since snapshot was taken
+	typename handles_map_t::iterator handle_it = handles_.find(handle_name);
+	if (handle_it != handles_.end() && handle_it->second) {
+		handle_it->second->enqueue_message(message);
+		return;
+	}
+
+	// if no handle, store locally
+	unhandled_messages_map_t::iterator queue_it = unhandled_messages_.find(handle_name);
+
+	// check for existing messages queue for handle
+	messages_deque_ptr_t queue_ptr;
+
+	if (queue_it == unhandled_messages_.end()) {
+		queue_ptr.reset(new cached_messages_deque_t);
+		queue_ptr->push_back(message);
+		unhandled_messages_[handle_name] = queue_ptr;
 	}
 	else {
-		// if no handle, store locally
-		unhandled_messages_map_t::iterator it = unhandled_messages_.find(handle_name);
+		queue_ptr = queue_it->second;
 
-		// check for existing messages queue for handle
-		messages_deque_ptr_t queue_ptr;
+		// validate msg queue
+		if (!queue_ptr) {
+			std::string error_str = "found empty message queue object in unhandled messages map!";
+			error_str += " service: " + info_.name_ + ", handle: " + handle_name;
+			error_str += ". at " + std::string(BOOST_CURRENT_FUNCTION);
+			throw error(error_str);
+		}
 
-		if (it == unhandled_messages_.end()) {
-			queue_ptr.reset(new cached_messages_deque_t);
-			queue_ptr->push_back(message);
-			unhandled_messages_[handle_name] = queue_ptr;
+		queue_ptr->push_back(message);
+	}
+}
+
+template <typename LSD_T> void
+service<LSD_T>::recover_messages(const cached_messages_deque_t& messages) {
+	boost::mutex::scoped_lock lock(mutex_);
+
+	for (size_t i = 0; i < messages.size(); ++i) {
+		const cached_message_prt_t& message = messages[i];
+		const std::string& handle_name = message->path().handle_name;
+
+		typename handles_map_t::iterator it = handles_.find(handle_name);
+		if (it != handles_.end() && it->second) {
+			it->second->enqueue_message(message);
 		}
 		else {
-			queue_ptr = it->second;
+			messages_deque_ptr_t& queue_ptr = unhandled_messages_[handle_name];
 
-			// validate msg queue
 			if (!queue_ptr) {
-				std::string error_str = "found empty message queue object in unhandled messages map!";
-				error_str += " service: " + info_.name_ + ", handle: " + handle_name;
-				error_str += ". at " + std::string(BOOST_CURRENT_FUNCTION);
-				throw error(error_str);
+				queue_ptr.reset(new cached_messages_deque_t);
 			}
 
 			queue_ptr->push_back(message);
 		}
-
-		cache_size_ += message->container_size();
 	}
 
 	update_statistics();
 }
 
-template <typename LSD_T> size_t
-service<LSD_T>::cache_size() const {
-	return cache_size_;
-}
-
 template<typename T>
 std::ostream& operator << (std::ostream& out, const service<T>& s) {
 	out << "----- service info: -----\n";
@@ -0,0 +1,100 @@
+//
+// Copyright (C) 2011 Rim Zaidullin <creator@bash.org.ru>
+//
+// Licensed under the BSD 2-Clause License (the "License");
+// you may not use this file except in compliance with the License.
+//
+// Unless required by applicable law or agreed to in writing, software
+// distributed under the License is distributed on an "AS IS" BASIS,
+// WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+// See the License for the specific language governing permissions and
+// limitations under the License.
+//
+
+#ifndef _LSD_SLAB_ALLOCATOR_HPP_INCLUDED_
+#define _LSD_SLAB_ALLOCATOR_HPP_INCLUDED_
+
+#include <cstddef>
+#include <limits>
+#include <new>
+
+#include <boost/cstdint.hpp>
+#include <boost/utility.hpp>
+
+#include "lsd/structs.hpp"
+
+namespace lsd {
+
+// allocator for message headers and payloads. sizes up to MAX_BLOCK_SIZE
+// are served from power of two size classes carved out of 1mb slabs.
+// every thread keeps a small cache of free blocks per class, blocks move
+// between thread caches and a shared depot in batches, so the fast path
+// takes no lock and memory freed on another thread (i.e. by handle) comes
+// back in circulation. slabs are never returned to the system. bigger
+// sizes go to malloc, or to hugepage mappings from HUGEPAGE_SIZE when
+// enabled and available. thread safe.
+class slab_allocator : private boost::noncopyable {
+public:
+	static void* allocate(size_t size);
+	static void deallocate(void* ptr);
+
+	// map allocations of HUGEPAGE_SIZE and more with MAP_HUGETLB,
+	// falls back to malloc when no hugepages are reserved
+	static void use_hugepages(bool value);
+
+	static void get_stats(allocator_stats& stats);
+
+	static const size_t CLASSES_COUNT = 11;
+	static const size_t MIN_BLOCK_SIZE = 64; // bytes, header included
+	static const size_t MAX_BLOCK_SIZE = 64 * 1024; // bytes, header included
+	static const size_t SLAB_SIZE = 1024 * 1024; // bytes
+	static const size_t HUGEPAGE_SIZE = 2 * 1024 * 1024; // bytes
+
+private:
+	slab_allocator();
+};
+
+// stl allocator on top of slab_allocator, for containers and allocate_shared()
+template <typename T>
+class slab_stl_allocator {
+public:
+	typedef T value_type;
+	typedef T* pointer;
+	typedef const T* const_pointer;
+	typedef T& reference;
+	typedef const T& const_reference;
+	typedef size_t size_type;
+	typedef ptrdiff_t difference_type;
+
+	template <typename U> struct rebind {
+		typedef slab_stl_allocator<U> other;
+	};
+
+	slab_stl_allocator() {};
+	template <typename U> slab_stl_allocator(const slab_stl_allocator<U>&) {};
+
+	pointer address(reference value) const { return &value; }
+	const_pointer address(const_reference value) const { return &value; }
+
+	pointer allocate(size_type n, const void* = 0) {
+		return static_cast<pointer>(slab_allocator::allocate(n * sizeof(T)));
+	}
+
+	void deallocate(pointer p, size_type) {
+		slab_allocator::deallocate(p);
+	}
+
+	size_type max_size() const {
+		return std::numeric_limits<size_type>::max() / sizeof(T);
+	}
+
+	void construct(pointer p, const T& value) { new (p) T(value); }
+	void destroy(pointer p) { p->~T(); }
+
+	template <typename U> bool operator == (const slab_stl_allocator<U>&) const { return true; }
+	template <typename U> bool operator != (const slab_stl_allocator<U>&) const { return false; }
+};
+
+} // namespace lsd
+
+#endif // _LSD_SLAB_ALLOCATOR_HPP_INCLUDED_
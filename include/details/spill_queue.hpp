@@ -0,0 +1,86 @@
+//
+// Copyright (C) 2011 Rim Zaidullin <creator@bash.org.ru>
+//
+// Licensed under the BSD 2-Clause License (the "License");
+// you may not use this file except in compliance with the License.
+//
+// Unless required by applicable law or agreed to in writing, software
+// distributed under the License is distributed on an "AS IS" BASIS,
+// WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+// See the License for the specific language governing permissions and
+// limitations under the License.
+//
+
+#ifndef _LSD_SPILL_QUEUE_HPP_INCLUDED_
+#define _LSD_SPILL_QUEUE_HPP_INCLUDED_
+
+#include <string>
+#include <deque>
+
+#include <boost/shared_ptr.hpp>
+#include <boost/cstdint.hpp>
+#include <boost/utility.hpp>
+
+#include "details/cached_message.hpp"
+#include "details/smart_logger.hpp"
+
+namespace lsd {
+
+// disk overflow of message cache: fifo of serialized messages kept in
+// chunk files under path. chunks are deleted once read through, so disk
+// usage follows the backlog. contents are not meant to survive restart,
+// stale chunks are removed on open. not thread safe, owner provides locking.
+class spill_queue : private boost::noncopyable {
+public:
+	typedef boost::shared_ptr<cached_message> cached_message_ptr_t;
+
+public:
+	spill_queue(const std::string& path, boost::uint64_t max_size, boost::shared_ptr<base_logger> logger);
+	virtual ~spill_queue();
+
+	// false if message doesn't fit under max_size
+	bool push(const cached_message& message);
+
+	// oldest spilled message, empty pointer if there are none
+	cached_message_ptr_t pop();
+
+	size_t size() const;
+	bool empty() const;
+	boost::uint64_t disk_size() const;
+
+	static const boost::uint64_t CHUNK_SIZE = 16 * 1024 * 1024; // bytes
+
+private:
+	struct chunk {
+		chunk() : fd(-1), size(0) {};
+
+		std::string path;
+		int fd;
+		boost::uint64_t size;
+	};
+
+	struct record_header {
+		boost::uint32_t body_size;
+		unsigned char uuid[message_uuid::SIZE];
+	};
+
+	void remove_stale_chunks();
+	void open_chunk();
+	void close_chunk(chunk& c);
+
+private:
+	std::string path_;
+	boost::uint64_t max_size_;
+	boost::shared_ptr<base_logger> logger_;
+
+	// oldest first, writes go to the last one
+	std::deque<chunk> chunks_;
+	boost::uint32_t next_chunk_id_;
+	boost::uint64_t read_offset_;
+	boost::uint64_t disk_size_;
+	size_t size_;
+};
+
+} // namespace lsd
+
+#endif // _LSD_SPILL_QUEUE_HPP_INCLUDED_
@@ -21,6 +21,7 @@
 #include <boost/utility.hpp>
 #include <boost/thread/thread.hpp>
 
+#include "details/cache_budget.hpp"
 #include "details/configuration.hpp"
 #include "lsd/structs.hpp"
 
@@ -61,8 +62,11 @@ public:
 
 	/* --- feeding statistics with collected data --- */
 
-	// cache statistics
-	void update_used_cache_size(size_t used_cache_size);
+	// cache statistics, used bytes are read from budget on request
+	void set_cache_budget(boost::shared_ptr<cache_budget> budget);
+
+	// persistent message log commits
+	void update_commit_stats(const commit_stats& stats);
 
 	// messages statistics from specific handle
 	void update_handle_stats(const std::string& service,
@@ -88,7 +92,8 @@ private:
 	boost::shared_ptr<configuration> config() const;
 
 	/* --- collected data --- */
-	size_t used_cache_size_;
+	boost::shared_ptr<cache_budget> cache_budget_;
+	commit_stats commit_stats_;
 
 	// services status
 	services_stats_t services_stats_;
@@ -0,0 +1,271 @@
+//
+// Copyright (C) 2011 Rim Zaidullin <creator@bash.org.ru>
+//
+// Licensed under the BSD 2-Clause License (the "License");
+// you may not use this file except in compliance with the License.
+//
+// Unless required by applicable law or agreed to in writing, software
+// distributed under the License is distributed on an "AS IS" BASIS,
+// WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+// See the License for the specific language governing permissions and
+// limitations under the License.
+//
+
+#ifndef _LSD_TIMING_WHEEL_HPP_INCLUDED_
+#define _LSD_TIMING_WHEEL_HPP_INCLUDED_
+
+#include <vector>
+
+#include <boost/cstdint.hpp>
+#include <boost/utility.hpp>
+
+namespace lsd {
+
+// hierarchical timing wheel: 256 slots of one tick at the first level and
+// 64 slots at each of three upper levels, which covers 2^26 ticks. timers
+// further away are parked in the last slot and re-filed when it cascades.
+// add is O(1), advance is O(1) amortized per tick and expired timer.
+// there is no removal, owners cancel timers lazily (e.g. by generation).
+// not thread safe.
+template <typename T>
+class timing_wheel : private boost::noncopyable {
+public:
+	timing_wheel(double resolution, double start_time);
+	virtual ~timing_wheel();
+
+	void add(double expire_time, const T& value);
+
+	// collect timers expired by now, returns amount of collected
+	size_t advance(double now, std::vector<T>& expired);
+
+	// time of the next tick that may have expired timers, false if empty
+	bool next_expiry_time(double& expire_time) const;
+
+	size_t size() const;
+	bool empty() const;
+
+private:
+	struct entry {
+		boost::uint64_t tick;
+		T value;
+	};
+
+	typedef std::vector<entry> slot_t;
+
+	static const int ROOT_BITS = 8;
+	static const int LEVEL_BITS = 6;
+	static const int LEVELS = 4;
+	static const boost::uint64_t ROOT_SIZE = 1ULL << ROOT_BITS;
+	static const boost::uint64_t LEVEL_SIZE = 1ULL << LEVEL_BITS;
+
+	boost::uint64_t tick_for_time(double time) const;
+	double time_for_tick(boost::uint64_t tick) const;
+
+	void insert(const entry& e);
+	void cascade(int level);
+
+private:
+	double resolution_;
+	double start_time_;
+	boost::uint64_t current_tick_;
+	size_t size_;
+
+	// level 0 has ROOT_SIZE slots, others LEVEL_SIZE
+	std::vector<slot_t> levels_[LEVELS];
+	size_t level_sizes_[LEVELS];
+};
+
+template <typename T>
+timing_wheel<T>::timing_wheel(double resolution, double start_time) :
+	resolution_(resolution),
+	start_time_(start_time),
+	current_tick_(0),
+	size_(0)
+{
+	levels_[0].resize(ROOT_SIZE);
+	level_sizes_[0] = 0;
+
+	for (int i = 1; i < LEVELS; ++i) {
+		levels_[i].resize(LEVEL_SIZE);
+		level_sizes_[i] = 0;
+	}
+}
+
+template <typename T>
+timing_wheel<T>::~timing_wheel() {
+}
+
+template <typename T> boost::uint64_t
+timing_wheel<T>::tick_for_time(double time) const {
+	if (time <= start_time_) {
+		return 0;
+	}
+
+	return (boost::uint64_t)((time - start_time_) / resolution_);
+}
+
+template <typename T> double
+timing_wheel<T>::time_for_tick(boost::uint64_t tick) const {
+	return start_time_ + tick * resolution_;
+}
+
+template <typename T> void
+timing_wheel<T>::add(double expire_time, const T& value) {
+	entry e;
+	e.tick = tick_for_time(expire_time);
+	e.value = value;
+
+	insert(e);
+	++size_;
+}
+
+template <typename T> void
+timing_wheel<T>::insert(const entry& e) {
+	// overdue timers fire with the current tick
+	boost::uint64_t tick = (e.tick < current_tick_) ? current_tick_ : e.tick;
+	boost::uint64_t distance = tick - current_tick_;
+
+	if (distance < ROOT_SIZE) {
+		levels_[0][tick & (ROOT_SIZE - 1)].push_back(e);
+		++level_sizes_[0];
+		return;
+	}
+
+	for (int level = 1; level < LEVELS; ++level) {
+		int shift = ROOT_BITS + (level - 1) * LEVEL_BITS;
+		boost::uint64_t level_range = 1ULL << (shift + LEVEL_BITS);
+
+		if (distance < level_range || level == LEVELS - 1) {
+			// too far away, park in the farthest slot of the top level
+			if (distance >= level_range) {
+				tick = current_tick_ + level_range - 1;
+			}
+
+			levels_[level][(tick >> shift) & (LEVEL_SIZE - 1)].push_back(e);
+			++level_sizes_[level];
+			return;
+		}
+	}
+}
+
+template <typename T> void
+timing_wheel<T>::cascade(int level) {
+	int shift = ROOT_BITS + (level - 1) * LEVEL_BITS;
+	slot_t& slot = levels_[level][(current_tick_ >> shift) & (LEVEL_SIZE - 1)];
+
+	if (slot.empty()) {
+		return;
+	}
+
+	slot_t entries;
+	entries.swap(slot);
+	level_sizes_[level] -= entries.size();
+
+	// entries keep their real tick, so they land on a lower level now
+	for (size_t i = 0; i < entries.size(); ++i) {
+		insert(entries[i]);
+	}
+}
+
+template <typename T> size_t
+timing_wheel<T>::advance(double now, std::vector<T>& expired) {
+	boost::uint64_t target_tick = tick_for_time(now);
+	size_t count = 0;
+
+	// nothing to fire, just catch up
+	if (size_ == 0) {
+		if (target_tick > current_tick_) {
+			current_tick_ = target_tick;
+		}
+
+		return 0;
+	}
+
+	while (current_tick_ <= target_tick) {
+		boost::uint64_t index = current_tick_ & (ROOT_SIZE - 1);
+
+		// refill lower levels when a level wraps around
+		if (index == 0) {
+			for (int level = 1; level < LEVELS; ++level) {
+				cascade(level);
+
+				int shift = ROOT_BITS + (level - 1) * LEVEL_BITS;
+				if (((current_tick_ >> shift) & (LEVEL_SIZE - 1)) != 0) {
+					break;
+				}
+			}
+		}
+
+		slot_t& slot = levels_[0][index];
+
+		if (!slot.empty()) {
+			for (size_t i = 0; i < slot.size(); ++i) {
+				expired.push_back(slot[i].value);
+			}
+
+			count += slot.size();
+			level_sizes_[0] -= slot.size();
+			size_ -= slot.size();
+			slot.clear();
+		}
+
+		// keep current tick at target so that new timers are filed relative to now
+		if (current_tick_ == target_tick) {
+			break;
+		}
+
+		++current_tick_;
+
+		if (size_ == 0) {
+			current_tick_ = target_tick;
+		}
+	}
+
+	return count;
+}
+
+template <typename T> bool
+timing_wheel<T>::next_expiry_time(double& expire_time) const {
+	if (size_ == 0) {
+		return false;
+	}
+
+	boost::uint64_t next_tick = 0;
+	bool found = false;
+
+	if (level_sizes_[0] > 0) {
+		for (boost::uint64_t i = 0; i < ROOT_SIZE; ++i) {
+			if (!levels_[0][(current_tick_ + i) & (ROOT_SIZE - 1)].empty()) {
+				next_tick = current_tick_ + i;
+				found = true;
+				break;
+			}
+		}
+	}
+
+	// upper levels can't fire before the next first level wrap
+	if (size_ > level_sizes_[0]) {
+		boost::uint64_t wrap_tick = ((current_tick_ >> ROOT_BITS) + 1) << ROOT_BITS;
+
+		if (!found || wrap_tick < next_tick) {
+			next_tick = wrap_tick;
+		}
+	}
+
+	expire_time = time_for_tick(next_tick);
+	return true;
+}
+
+template <typename T> size_t
+timing_wheel<T>::size() const {
+	return size_;
+}
+
+template <typename T> bool
+timing_wheel<T>::empty() const {
+	return (size_ == 0);
+}
+
+} // namespace lsd
+
+#endif // _LSD_TIMING_WHEEL_HPP_INCLUDED_
@@ -0,0 +1,42 @@
+//
+// Copyright (C) 2011 Rim Zaidullin <creator@bash.org.ru>
+//
+// Licensed under the BSD 2-Clause License (the "License");
+// you may not use this file except in compliance with the License.
+//
+// Unless required by applicable law or agreed to in writing, software
+// distributed under the License is distributed on an "AS IS" BASIS,
+// WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+// See the License for the specific language governing permissions and
+// limitations under the License.
+//
+
+#ifndef _LSD_WAKEUP_SIGNAL_HPP_INCLUDED_
+#define _LSD_WAKEUP_SIGNAL_HPP_INCLUDED_
+
+#include <boost/utility.hpp>
+
+namespace lsd {
+
+// pollable cross-thread signal, fd() becomes readable after notify()
+// and stays readable until drain() is called. notifications between
+// two drains are coalesced into a single write.
+class wakeup_signal : private boost::noncopyable {
+public:
+	wakeup_signal();
+	virtual ~wakeup_signal();
+
+	int fd() const;
+
+	void notify();
+	void drain();
+
+private:
+	int read_fd_;
+	int write_fd_;
+	volatile int pending_;
+};
+
+} // namespace lsd
+
+#endif // _LSD_WAKEUP_SIGNAL_HPP_INCLUDED_
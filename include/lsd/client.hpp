@@ -59,6 +59,38 @@ public:
 							 const message_path& path,
 							 const message_policy& policy);
 
+	// send_message() throws LSD_MESSAGE_CACHE_OVER_CAPACITY_ERROR when message
+	// doesn't fit under max_ram_limit, these give producers a way to back off.
+	// with spilling enabled messages over the limit go to disk and only a full
+	// spill makes a send fail, nothing waits for room then.
+
+	// fail fast, false if there's no room
+	bool try_send_message(const void* data,
+						  size_t size,
+						  const message_path& path,
+						  const message_policy& policy,
+						  std::string& uuid);
+
+	// wait up to timeout seconds for room, false if there's still none
+	bool timed_send_message(const void* data,
+							size_t size,
+							const message_path& path,
+							const message_policy& policy,
+							double timeout,
+							std::string& uuid);
+
+	// wait for room as long as it takes
+	std::string blocking_send_message(const void* data,
+									  size_t size,
+									  const message_path& path,
+									  const message_policy& policy);
+
+	// callback is invoked once used message cache bytes reach high_watermark
+	// and again once they drop to low_watermark, on the thread that crossed it
+	void set_cache_watermarks(size_t high_watermark,
+							  size_t low_watermark,
+							  boost::function<void(enum cache_watermark_event, size_t)> callback);
+
 	int set_response_callback(boost::function<void(const response&, const response_info&)> callback,
 							  const std::string& service_name,
 							  const std::string& handle_name);
@@ -14,6 +14,8 @@
 #ifndef _LSD_STRUCTS_HPP_INCLUDED_
 #define _LSD_STRUCTS_HPP_INCLUDED_
 
+#include <map>
+#include <string>
 #include <vector>
 #include <stdexcept>
 #include <time.h>
@@ -21,17 +23,30 @@
 
 namespace lsd {
 
-static const int PROTOCOL_VERSION = 1;
+static const int PROTOCOL_VERSION = 2;
+static const int JSON_ENVELOPE_PROTOCOL_VERSION = 1; // nodes that don't advertise a version
+static const int MSGPACK_ENVELOPE_PROTOCOL_VERSION = 2;
 static const int STATISTICS_PROTOCOL_VERSION = 1;
 static const unsigned long long MESSAGE_TIMEOUT = 10;	// seconds
 static const unsigned long long HEARTBEAT_INTERVAL = 1;	// seconds
 static const unsigned long long DEFAULT_SOCKET_POLL_TIMEOUT = 2000; // milliseconds
 static const unsigned long long DEFAULT_SOCKET_PING_TIMEOUT = 1000; // milliseconds
+static const size_t DEFAULT_SEND_BATCH_MESSAGES = 1;
+static const size_t DEFAULT_SEND_BATCH_BYTES = 1048576; // bytes
+static const unsigned long long DEFAULT_RESEND_BASE_DELAY = 50; // milliseconds
+static const unsigned long long DEFAULT_RESEND_MAX_DELAY = 5000; // milliseconds
+static const unsigned int DEFAULT_MAX_RESEND_RATE = 1000; // messages per second
+static const unsigned long long TIMERS_RESOLUTION = 10; // milliseconds
+static const unsigned int DEFAULT_REACTOR_THREADS = 0; // 0 means number of cores
+static const unsigned int DEFAULT_CALLBACK_THREADS = 2;
+static const size_t PENDING_MESSAGES_RING_SIZE = 8192; // messages
 
 static const std::string DEFAULT_EBLOB_PATH = "/tmp/pmq_eblob";
 static const std::string DEFAULT_EBLOB_LOG_PATH = "/var/log/pmq_eblob.log";
 static const unsigned int DEFAULT_EBLOB_LOG_FLAGS = 0;
 static const int DEFAULT_EBLOB_SYNC_INTERVAL = 1;
+static const unsigned int DEFAULT_EBLOB_MAX_GB = 20; // 0 means unlimited
+static const size_t DEFAULT_EBLOB_SYNC_BYTES = 4194304; // bytes, 0 means interval only
 
 static const std::string DEFAULT_HOSTS_URL = "";
 static const unsigned short DEFAULT_CONTROL_PORT = 5555;
@@ -39,6 +54,11 @@ static const std::string DEFAULT_MULTICAST_IP = "226.1.1.1";
 static const unsigned short DEFAULT_MULTICAST_PORT = 5556;
 static const unsigned short DEFAULT_STATISTICS_PORT = 3333;
 static const size_t DEFAULT_MAX_MESSAGE_CACHE_SIZE = 512; // megabytes
+static const std::string DEFAULT_SPILL_PATH = "/var/tmp/lsd_spill";
+static const unsigned int DEFAULT_MAX_SPILL_SIZE = 0; // megabytes, 0 means spilling is off
+static const double SPILL_REFILL_WATERMARK = 0.75; // part of max ram limit
+static const bool DEFAULT_USE_HUGEPAGES = false;
+static const unsigned int DEFAULT_DEDUP_MIN_SIZE = 0; // kilobytes, 0 means payload dedup is off
 
 struct lsd_types {
 	typedef boost::uint32_t ip_addr;
@@ -76,6 +96,28 @@ enum message_cache_type {
 	PERSISTANT
 };
 
+enum cache_watermark_event {
+	CACHE_HIGH_WATERMARK_REACHED = 1,
+	CACHE_LOW_WATERMARK_REACHED
+};
+
+enum response_validation_level {
+	RVL_NONE = 1,		// deliver response chunks as is
+	RVL_MSGPACK,		// drop chunks that are not valid msgpack
+	RVL_MSGPACK_DUMP	// validate and log chunks contents
+};
+
+enum balancing_type {
+	BT_ROUND_ROBIN = 1,		// single socket, zmq round robin over all hosts
+	BT_LEAST_OUTSTANDING,	// socket per host, fewest in-flight messages first
+	BT_LOAD_AWARE			// same, in-flight messages weighted by heartbeat load
+};
+
+enum envelope_encoding {
+	JSON_ENVELOPE = 1,
+	MSGPACK_ENVELOPE
+};
+
 struct message_path {
 	message_path() {};
 	message_path(const std::string& service_name_,
@@ -122,20 +164,23 @@ struct message_policy {
 		mailboxed(false),
 		timeout(0.0f),
 		deadline(0.0f),
-		max_timeout_retries(0) {};
+		max_timeout_retries(0),
+		wait_for_commit(false) {};
 
 	message_policy(bool send_to_all_hosts_,
 				   bool urgent_,
 				   float mailboxed_,
 				   float timeout_,
 				   float deadline_,
-				   int max_timeout_retries_) :
+				   int max_timeout_retries_,
+				   bool wait_for_commit_ = false) :
 		send_to_all_hosts(send_to_all_hosts_),
 		urgent(urgent_),
 		mailboxed(mailboxed_),
 		timeout(timeout_),
 		deadline(deadline_),
-		max_timeout_retries(max_timeout_retries_) {};
+		max_timeout_retries(max_timeout_retries_),
+		wait_for_commit(wait_for_commit_) {};
 
 	message_policy(const message_policy& mp) {
 		*this = mp;
@@ -152,6 +197,7 @@ struct message_policy {
 		timeout = rhs.timeout;
 		deadline = rhs.deadline;
 		max_timeout_retries = rhs.max_timeout_retries;
+		wait_for_commit = rhs.wait_for_commit;
 
 		return *this;
 	}
@@ -174,18 +220,25 @@ struct message_policy {
     double timeout;
     double deadline;
     int max_timeout_retries;
+
+    // PERSISTANT cache only: send_message() returns once message is synced to disk
+    bool wait_for_commit;
 };
 
 struct msg_queue_status {
 	msg_queue_status() :
 		pending(0),
-		sent(0) {};
+		sent(0),
+		retrying(0) {};
 
 	// amount of messages currently queued
 	size_t pending;
 
 	// amount of sent messages that haven't yed received response from server
 	size_t sent;
+
+	// amount of rejected messages waiting for delayed resend
+	size_t retrying;
 };
 
 struct handle_stats {
@@ -197,7 +250,9 @@ struct handle_stats {
 		normal_responces(0),
 		timedout_responces(0),
 		err_responces(0),
-		expired_responses(0) {};
+		expired_responses(0),
+		resend_delay_sum(0.0),
+		resend_delay_max(0.0) {};
 
 	// tatal sent msgs (with resent msgs)
 	size_t sent_messages;
@@ -223,10 +278,93 @@ struct handle_stats {
 	// expired messages
 	size_t expired_responses;
 
+	// delays of resends after queue full responses (seconds)
+	double resend_delay_sum;
+	double resend_delay_max;
+
 	// handle queue status
 	struct msg_queue_status queue_status;
 };
 
+// counts of values in power of two ranges: bucket 0 holds zeros,
+// bucket i holds [2^(i - 1), 2^i), the last one everything above
+struct log2_histogram {
+	static const size_t BUCKETS_COUNT = 32;
+
+	log2_histogram() {
+		for (size_t i = 0; i < BUCKETS_COUNT; ++i) {
+			buckets[i] = 0;
+		}
+	}
+
+	void add(boost::uint64_t value) {
+		size_t bucket = 0;
+
+		while (value > 0 && bucket < BUCKETS_COUNT - 1) {
+			value >>= 1;
+			++bucket;
+		}
+
+		++buckets[bucket];
+	}
+
+	boost::uint64_t buckets[BUCKETS_COUNT];
+};
+
+// slab allocator of message memory, see slab_allocator.hpp
+struct allocator_class_stats {
+	allocator_class_stats() :
+		block_size(0),
+		slabs(0),
+		depot_blocks(0),
+		thread_blocks(0) {};
+
+	size_t block_size;
+	size_t slabs;
+
+	// free blocks in shared depot
+	size_t depot_blocks;
+
+	// blocks handed out to threads, used or kept in their caches
+	size_t thread_blocks;
+};
+
+struct allocator_stats {
+	allocator_stats() :
+		slab_bytes(0),
+		large_allocations(0),
+		large_bytes(0),
+		hugepage_allocations(0),
+		hugepage_bytes(0) {};
+
+	std::vector<allocator_class_stats> classes;
+	boost::uint64_t slab_bytes;
+
+	// live allocations over the biggest size class
+	size_t large_allocations;
+	boost::uint64_t large_bytes;
+	size_t hugepage_allocations;
+	boost::uint64_t hugepage_bytes;
+};
+
+// group commits of persistent message log
+struct commit_stats {
+	commit_stats() :
+		commits(0),
+		committed_records(0),
+		committed_bytes(0) {};
+
+	size_t commits;
+	size_t committed_records;
+	boost::uint64_t committed_bytes;
+
+	// fdatasync duration, microseconds
+	log2_histogram latency;
+
+	// records made durable by one fdatasync
+	log2_histogram batch_size;
+};
+
 struct service_stats {
 	// <ip address, hostname>
 	std::map<LT::ip_addr, std::string> hosts;
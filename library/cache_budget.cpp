@@ -0,0 +1,164 @@
+//
+// Copyright (C) 2011 Rim Zaidullin <creator@bash.org.ru>
+//
+// Licensed under the BSD 2-Clause License (the "License");
+// you may not use this file except in compliance with the License.
+//
+// Unless required by applicable law or agreed to in writing, software
+// distributed under the License is distributed on an "AS IS" BASIS,
+// WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+// See the License for the specific language governing permissions and
+// limitations under the License.
+//
+
+#include <algorithm>
+
+#include <boost/thread/thread_time.hpp>
+
+#include "details/cache_budget.hpp"
+
+namespace lsd {
+
+cache_budget::cache_budget(size_t max_size) :
+	max_size_(max_size),
+	used_(0),
+	high_watermark_(0),
+	low_watermark_(0),
+	is_over_high_watermark_(0),
+	waiters_(0)
+{
+}
+
+cache_budget::~cache_budget() {
+}
+
+bool
+cache_budget::try_reserve(size_t size) {
+	size_t used = used_;
+
+	while (true) {
+		if (used + size > max_size_) {
+			return false;
+		}
+
+		size_t prev = __sync_val_compare_and_swap(&used_, used, used + size);
+
+		if (prev == used) {
+			break;
+		}
+
+		used = prev;
+	}
+
+	reserved(used + size);
+	return true;
+}
+
+bool
+cache_budget::reserve(size_t size, double timeout) {
+	if (try_reserve(size)) {
+		return true;
+	}
+
+	// nothing ever fits, don't wait for it
+	if (timeout == 0.0 || size > max_size_) {
+		return false;
+	}
+
+	boost::system_time deadline = boost::get_system_time();
+
+	if (timeout > 0.0) {
+		deadline += boost::posix_time::microseconds((boost::int64_t)(timeout * 1000000));
+	}
+
+	boost::mutex::scoped_lock lock(mutex_);
+	__sync_fetch_and_add(&waiters_, 1);
+
+	bool result = true;
+
+	// releases check waiters_ after updating used_, so rechecking
+	// under the mutex can't miss a wakeup
+	while (!try_reserve(size)) {
+		if (timeout < 0.0) {
+			condition_.wait(lock);
+		}
+		else if (!condition_.timed_wait(lock, deadline)) {
+			result = try_reserve(size);
+			break;
+		}
+	}
+
+	__sync_fetch_and_sub(&waiters_, 1);
+	return result;
+}
+
+void
+cache_budget::force_reserve(size_t size) {
+	reserved(__sync_add_and_fetch(&used_, size));
+}
+
+void
+cache_budget::release(size_t size) {
+	if (size == 0) {
+		return;
+	}
+
+	size_t used = __sync_sub_and_fetch(&used_, size);
+
+	if (waiters_ > 0) {
+		boost::mutex::scoped_lock lock(mutex_);
+		condition_.notify_all();
+	}
+
+	if (high_watermark_ > 0 && used <= low_watermark_ &&
+		__sync_bool_compare_and_swap(&is_over_high_watermark_, 1, 0))
+	{
+		invoke_watermark_callback(CACHE_LOW_WATERMARK_REACHED, used);
+	}
+}
+
+void
+cache_budget::reserved(size_t used) {
+	if (high_watermark_ > 0 && used >= high_watermark_ &&
+		__sync_bool_compare_and_swap(&is_over_high_watermark_, 0, 1))
+	{
+		invoke_watermark_callback(CACHE_HIGH_WATERMARK_REACHED, used);
+	}
+}
+
+void
+cache_budget::invoke_watermark_callback(enum cache_watermark_event event, size_t used) {
+	watermark_callback_t callback;
+
+	{
+		boost::mutex::scoped_lock lock(mutex_);
+		callback = watermark_callback_;
+	}
+
+	// outside the lock, callback may well send messages itself
+	if (callback) {
+		callback(event, used);
+	}
+}
+
+size_t
+cache_budget::used() const {
+	return used_;
+}
+
+size_t
+cache_budget::max_size() const {
+	return max_size_;
+}
+
+void
+cache_budget::set_watermarks(size_t high, size_t low, const watermark_callback_t& callback) {
+	boost::mutex::scoped_lock lock(mutex_);
+
+	watermark_callback_ = callback;
+	low_watermark_ = std::min(low, high);
+	high_watermark_ = callback ? high : 0;
+	is_over_high_watermark_ = (high_watermark_ > 0 && used_ >= high_watermark_) ? 1 : 0;
+}
+
+} // namespace lsd
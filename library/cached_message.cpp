@@ -11,13 +11,15 @@
 // limitations under the License.
 //
 
+#include <algorithm>
 #include <cstring>
 #include <stdexcept>
 
 #include <boost/lexical_cast.hpp>
 #include <boost/current_function.hpp>
 
-#include <uuid/uuid.h>
+#include <msgpack.hpp>
+
 #include "json/json.h"
 
 #include "lsd/structs.hpp"
@@ -27,7 +29,15 @@
 
 namespace lsd {
 cached_message::cached_message() :
-	is_sent_(false)
+	is_sent_(false),
+	destination_host_(0),
+	rejected_host_(0),
+	resend_attempts_(0),
+	timer_generation_(0),
+	is_response_started_(false),
+	container_size_(0),
+	accounted_size_(0),
+	timeout_retries_count_(0)
 {
 	init();
 }
@@ -43,7 +53,40 @@ cached_message::cached_message(const message_path& path,
 	path_(path),
 	policy_(policy),
 	is_sent_(false),
-	container_size_(0)
+	destination_host_(0),
+	rejected_host_(0),
+	resend_attempts_(0),
+	timer_generation_(0),
+	is_response_started_(false),
+	container_size_(0),
+	accounted_size_(0),
+	timeout_retries_count_(0)
+{
+	if (data_size > MAX_MESSAGE_DATA_SIZE) {
+		throw error(LSD_MESSAGE_DATA_TOO_BIG_ERROR, "can't create message, message data too big.");
+	}
+
+	data_ = data_container(data, data_size);
+	init();
+}
+
+cached_message::cached_message(const message_uuid& uuid,
+							   const message_path& path,
+							   const message_policy& policy,
+							   const void* data,
+							   size_t data_size) :
+	path_(path),
+	policy_(policy),
+	uuid_(uuid),
+	is_sent_(false),
+	destination_host_(0),
+	rejected_host_(0),
+	resend_attempts_(0),
+	timer_generation_(0),
+	is_response_started_(false),
+	container_size_(0),
+	accounted_size_(0),
+	timeout_retries_count_(0)
 {
 	if (data_size > MAX_MESSAGE_DATA_SIZE) {
 		throw error(LSD_MESSAGE_DATA_TOO_BIG_ERROR, "can't create message, message data too big.");
@@ -58,7 +101,9 @@ cached_message::~cached_message() {
 
 void
 cached_message::init() {
-	gen_uuid();
+	if (uuid_.is_nil()) {
+		gen_uuid();
+	}
 
 	// calc data size
 	container_size_ = sizeof(cached_message) + data_.size() + UUID_SIZE + path_.container_size();
@@ -66,14 +111,7 @@ cached_message::init() {
 
 void
 cached_message::gen_uuid() {
-	char buff[128];
-	memset(buff, 0, sizeof(buff));
-
-	uuid_t uuid;
-	uuid_generate(uuid);
-	uuid_unparse(uuid, buff);
-
-	uuid_ = buff;
+	uuid_ = message_uuid::generate();
 }
 
 const data_container&
@@ -95,7 +133,17 @@ cached_message::operator = (const cached_message& rhs) {
 	uuid_			= rhs.uuid_;
 	is_sent_		= rhs.is_sent_;
 	sent_timestamp_	= rhs.sent_timestamp_;
+	destination_host_	= rhs.destination_host_;
+	rejected_host_		= rhs.rejected_host_;
+	resend_attempts_	= rhs.resend_attempts_;
+	timer_generation_	= rhs.timer_generation_;
+	is_response_started_	= rhs.is_response_started_;
+	timeout_retries_count_	= rhs.timeout_retries_count_;
+	broadcast_			= rhs.broadcast_;
 	container_size_	= rhs.container_size_;
+	accounted_size_	= 0;
+	json_envelope_		= rhs.json_envelope_;
+	msgpack_envelope_	= rhs.msgpack_envelope_;
 
 	return *this;
 }
@@ -110,8 +158,13 @@ cached_message::operator != (const cached_message& rhs) const {
 	return !(*this == rhs);
 }
 
-const std::string&
+std::string
 cached_message::uuid() const {
+	return uuid_.as_string();
+}
+
+const message_uuid&
+cached_message::binary_uuid() const {
 	return uuid_;
 }
 
@@ -140,12 +193,24 @@ cached_message::container_size() const {
 	return container_size_;
 }
 
+void
+cached_message::set_accounted_size(size_t size) {
+	accounted_size_ = size;
+}
+
+size_t
+cached_message::take_accounted_size() {
+	return __sync_lock_test_and_set(&accounted_size_, 0);
+}
+
 void
 cached_message::mark_as_sent(bool value) {
 	boost::mutex::scoped_lock lock(mutex_);
 
 	if (value) {
-		is_sent_ = false;
+		is_sent_ = true;
+		is_response_started_ = false;
+		++timer_generation_;
 		sent_timestamp_.init_from_current_time();
 	}
 	else {
@@ -154,6 +219,108 @@ cached_message::mark_as_sent(bool value) {
 	}
 }
 
+LT::ip_addr
+cached_message::destination_host() const {
+	return destination_host_;
+}
+
+void
+cached_message::set_destination_host(LT::ip_addr ip) {
+	destination_host_ = ip;
+}
+
+boost::uint32_t
+cached_message::timer_generation() const {
+	return timer_generation_;
+}
+
+bool
+cached_message::is_response_started() const {
+	return is_response_started_;
+}
+
+void
+cached_message::mark_response_started() {
+	is_response_started_ = true;
+}
+
+int
+cached_message::timeout_retries_count() const {
+	return timeout_retries_count_;
+}
+
+void
+cached_message::increment_timeout_retries() {
+	++timeout_retries_count_;
+}
+
+LT::ip_addr
+cached_message::rejected_host() const {
+	return rejected_host_;
+}
+
+int
+cached_message::resend_attempts() const {
+	return resend_attempts_;
+}
+
+void
+cached_message::mark_as_rejected() {
+	rejected_host_ = destination_host_;
+	++resend_attempts_;
+}
+
+const broadcast_state&
+cached_message::broadcast() const {
+	return broadcast_;
+}
+
+void
+cached_message::start_broadcast(const std::vector<LT::ip_addr>& hosts) {
+	broadcast_ = broadcast_state();
+	broadcast_.pending_hosts = hosts;
+	broadcast_.hosts_count = hosts.size();
+}
+
+bool
+cached_message::complete_broadcast_host(LT::ip_addr ip, int error_code, const std::string& error_message) {
+	std::vector<LT::ip_addr>& pending = broadcast_.pending_hosts;
+	std::vector<LT::ip_addr>::iterator it = std::find(pending.begin(), pending.end(), ip);
+
+	if (it == pending.end()) {
+		return false;
+	}
+
+	pending.erase(it);
+
+	if (error_code != 0) {
+		++broadcast_.failed_hosts;
+		broadcast_.error_code = error_code;
+		broadcast_.error_message = error_message;
+	}
+
+	return true;
+}
+
+bool
+cached_message::is_broadcast_completed() const {
+	return broadcast_.pending_hosts.empty();
+}
+
+bool
+cached_message::broadcast_error(int& error_code, std::string& error_message) const {
+	if (broadcast_.failed_hosts == 0) {
+		return false;
+	}
+
+	error_code = broadcast_.error_code;
+	error_message = "failed on " + boost::lexical_cast<std::string>(broadcast_.failed_hosts);
+	error_message += " of " + boost::lexical_cast<std::string>(broadcast_.hosts_count) + " hosts, last error: ";
+	error_message += broadcast_.error_message;
+
+	return true;
+}
+
 bool
 cached_message::is_expired() {
 	if (policy_.deadline == 0.0f) {
@@ -167,8 +334,25 @@ cached_message::is_expired() {
 	return false;
 }
 
-std::string
-cached_message::json() {
+const std::string&
+cached_message::envelope(enum envelope_encoding encoding) {
+	if (encoding == MSGPACK_ENVELOPE) {
+		if (msgpack_envelope_.empty()) {
+			build_msgpack_envelope();
+		}
+
+		return msgpack_envelope_;
+	}
+
+	if (json_envelope_.empty()) {
+		build_json_envelope();
+	}
+
+	return json_envelope_;
+}
+
+void
+cached_message::build_json_envelope() {
 	Json::Value envelope(Json::objectValue);
 	Json::FastWriter writer;
 
@@ -176,9 +360,38 @@ cached_message::json() {
 	envelope["mailboxed"] = policy_.mailboxed;
 	envelope["timeout"] = policy_.timeout;
 	envelope["deadline"] = policy_.deadline;
-	envelope["uuid"] = uuid_;
+	envelope["uuid"] = uuid_.as_string();
+
+	json_envelope_ = writer.write(envelope);
+}
+
+void
+cached_message::build_msgpack_envelope() {
+	// same fields as json envelope, fixed order
+	msgpack::sbuffer buffer;
+	msgpack::packer<msgpack::sbuffer> packer(&buffer);
+
+	packer.pack_map(5);
+
+	packer.pack_raw(6).pack_raw_body("urgent", 6);
+	packer.pack(policy_.urgent);
+
+	packer.pack_raw(9).pack_raw_body("mailboxed", 9);
+	packer.pack(policy_.mailboxed);
+
+	packer.pack_raw(7).pack_raw_body("timeout", 7);
+	packer.pack_double(policy_.timeout);
+
+	packer.pack_raw(8).pack_raw_body("deadline", 8);
+	packer.pack_double(policy_.deadline);
+
+	char uuid[message_uuid::STRING_SIZE];
+	uuid_.format(uuid);
+
+	packer.pack_raw(4).pack_raw_body("uuid", 4);
+	packer.pack_raw(message_uuid::STRING_SIZE).pack_raw_body(uuid, message_uuid::STRING_SIZE);
 
-	return writer.write(envelope);
+	msgpack_envelope_.assign(buffer.data(), buffer.size());
 }
 
 } // namespace lsd
@@ -57,6 +57,25 @@ cached_response::cached_response(const std::string& uuid,
 	container_size_ += path_.container_size() + error_message_.length();
 }
 
+cached_response::cached_response(const std::string& uuid,
+								 const message_path& path,
+								 zmq::message_t& chunk) :
+	uuid_(uuid),
+	path_(path),
+	error_code_(0)
+{
+	if (chunk.size() > MAX_RESPONSE_DATA_SIZE) {
+		throw error(LSD_MESSAGE_DATA_TOO_BIG_ERROR, "can't create response, response data too big.");
+	}
+
+	frame_.reset(new zmq::message_t);
+	frame_->move(&chunk);
+
+	// calc data size
+	container_size_ = sizeof(cached_response) + data_size() + UUID_SIZE;
+	container_size_ += path_.container_size() + error_message_.length();
+}
+
 cached_response::cached_response(const std::string& uuid,
 								 const message_path& path,
 								 int error_code,
@@ -74,9 +93,22 @@ cached_response::cached_response(const std::string& uuid,
 cached_response::~cached_response() {
 }
 
-const data_container&
+void*
 cached_response::data() const {
-	return data_;
+	if (frame_) {
+		return frame_->data();
+	}
+
+	return data_.data();
+}
+
+size_t
+cached_response::data_size() const {
+	if (frame_) {
+		return frame_->size();
+	}
+
+	return data_.size();
 }
 
 cached_response&
@@ -90,6 +122,7 @@ cached_response::operator = (const cached_response& rhs) {
 	uuid_			= rhs.uuid_;
 	path_			= rhs.path_;
 	data_			= rhs.data_;
+	frame_			= rhs.frame_;
 	received_timestamp_	= rhs.received_timestamp_;
 	container_size_		= rhs.container_size_;
 
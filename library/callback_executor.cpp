@@ -0,0 +1,152 @@
+//
+// Copyright (C) 2011 Rim Zaidullin <creator@bash.org.ru>
+//
+// Licensed under the BSD 2-Clause License (the "License");
+// you may not use this file except in compliance with the License.
+//
+// Unless required by applicable law or agreed to in writing, software
+// distributed under the License is distributed on an "AS IS" BASIS,
+// WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+// See the License for the specific language governing permissions and
+// limitations under the License.
+//
+
+
+#include <exception>
+
+#include <boost/bind.hpp>
+
+#include "details/callback_executor.hpp"
+
+namespace lsd {
+
+callback_executor::queue::queue() :
+	is_scheduled_(false),
+	is_running_(false),
+	is_closed_(false)
+{
+}
+
+callback_executor::callback_executor(size_t threads, boost::shared_ptr<base_logger> logger) :
+	logger_(logger),
+	is_running_(true)
+{
+	if (threads == 0) {
+		threads = 1;
+	}
+
+	for (size_t i = 0; i < threads; ++i) {
+		boost::shared_ptr<boost::thread> thread(new boost::thread(boost::bind(&callback_executor::run, this)));
+		threads_.push_back(thread);
+	}
+}
+
+callback_executor::~callback_executor() {
+	{
+		boost::mutex::scoped_lock lock(mutex_);
+		is_running_ = false;
+		ready_cond_.notify_all();
+	}
+
+	for (size_t i = 0; i < threads_.size(); ++i) {
+		threads_[i]->join();
+	}
+}
+
+callback_executor::queue_ptr_t
+callback_executor::create_queue() {
+	return queue_ptr_t(new queue);
+}
+
+void
+callback_executor::post(const queue_ptr_t& queue, const task_t& task) {
+	boost::mutex::scoped_lock lock(mutex_);
+
+	if (queue->is_closed_) {
+		return;
+	}
+
+	queue->tasks_.push_back(task);
+
+	if (!queue->is_scheduled_) {
+		queue->is_scheduled_ = true;
+		ready_.push_back(queue);
+		ready_cond_.notify_one();
+	}
+}
+
+void
+callback_executor::close(const queue_ptr_t& queue) {
+	boost::mutex::scoped_lock lock(mutex_);
+
+	queue->is_closed_ = true;
+	queue->tasks_.clear();
+
+	while (queue->is_running_) {
+		done_cond_.wait(lock);
+	}
+}
+
+size_t
+callback_executor::size() const {
+	return threads_.size();
+}
+
+void
+callback_executor::run() {
+	boost::mutex::scoped_lock lock(mutex_);
+
+	while (true) {
+		while (is_running_ && ready_.empty()) {
+			ready_cond_.wait(lock);
+		}
+
+		if (ready_.empty()) {
+			return;
+		}
+
+		queue_ptr_t queue = ready_.front();
+		ready_.pop_front();
+
+		// emptied by close()
+		if (queue->tasks_.empty()) {
+			queue->is_scheduled_ = false;
+			continue;
+		}
+
+		task_t task;
+		task.swap(queue->tasks_.front());
+		queue->tasks_.pop_front();
+		queue->is_running_ = true;
+
+		lock.unlock();
+
+		try {
+			task();
+		}
+		catch (const std::exception& ex) {
+			logger_->log(PLOG_ERROR, "response callback failed, details: %s", ex.what());
+		}
+		catch (...) {
+			logger_->log(PLOG_ERROR, "response callback failed with unknown exception");
+		}
+
+		// drop bound arguments before taking the lock
+		task.clear();
+		lock.lock();
+
+		queue->is_running_ = false;
+		done_cond_.notify_all();
+
+		// back of the line, other queues get their turn
+		if (queue->tasks_.empty()) {
+			queue->is_scheduled_ = false;
+		}
+		else {
+			ready_.push_back(queue);
+			ready_cond_.notify_one();
+		}
+	}
+}
+
+} // namespace lsd
@@ -86,6 +86,44 @@ client::send_message(const std::string& data,
 	return get_impl()->send_message(data, path, policy);
 }
 
+bool
+client::try_send_message(const void* data,
+						 size_t size,
+						 const message_path& path,
+						 const message_policy& policy,
+						 std::string& uuid)
+{
+	return get_impl()->try_send_message(data, size, path, policy, uuid);
+}
+
+bool
+client::timed_send_message(const void* data,
+						   size_t size,
+						   const message_path& path,
+						   const message_policy& policy,
+						   double timeout,
+						   std::string& uuid)
+{
+	return get_impl()->timed_send_message(data, size, path, policy, timeout, uuid);
+}
+
+std::string
+client::blocking_send_message(const void* data,
+							  size_t size,
+							  const message_path& path,
+							  const message_policy& policy)
+{
+	return get_impl()->blocking_send_message(data, size, path, policy);
+}
+
+void
+client::set_cache_watermarks(size_t high_watermark,
+							 size_t low_watermark,
+							 boost::function<void(enum cache_watermark_event, size_t)> callback)
+{
+	get_impl()->set_cache_watermarks(high_watermark, low_watermark, callback);
+}
+
 int
 client::set_response_callback(boost::function<void(const response&, const response_info&)> callback,
 						   	  const std::string& service_name,
@@ -11,19 +11,28 @@
 // limitations under the License.
 //
 
+#include <algorithm>
+#include <map>
 #include <stdexcept>
 
 #include <boost/current_function.hpp>
+#include <boost/make_shared.hpp>
 
 #include "details/client_impl.hpp"
 #include "details/http_heartbeats_collector.hpp"
 #include "details/error.hpp"
 #include "details/cached_message.hpp"
+#include "details/progress_timer.hpp"
+#include "details/slab_allocator.hpp"
 
 namespace lsd {
 
 client_impl::client_impl(const std::string& config_path) :
-	messages_cache_size_(0)
+	spilling_(false),
+	recovering_(false),
+	recovered_count_(0),
+	recovered_bytes_(0),
+	recovery_dropped_(0)
 {
 	// create lsd context
 	std::string ctx_error_msg = "could not create lsd context at: " + std::string(BOOST_CURRENT_FUNCTION) + " ";
@@ -43,10 +52,24 @@ client_impl::client_impl(const std::string& config_path) :
 		services_[it->first] = service_ptr;
 	}
 
+	// overflow tier
+	if (config()->max_spill_size() > 0) {
+		spill_.reset(new spill_queue(config()->spill_path(), config()->max_spill_size(), logger()));
+	}
+
+	// messages left by previous run are streamed back as room allows
+	boost::shared_ptr<message_log> log = context()->messages_log();
+	recovering_ = (log && log->recovered_messages_count() > 0);
+
+	if (recovering_ || spill_.get()) {
+		refill_refresher_.reset(new refresher(boost::bind(&client_impl::refill_queues, this), 1));
+	}
+
 	logger()->log("client created.");
 }
 
 client_impl::~client_impl() {
+	refill_refresher_.reset();
 	disconnect();
 	logger()->log("client destroyed.");
 }
@@ -153,16 +176,67 @@ client_impl::send_message(const void* data,
 						  const message_path& path,
 						  const message_policy& policy)
 {
-	boost::mutex::scoped_lock lock(mutex_);
-
-	// make sure we are not overcapacitated
-	size_t message_size = size + sizeof(cached_message) + cached_message::UUID_SIZE + path.container_size();
-	size_t new_resulting_size = messages_cache_size() + message_size;
+	std::string uuid;
 
-	if (new_resulting_size > config()->max_message_cache_size()) {
+	if (!enqueue_message(data, size, path, policy, 0.0, uuid)) {
 		throw error(LSD_MESSAGE_CACHE_OVER_CAPACITY_ERROR, "can not send message, balancer over capacity.");
 	}
 
+	return uuid;
+}
+
+bool
+client_impl::try_send_message(const void* data,
+							  size_t size,
+							  const message_path& path,
+							  const message_policy& policy,
+							  std::string& uuid)
+{
+	return enqueue_message(data, size, path, policy, 0.0, uuid);
+}
+
+bool
+client_impl::timed_send_message(const void* data,
+								size_t size,
+								const message_path& path,
+								const message_policy& policy,
+								double timeout,
+								std::string& uuid)
+{
+	return enqueue_message(data, size, path, policy, std::max(timeout, 0.0), uuid);
+}
+
+std::string
+client_impl::blocking_send_message(const void* data,
+								   size_t size,
+								   const message_path& path,
+								   const message_policy& policy)
+{
+	std::string uuid;
+
+	if (!enqueue_message(data, size, path, policy, -1.0, uuid)) {
+		throw error(LSD_MESSAGE_CACHE_OVER_CAPACITY_ERROR, "can not send message, message is bigger than balancer capacity.");
+	}
+
+	return uuid;
+}
+
+void
+client_impl::set_cache_watermarks(size_t high_watermark,
+								  size_t low_watermark,
+								  boost::function<void(enum cache_watermark_event, size_t)> callback)
+{
+	context()->messages_budget()->set_watermarks(high_watermark, low_watermark, callback);
+}
+
+bool
+client_impl::enqueue_message(const void* data,
+							 size_t size,
+							 const message_path& path,
+							 const message_policy& policy,
+							 double timeout,
+							 std::string& uuid)
+{
 	// validate message path
 	if (!config()->service_info_by_name(path.service_name)) {
 		std::string error_str = "message sent to unknown service, check your config file.";
@@ -171,34 +245,101 @@ client_impl::send_message(const void* data,
 	}
 
 	// find service to send message to
-	std::string uuid;
 	services_map_t::iterator it = services_.find(path.service_name);
 
-	if (it != services_.end()) {
-		boost::shared_ptr<cached_message> msg;
-		msg.reset(new cached_message(path, policy, data, size));
+	if (it == services_.end()) {
+		std::string error_str = "no service wth name " + path.service_name;
+		error_str += " found at " + std::string(BOOST_CURRENT_FUNCTION);
+		throw error(error_str);
+	}
+
+	if (!it->second) {
+		std::string error_str = "object for service wth name " + path.service_name;
+		error_str += " is emty at " + std::string(BOOST_CURRENT_FUNCTION);
+		throw error(error_str);
+	}
+
+	// make sure we are not overcapacitated, waiting for room goes
+	// without client lock so that nobody else is held up
+	boost::shared_ptr<cache_budget> budget = context()->messages_budget();
+	size_t message_size = size + sizeof(cached_message) + cached_message::UUID_SIZE + path.container_size();
+	bool reserved = false;
+
+	if (!spill_.get()) {
+		if (!budget->reserve(message_size, timeout)) {
+			return false;
+		}
+
+		reserved = true;
+	}
+
+	boost::shared_ptr<message_log> log = context()->messages_log();
+	boost::uint64_t commit_ticket = 0;
+
+	try {
+		// message and its reference counter share one slab block
+		boost::shared_ptr<cached_message> msg =
+			boost::allocate_shared<cached_message>(slab_stl_allocator<cached_message>(), path, policy, data, size);
 		uuid = msg->uuid();
 
-		// send message to handle
-		if (it->second) {
+		// message must be on disk before anyone can send it, log has
+		// its own lock and concurrent appends share one commit
+		if (log) {
+			commit_ticket = log->append(*msg);
+		}
+
+		// nothing spilled, no need to queue up behind anyone
+		if (!reserved && !spilling_) {
+			reserved = budget->try_reserve(message_size);
+		}
+
+		// services_ is not changed after construction, services lock themselves
+		if (reserved) {
+			msg->set_accounted_size(message_size);
 			it->second->send_message(msg);
 		}
 		else {
-			std::string error_str = "object for service wth name " + path.service_name;
-			error_str += " is emty at " + std::string(BOOST_CURRENT_FUNCTION);
-			throw error(error_str);
+			boost::mutex::scoped_lock lock(mutex_);
+
+			// once spilling started new messages queue up behind spilled ones
+			move_spilled_messages();
+			reserved = (spill_->empty() && budget->try_reserve(message_size));
+
+			if (reserved) {
+				msg->set_accounted_size(message_size);
+				it->second->send_message(msg);
+			}
+			else {
+				if (spill_->empty()) {
+					logger()->log(PLOG_WARNING, "message cache is over max ram limit, spilling messages to %s", config()->spill_path().c_str());
+				}
+
+				if (!spill_->push(*msg)) {
+					if (log) {
+						log->remove(msg->binary_uuid());
+					}
+
+					return false;
+				}
+
+				spilling_ = true;
+			}
 		}
 	}
-	else {
-		std::string error_str = "no service wth name " + path.service_name;
-		error_str += " found at " + std::string(BOOST_CURRENT_FUNCTION);
-		throw error(error_str);
+	catch (...) {
+		if (reserved) {
+			budget->release(message_size);
+		}
+
+		throw;
 	}
 
-	update_messages_cache_size();
+	// other producers keep going, their records join the same commit
+	if (policy.wait_for_commit && commit_ticket > 0) {
+		log->wait_committed(commit_ticket);
+	}
 
-	// return message uuid
-	return uuid;
+	return true;
 }
 
 std::string
@@ -254,6 +395,113 @@ client_impl::set_response_callback(boost::function<void(const response&, const r
 	return 0;
 }
 
+void
+client_impl::refill_queues() {
+	move_recovered_messages();
+
+	if (spill_.get()) {
+		boost::mutex::scoped_lock lock(mutex_);
+		move_spilled_messages();
+	}
+}
+
+void
+client_impl::move_recovered_messages() {
+	boost::shared_ptr<message_log> log = context()->messages_log();
+
+	if (!log || !recovering_) {
+		return;
+	}
+
+	// backlog of previous run goes back in batches, under the same
+	// watermark as spilled messages, so that new messages still fit
+	boost::shared_ptr<cache_budget> budget = context()->messages_budget();
+	size_t refill_size = (size_t)(budget->max_size() * SPILL_REFILL_WATERMARK);
+
+	while (budget->used() < refill_size) {
+		std::vector<boost::shared_ptr<cached_message> > messages;
+
+		if (log->read_recovered_messages(refill_size - budget->used(), messages) == 0) {
+			if (log->recovered_messages_count() == 0) {
+				break;
+			}
+
+			continue;
+		}
+
+		// group by service keeping original order, so that every service
+		// takes its part of a batch under one lock
+		std::map<std::string, service_t::cached_messages_deque_t> services_messages;
+
+		for (size_t i = 0; i < messages.size(); ++i) {
+			const std::string& service_name = messages[i]->path().service_name;
+			services_map_t::iterator it = services_.find(service_name);
+
+			// recovered messages are already logged, only dead ones need a tombstone
+			if (it == services_.end() || !it->second) {
+				log->remove(messages[i]->binary_uuid());
+				++recovery_dropped_;
+				continue;
+			}
+
+			budget->force_reserve(messages[i]->container_size());
+			messages[i]->set_accounted_size(messages[i]->container_size());
+
+			services_messages[service_name].push_back(messages[i]);
+			recovered_bytes_ += messages[i]->data().size();
+			++recovered_count_;
+		}
+
+		std::map<std::string, service_t::cached_messages_deque_t>::iterator it = services_messages.begin();
+		for (; it != services_messages.end(); ++it) {
+			services_.find(it->first)->second->recover_messages(it->second);
+		}
+	}
+
+	if (log->recovered_messages_count() > 0) {
+		return;
+	}
+
+	recovering_ = false;
+
+	if (recovery_dropped_ > 0) {
+		logger()->log(PLOG_ERROR, "dropped %d recovered messages of services missing in config", (int)recovery_dropped_);
+	}
+
+	double elapsed = std::max(recovery_timer_.elapsed().as_double(), 0.001);
+
+	logger()->log("requeued %d recovered messages (%.1f MB) in %.3f sec, %d messages/sec",
+				  (int)recovered_count_, recovered_bytes_ / 1048576.0, elapsed, (int)(recovered_count_ / elapsed));
+}
+
+void
+client_impl::move_spilled_messages() {
+	if (spill_->empty()) {
+		return;
+	}
+
+	// refill with some headroom, so that spilling doesn't flip on every message
+	boost::shared_ptr<cache_budget> budget = context()->messages_budget();
+	size_t refill_size = (size_t)(budget->max_size() * SPILL_REFILL_WATERMARK);
+	size_t moved = 0;
+
+	while (!spill_->empty() && budget->used() < refill_size) {
+		boost::shared_ptr<cached_message> msg = spill_->pop();
+
+		budget->force_reserve(msg->container_size());
+		msg->set_accounted_size(msg->container_size());
+		services_.find(msg->path().service_name)->second->send_message(msg);
+
+		++moved;
+	}
+
+	if (moved > 0 && spill_->empty()) {
+		logger()->log(PLOG_WARNING, "message cache is under max ram limit, all spilled messages are back in queues");
+	}
+
+	spilling_ = !spill_->empty();
+}
+
 boost::shared_ptr<context>
 client_impl::context() {
 	if (!context_) {
@@ -269,31 +517,8 @@ client_impl::logger() {
 }
 
 size_t
-client_impl::messages_cache_size() const {
-	return messages_cache_size_;
-}
-
-void
-client_impl::update_messages_cache_size() {
-	// collect cache sizes of all services
-	messages_cache_size_ = 0;
-
-	services_map_t::iterator it = services_.begin();
-	for (; it != services_.end(); ++it) {
-
-		boost::shared_ptr<service_t> service_ptr = it->second;
-		if (service_ptr) {
-			messages_cache_size_ += service_ptr->cache_size();
-		}
-		else {
-			std::string error_str = "object for service wth name " + it->first;
-			error_str += " is empty at " + std::string(BOOST_CURRENT_FUNCTION);
-			throw error(error_str);
-		}
-	}
-
-	// total size of all queues in all services
-	context()->stats()->update_used_cache_size(messages_cache_size_);
+client_impl::messages_cache_size() {
+	return context()->messages_budget()->used();
 }
 
 boost::shared_ptr<configuration>
@@ -28,13 +28,29 @@ configuration::configuration() :
 	version_ (0),
 	message_timeout_(MESSAGE_TIMEOUT),
 	socket_poll_timeout_(DEFAULT_SOCKET_POLL_TIMEOUT),
+	send_batch_messages_(DEFAULT_SEND_BATCH_MESSAGES),
+	send_batch_bytes_(DEFAULT_SEND_BATCH_BYTES),
+	response_validation_level_(RVL_NONE),
+	balancing_type_(BT_ROUND_ROBIN),
+	resend_base_delay_(DEFAULT_RESEND_BASE_DELAY),
+	resend_max_delay_(DEFAULT_RESEND_MAX_DELAY),
+	max_resend_rate_(DEFAULT_MAX_RESEND_RATE),
+	is_reactor_pool_enabled_(false),
+	reactor_threads_(DEFAULT_REACTOR_THREADS),
+	callback_threads_(DEFAULT_CALLBACK_THREADS),
 	max_message_cache_size_(DEFAULT_MAX_MESSAGE_CACHE_SIZE),
+	spill_path_(DEFAULT_SPILL_PATH),
+	max_spill_size_(DEFAULT_MAX_SPILL_SIZE),
+	use_hugepages_(DEFAULT_USE_HUGEPAGES),
+	dedup_min_size_(DEFAULT_DEDUP_MIN_SIZE),
 	logger_type_(STDOUT_LOGGER),
 	logger_flags_(PLOG_NONE),
 	eblob_path_(DEFAULT_EBLOB_PATH),
 	eblob_log_path_(DEFAULT_EBLOB_LOG_PATH),
 	eblob_log_flags_(DEFAULT_EBLOB_LOG_FLAGS),
 	eblob_sync_interval_(DEFAULT_EBLOB_SYNC_INTERVAL),
+	eblob_max_gb_(DEFAULT_EBLOB_MAX_GB),
+	eblob_sync_bytes_(DEFAULT_EBLOB_SYNC_BYTES),
 	autodiscovery_type_(AT_HTTP),
 	multicast_ip_(DEFAULT_MULTICAST_IP),
 	multicast_port_(DEFAULT_MULTICAST_PORT),
@@ -50,13 +66,29 @@ configuration::configuration(const std::string& path) :
 	version_ (0),
 	message_timeout_(MESSAGE_TIMEOUT),
 	socket_poll_timeout_(DEFAULT_SOCKET_POLL_TIMEOUT),
+	send_batch_messages_(DEFAULT_SEND_BATCH_MESSAGES),
+	send_batch_bytes_(DEFAULT_SEND_BATCH_BYTES),
+	response_validation_level_(RVL_NONE),
+	balancing_type_(BT_ROUND_ROBIN),
+	resend_base_delay_(DEFAULT_RESEND_BASE_DELAY),
+	resend_max_delay_(DEFAULT_RESEND_MAX_DELAY),
+	max_resend_rate_(DEFAULT_MAX_RESEND_RATE),
+	is_reactor_pool_enabled_(false),
+	reactor_threads_(DEFAULT_REACTOR_THREADS),
+	callback_threads_(DEFAULT_CALLBACK_THREADS),
 	max_message_cache_size_(DEFAULT_MAX_MESSAGE_CACHE_SIZE),
+	spill_path_(DEFAULT_SPILL_PATH),
+	max_spill_size_(DEFAULT_MAX_SPILL_SIZE),
+	use_hugepages_(DEFAULT_USE_HUGEPAGES),
+	dedup_min_size_(DEFAULT_DEDUP_MIN_SIZE),
 	logger_type_(STDOUT_LOGGER),
 	logger_flags_(PLOG_NONE),
 	eblob_path_(DEFAULT_EBLOB_PATH),
 	eblob_log_path_(DEFAULT_EBLOB_LOG_PATH),
 	eblob_log_flags_(DEFAULT_EBLOB_LOG_FLAGS),
 	eblob_sync_interval_(DEFAULT_EBLOB_SYNC_INTERVAL),
+	eblob_max_gb_(DEFAULT_EBLOB_MAX_GB),
+	eblob_sync_bytes_(DEFAULT_EBLOB_SYNC_BYTES),
 	autodiscovery_type_(AT_HTTP),
 	multicast_ip_(DEFAULT_MULTICAST_IP),
 	multicast_port_(DEFAULT_MULTICAST_PORT),
@@ -76,6 +108,64 @@ configuration::parse_basic_settings(const Json::Value& config_value) {
 	version_ = config_value.get("config_version", 0).asUInt();
 	message_timeout_ = (unsigned long long)config_value.get("message_timeout", (int)MESSAGE_TIMEOUT).asInt();
 	socket_poll_timeout_ = (unsigned long long)config_value.get("socket_poll_timeout", (int)DEFAULT_SOCKET_POLL_TIMEOUT).asInt();
+	send_batch_messages_ = (size_t)config_value.get("send_batch_messages", (int)DEFAULT_SEND_BATCH_MESSAGES).asInt();
+	send_batch_bytes_ = (size_t)config_value.get("send_batch_bytes", (int)DEFAULT_SEND_BATCH_BYTES).asInt();
+
+	if (send_batch_messages_ == 0) {
+		send_batch_messages_ = 1;
+	}
+
+	std::string validation_str = config_value.get("response_validation", "NONE").asString();
+
+	if (validation_str == "NONE") {
+		response_validation_level_ = RVL_NONE;
+	}
+	else if (validation_str == "MSGPACK") {
+		response_validation_level_ = RVL_MSGPACK;
+	}
+	else if (validation_str == "MSGPACK_DUMP") {
+		response_validation_level_ = RVL_MSGPACK_DUMP;
+	}
+	else {
+		std::string error_str = "unknown response validation level: " + validation_str;
+		error_str += "response_validation property can only take NONE, MSGPACK or MSGPACK_DUMP as value. ";
+		error_str += "at " + std::string(BOOST_CURRENT_FUNCTION);
+		throw error(error_str);
+	}
+
+	std::string balancing_str = config_value.get("balancing", "ROUND_ROBIN").asString();
+
+	if (balancing_str == "ROUND_ROBIN") {
+		balancing_type_ = BT_ROUND_ROBIN;
+	}
+	else if (balancing_str == "LEAST_OUTSTANDING") {
+		balancing_type_ = BT_LEAST_OUTSTANDING;
+	}
+	else if (balancing_str == "LOAD_AWARE") {
+		balancing_type_ = BT_LOAD_AWARE;
+	}
+	else {
+		std::string error_str = "unknown balancing type: " + balancing_str;
+		error_str += "balancing property can only take ROUND_ROBIN, LEAST_OUTSTANDING or LOAD_AWARE as value. ";
+		error_str += "at " + std::string(BOOST_CURRENT_FUNCTION);
+		throw error(error_str);
+	}
+
+	resend_base_delay_ = (unsigned long long)config_value.get("resend_base_delay", (int)DEFAULT_RESEND_BASE_DELAY).asInt();
+	resend_max_delay_ = (unsigned long long)config_value.get("resend_max_delay", (int)DEFAULT_RESEND_MAX_DELAY).asInt();
+	max_resend_rate_ = config_value.get("max_resend_rate", DEFAULT_MAX_RESEND_RATE).asUInt();
+
+	if (resend_max_delay_ < resend_base_delay_) {
+		resend_max_delay_ = resend_base_delay_;
+	}
+
+	is_reactor_pool_enabled_ = config_value.get("reactor_pool", false).asBool();
+	reactor_threads_ = config_value.get("reactor_threads", DEFAULT_REACTOR_THREADS).asUInt();
+	callback_threads_ = config_value.get("callback_threads", DEFAULT_CALLBACK_THREADS).asUInt();
+
+	if (callback_threads_ == 0) {
+		callback_threads_ = 1;
+	}
 }
 
 void
@@ -153,6 +243,18 @@ configuration::parse_messages_cache_settings(const Json::Value& config_value) {
 		error_str += "at " + std::string(BOOST_CURRENT_FUNCTION);
 		throw error(error_str);
 	}
+
+	// messages over max_ram_limit go to disk instead of being rejected
+	spill_path_ = cache_value.get("spill_path", DEFAULT_SPILL_PATH).asString();
+	max_spill_size_ = cache_value.get("spill_max_size", DEFAULT_MAX_SPILL_SIZE).asUInt();
+	max_spill_size_ *= 1048576; // convert mb to bytes
+
+	// map big payloads with MAP_HUGETLB, needs hugepages reserved by admin
+	use_hugepages_ = cache_value.get("hugepages", DEFAULT_USE_HUGEPAGES).asBool();
+
+	// equal payloads of this size and more share memory
+	dedup_min_size_ = cache_value.get("dedup_min_size", DEFAULT_DEDUP_MIN_SIZE).asUInt();
+	dedup_min_size_ *= 1024; // convert kb to bytes
 }
 
 void
@@ -163,6 +265,8 @@ configuration::parse_persistant_storage_settings(const Json::Value& config_value
 	eblob_log_path_ = persistent_storage_value.get("eblob_log_path", "").asString();
 	eblob_log_flags_ = persistent_storage_value.get("eblob_log_flags", 0).asUInt();
 	eblob_sync_interval_ = persistent_storage_value.get("eblob_sync_interval", DEFAULT_EBLOB_SYNC_INTERVAL).asInt();
+	eblob_max_gb_ = persistent_storage_value.get("eblob_max_gb", DEFAULT_EBLOB_MAX_GB).asUInt();
+	eblob_sync_bytes_ = (size_t)persistent_storage_value.get("eblob_sync_bytes", (unsigned int)DEFAULT_EBLOB_SYNC_BYTES).asUInt();
 }
 
 void
@@ -315,6 +419,56 @@ configuration::socket_poll_timeout() const {
 	return socket_poll_timeout_;
 }
 
+size_t
+configuration::send_batch_messages() const {
+	return send_batch_messages_;
+}
+
+size_t
+configuration::send_batch_bytes() const {
+	return send_batch_bytes_;
+}
+
+enum response_validation_level
+configuration::response_validation_level() const {
+	return response_validation_level_;
+}
+
+enum balancing_type
+configuration::balancing_type() const {
+	return balancing_type_;
+}
+
+unsigned long long
+configuration::resend_base_delay() const {
+	return resend_base_delay_;
+}
+
+unsigned long long
+configuration::resend_max_delay() const {
+	return resend_max_delay_;
+}
+
+unsigned int
+configuration::max_resend_rate() const {
+	return max_resend_rate_;
+}
+
+bool
+configuration::is_reactor_pool_enabled() const {
+	return is_reactor_pool_enabled_;
+}
+
+unsigned int
+configuration::reactor_threads() const {
+	return reactor_threads_;
+}
+
+unsigned int
+configuration::callback_threads() const {
+	return callback_threads_;
+}
+
 size_t
 configuration::max_message_cache_size() const {
 	return max_message_cache_size_;
@@ -325,6 +479,26 @@ configuration::message_cache_type() const {
 	return message_cache_type_;
 }
 
+const std::string&
+configuration::spill_path() const {
+	return spill_path_;
+}
+
+boost::uint64_t
+configuration::max_spill_size() const {
+	return max_spill_size_;
+}
+
+bool
+configuration::use_hugepages() const {
+	return use_hugepages_;
+}
+
+size_t
+configuration::dedup_min_size() const {
+	return dedup_min_size_;
+}
+
 enum logger_type
 configuration::logger_type() const {
 	return logger_type_;
@@ -365,6 +539,16 @@ configuration::eblob_sync_interval() const {
 	return eblob_sync_interval_;
 }
 
+unsigned int
+configuration::eblob_max_gb() const {
+	return eblob_max_gb_;
+}
+
+size_t
+configuration::eblob_sync_bytes() const {
+	return eblob_sync_bytes_;
+}
+
 enum autodiscovery_type
 configuration::autodiscovery_type() const {
 	return autodiscovery_type_;
@@ -428,9 +612,39 @@ std::string configuration::as_json() const {
 	Json::Value root;
 
 	Json::Value basic_settings;
-	basic_settings["1 - config version"] = version_;
-	basic_settings["2 - message timeout"] = (unsigned int)message_timeout_;
-	basic_settings["3 - socket poll timeout"] = (unsigned int)socket_poll_timeout_;
+	basic_settings["01 - config version"] = version_;
+	basic_settings["02 - message timeout"] = (unsigned int)message_timeout_;
+	basic_settings["03 - socket poll timeout"] = (unsigned int)socket_poll_timeout_;
+	basic_settings["04 - send batch messages"] = (unsigned int)send_batch_messages_;
+	basic_settings["05 - send batch bytes"] = (unsigned int)send_batch_bytes_;
+
+	if (response_validation_level_ == RVL_NONE) {
+		basic_settings["06 - response validation"] = "NONE";
+	}
+	else if (response_validation_level_ == RVL_MSGPACK) {
+		basic_settings["06 - response validation"] = "MSGPACK";
+	}
+	else if (response_validation_level_ == RVL_MSGPACK_DUMP) {
+		basic_settings["06 - response validation"] = "MSGPACK_DUMP";
+	}
+
+	if (balancing_type_ == BT_ROUND_ROBIN) {
+		basic_settings["07 - balancing"] = "ROUND_ROBIN";
+	}
+	else if (balancing_type_ == BT_LEAST_OUTSTANDING) {
+		basic_settings["07 - balancing"] = "LEAST_OUTSTANDING";
+	}
+	else if (balancing_type_ == BT_LOAD_AWARE) {
+		basic_settings["07 - balancing"] = "LOAD_AWARE";
+	}
+
+	basic_settings["08 - resend base delay"] = (unsigned int)resend_base_delay_;
+	basic_settings["09 - resend max delay"] = (unsigned int)resend_max_delay_;
+	basic_settings["10 - max resend rate"] = max_resend_rate_;
+	basic_settings["11 - reactor pool"] = is_reactor_pool_enabled_;
+	basic_settings["12 - reactor threads"] = reactor_threads_;
+	basic_settings["13 - callback threads"] = callback_threads_;
+
 	root["1 - basic settings"] = basic_settings;
 
 	Json::Value logger;
@@ -490,6 +704,13 @@ std::string configuration::as_json() const {
  	else if (message_cache_type_ == PERSISTANT) {
  		message_cache["2 - type"] = "PERSISTANT";
  	}
+
+	std::string spill_size_str = boost::lexical_cast<std::string>(max_spill_size_ / 1048576);
+	spill_size_str += " Mb";
+	message_cache["3 - spill path"] = spill_path_;
+	message_cache["4 - spill max size"] = spill_size_str;
+	message_cache["5 - hugepages"] = use_hugepages_;
+	message_cache["6 - dedup min size"] = boost::lexical_cast<std::string>(dedup_min_size_ / 1024) + " Kb";
 	root["3 - message cache"] = message_cache;
 
 	Json::Value persistant_storage;
@@ -497,6 +718,8 @@ std::string configuration::as_json() const {
 	persistant_storage["2 - eblob log path"] = eblob_log_path_;
 	persistant_storage["3 - eblob log flags"] = eblob_log_flags_;
 	persistant_storage["4 - eblob sync interval"] = eblob_sync_interval_;
+	persistant_storage["5 - eblob max gb"] = eblob_max_gb_;
+	persistant_storage["6 - eblob sync bytes"] = (unsigned int)eblob_sync_bytes_;
 	root["4 - persistant storage"] = persistant_storage;
 
 	Json::Value autodiscovery;
@@ -550,6 +773,35 @@ std::string configuration::as_string() const {
 	out << "\tconfig version: " << version_ << "\n";
 	out << "\tmessage timeout: " << message_timeout_ << "\n";
 	out << "\tsocket poll timeout: " << socket_poll_timeout_ << "\n";
+	out << "\tsend batch messages: " << send_batch_messages_ << "\n";
+	out << "\tsend batch bytes: " << send_batch_bytes_ << "\n";
+
+	if (response_validation_level_ == RVL_NONE) {
+		out << "\tresponse validation: NONE\n";
+	}
+	else if (response_validation_level_ == RVL_MSGPACK) {
+		out << "\tresponse validation: MSGPACK\n";
+	}
+	else if (response_validation_level_ == RVL_MSGPACK_DUMP) {
+		out << "\tresponse validation: MSGPACK_DUMP\n";
+	}
+
+	if (balancing_type_ == BT_ROUND_ROBIN) {
+		out << "\tbalancing: ROUND_ROBIN\n";
+	}
+	else if (balancing_type_ == BT_LEAST_OUTSTANDING) {
+		out << "\tbalancing: LEAST_OUTSTANDING\n";
+	}
+	else if (balancing_type_ == BT_LOAD_AWARE) {
+		out << "\tbalancing: LOAD_AWARE\n";
+	}
+
+	out << "\tresend base delay: " << resend_base_delay_ << "\n";
+	out << "\tresend max delay: " << resend_max_delay_ << "\n";
+	out << "\tmax resend rate: " << max_resend_rate_ << "\n";
+	out << "\treactor pool: " << (is_reactor_pool_enabled_ ? "true" : "false") << "\n";
+	out << "\treactor threads: " << reactor_threads_ << "\n";
+	out << "\tcallback threads: " << callback_threads_ << "\n";
 	
 	// logger
 	out << "logger\n";
@@ -604,18 +856,25 @@ std::string configuration::as_string() const {
  	out << "\tmax ram limit: " << max_message_cache_size_ / 1048576 << " Mb\n";
 
  	if (message_cache_type_ == RAM_ONLY) {
- 		out << "\ttype: RAM_ONLY\n\n";
+ 		out << "\ttype: RAM_ONLY\n";
  	}
  	else if (message_cache_type_ == PERSISTANT) {
- 		out << "\ttype: PERSISTANT\n\n";
+ 		out << "\ttype: PERSISTANT\n";
  	}
 
+ 	out << "\tspill path: " << spill_path_ << "\n";
+ 	out << "\tspill max size: " << max_spill_size_ / 1048576 << " Mb\n";
+ 	out << "\thugepages: " << (use_hugepages_ ? "true" : "false") << "\n";
+ 	out << "\tdedup min size: " << dedup_min_size_ / 1024 << " Kb\n\n";
+
  	// persistant storage
  	out << "persistant storage\n";
 	out << "\teblob path: " << eblob_path_ << "\n";
 	out << "\teblob log path: " << eblob_log_path_ << "\n";
 	out << "\teblob log flags: " << eblob_log_flags_ << "\n";
- 	out << "\teblob sync interval: " << eblob_sync_interval_ << "\n\n";
+ 	out << "\teblob sync interval: " << eblob_sync_interval_ << "\n";
+	out << "\teblob max gb: " << eblob_max_gb_ << "\n";
+	out << "\teblob sync bytes: " << eblob_sync_bytes_ << "\n\n";
 
  	// autodiscovery
  	out << "autodiscovery\n";
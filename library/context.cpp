@@ -11,8 +11,12 @@
 // limitations under the License.
 //
 
+#include <boost/bind.hpp>
+
 #include "details/context.hpp"
 #include "details/error.hpp"
+#include "details/data_container.hpp"
+#include "details/slab_allocator.hpp"
 
 namespace lsd {
 
@@ -53,9 +57,40 @@ context::context(const std::string& config_path) {
 
 	// create statistics collector
 	stats_.reset(new statistics_collector(config_, zmq_context_, logger()));
+
+	// ram taken by messages is accounted in one place, stats read it from there
+	messages_budget_.reset(new cache_budget(config_->max_message_cache_size()));
+	stats_->set_cache_budget(messages_budget_);
+	slab_allocator::use_hugepages(config_->use_hugepages());
+	data_container::set_dedup_min_size(config_->dedup_min_size());
+
+	// create reactor threads, handles attach to them instead of running own threads
+	if (config_->is_reactor_pool_enabled()) {
+		reactors_.reset(new reactor_pool(config_->reactor_threads(), logger()));
+		logger()->log("started %d reactor threads", (int)reactors_->size());
+
+		// user code never runs on reactor threads
+		callbacks_.reset(new callback_executor(config_->callback_threads(), logger()));
+		logger()->log("started %d callback threads", (int)callbacks_->size());
+	}
+
+	// open message log, messages left from previous run are recovered by client
+	if (config_->message_cache_type() == PERSISTANT) {
+		boost::uint64_t max_size = (boost::uint64_t)config_->eblob_max_gb() * 1024 * 1024 * 1024;
+		messages_log_.reset(new message_log(config_->eblob_path(),
+											max_size,
+											(double)config_->eblob_sync_interval(),
+											config_->eblob_sync_bytes(),
+											logger()));
+
+		messages_log_->set_commit_callback(boost::bind(&statistics_collector::update_commit_stats, stats_.get(), _1));
+	}
 }
 
 context::~context() {
+	reactors_.reset();
+	callbacks_.reset();
+	messages_log_.reset();
 	stats_.reset();
 	zmq_context_.reset();
 }
@@ -82,4 +117,24 @@ context::stats() {
 	return stats_;
 }
 
+boost::shared_ptr<reactor_pool>
+context::reactors() {
+	return reactors_;
+}
+
+boost::shared_ptr<callback_executor>
+context::callbacks() {
+	return callbacks_;
+}
+
+boost::shared_ptr<message_log>
+context::messages_log() {
+	return messages_log_;
+}
+
+boost::shared_ptr<cache_budget>
+context::messages_budget() {
+	return messages_budget_;
+}
+
 } // namespace lsd
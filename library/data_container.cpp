@@ -12,138 +12,226 @@
 //
 
 #include <cstring>
+#include <map>
 
-#include <boost/lexical_cast.hpp>
 #include <boost/current_function.hpp>
-#include <boost/shared_ptr.hpp>
+#include <boost/thread/mutex.hpp>
 
-#include <uuid/uuid.h>
-
-#include <openssl/sha.h>
-#include <openssl/evp.h>
-
-#include "json/json.h"
 #include "lsd/structs.hpp"
 #include "details/error.hpp"
 #include "details/data_container.hpp"
+#include "details/slab_allocator.hpp"
 
 namespace lsd {
 
+namespace {
+
+const boost::uint64_t PRIME64_1 = 0x9e3779b185ebca87ULL;
+const boost::uint64_t PRIME64_2 = 0xc2b2ae3d27d4eb4fULL;
+const boost::uint64_t PRIME64_3 = 0x165667b19e3779f9ULL;
+const boost::uint64_t PRIME64_4 = 0x85ebca77c2b2ae63ULL;
+const boost::uint64_t PRIME64_5 = 0x27d4eb2f165667c5ULL;
+
+inline boost::uint64_t
+rotl64(boost::uint64_t value, int bits) {
+	return (value << bits) | (value >> (64 - bits));
+}
+
+// unaligned little endian reads
+inline boost::uint64_t
+read64(const unsigned char* pos) {
+	boost::uint64_t value;
+	memcpy(&value, pos, sizeof(value));
+	return value;
+}
+
+inline boost::uint32_t
+read32(const unsigned char* pos) {
+	boost::uint32_t value;
+	memcpy(&value, pos, sizeof(value));
+	return value;
+}
+
+inline boost::uint64_t
+xxh64_round(boost::uint64_t acc, boost::uint64_t input) {
+	acc += input * PRIME64_2;
+	acc = rotl64(acc, 31);
+	return acc * PRIME64_1;
+}
+
+inline boost::uint64_t
+xxh64_merge_round(boost::uint64_t acc, boost::uint64_t value) {
+	acc ^= xxh64_round(0, value);
+	return acc * PRIME64_1 + PRIME64_4;
+}
+
+// content addressed buffers, <fingerprint, buffer>
+typedef std::multimap<boost::uint64_t, void*> dedup_store_t;
+
+dedup_store_t dedup_store;
+boost::mutex dedup_mutex;
+volatile size_t dedup_min_size = 0;
+
+} // anonymous namespace
+
 data_container::data_container() :
-	data_(NULL),
-	size_(0),
-	signed_(false)
+	buffer_(NULL)
 {
-	init();
 }
 
 data_container::data_container(const void* data, size_t size) :
-	data_((unsigned char*)data),
-	size_(size),
-	signed_(false)
+	buffer_(NULL)
 {
-	init_with_data((unsigned char*)data, size);
+	init_with_data((const unsigned char*)data, size);
 }
 
-data_container::data_container(const data_container& dc) {
-	if (dc.empty()) {
-		init();
-		return;
-	}
-
-	data_ = dc.data_;
-	size_ = dc.size_;
-
-	if (dc.signed_) {
-		memcpy(signature_, dc.signature_, SHA1_SIZE);
-		signed_ = dc.signed_;
+data_container::data_container(const data_container& dc) :
+	buffer_(dc.buffer_)
+{
+	if (buffer_) {
+		__sync_add_and_fetch(&buffer_->references, 1);
 	}
-
-	ref_counter_ = dc.ref_counter_;
-	++*ref_counter_;
 }
 
 void
-data_container::init_with_data(unsigned char* data, size_t size) {
+data_container::init_with_data(const unsigned char* data, size_t size) {
 	init();
 
 	if (data == NULL || size == 0) {
-		data_ = NULL;
-		size_ = 0;
 		return;
 	}
 
-	std::string error_msg = "not enough memory to create new data container at ";
-	error_msg += std::string(BOOST_CURRENT_FUNCTION);
+	// hashing is done at enqueue only when dedup asks for it
+	size_t min_size = dedup_min_size;
 
-	// allocate new space
-	try {
-		data_ = new unsigned char[size];
-	}
-	catch (...) {
-		throw error(error_msg);
-	}
-
-	if (!data_) {
-		throw error(error_msg);
+	if (min_size == 0 || size < min_size) {
+		buffer_ = allocate_buffer(data, size);
+		return;
 	}
 
-	// copy data
-	memcpy(data_, data, size);
-	++*ref_counter_;
-
-	size_ = size;
+	boost::uint64_t value = hash_data(data, size);
+	buffer_ = find_shared_buffer(data, size, value);
 
-	if (size <= SMALL_DATA_SIZE) {
+	if (buffer_) {
 		return;
 	}
 
-	sign_data(data_, size_, signature_);
-	signed_ = true;
+	buffer_ = allocate_buffer(data, size);
+	buffer_->fingerprint = value;
+	buffer_->state = BUFFER_FINGERPRINTED | BUFFER_SHARED;
+
+	boost::mutex::scoped_lock lock(dedup_mutex);
+	dedup_store.insert(std::make_pair(value, (void*)buffer_));
 }
 
 void
 data_container::init() {
-	// reset sha1 signature
-	signed_ = false;
-	memset(signature_, 0, SHA1_SIZE);
+	buffer_ = NULL;
+}
 
-	// create ref counter
-	std::string error_msg = "not enough memory to create new ref_counter in data container at ";
-	error_msg += std::string(BOOST_CURRENT_FUNCTION);
+data_container::~data_container() {
+	release_buffer(buffer_);
+}
+
+data_container::buffer*
+data_container::allocate_buffer(const unsigned char* data, size_t size) {
+	buffer* buff = NULL;
 
+	// counter and data in one block
 	try {
-		ref_counter_.reset(new reference_counter(0));
+		buff = static_cast<buffer*>(slab_allocator::allocate(sizeof(buffer) + size));
 	}
 	catch (...) {
-		throw error(error_msg);
+		std::string error_msg = "not enough memory to create new data container at ";
+		throw error(error_msg + std::string(BOOST_CURRENT_FUNCTION));
+	}
+
+	buff->references = 1;
+	buff->size = size;
+	buff->fingerprint = 0;
+	buff->state = 0;
+	memcpy(buff + 1, data, size);
+
+	return buff;
+}
+
+data_container::buffer*
+data_container::find_shared_buffer(const unsigned char* data, size_t size, boost::uint64_t fingerprint) {
+	buffer* found = NULL;
+
+	{
+		boost::mutex::scoped_lock lock(dedup_mutex);
+
+		std::pair<dedup_store_t::iterator, dedup_store_t::iterator> range = dedup_store.equal_range(fingerprint);
+		for (dedup_store_t::iterator it = range.first; it != range.second; ++it) {
+			buffer* buff = static_cast<buffer*>(it->second);
+
+			if (buff->size == size && try_add_reference(buff)) {
+				found = buff;
+				break;
+			}
+		}
 	}
 
-	if (!ref_counter_.get()) {
-		throw error(error_msg);
+	if (!found) {
+		return NULL;
 	}
 
-	// init data
-	data_ = NULL;
-	size_ = 0;
+	// hash collision, keep own copy
+	if (memcmp(found + 1, data, size) != 0) {
+		release_buffer(found);
+		return NULL;
+	}
+
+	return found;
 }
 
-data_container::~data_container() {
-	if (*ref_counter_ == 0) {
+bool
+data_container::try_add_reference(buffer* buff) {
+	// buffers already on their way out of dedup store are not revived
+	while (true) {
+		long references = buff->references;
+
+		if (references == 0) {
+			return false;
+		}
+
+		if (__sync_bool_compare_and_swap(&buff->references, references, references + 1)) {
+			return true;
+		}
+	}
+}
+
+void
+data_container::release_buffer(buffer* buff) {
+	if (!buff) {
 		return;
 	}
 
-	--*ref_counter_;
+	// references can be dropped concurrently (i.e. by zmq i/o thread),
+	// so only the thread that performed the last decrement frees data
+	if (__sync_sub_and_fetch(&buff->references, 1) != 0) {
+		return;
+	}
 
-	if (data_ && *ref_counter_ == 0) {
-		delete [] data_;
+	if (buff->state & BUFFER_SHARED) {
+		boost::uint64_t fingerprint = buff->fingerprint;
+		boost::mutex::scoped_lock lock(dedup_mutex);
+
+		std::pair<dedup_store_t::iterator, dedup_store_t::iterator> range = dedup_store.equal_range(fingerprint);
+		for (dedup_store_t::iterator it = range.first; it != range.second; ++it) {
+			if (it->second == buff) {
+				dedup_store.erase(it);
+				break;
+			}
+		}
 	}
+
+	slab_allocator::deallocate(buff);
 }
 
 data_container&
 data_container::operator = (const data_container& rhs) {
-	boost::mutex::scoped_lock lock(mutex_);
-
 	data_container(rhs).swap(*this);
 	return *this;
 }
@@ -151,22 +239,22 @@ data_container::operator = (const data_container& rhs) {
 bool
 data_container::operator == (const data_container& rhs) const {
 	// data size differs?
-	if (size_ != rhs.size_) {
+	if (size() != rhs.size()) {
 		return false;
 	}
 
-	// both containers empty?
-	if (size_ == 0 && rhs.size_ == 0) {
+	// both containers empty or share data?
+	if (buffer_ == rhs.buffer_) {
 		return true;
 	}
 
-	// compare small containers
-	if (size_ <= SMALL_DATA_SIZE) {
-		return (0 == memcmp(data_, rhs.data_, size_));
+	// fingerprints of big containers are cached, so most mismatches
+	// are found without going through data again
+	if (size() > SMALL_DATA_SIZE && fingerprint() != rhs.fingerprint()) {
+		return false;
 	}
 
-	// compare big containers
-	return (0 == memcmp(signature_, rhs.signature_, SHA1_SIZE));
+	return (0 == memcmp(data(), rhs.data(), size()));
 }
 
 bool
@@ -176,83 +264,123 @@ data_container::operator != (const data_container& rhs) const {
 
 bool
 data_container::empty() const {
-	return (size_ == 0);
+	return (buffer_ == NULL);
 }
 
 void
 data_container::clear() {
-	boost::mutex::scoped_lock lock(mutex_);
+	release_buffer(buffer_);
+	init();
+}
 
-	if (*ref_counter_ == 0) {
-		return;
+void*
+data_container::add_reference() const {
+	if (buffer_) {
+		__sync_add_and_fetch(&buffer_->references, 1);
 	}
 
-	--*ref_counter_;
-
-	if (data_ && *ref_counter_ == 0) {
-		delete data_;
-	}
+	return buffer_;
+}
 
-	init();
+void
+data_container::release_reference(void*, void* hint) {
+	release_buffer(static_cast<buffer*>(hint));
 }
 
 void*
 data_container::data() const {
-	return (void*)data_;
+	return buffer_ ? (void*)(buffer_ + 1) : NULL;
 }
 
 size_t
 data_container::size() const {
-	return size_;
+	return buffer_ ? buffer_->size : 0;
 }
 
-void
-data_container::swap(data_container& other) {
-	std::swap(data_, other.data_);
-	std::swap(size_, other.size_);
-	std::swap(signed_, other.signed_);
-
-	unsigned char signature_tmp[SHA1_SIZE];
-	memcpy(signature_tmp, signature_, SHA1_SIZE);
-	memcpy(signature_, other.signature_, SHA1_SIZE);
-	memcpy(other.signature_, signature_tmp, SHA1_SIZE);
-
-	std::swap(ref_counter_, other.ref_counter_);
-}
+boost::uint64_t
+data_container::fingerprint() const {
+	if (!buffer_) {
+		return hash_data(NULL, 0);
+	}
 
-void
-data_container::sign_data(unsigned char* data, size_t& size, unsigned char signature[SHA1_SIZE]) {
-	SHA_CTX sha_context;
-	SHA1_Init(&sha_context);
+	if (buffer_->state & BUFFER_FINGERPRINTED) {
+		__sync_synchronize();
+		return buffer_->fingerprint;
+	}
 
-	// reset signature
-	memset(signature, 0, sizeof(signature));
+	// copies may race here, they all compute the same value
+	boost::uint64_t value = hash_data(buffer_ + 1, buffer_->size);
+	buffer_->fingerprint = value;
+	__sync_fetch_and_or(&buffer_->state, (boost::uint32_t)BUFFER_FINGERPRINTED);
 
-	// go through compiled and flattened data in chunks of 512 kb., building signature
-	unsigned int full_chunks_count = size / SHA1_CHUNK_SIZE;
-	char* data_offset_ptr = (char*)data;
+	return value;
+}
 
-	// process full chunks
-	for (unsigned i = 0; i < full_chunks_count; i++) {
-		SHA1_Update(&sha_context, data_offset_ptr, SHA1_CHUNK_SIZE);
-		data_offset_ptr += SHA1_CHUNK_SIZE;
+boost::uint64_t
+data_container::hash_data(const void* data, size_t size) {
+	const unsigned char* pos = static_cast<const unsigned char*>(data);
+	const unsigned char* end = pos + size;
+	boost::uint64_t hash = 0;
+
+	if (size >= 32) {
+		boost::uint64_t v1 = PRIME64_1 + PRIME64_2;
+		boost::uint64_t v2 = PRIME64_2;
+		boost::uint64_t v3 = 0;
+		boost::uint64_t v4 = 0 - PRIME64_1;
+
+		// four independent lanes of 8 bytes
+		for (; pos + 32 <= end; pos += 32) {
+			v1 = xxh64_round(v1, read64(pos));
+			v2 = xxh64_round(v2, read64(pos + 8));
+			v3 = xxh64_round(v3, read64(pos + 16));
+			v4 = xxh64_round(v4, read64(pos + 24));
+		}
+
+		hash = rotl64(v1, 1) + rotl64(v2, 7) + rotl64(v3, 12) + rotl64(v4, 18);
+		hash = xxh64_merge_round(hash, v1);
+		hash = xxh64_merge_round(hash, v2);
+		hash = xxh64_merge_round(hash, v3);
+		hash = xxh64_merge_round(hash, v4);
+	}
+	else {
+		hash = PRIME64_5;
 	}
 
-	unsigned int remainder_chunk_size = 0;
+	hash += (boost::uint64_t)size;
 
-	if (size < SHA1_CHUNK_SIZE) {
-		remainder_chunk_size = size;
+	for (; pos + 8 <= end; pos += 8) {
+		hash ^= xxh64_round(0, read64(pos));
+		hash = rotl64(hash, 27) * PRIME64_1 + PRIME64_4;
 	}
-	else {
-		remainder_chunk_size = size % SHA1_CHUNK_SIZE;
+
+	if (pos + 4 <= end) {
+		hash ^= (boost::uint64_t)read32(pos) * PRIME64_1;
+		hash = rotl64(hash, 23) * PRIME64_2 + PRIME64_3;
+		pos += 4;
 	}
 
-	// process remained chunk
-	if (0 != remainder_chunk_size) {
-		SHA1_Update(&sha_context, data_offset_ptr, remainder_chunk_size);
+	for (; pos < end; ++pos) {
+		hash ^= (boost::uint64_t)(*pos) * PRIME64_5;
+		hash = rotl64(hash, 11) * PRIME64_1;
 	}
 
-	SHA1_Final(signature, &sha_context);
+	hash ^= hash >> 33;
+	hash *= PRIME64_2;
+	hash ^= hash >> 29;
+	hash *= PRIME64_3;
+	hash ^= hash >> 32;
+
+	return hash;
+}
+
+void
+data_container::set_dedup_min_size(size_t min_size) {
+	dedup_min_size = min_size;
+}
+
+void
+data_container::swap(data_container& other) {
+	std::swap(buffer_, other.buffer_);
 }
 
 } // namespace lsd
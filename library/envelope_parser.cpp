@@ -0,0 +1,416 @@
+//
+// Copyright (C) 2011 Rim Zaidullin <creator@bash.org.ru>
+//
+// Licensed under the BSD 2-Clause License (the "License");
+// you may not use this file except in compliance with the License.
+//
+// Unless required by applicable law or agreed to in writing, software
+// distributed under the License is distributed on an "AS IS" BASIS,
+// WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+// See the License for the specific language governing permissions and
+// limitations under the License.
+//
+
+#include <climits>
+#include <cstring>
+
+#include "details/envelope_parser.hpp"
+
+namespace lsd {
+
+namespace {
+
+inline bool
+key_equals(const char* key, size_t key_size, const char* name, size_t name_size) {
+	return (key_size == name_size && memcmp(key, name, name_size) == 0);
+}
+
+inline bool
+literal_equals(const char* pos, const char* end, const char* literal, size_t literal_size) {
+	return ((size_t)(end - pos) >= literal_size && memcmp(pos, literal, literal_size) == 0);
+}
+
+inline int
+hex_digit(char c) {
+	if (c >= '0' && c <= '9') {
+		return c - '0';
+	}
+
+	if (c >= 'a' && c <= 'f') {
+		return c - 'a' + 10;
+	}
+
+	if (c >= 'A' && c <= 'F') {
+		return c - 'A' + 10;
+	}
+
+	return -1;
+}
+
+bool
+read_code_unit(const char* pos, const char* end, unsigned int& value) {
+	if (end - pos < 4) {
+		return false;
+	}
+
+	value = 0;
+	for (int i = 0; i < 4; ++i) {
+		int digit = hex_digit(pos[i]);
+
+		if (digit < 0) {
+			return false;
+		}
+
+		value = (value << 4) | digit;
+	}
+
+	return true;
+}
+
+void
+append_utf8(unsigned int code_point, std::string& result) {
+	if (code_point < 0x80) {
+		result += (char)code_point;
+	}
+	else if (code_point < 0x800) {
+		result += (char)(0xc0 | (code_point >> 6));
+		result += (char)(0x80 | (code_point & 0x3f));
+	}
+	else if (code_point < 0x10000) {
+		result += (char)(0xe0 | (code_point >> 12));
+		result += (char)(0x80 | ((code_point >> 6) & 0x3f));
+		result += (char)(0x80 | (code_point & 0x3f));
+	}
+	else {
+		result += (char)(0xf0 | (code_point >> 18));
+		result += (char)(0x80 | ((code_point >> 12) & 0x3f));
+		result += (char)(0x80 | ((code_point >> 6) & 0x3f));
+		result += (char)(0x80 | (code_point & 0x3f));
+	}
+}
+
+} // anonymous namespace
+
+bool
+envelope_parser::scan_json(const char* data, size_t size, response_envelope& envelope) {
+	envelope = response_envelope();
+
+	const char* end = data + size;
+	const char* pos = skip_whitespace(data, end);
+
+	if (pos == end || *pos != '{') {
+		return false;
+	}
+
+	pos = skip_whitespace(pos + 1, end);
+
+	if (pos != end && *pos == '}') {
+		return (skip_whitespace(pos + 1, end) == end);
+	}
+
+	while (true) {
+		// key
+		if (pos == end || *pos != '"') {
+			return false;
+		}
+
+		bool key_escaped = false;
+		const char* key = pos + 1;
+		pos = scan_string(pos, end, key_escaped);
+
+		// escaped keys are too exotic to bother with
+		if (!pos || key_escaped) {
+			return false;
+		}
+
+		size_t key_size = pos - key - 1;
+
+		pos = skip_whitespace(pos, end);
+		if (pos == end || *pos != ':') {
+			return false;
+		}
+
+		pos = skip_whitespace(pos + 1, end);
+		if (pos == end) {
+			return false;
+		}
+
+		// value
+		if (key_equals(key, key_size, "uuid", 4)) {
+			bool escaped = false;
+
+			if (*pos != '"') {
+				return false;
+			}
+
+			envelope.uuid = pos + 1;
+			pos = scan_string(pos, end, escaped);
+
+			if (!pos || escaped) {
+				return false;
+			}
+
+			envelope.uuid_size = pos - envelope.uuid - 1;
+		}
+		else if (key_equals(key, key_size, "completed", 9)) {
+			if (literal_equals(pos, end, "true", 4)) {
+				envelope.completed = true;
+				pos += 4;
+			}
+			else if (literal_equals(pos, end, "false", 5)) {
+				envelope.completed = false;
+				pos += 5;
+			}
+			else {
+				return false;
+			}
+		}
+		else if (key_equals(key, key_size, "code", 4)) {
+			pos = scan_integer(pos, end, envelope.code);
+		}
+		else if (key_equals(key, key_size, "message", 7)) {
+			if (*pos != '"') {
+				return false;
+			}
+
+			envelope.message = pos + 1;
+			pos = scan_string(pos, end, envelope.message_escaped);
+
+			if (pos) {
+				envelope.message_size = pos - envelope.message - 1;
+			}
+		}
+		else {
+			pos = skip_value(pos, end);
+		}
+
+		if (!pos) {
+			return false;
+		}
+
+		// next member or end of object
+		pos = skip_whitespace(pos, end);
+		if (pos == end) {
+			return false;
+		}
+
+		if (*pos == ',') {
+			pos = skip_whitespace(pos + 1, end);
+			continue;
+		}
+
+		if (*pos == '}') {
+			return (skip_whitespace(pos + 1, end) == end);
+		}
+
+		return false;
+	}
+}
+
+bool
+envelope_parser::unescape(const char* data, size_t size, std::string& result) {
+	result.clear();
+	result.reserve(size);
+
+	const char* end = data + size;
+
+	for (const char* pos = data; pos < end; ++pos) {
+		if (*pos != '\\') {
+			result += *pos;
+			continue;
+		}
+
+		if (++pos == end) {
+			return false;
+		}
+
+		switch (*pos) {
+			case '"': result += '"'; break;
+			case '\\': result += '\\'; break;
+			case '/': result += '/'; break;
+			case 'b': result += '\b'; break;
+			case 'f': result += '\f'; break;
+			case 'n': result += '\n'; break;
+			case 'r': result += '\r'; break;
+			case 't': result += '\t'; break;
+
+			case 'u': {
+				unsigned int code_point = 0;
+				if (!read_code_unit(pos + 1, end, code_point)) {
+					return false;
+				}
+
+				pos += 4;
+
+				// surrogate pair
+				if (code_point >= 0xd800 && code_point <= 0xdbff) {
+					unsigned int low = 0;
+
+					if (end - pos < 7 || pos[1] != '\\' || pos[2] != 'u' || !read_code_unit(pos + 3, end, low)) {
+						return false;
+					}
+
+					if (low < 0xdc00 || low > 0xdfff) {
+						return false;
+					}
+
+					code_point = 0x10000 + ((code_point - 0xd800) << 10) + (low - 0xdc00);
+					pos += 6;
+				}
+
+				append_utf8(code_point, result);
+			}
+			break;
+
+			default:
+				return false;
+		}
+	}
+
+	return true;
+}
+
+const char*
+envelope_parser::skip_whitespace(const char* pos, const char* end) {
+	while (pos != end && (*pos == ' ' || *pos == '\n' || *pos == '\r' || *pos == '\t')) {
+		++pos;
+	}
+
+	return pos;
+}
+
+const char*
+envelope_parser::scan_string(const char* pos, const char* end, bool& escaped) {
+	// skip opening quote
+	++pos;
+
+	while (pos != end) {
+		unsigned char c = (unsigned char)*pos;
+
+		if (c == '"') {
+			return pos + 1;
+		}
+
+		if (c == '\\') {
+			escaped = true;
+
+			if (++pos == end) {
+				return NULL;
+			}
+		}
+		else if (c < 0x20) {
+			return NULL;
+		}
+
+		++pos;
+	}
+
+	return NULL;
+}
+
+const char*
+envelope_parser::scan_integer(const char* pos, const char* end, int& value) {
+	bool negative = false;
+
+	if (pos != end && *pos == '-') {
+		negative = true;
+		++pos;
+	}
+
+	if (pos == end || *pos < '0' || *pos > '9') {
+		return NULL;
+	}
+
+	long long result = 0;
+
+	while (pos != end && *pos >= '0' && *pos <= '9') {
+		result = result * 10 + (*pos - '0');
+
+		if (result > (long long)INT_MAX + 1) {
+			return NULL;
+		}
+
+		++pos;
+	}
+
+	// fractions and exponents are left to the full parser
+	if (pos != end && (*pos == '.' || *pos == 'e' || *pos == 'E')) {
+		return NULL;
+	}
+
+	if (negative) {
+		result = -result;
+	}
+
+	if (result > INT_MAX || result < INT_MIN) {
+		return NULL;
+	}
+
+	value = (int)result;
+	return pos;
+}
+
+const char*
+envelope_parser::skip_value(const char* pos, const char* end) {
+	bool escaped = false;
+
+	switch (*pos) {
+		case '"':
+			return scan_string(pos, end, escaped);
+
+		case 't':
+			return literal_equals(pos, end, "true", 4) ? pos + 4 : NULL;
+
+		case 'f':
+			return literal_equals(pos, end, "false", 5) ? pos + 5 : NULL;
+
+		case 'n':
+			return literal_equals(pos, end, "null", 4) ? pos + 4 : NULL;
+
+		case '{':
+		case '[': {
+			// nested containers are skipped by bracket depth only
+			int depth = 0;
+
+			while (pos != end) {
+				if (*pos == '"') {
+					pos = scan_string(pos, end, escaped);
+
+					if (!pos) {
+						return NULL;
+					}
+
+					continue;
+				}
+
+				if (*pos == '{' || *pos == '[') {
+					++depth;
+				}
+				else if (*pos == '}' || *pos == ']') {
+					if (--depth == 0) {
+						return pos + 1;
+					}
+				}
+
+				++pos;
+			}
+
+			return NULL;
+		}
+
+		default:
+			break;
+	}
+
+	// number
+	const char* begin = pos;
+	while (pos != end && ((*pos >= '0' && *pos <= '9') || *pos == '-' || *pos == '+' ||
+						  *pos == '.' || *pos == 'e' || *pos == 'E'))
+	{
+		++pos;
+	}
+
+	return (pos == begin) ? NULL : pos;
+}
+
+} // namespace lsd
@@ -11,6 +11,7 @@
 // limitations under the License.
 //
 
+#include <algorithm>
 #include <stdexcept>
 
 #include <boost/tokenizer.hpp>
@@ -138,6 +139,7 @@ http_heartbeats_collector::get_metainfo_from_host(const service_info_t& s_info,
 
 	msg["version"] = 2;
 	msg["action"] = "info";
+	msg["lsd_protocol_version"] = PROTOCOL_VERSION;
 
 	std::string info_request = writer.write(msg);
 	zmq::message_t message(info_request.length());
@@ -235,7 +237,7 @@ http_heartbeats_collector::ping_service_hosts(const service_info_t& s_info, std:
 		std::vector<handle_info_t> host_handles;
 
 		try {
-			parse_host_response(s_info, hosts[i].ip_, metadata, host_handles);
+			parse_host_response(s_info, hosts[i], metadata, host_handles);
 		}
 		catch (const std::exception& ex) {
 			// in case of unparsealbe response, skip
@@ -380,14 +382,14 @@ http_heartbeats_collector::validate_host_handles(const service_info_t& s_info,
 
 void
 http_heartbeats_collector::parse_host_response(const service_info_t& s_info,
-											   LT::ip_addr ip,
+											   host_info_t& host,
 											   const std::string& response,
 											   std::vector<handle_info_t>& handles)
 {
 	Json::Value root;
 	Json::Reader reader;
 	bool parsing_successful = reader.parse(response, root);
-	std::string host_ip = host_info_t::string_from_ip(ip);
+	std::string host_ip = host_info_t::string_from_ip(host.ip_);
 
 	std::string host_info_err = "server (" + host_ip + "), app " + s_info.app_name_;
 
@@ -396,7 +398,19 @@ http_heartbeats_collector::parse_host_response(const service_info_t& s_info,
 		err_msg += host_info_err + " at " + std::string(BOOST_CURRENT_FUNCTION);
 		throw std::runtime_error(err_msg);
 	}
+
+	// negotiate envelope protocol, older nodes don't advertise any
+	int host_protocol_version = root.get("lsd_protocol_version", JSON_ENVELOPE_PROTOCOL_VERSION).asInt();
+	host.protocol_version_ = std::min(host_protocol_version, PROTOCOL_VERSION);
 	
+	// node wide jobs backlog
+	const Json::Value jobs = root["jobs"];
+	host.load_ = host_load();
+
+	if (jobs.isObject()) {
+		host.load_.pending_jobs = jobs.get("pending", 0).asUInt();
+	}
+
 	const Json::Value apps = root["apps"];
 
 	if (!apps.isObject() || !apps.size()) {
@@ -438,6 +452,16 @@ http_heartbeats_collector::parse_host_response(const service_info_t& s_info,
 			continue;
         }
 
+		// app worker pool and queue state
+		Json::Value pool(app["pool"]);
+		if (pool.isObject()) {
+			host.load_.pool_active = pool.get("active", 0).asUInt();
+			host.load_.pool_total = pool.get("total", 0).asUInt();
+			host.load_.is_reported = true;
+		}
+
+		host.load_.queue = app.get("queue", 0).asUInt();
+
     	//iterate through app handles
     	Json::Value app_tasks(apps[s_info.app_name_]["tasks"]);
     	if (!app_tasks.isObject() || !app_tasks.size()) {
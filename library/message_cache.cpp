@@ -16,6 +16,7 @@
 #include <uuid/uuid.h>
 #include <map>
 #include <cstring>
+#include <ctime>
 #include <algorithm>
 
 #include <boost/bind.hpp>
@@ -31,9 +32,12 @@ namespace lsd {
 message_cache::message_cache(boost::shared_ptr<lsd::context> context,
 							 enum message_cache_type type) :
 	context_(context),
-	type_(type)
+	type_(type),
+	random_seed_((unsigned int)time(NULL) ^ (unsigned int)(size_t)this)
 {
-	new_messages_.reset(new message_queue_t);
+	// cap resends at max_resend_rate with bursts of 1/10 of a second
+	double max_rate = config()->max_resend_rate();
+	retries_.set_rate_limit(max_rate, max_rate / 10.0);
 }
 
 message_cache::~message_cache() {
@@ -63,19 +67,19 @@ boost::shared_ptr<std::deque<boost::shared_ptr<cached_message> > >
 message_cache::new_messages() {
 	logger()->log("message_cache::new_messages");
 
-	if (!new_messages_) {
-		std::string error_str = "new messages queue object is empty at ";
-		error_str += std::string(BOOST_CURRENT_FUNCTION);
-		throw error(error_str);
-	}
+	boost::mutex::scoped_lock lock(mutex_);
+	release_all_retries();
 
-	return new_messages_;
+	message_queue_ptr_t messages(new message_queue_t);
+	new_messages_.pop_all(*messages);
+
+	return messages;
 }
 
 void
 message_cache::enqueue(boost::shared_ptr<cached_message> message) {
 	boost::mutex::scoped_lock lock(mutex_);
-	new_messages_->push_back(message);
+	new_messages_.push_back(message);
 }
 
 void
@@ -88,27 +92,31 @@ message_cache::append_message_queue(message_queue_ptr_t queue) {
 	}
 
 	// append messages
-	new_messages_->insert(new_messages_->end(), queue->begin(), queue->end());
+	for (message_queue_t::iterator it = queue->begin(); it != queue->end(); ++it) {
+		new_messages_.push_back(*it);
+	}
 }
 
 boost::shared_ptr<cached_message>
 message_cache::get_new_message() {
 	boost::mutex::scoped_lock lock(mutex_);
 
+	boost::shared_ptr<cached_message> msg = new_messages_.front();
+
 	// validate message
-	if (!new_messages_->front()) {
+	if (!msg) {
 		std::string error_str = "empty message object at ";
 		error_str += std::string(BOOST_CURRENT_FUNCTION);
 		throw error(error_str);
 	}
 
-	return new_messages_->front();
+	return msg;
 }
 
 size_t
 message_cache::new_messages_count() {
 	boost::mutex::scoped_lock lock(mutex_);
-	return new_messages_->size();
+	return new_messages_.size();
 }
 
 size_t
@@ -117,160 +125,229 @@ message_cache::sent_messages_count() {
 	return sent_messages_.size();
 }
 
+void
+message_cache::get_queue_status(msg_queue_status& status) {
+	boost::mutex::scoped_lock lock(mutex_);
+	status.pending = new_messages_.size();
+	status.sent = sent_messages_.size();
+	status.retrying = retries_.size();
+}
+
+void
+message_cache::get_in_flight_counts(in_flight_counts_t& counts) {
+	boost::mutex::scoped_lock lock(mutex_);
+	counts = in_flight_counts_;
+}
+
+void
+message_cache::index_sent_message(cached_message_ptr_t msg) {
+	if (sent_messages_.insert(msg)) {
+		++in_flight_counts_[msg->destination_host()];
+	}
+}
+
+void
+message_cache::unindex_sent_message(cached_message_ptr_t msg) {
+	in_flight_counts_t::iterator cit = in_flight_counts_.find(msg->destination_host());
+
+	if (cit != in_flight_counts_.end() && --cit->second == 0) {
+		in_flight_counts_.erase(cit);
+	}
+
+	// message is not in flight anymore, its timers are stale
+	msg->mark_as_sent(false);
+}
+
 boost::shared_ptr<cached_message>
-message_cache::get_sent_message(const std::string& uuid) {
+message_cache::find_sent_message(const message_uuid& uuid) {
 	boost::mutex::scoped_lock lock(mutex_);
-	messages_index_t::const_iterator it = sent_messages_.find(uuid);
+	return sent_messages_.find(uuid);
+}
 
-	if (it == sent_messages_.end()) {
-		std::string error_str = "can not find message with uuid " + uuid;
-		error_str += " at " + std::string(BOOST_CURRENT_FUNCTION);
-		throw error(error_str);
+boost::shared_ptr<cached_message>
+message_cache::take_sent_message(const message_uuid& uuid) {
+	boost::mutex::scoped_lock lock(mutex_);
+	cached_message_ptr_t msg = sent_messages_.take(uuid);
+
+	if (!msg) {
+		return msg;
 	}
 
-	if (!it->second) {
-		throw error("empty cached message object at " + std::string(BOOST_CURRENT_FUNCTION));
+	// broadcast waits for the rest of hosts, put it back
+	if (msg->policy().send_to_all_hosts) {
+		sent_messages_.insert(msg);
+		return msg;
 	}
 
-	return it->second;
+	unindex_sent_message(msg);
+	return msg;
 }
 
 void
 message_cache::move_new_message_to_sent() {
 	boost::mutex::scoped_lock lock(mutex_);
-	boost::shared_ptr<cached_message> msg = new_messages_->front();
+	boost::shared_ptr<cached_message> msg = new_messages_.front();
 
 	if (!msg) {
 		throw error("empty cached message object at " + std::string(BOOST_CURRENT_FUNCTION));
 	}
 
-	sent_messages_.insert(std::make_pair(msg->uuid(), msg));
-	new_messages_->pop_front();
+	index_sent_message(msg);
+	new_messages_.pop_front();
 }
 
-void
-message_cache::move_sent_message_to_new(const std::string& uuid) {
+size_t
+message_cache::get_new_messages(size_t max_count, size_t max_bytes, message_queue_t& messages) {
 	boost::mutex::scoped_lock lock(mutex_);
-	messages_index_t::iterator it = sent_messages_.find(uuid);
 
-	if (it == sent_messages_.end()) {
-		return;
+	// due resends go first but take at most half of the batch,
+	// so that they never starve fresh messages
+	if (!retries_.empty()) {
+		size_t max_retries = std::max(max_count / 2, (size_t)1);
+		double now = time_value::get_current_time().as_double();
+		retries_.pop_due(now, max_retries, messages);
 	}
 
-	boost::shared_ptr<cached_message> msg = it->second;
-
-	if (!msg) {
-		throw error("empty cached message object at " + std::string(BOOST_CURRENT_FUNCTION));
+	size_t batch_bytes = 0;
+	for (size_t i = 0; i < messages.size(); ++i) {
+		batch_bytes += messages[i]->data().size();
 	}
 
-	sent_messages_.erase(it);
+	// urgent lane first, earliest deadline first within a lane
+	while (!new_messages_.empty() && messages.size() < max_count) {
+		boost::shared_ptr<cached_message> msg = new_messages_.front();
 
-	msg->mark_as_sent(false);
-	new_messages_->push_back(msg);
+		if (!msg) {
+			throw error("empty cached message object at " + std::string(BOOST_CURRENT_FUNCTION));
+		}
+
+		// always take at least one message, however big it is
+		batch_bytes += msg->data().size();
+		if (!messages.empty() && batch_bytes > max_bytes) {
+			break;
+		}
+
+		messages.push_back(msg);
+		new_messages_.pop_front();
+	}
+
+	return messages.size();
 }
 
 void
-message_cache::move_sent_message_to_new_front(const std::string& uuid) {
+message_cache::commit_sent_messages(const message_queue_t& sent, const message_queue_t& unsent) {
 	boost::mutex::scoped_lock lock(mutex_);
-	messages_index_t::iterator it = sent_messages_.find(uuid);
 
-	if (it == sent_messages_.end()) {
-		return;
+	for (size_t i = 0; i < sent.size(); ++i) {
+		index_sent_message(sent[i]);
 	}
 
-	boost::shared_ptr<cached_message> msg = it->second;
+	new_messages_.push_front(unsent);
+}
+
+void
+message_cache::move_sent_message_to_new(const message_uuid& uuid) {
+	boost::mutex::scoped_lock lock(mutex_);
+	cached_message_ptr_t msg = sent_messages_.take(uuid);
 
 	if (!msg) {
-		throw error("empty cached message object at " + std::string(BOOST_CURRENT_FUNCTION));
+		return;
 	}
 
-	sent_messages_.erase(it);
-
-	msg->mark_as_sent(false);
-	new_messages_->push_front(msg);
+	unindex_sent_message(msg);
+	new_messages_.push_back(msg);
 }
 
 void
-message_cache::remove_message_from_cache(const std::string& uuid) {
+message_cache::move_sent_message_to_new_front(const message_uuid& uuid) {
 	boost::mutex::scoped_lock lock(mutex_);
-	messages_index_t::iterator it = sent_messages_.find(uuid);
+	cached_message_ptr_t msg = sent_messages_.take(uuid);
 
-	if (it == sent_messages_.end()) {
+	if (!msg) {
 		return;
 	}
 
-	sent_messages_.erase(it);
+	unindex_sent_message(msg);
+	new_messages_.push_front(msg);
 }
 
-void
-message_cache::make_all_messages_new() {
+double
+message_cache::schedule_message_retry(cached_message_ptr_t msg) {
+	if (!msg) {
+		throw error("empty cached message object at " + std::string(BOOST_CURRENT_FUNCTION));
+	}
+
 	boost::mutex::scoped_lock lock(mutex_);
-	messages_index_t::iterator it = sent_messages_.begin();
-	for (; it != sent_messages_.end(); ++it) {
-		if (!it->second) {
-			throw error("empty cached message object at " + std::string(BOOST_CURRENT_FUNCTION));
-		}
 
-		new_messages_->push_back(it->second);
-	}
+	// destination host is still known after message left sent index
+	msg->mark_as_rejected();
 
-	sent_messages_.clear();
+	double base_delay = config()->resend_base_delay() / 1000.0;
+	double max_delay = config()->resend_max_delay() / 1000.0;
+	double delay = retry_scheduler::backoff_delay(msg->resend_attempts(), base_delay, max_delay, &random_seed_);
+
+	retries_.schedule(msg, time_value::get_current_time().as_double() + delay);
+
+	return delay;
 }
 
 bool
-message_cache::is_message_expired(cached_message_ptr_t msg) {
-	return msg->is_expired();
+message_cache::next_retry_time(double& retry_time) {
+	boost::mutex::scoped_lock lock(mutex_);
+	return retries_.next_release_time(time_value::get_current_time().as_double(), retry_time);
 }
 
 void
-message_cache::process_expired_messages(std::vector<std::pair<std::string, message_path> >& expired_uuids) {
-	boost::mutex::scoped_lock lock(mutex_);
+message_cache::release_all_retries() {
+	message_queue_t retries;
+	retries_.pop_all(retries);
+	new_messages_.push_front(retries);
+}
 
-	// remove expired from sent
-	messages_index_t::iterator it = sent_messages_.begin();
-	while (it != sent_messages_.end()) {
+void
+message_cache::remove_message_from_cache(const message_uuid& uuid) {
+	boost::mutex::scoped_lock lock(mutex_);
+	cached_message_ptr_t msg = sent_messages_.take(uuid);
 
-		// get single sent message
-		boost::shared_ptr<cached_message> msg = it->second;
-		if (!msg) {
-			throw error("empty cached message object at " + std::string(BOOST_CURRENT_FUNCTION));
-		}
+	if (msg) {
+		unindex_sent_message(msg);
+	}
+}
 
-		// remove expired messages
-		if (msg->is_expired()) {
-			expired_uuids.push_back(std::make_pair(msg->uuid(), msg->path()));
-			sent_messages_.erase(it++);
-		}
-		else {
-			++it;
-		}
+void
+message_cache::complete_message(cached_message_ptr_t msg) {
+	if (!msg) {
+		return;
 	}
 
-	if (!new_messages_) {
-		throw error("empty pending message queue object at " + std::string(BOOST_CURRENT_FUNCTION));
+	context()->messages_budget()->release(msg->take_accounted_size());
+
+	if (type_ != PERSISTANT) {
+		return;
 	}
 
-	message_queue_t::iterator it2 = new_messages_->begin();
-	while (it2 != new_messages_->end()) {
-		// get single pending message
-		boost::shared_ptr<cached_message> msg = *it2;
+	boost::shared_ptr<message_log> log = context()->messages_log();
 
-		if (!msg) {
-			throw error("empty cached message object at " + std::string(BOOST_CURRENT_FUNCTION));
-		}
+	if (log) {
+		log->remove(msg->binary_uuid());
+	}
+}
 
-		// remove expired messages
-		if (msg->is_expired()) {
-			expired_uuids.push_back(std::make_pair(msg->uuid(), msg->path()));
-		}
+void
+message_cache::make_all_messages_new() {
+	boost::mutex::scoped_lock lock(mutex_);
+
+	std::vector<cached_message_ptr_t> messages;
+	sent_messages_.take_all(messages);
 
-		++it2;
+	for (size_t i = 0; i < messages.size(); ++i) {
+		messages[i]->mark_as_sent(false);
+		new_messages_.push_back(messages[i]);
 	}
 
-	new_messages_->erase(std::remove_if(new_messages_->begin(),
-										new_messages_->end(),
-										&message_cache::is_message_expired),
-						 new_messages_->end());
+	in_flight_counts_.clear();
+
+	release_all_retries();
 }
 
 } // namespace lsd
@@ -0,0 +1,163 @@
+//
+// Copyright (C) 2011 Rim Zaidullin <creator@bash.org.ru>
+//
+// Licensed under the BSD 2-Clause License (the "License");
+// you may not use this file except in compliance with the License.
+//
+// Unless required by applicable law or agreed to in writing, software
+// distributed under the License is distributed on an "AS IS" BASIS,
+// WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+// See the License for the specific language governing permissions and
+// limitations under the License.
+//
+
+#include "details/message_index.hpp"
+
+namespace lsd {
+
+message_index::message_index() :
+	slots_(INITIAL_CAPACITY),
+	mask_(INITIAL_CAPACITY - 1),
+	size_(0)
+{
+}
+
+message_index::~message_index() {
+}
+
+size_t
+message_index::find_slot(const message_uuid& uuid) const {
+	size_t index = (size_t)uuid.hash() & mask_;
+
+	// load factor < 1, so there's always an empty slot to stop at
+	while (slots_[index].message) {
+		if (slots_[index].uuid == uuid) {
+			return index;
+		}
+
+		index = (index + 1) & mask_;
+	}
+
+	return slots_.size();
+}
+
+bool
+message_index::insert(cached_message_ptr_t message) {
+	if ((size_ + 1) * 4 > slots_.size() * 3) {
+		grow();
+	}
+
+	const message_uuid& uuid = message->binary_uuid();
+	size_t index = (size_t)uuid.hash() & mask_;
+
+	while (slots_[index].message) {
+		if (slots_[index].uuid == uuid) {
+			return false;
+		}
+
+		index = (index + 1) & mask_;
+	}
+
+	slots_[index].uuid = uuid;
+	slots_[index].message = message;
+	++size_;
+
+	return true;
+}
+
+message_index::cached_message_ptr_t
+message_index::find(const message_uuid& uuid) const {
+	size_t index = find_slot(uuid);
+
+	if (index == slots_.size()) {
+		return cached_message_ptr_t();
+	}
+
+	return slots_[index].message;
+}
+
+message_index::cached_message_ptr_t
+message_index::take(const message_uuid& uuid) {
+	size_t index = find_slot(uuid);
+
+	if (index == slots_.size()) {
+		return cached_message_ptr_t();
+	}
+
+	cached_message_ptr_t message = slots_[index].message;
+	erase_slot(index);
+
+	return message;
+}
+
+void
+message_index::erase_slot(size_t index) {
+	slots_[index].message.reset();
+	--size_;
+
+	// pull following entries of the cluster back, unless they're already
+	// at or after their home slot relative to the hole
+	size_t hole = index;
+	size_t next = (index + 1) & mask_;
+
+	while (slots_[next].message) {
+		size_t home = (size_t)slots_[next].uuid.hash() & mask_;
+
+		if (((next - home) & mask_) >= ((next - hole) & mask_)) {
+			slots_[hole].uuid = slots_[next].uuid;
+			slots_[hole].message.swap(slots_[next].message);
+			hole = next;
+		}
+
+		next = (next + 1) & mask_;
+	}
+}
+
+void
+message_index::grow() {
+	std::vector<slot> old_slots(slots_.size() * 2);
+	old_slots.swap(slots_);
+
+	mask_ = slots_.size() - 1;
+	size_ = 0;
+
+	for (size_t i = 0; i < old_slots.size(); ++i) {
+		if (!old_slots[i].message) {
+			continue;
+		}
+
+		size_t index = (size_t)old_slots[i].uuid.hash() & mask_;
+
+		while (slots_[index].message) {
+			index = (index + 1) & mask_;
+		}
+
+		slots_[index].uuid = old_slots[i].uuid;
+		slots_[index].message.swap(old_slots[i].message);
+		++size_;
+	}
+}
+
+void
+message_index::take_all(std::vector<cached_message_ptr_t>& messages) {
+	for (size_t i = 0; i < slots_.size(); ++i) {
+		if (slots_[i].message) {
+			messages.push_back(slots_[i].message);
+			slots_[i].message.reset();
+		}
+	}
+
+	size_ = 0;
+}
+
+size_t
+message_index::size() const {
+	return size_;
+}
+
+bool
+message_index::empty() const {
+	return (size_ == 0);
+}
+
+} // namespace lsd
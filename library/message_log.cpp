@@ -0,0 +1,1017 @@
+//
+// Copyright (C) 2011 Rim Zaidullin <creator@bash.org.ru>
+//
+// Licensed under the BSD 2-Clause License (the "License");
+// you may not use this file except in compliance with the License.
+//
+// Unless required by applicable law or agreed to in writing, software
+// distributed under the License is distributed on an "AS IS" BASIS,
+// WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+// See the License for the specific language governing permissions and
+// limitations under the License.
+//
+
+#include <algorithm>
+#include <cerrno>
+#include <cstdio>
+#include <cstring>
+
+#include <dirent.h>
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <sys/types.h>
+#include <unistd.h>
+
+#include <boost/bind.hpp>
+#include <boost/current_function.hpp>
+#include <boost/make_shared.hpp>
+
+#include "details/message_log.hpp"
+#include "details/error.hpp"
+#include "details/progress_timer.hpp"
+#include "details/slab_allocator.hpp"
+
+namespace lsd {
+
+namespace {
+
+template <typename T> void
+append_value(std::string& buffer, const T& value) {
+	buffer.append((const char*)&value, sizeof(value));
+}
+
+void
+append_string(std::string& buffer, const std::string& str) {
+	boost::uint16_t size = (boost::uint16_t)str.size();
+	append_value(buffer, size);
+	buffer.append(str.data(), size);
+}
+
+template <typename T> bool
+read_value(const char*& pos, const char* end, T& value) {
+	if ((size_t)(end - pos) < sizeof(value)) {
+		return false;
+	}
+
+	memcpy(&value, pos, sizeof(value));
+	pos += sizeof(value);
+	return true;
+}
+
+bool
+read_string(const char*& pos, const char* end, std::string& str) {
+	boost::uint16_t size = 0;
+
+	if (!read_value(pos, end, size) || (size_t)(end - pos) < size) {
+		return false;
+	}
+
+	str.assign(pos, size);
+	pos += size;
+	return true;
+}
+
+void
+write_all(int fd, const char* data, size_t size) {
+	while (size > 0) {
+		ssize_t written = ::write(fd, data, size);
+
+		if (written < 0) {
+			if (errno == EINTR) {
+				continue;
+			}
+
+			throw error("message log write failed: " + std::string(strerror(errno)) + " at " + std::string(BOOST_CURRENT_FUNCTION));
+		}
+
+		data += written;
+		size -= written;
+	}
+}
+
+void
+make_directories(const std::string& path) {
+	for (size_t pos = 1; pos <= path.size(); ++pos) {
+		if (pos != path.size() && path[pos] != '/') {
+			continue;
+		}
+
+		std::string dir = path.substr(0, pos);
+
+		if (mkdir(dir.c_str(), 0755) != 0 && errno != EEXIST) {
+			throw error("can't create message log directory " + dir + ": " + std::string(strerror(errno)) + " at " + std::string(BOOST_CURRENT_FUNCTION));
+		}
+	}
+}
+
+// read-only mapping of a whole segment file
+class mapped_segment : private boost::noncopyable {
+public:
+	explicit mapped_segment(const std::string& path) : fd_(-1), data_(NULL), size_(0) {
+		fd_ = ::open(path.c_str(), O_RDONLY);
+
+		if (fd_ < 0) {
+			throw error("can't open message log segment " + path + ": " + std::string(strerror(errno)) + " at " + std::string(BOOST_CURRENT_FUNCTION));
+		}
+
+		struct stat st;
+		if (fstat(fd_, &st) != 0) {
+			::close(fd_);
+			throw error("can't stat message log segment " + path + " at " + std::string(BOOST_CURRENT_FUNCTION));
+		}
+
+		size_ = (size_t)st.st_size;
+
+		if (size_ == 0) {
+			return;
+		}
+
+		void* data = mmap(NULL, size_, PROT_READ, MAP_PRIVATE, fd_, 0);
+
+		if (data == MAP_FAILED) {
+			::close(fd_);
+			throw error("can't map message log segment " + path + ": " + std::string(strerror(errno)) + " at " + std::string(BOOST_CURRENT_FUNCTION));
+		}
+
+		data_ = (const char*)data;
+		madvise(data, size_, MADV_SEQUENTIAL);
+	}
+
+	~mapped_segment() {
+		if (data_) {
+			munmap((void*)data_, size_);
+		}
+
+		::close(fd_);
+	}
+
+	const char* data() const { return data_; }
+	size_t size() const { return size_; }
+
+private:
+	int fd_;
+	const char* data_;
+	size_t size_;
+};
+
+// recovered record to be read back, mapping keeps its segment readable
+struct record_location {
+	message_uuid uuid;
+	boost::shared_ptr<mapped_segment> mapping;
+	boost::uint64_t offset;
+};
+
+bool
+sequence_less(const std::pair<boost::uint64_t, message_uuid>& lhs, const std::pair<boost::uint64_t, message_uuid>& rhs) {
+	return lhs.first < rhs.first;
+}
+
+} // anonymous namespace
+
+message_log::message_log(const std::string& path,
+						 boost::uint64_t max_size,
+						 double sync_interval,
+						 size_t sync_bytes,
+						 boost::shared_ptr<base_logger> logger,
+						 boost::uint64_t segment_size) :
+	path_(path),
+	max_size_(max_size),
+	segment_size_(segment_size),
+	logger_(logger),
+	disk_size_(0),
+	live_bytes_(0),
+	active_fd_(-1),
+	active_id_(0),
+	next_sequence_(0),
+	sync_interval_(std::max(sync_interval, 0.0)),
+	sync_bytes_(sync_bytes),
+	written_(0),
+	synced_(0),
+	unsynced_records_(0),
+	unsynced_bytes_(0),
+	waiters_(0),
+	last_commit_time_(boost::get_system_time()),
+	stopping_(false)
+{
+	if (path_.empty()) {
+		throw error("message log path is empty, check persistent_storage/eblob_path in config at " + std::string(BOOST_CURRENT_FUNCTION));
+	}
+
+	open();
+	committer_thread_ = boost::thread(&message_log::committer, this);
+}
+
+message_log::~message_log() {
+	{
+		boost::mutex::scoped_lock lock(mutex_);
+		stopping_ = true;
+		commit_condition_.notify_all();
+		committed_condition_.notify_all();
+	}
+
+	committer_thread_.join();
+
+	if (active_fd_ >= 0) {
+		sync_all_segments();
+		::close(active_fd_);
+	}
+}
+
+std::string
+message_log::segment_path(boost::uint32_t id) const {
+	char name[32];
+	snprintf(name, sizeof(name), "segment-%08u.log", id);
+	return path_ + "/" + name;
+}
+
+void
+message_log::open() {
+	make_directories(path_);
+
+	// find existing segments
+	std::vector<boost::uint32_t> ids;
+
+	DIR* dir = opendir(path_.c_str());
+	if (!dir) {
+		throw error("can't open message log directory " + path_ + " at " + std::string(BOOST_CURRENT_FUNCTION));
+	}
+
+	while (struct dirent* entry = readdir(dir)) {
+		unsigned int id = 0;
+		char tail = 0;
+
+		if (sscanf(entry->d_name, "segment-%08u.lo%c", &id, &tail) == 2 && tail == 'g') {
+			ids.push_back(id);
+		}
+	}
+
+	closedir(dir);
+	std::sort(ids.begin(), ids.end());
+
+	// replay records, tombstones always come after their messages.
+	// parsing is the expensive part, it runs on all cores a batch of
+	// segments at a time, merging has to go in order and is cheap.
+	progress_timer timer;
+
+	size_t threads_count = std::max(boost::thread::hardware_concurrency(), 1u);
+	boost::uint64_t scanned_bytes = 0;
+
+	for (size_t first = 0; first < ids.size(); first += threads_count) {
+		std::vector<parsed_segment> batch(std::min(threads_count, ids.size() - first));
+
+		for (size_t i = 0; i < batch.size(); ++i) {
+			batch[i].path = segment_path(ids[first + i]);
+		}
+
+		volatile size_t next_index = 0;
+
+		if (batch.size() == 1) {
+			parse_segments(&batch, &next_index);
+		}
+		else {
+			boost::thread_group workers;
+
+			for (size_t i = 0; i < batch.size(); ++i) {
+				workers.create_thread(boost::bind(&message_log::parse_segments, &batch, &next_index));
+			}
+
+			workers.join_all();
+		}
+
+		for (size_t i = 0; i < batch.size(); ++i) {
+			if (!batch[i].error.empty()) {
+				throw error(batch[i].error);
+			}
+
+			boost::uint32_t id = ids[first + i];
+			segment& seg = segments_[id];
+			seg.path = batch[i].path;
+
+			merge_segment(id, seg, batch[i], first + i + 1 == ids.size());
+			disk_size_ += seg.size;
+			scanned_bytes += batch[i].size;
+		}
+	}
+
+	// compaction moves records forward, restore append order
+	std::vector<std::pair<boost::uint64_t, message_uuid> > ordered;
+	ordered.reserve(live_records_.size());
+
+	for (live_records_t::iterator it = live_records_.begin(); it != live_records_.end(); ++it) {
+		ordered.push_back(std::make_pair(it->second.sequence, it->first));
+	}
+
+	std::sort(ordered.begin(), ordered.end(), sequence_less);
+
+	for (size_t i = 0; i < ordered.size(); ++i) {
+		recovered_uuids_.push_back(ordered[i].second);
+	}
+
+	if (!ids.empty()) {
+		double elapsed = std::max(timer.elapsed().as_double(), 0.001);
+
+		logger_->log("message log %s: found %d live messages (%.1f MB) in %d segments (%.1f MB) in %.3f sec with %d threads, %.1f MB/sec",
+					 path_.c_str(), (int)recovered_uuids_.size(), live_bytes_ / 1048576.0, (int)ids.size(), scanned_bytes / 1048576.0,
+					 elapsed, (int)std::min(threads_count, ids.size()), scanned_bytes / 1048576.0 / elapsed);
+	}
+
+	// keep appending to the last segment if there's room and no garbage in it
+	if (!ids.empty() && segments_[ids.back()].size < segment_size_ &&
+		segments_[ids.back()].size == segments_[ids.back()].valid_size)
+	{
+		open_active_segment(ids.back());
+	}
+	else {
+		open_active_segment(ids.empty() ? 0 : ids.back() + 1);
+	}
+
+	delete_dead_segments();
+}
+
+void
+message_log::parse_segments(std::vector<parsed_segment>* batch, volatile size_t* next_index) {
+	while (true) {
+		size_t index = __sync_fetch_and_add(next_index, 1);
+
+		if (index >= batch->size()) {
+			return;
+		}
+
+		parsed_segment& parsed = (*batch)[index];
+
+		try {
+			parse_segment(parsed);
+		}
+		catch (const std::exception& ex) {
+			parsed.error = ex.what();
+		}
+	}
+}
+
+void
+message_log::parse_segment(parsed_segment& parsed) {
+	mapped_segment mapped(parsed.path);
+
+	const char* data = mapped.data();
+	size_t size = mapped.size();
+	size_t offset = 0;
+
+	while (size - offset >= sizeof(record_header)) {
+		record_header header;
+		memcpy(&header, data + offset, sizeof(header));
+
+		const char* body = data + offset + sizeof(header);
+		size_t record_size = sizeof(header) + header.body_size;
+
+		if (header.magic != RECORD_MAGIC || header.body_size > size - offset - sizeof(header) ||
+			header.checksum != checksum(header, body))
+		{
+			break;
+		}
+
+		if (header.type != RECORD_MESSAGE && header.type != RECORD_TOMBSTONE) {
+			break;
+		}
+
+		// payloads stay on disk, they are read back when requeued
+		parsed_record record;
+		record.type = header.type;
+		record.sequence = header.sequence;
+		record.offset = offset;
+		record.size = record_size;
+		memcpy(record.uuid.bytes, header.uuid, message_uuid::SIZE);
+
+		parsed.records.push_back(record);
+		offset += record_size;
+	}
+
+	parsed.size = size;
+	parsed.valid_size = offset;
+}
+
+void
+message_log::merge_segment(boost::uint32_t id, segment& seg, parsed_segment& parsed, bool is_last) {
+	for (size_t i = 0; i < parsed.records.size(); ++i) {
+		parsed_record& record = parsed.records[i];
+		next_sequence_ = std::max(next_sequence_, record.sequence + 1);
+
+		if (record.type == RECORD_MESSAGE) {
+			// same message again means it was moved forward by compaction
+			live_records_t::iterator it = live_records_.find(record.uuid);
+
+			if (it != live_records_.end()) {
+				segment& prev = segments_[it->second.segment_id];
+				--prev.live_count;
+				prev.live_bytes -= it->second.size;
+				live_bytes_ -= it->second.size;
+			}
+
+			live_record& live = live_records_[record.uuid];
+			live.segment_id = id;
+			live.offset = record.offset;
+			live.size = record.size;
+			live.sequence = record.sequence;
+
+			++seg.live_count;
+			seg.live_bytes += record.size;
+			live_bytes_ += record.size;
+		}
+		else {
+			live_records_t::iterator it = live_records_.find(record.uuid);
+
+			if (it != live_records_.end()) {
+				segment& owner = segments_[it->second.segment_id];
+				--owner.live_count;
+				owner.live_bytes -= it->second.size;
+				live_bytes_ -= it->second.size;
+				live_records_.erase(it);
+			}
+		}
+	}
+
+	std::vector<parsed_record> empty;
+	parsed.records.swap(empty);
+
+	seg.size = parsed.size;
+	seg.valid_size = parsed.valid_size;
+
+	if (parsed.valid_size == parsed.size) {
+		return;
+	}
+
+	// torn write at the end of the log, cut it off
+	if (is_last) {
+		logger_->log(PLOG_ERROR, "message log segment %s: dropped %d bytes of incomplete record",
+					 seg.path.c_str(), (int)(parsed.size - parsed.valid_size));
+
+		if (truncate(seg.path.c_str(), parsed.valid_size) == 0) {
+			seg.size = parsed.valid_size;
+		}
+
+		return;
+	}
+
+	logger_->log(PLOG_ERROR, "message log segment %s: corrupted record at offset %d, rest of segment skipped",
+				 seg.path.c_str(), (int)parsed.valid_size);
+}
+
+void
+message_log::open_active_segment(boost::uint32_t id) {
+	segment& seg = segments_[id];
+	seg.path = segment_path(id);
+
+	active_fd_ = ::open(seg.path.c_str(), O_WRONLY | O_CREAT | O_APPEND, 0644);
+
+	if (active_fd_ < 0) {
+		throw error("can't open message log segment " + seg.path + ": " + std::string(strerror(errno)) + " at " + std::string(BOOST_CURRENT_FUNCTION));
+	}
+
+	active_id_ = id;
+}
+
+void
+message_log::sync_all_segments() {
+	for (size_t i = 0; i < rolled_fds_.size(); ++i) {
+		fdatasync(rolled_fds_[i]);
+		::close(rolled_fds_[i]);
+	}
+
+	rolled_fds_.clear();
+	fdatasync(active_fd_);
+
+	synced_ = written_;
+	unsynced_records_ = 0;
+	unsynced_bytes_ = 0;
+	committed_condition_.notify_all();
+
+	unlink_compacted_segments();
+}
+
+void
+message_log::unlink_compacted_segments() {
+	std::vector<std::pair<boost::uint64_t, std::string> >::iterator it = compacted_segments_.begin();
+
+	while (it != compacted_segments_.end()) {
+		if (it->first > synced_) {
+			++it;
+			continue;
+		}
+
+		unlink(it->second.c_str());
+		it = compacted_segments_.erase(it);
+	}
+}
+
+void
+message_log::roll_active_segment() {
+	// whoever crosses segment boundary doesn't pay for the sync,
+	// committer takes care of the old fd with the next commit
+	if (unsynced_records_ > 0) {
+		rolled_fds_.push_back(active_fd_);
+		commit_condition_.notify_one();
+	}
+	else {
+		::close(active_fd_);
+	}
+
+	active_fd_ = -1;
+	open_active_segment(active_id_ + 1);
+}
+
+boost::uint64_t
+message_log::write_record(enum record_type type, const message_uuid& uuid, boost::uint64_t sequence, const std::string& body) {
+	record_header header;
+	header.magic = RECORD_MAGIC;
+	header.type = type;
+	header.body_size = (boost::uint32_t)body.size();
+	header.sequence = sequence;
+	memcpy(header.uuid, uuid.bytes, message_uuid::SIZE);
+	header.checksum = checksum(header, body.data());
+
+	size_t record_size = sizeof(header) + body.size();
+
+	if (segments_[active_id_].size > 0 && segments_[active_id_].size + record_size > segment_size_) {
+		roll_active_segment();
+	}
+
+	boost::uint64_t offset = segments_[active_id_].size;
+
+	// header and body go with one write, so a crash can only tear the tail
+	std::string record;
+	record.reserve(record_size);
+	record.append((const char*)&header, sizeof(header));
+	record.append(body);
+
+	write_all(active_fd_, record.data(), record.size());
+
+	segments_[active_id_].size += record_size;
+	segments_[active_id_].valid_size += record_size;
+	disk_size_ += record_size;
+
+	++written_;
+	++unsynced_records_;
+	unsynced_bytes_ += record_size;
+
+	// committer sleeps without timeout while there's nothing to sync
+	if (unsynced_records_ == 1 || (sync_bytes_ > 0 && unsynced_bytes_ >= sync_bytes_)) {
+		commit_condition_.notify_one();
+	}
+
+	return offset;
+}
+
+boost::uint64_t
+message_log::append(const cached_message& message) {
+	std::string body;
+	serialize_message(message, body);
+
+	boost::mutex::scoped_lock lock(mutex_);
+
+	boost::uint64_t record_size = sizeof(record_header) + body.size();
+	make_room(record_size);
+
+	const message_uuid& uuid = message.binary_uuid();
+	boost::uint64_t sequence = next_sequence_++;
+	boost::uint64_t offset = write_record(RECORD_MESSAGE, uuid, sequence, body);
+
+	live_record& live = live_records_[uuid];
+	live.segment_id = active_id_;
+	live.offset = offset;
+	live.size = record_size;
+	live.sequence = sequence;
+
+	segment& seg = segments_[active_id_];
+	++seg.live_count;
+	seg.live_bytes += record_size;
+	live_bytes_ += record_size;
+
+	return written_;
+}
+
+void
+message_log::wait_committed(boost::uint64_t ticket) {
+	boost::mutex::scoped_lock lock(mutex_);
+
+	if (synced_ >= ticket) {
+		return;
+	}
+
+	// waiters don't wait for the interval, they get a commit right away
+	// together with whoever else is waiting
+	++waiters_;
+	commit_condition_.notify_one();
+
+	while (synced_ < ticket && !stopping_) {
+		committed_condition_.wait(lock);
+	}
+
+	--waiters_;
+}
+
+void
+message_log::set_commit_callback(const commit_callback_t& callback) {
+	boost::mutex::scoped_lock lock(mutex_);
+	commit_callback_ = callback;
+}
+
+commit_stats
+message_log::commit_statistics() {
+	boost::mutex::scoped_lock lock(mutex_);
+	return commit_stats_;
+}
+
+void
+message_log::committer() {
+	boost::mutex::scoped_lock lock(mutex_);
+
+	while (!stopping_) {
+		if (is_commit_due()) {
+			commit(lock);
+			continue;
+		}
+
+		if (unsynced_records_ == 0) {
+			commit_condition_.wait(lock);
+		}
+		else {
+			boost::system_time deadline = last_commit_time_ + boost::posix_time::microseconds((boost::int64_t)(sync_interval_ * 1000000));
+			commit_condition_.timed_wait(lock, deadline);
+		}
+	}
+}
+
+bool
+message_log::is_commit_due() const {
+	if (unsynced_records_ == 0) {
+		return false;
+	}
+
+	if (waiters_ > 0 || (sync_bytes_ > 0 && unsynced_bytes_ >= sync_bytes_)) {
+		return true;
+	}
+
+	boost::posix_time::time_duration since_commit = boost::get_system_time() - last_commit_time_;
+	return (since_commit.total_microseconds() >= (boost::int64_t)(sync_interval_ * 1000000));
+}
+
+void
+message_log::commit(boost::mutex::scoped_lock& lock) {
+	// producers keep writing while we sync, the fd is duplicated so that
+	// a segment roll can't close it under us. segments rolled since the
+	// previous commit are handed over and closed here.
+	int fd = dup(active_fd_);
+
+	if (fd < 0) {
+		sync_all_segments();
+		return;
+	}
+
+	std::vector<int> rolled_fds;
+	rolled_fds.swap(rolled_fds_);
+
+	boost::uint64_t ticket = written_;
+	size_t records = unsynced_records_;
+	boost::uint64_t bytes = unsynced_bytes_;
+
+	unsynced_records_ = 0;
+	unsynced_bytes_ = 0;
+
+	lock.unlock();
+
+	progress_timer timer;
+
+	for (size_t i = 0; i < rolled_fds.size(); ++i) {
+		fdatasync(rolled_fds[i]);
+		::close(rolled_fds[i]);
+	}
+
+	fdatasync(fd);
+	::close(fd);
+
+	double elapsed = timer.elapsed().as_double();
+
+	lock.lock();
+
+	synced_ = std::max(synced_, ticket);
+	last_commit_time_ = boost::get_system_time();
+	unlink_compacted_segments();
+
+	++commit_stats_.commits;
+	commit_stats_.committed_records += records;
+	commit_stats_.committed_bytes += bytes;
+	commit_stats_.latency.add((boost::uint64_t)(elapsed * 1000000));
+	commit_stats_.batch_size.add(records);
+
+	committed_condition_.notify_all();
+
+	if (commit_callback_) {
+		commit_stats stats = commit_stats_;
+		commit_callback_t callback = commit_callback_;
+
+		lock.unlock();
+		callback(stats);
+		lock.lock();
+	}
+}
+
+void
+message_log::remove(const message_uuid& uuid) {
+	boost::mutex::scoped_lock lock(mutex_);
+
+	live_records_t::iterator it = live_records_.find(uuid);
+	if (it == live_records_.end()) {
+		return;
+	}
+
+	segment& owner = segments_[it->second.segment_id];
+	--owner.live_count;
+	owner.live_bytes -= it->second.size;
+	live_bytes_ -= it->second.size;
+	live_records_.erase(it);
+
+	// tombstones are tiny and let dead segments go, they ignore max size
+	write_record(RECORD_TOMBSTONE, uuid, next_sequence_++, std::string());
+	delete_dead_segments();
+}
+
+void
+message_log::make_room(boost::uint64_t record_size) {
+	if (max_size_ == 0 || disk_size_ + record_size <= max_size_) {
+		return;
+	}
+
+	// live messages alone don't fit, compaction won't help
+	if (live_bytes_ + record_size > max_size_) {
+		throw error(LSD_OVER_HDD_CAPACITY_ERROR, "can not store message, message log is over eblob_max_gb capacity.");
+	}
+
+	// every pass drops one old segment, bounded in case compaction can't catch up
+	size_t passes = segments_.size() * 2 + 2;
+
+	while (disk_size_ + record_size > max_size_ && passes-- > 0) {
+		if (segments_.begin()->first == active_id_) {
+			roll_active_segment();
+		}
+
+		compact_oldest_segment();
+	}
+
+	if (disk_size_ + record_size > max_size_) {
+		throw error(LSD_OVER_HDD_CAPACITY_ERROR, "can not store message, message log is over eblob_max_gb capacity.");
+	}
+}
+
+void
+message_log::compact_oldest_segment() {
+	segments_t::iterator oldest = segments_.begin();
+	boost::uint32_t id = oldest->first;
+
+	if (oldest->second.live_count > 0) {
+		mapped_segment mapped(oldest->second.path);
+
+		const char* data = mapped.data();
+		size_t size = std::min((size_t)oldest->second.valid_size, mapped.size());
+		size_t offset = 0;
+
+		// only the valid part was scanned, still don't trust the file blindly
+		while (size - offset >= sizeof(record_header)) {
+			record_header header;
+			memcpy(&header, data + offset, sizeof(header));
+
+			if (header.magic != RECORD_MAGIC || header.body_size > size - offset - sizeof(header)) {
+				logger_->log(PLOG_ERROR, "message log segment %s: bad record at offset %d during compaction, rest of segment skipped",
+							 oldest->second.path.c_str(), (int)offset);
+				break;
+			}
+
+			size_t record_size = sizeof(header) + header.body_size;
+			message_uuid uuid;
+			memcpy(uuid.bytes, header.uuid, message_uuid::SIZE);
+
+			live_records_t::iterator it = live_records_.find(uuid);
+
+			if (header.type == RECORD_MESSAGE && it != live_records_.end() && it->second.segment_id == id) {
+				boost::uint64_t new_offset = write_record(RECORD_MESSAGE, uuid, header.sequence, std::string(data + offset + sizeof(header), header.body_size));
+
+				it->second.segment_id = active_id_;
+				it->second.offset = new_offset;
+				segment& active = segments_[active_id_];
+				++active.live_count;
+				active.live_bytes += record_size;
+			}
+
+			offset += record_size;
+		}
+	}
+
+	disk_size_ -= oldest->second.size;
+
+	// moved records must be durable before their old copies go away,
+	// the file is left to the committer until then and is no longer counted
+	if (synced_ < written_) {
+		compacted_segments_.push_back(std::make_pair(written_, oldest->second.path));
+		commit_condition_.notify_one();
+	}
+	else {
+		unlink(oldest->second.path.c_str());
+	}
+
+	segments_.erase(oldest);
+}
+
+void
+message_log::delete_dead_segments() {
+	// oldest first only, tombstones in newer segments must outlive their messages
+	while (!segments_.empty() && segments_.begin()->first != active_id_ && segments_.begin()->second.live_count == 0) {
+		segments_t::iterator oldest = segments_.begin();
+		disk_size_ -= oldest->second.size;
+		unlink(oldest->second.path.c_str());
+		segments_.erase(oldest);
+	}
+}
+
+size_t
+message_log::read_recovered_messages(size_t max_bytes, std::vector<cached_message_ptr_t>& messages) {
+	std::vector<record_location> locations;
+
+	// under lock records are only located, segments they are in get
+	// mapped so that compaction can't take them away. reading and
+	// copying payloads goes without lock.
+	{
+		boost::mutex::scoped_lock lock(mutex_);
+
+		std::map<boost::uint32_t, boost::shared_ptr<mapped_segment> > mappings;
+		size_t bytes = 0;
+
+		while (!recovered_uuids_.empty() && (bytes < max_bytes || locations.empty())) {
+			message_uuid uuid = recovered_uuids_.front();
+			recovered_uuids_.pop_front();
+
+			live_records_t::iterator it = live_records_.find(uuid);
+
+			if (it == live_records_.end()) {
+				continue;
+			}
+
+			boost::shared_ptr<mapped_segment>& mapping = mappings[it->second.segment_id];
+
+			if (!mapping) {
+				mapping.reset(new mapped_segment(segments_[it->second.segment_id].path));
+			}
+
+			record_location location;
+			location.uuid = uuid;
+			location.mapping = mapping;
+			location.offset = it->second.offset;
+			locations.push_back(location);
+
+			bytes += it->second.size;
+		}
+
+		// let go of memory taken by the index of a big backlog
+		if (recovered_uuids_.empty()) {
+			std::deque<message_uuid> empty;
+			recovered_uuids_.swap(empty);
+		}
+	}
+
+	size_t count = 0;
+
+	for (size_t i = 0; i < locations.size(); ++i) {
+		const record_location& location = locations[i];
+		const char* data = location.mapping->data();
+		size_t size = location.mapping->size();
+
+		cached_message_ptr_t message;
+		record_header header;
+
+		if (location.offset + sizeof(header) <= size) {
+			memcpy(&header, data + location.offset, sizeof(header));
+			const char* body = data + location.offset + sizeof(header);
+
+			if (header.magic == RECORD_MAGIC && header.type == RECORD_MESSAGE &&
+				header.body_size <= size - location.offset - sizeof(header) &&
+				memcmp(header.uuid, location.uuid.bytes, message_uuid::SIZE) == 0)
+			{
+				message = deserialize_message(location.uuid, body, header.body_size);
+			}
+		}
+
+		// can't be sent anyway, don't let it come back on next start
+		if (!message) {
+			logger_->log(PLOG_ERROR, "message log %s: can't read recovered message %s, dropped",
+						 path_.c_str(), location.uuid.as_string().c_str());
+			remove(location.uuid);
+			continue;
+		}
+
+		messages.push_back(message);
+		++count;
+	}
+
+	return count;
+}
+
+size_t
+message_log::recovered_messages_count() {
+	boost::mutex::scoped_lock lock(mutex_);
+	return recovered_uuids_.size();
+}
+
+boost::uint64_t
+message_log::disk_size() {
+	boost::mutex::scoped_lock lock(mutex_);
+	return disk_size_;
+}
+
+size_t
+message_log::segments_count() {
+	boost::mutex::scoped_lock lock(mutex_);
+	return segments_.size();
+}
+
+size_t
+message_log::live_messages_count() {
+	boost::mutex::scoped_lock lock(mutex_);
+	return live_records_.size();
+}
+
+void
+message_log::serialize_message(const cached_message& message, std::string& body) {
+	const message_path& path = message.path();
+	const message_policy& policy = message.policy();
+	const data_container& data = message.data();
+
+	body.reserve(64 + path.service_name.size() + path.handle_name.size() + data.size());
+
+	append_string(body, path.service_name);
+	append_string(body, path.handle_name);
+
+	append_value(body, (boost::uint8_t)policy.send_to_all_hosts);
+	append_value(body, (boost::uint8_t)policy.urgent);
+	append_value(body, (boost::uint8_t)policy.mailboxed);
+	append_value(body, policy.timeout);
+	append_value(body, policy.deadline);
+	append_value(body, (boost::int32_t)policy.max_timeout_retries);
+
+	append_value(body, (boost::uint32_t)data.size());
+	body.append((const char*)data.data(), data.size());
+}
+
+message_log::cached_message_ptr_t
+message_log::deserialize_message(const message_uuid& uuid, const char* body, size_t size) {
+	const char* pos = body;
+	const char* end = body + size;
+
+	message_path path;
+	message_policy policy;
+	boost::uint8_t send_to_all_hosts = 0;
+	boost::uint8_t urgent = 0;
+	boost::uint8_t mailboxed = 0;
+	boost::int32_t max_timeout_retries = 0;
+	boost::uint32_t data_size = 0;
+
+	if (!read_string(pos, end, path.service_name) ||
+		!read_string(pos, end, path.handle_name) ||
+		!read_value(pos, end, send_to_all_hosts) ||
+		!read_value(pos, end, urgent) ||
+		!read_value(pos, end, mailboxed) ||
+		!read_value(pos, end, policy.timeout) ||
+		!read_value(pos, end, policy.deadline) ||
+		!read_value(pos, end, max_timeout_retries) ||
+		!read_value(pos, end, data_size) ||
+		(size_t)(end - pos) != data_size)
+	{
+		return cached_message_ptr_t();
+	}
+
+	policy.send_to_all_hosts = (send_to_all_hosts != 0);
+	policy.urgent = (urgent != 0);
+	policy.mailboxed = (mailboxed != 0);
+	policy.max_timeout_retries = max_timeout_retries;
+
+	return boost::allocate_shared<cached_message>(slab_stl_allocator<cached_message>(), uuid, path, policy, pos, data_size);
+}
+
+boost::uint32_t
+message_log::checksum(const record_header& header, const char* body) {
+	// fnv-1a over header (without checksum itself) and body, catches torn and garbage tails
+	record_header copy = header;
+	copy.checksum = 0;
+
+	const unsigned char* bytes = (const unsigned char*)&copy;
+	boost::uint32_t hash = 2166136261U;
+
+	for (size_t i = 0; i < sizeof(copy); ++i) {
+		hash = (hash ^ bytes[i]) * 16777619U;
+	}
+
+	for (size_t i = 0; i < header.body_size; ++i) {
+		hash = (hash ^ (unsigned char)body[i]) * 16777619U;
+	}
+
+	return hash;
+}
+
+} // namespace lsd
@@ -0,0 +1,185 @@
+//
+// Copyright (C) 2011 Rim Zaidullin <creator@bash.org.ru>
+//
+// Licensed under the BSD 2-Clause License (the "License");
+// you may not use this file except in compliance with the License.
+//
+// Unless required by applicable law or agreed to in writing, software
+// distributed under the License is distributed on an "AS IS" BASIS,
+// WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+// See the License for the specific language governing permissions and
+// limitations under the License.
+//
+
+#include <algorithm>
+
+#include <boost/current_function.hpp>
+
+#include "details/error.hpp"
+#include "details/message_scheduler.hpp"
+#include "details/time_value.hpp"
+
+namespace lsd {
+
+// sequences put back to front count down from the middle of the range
+static const boost::uint64_t SEQUENCE_MIDDLE = 1ULL << 63;
+
+message_scheduler::message_scheduler() :
+	back_sequence_(SEQUENCE_MIDDLE),
+	front_sequence_(SEQUENCE_MIDDLE)
+{
+}
+
+message_scheduler::~message_scheduler() {
+}
+
+message_scheduler::lane&
+message_scheduler::lane_for(const cached_message_ptr_t& message) {
+	if (!message) {
+		throw error("empty cached message object at " + std::string(BOOST_CURRENT_FUNCTION));
+	}
+
+	return message->policy().urgent ? urgent_ : normal_;
+}
+
+const message_scheduler::lane&
+message_scheduler::front_lane() const {
+	return urgent_.empty() ? normal_ : urgent_;
+}
+
+message_scheduler::lane&
+message_scheduler::front_lane() {
+	return urgent_.empty() ? normal_ : urgent_;
+}
+
+void
+message_scheduler::push_deadline(lane& l, cached_message_ptr_t message, boost::uint64_t sequence) {
+	entry e;
+	e.deadline = message->policy().deadline;
+	e.sequence = sequence;
+	e.message = message;
+
+	l.deadlines.push_back(e);
+	std::push_heap(l.deadlines.begin(), l.deadlines.end());
+}
+
+message_scheduler::entry
+message_scheduler::fifo_entry(cached_message_ptr_t message, double now) {
+	double timeout = message->policy().timeout;
+
+	entry e;
+	e.deadline = now + ((timeout > 0.0) ? timeout : (double)MESSAGE_TIMEOUT);
+	e.sequence = 0;
+	e.message = message;
+
+	return e;
+}
+
+bool
+message_scheduler::is_fifo_first(const lane& l) {
+	if (l.deadlines.empty()) {
+		return true;
+	}
+
+	if (l.fifo.empty()) {
+		return false;
+	}
+
+	// explicit deadline wins a tie
+	return (l.fifo.front().deadline < l.deadlines.front().deadline);
+}
+
+void
+message_scheduler::push_back(cached_message_ptr_t message) {
+	lane& l = lane_for(message);
+
+	if (message->policy().deadline > 0.0) {
+		push_deadline(l, message, back_sequence_++);
+	}
+	else {
+		l.fifo.push_back(fifo_entry(message, time_value::get_current_time().as_double()));
+	}
+}
+
+void
+message_scheduler::push_front(cached_message_ptr_t message) {
+	lane& l = lane_for(message);
+
+	if (message->policy().deadline > 0.0) {
+		push_deadline(l, message, --front_sequence_);
+		return;
+	}
+
+	// enqueue time of message put back is unknown, don't let it
+	// push the implicit deadline of the fifo further away
+	entry e = fifo_entry(message, time_value::get_current_time().as_double());
+
+	if (!l.fifo.empty() && l.fifo.front().deadline < e.deadline) {
+		e.deadline = l.fifo.front().deadline;
+	}
+
+	l.fifo.push_front(e);
+}
+
+void
+message_scheduler::push_front(const message_queue_t& messages) {
+	for (message_queue_t::const_reverse_iterator it = messages.rbegin(); it != messages.rend(); ++it) {
+		push_front(*it);
+	}
+}
+
+message_scheduler::cached_message_ptr_t
+message_scheduler::front() const {
+	const lane& l = front_lane();
+
+	if (l.empty()) {
+		return cached_message_ptr_t();
+	}
+
+	return is_fifo_first(l) ? l.fifo.front().message : l.deadlines.front().message;
+}
+
+void
+message_scheduler::pop_front() {
+	lane& l = front_lane();
+
+	if (l.empty()) {
+		return;
+	}
+
+	if (is_fifo_first(l)) {
+		l.fifo.pop_front();
+	}
+	else {
+		std::pop_heap(l.deadlines.begin(), l.deadlines.end());
+		l.deadlines.pop_back();
+	}
+}
+
+void
+message_scheduler::pop_all(message_queue_t& messages) {
+	while (!empty()) {
+		messages.push_back(front());
+		pop_front();
+	}
+
+	back_sequence_ = SEQUENCE_MIDDLE;
+	front_sequence_ = SEQUENCE_MIDDLE;
+}
+
+size_t
+message_scheduler::size() const {
+	return urgent_.size() + normal_.size();
+}
+
+size_t
+message_scheduler::urgent_size() const {
+	return urgent_.size();
+}
+
+bool
+message_scheduler::empty() const {
+	return urgent_.empty() && normal_.empty();
+}
+
+} // namespace lsd
@@ -0,0 +1,286 @@
+//
+// Copyright (C) 2011 Rim Zaidullin <creator@bash.org.ru>
+//
+// Licensed under the BSD 2-Clause License (the "License");
+// you may not use this file except in compliance with the License.
+//
+// Unless required by applicable law or agreed to in writing, software
+// distributed under the License is distributed on an "AS IS" BASIS,
+// WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+// See the License for the specific language governing permissions and
+// limitations under the License.
+//
+
+#include <pthread.h>
+#include <uuid/uuid.h>
+
+#ifdef __SSE2__
+#include <emmintrin.h>
+#endif
+
+#include "details/message_uuid.hpp"
+
+namespace lsd {
+
+namespace {
+
+// hex digit groups of canonical form
+const size_t GROUPS_COUNT = 5;
+const size_t group_offsets[GROUPS_COUNT] = { 0, 9, 14, 19, 24 };
+const size_t group_sizes[GROUPS_COUNT] = { 8, 4, 4, 4, 12 };
+
+const size_t DIGITS_COUNT = message_uuid::SIZE * 2;
+
+// per-thread generator: uuid halves are a bijective mix of the thread
+// counter under two random keys, so there is no locking or syscall per
+// uuid and the keys are the only thing that is read from libuuid.
+struct generator_state {
+	boost::uint64_t key_high;
+	boost::uint64_t key_low;
+	boost::uint64_t counter;
+	boost::uint32_t fork_generation;
+	bool seeded;
+};
+
+__thread generator_state generator = { 0, 0, 0, 0, false };
+
+// forked child must not continue parent's sequences
+volatile boost::uint32_t fork_generation = 0;
+pthread_once_t fork_handler_once = PTHREAD_ONCE_INIT;
+
+void
+on_fork_child() {
+	__sync_fetch_and_add(&fork_generation, 1);
+}
+
+void
+register_fork_handler() {
+	pthread_atfork(NULL, NULL, &on_fork_child);
+}
+
+void
+seed_generator() {
+	pthread_once(&fork_handler_once, &register_fork_handler);
+
+	uuid_t seed;
+	uuid_generate(seed);
+
+	memcpy(&generator.key_high, seed, sizeof(generator.key_high));
+	memcpy(&generator.key_low, seed + sizeof(generator.key_high), sizeof(generator.key_low));
+	generator.counter = 0;
+	generator.fork_generation = fork_generation;
+	generator.seeded = true;
+}
+
+// splitmix64 finalizer, a bijection on 64 bit values
+inline boost::uint64_t
+mix(boost::uint64_t value) {
+	value = (value ^ (value >> 30)) * 0xbf58476d1ce4e5b9ULL;
+	value = (value ^ (value >> 27)) * 0x94d049bb133111ebULL;
+	return value ^ (value >> 31);
+}
+
+#ifdef __SSE2__
+
+// nibbles to lowercase hex chars
+inline __m128i
+encode_digits(__m128i nibbles) {
+	__m128i letters = _mm_cmpgt_epi8(nibbles, _mm_set1_epi8(9));
+	__m128i chars = _mm_add_epi8(nibbles, _mm_set1_epi8('0'));
+	return _mm_add_epi8(chars, _mm_and_si128(letters, _mm_set1_epi8('a' - '0' - 10)));
+}
+
+// hex chars to nibbles, valid_mask gets a bit per hex char lane.
+// unsigned range checks are done as signed compares of values biased by 0x80.
+inline __m128i
+decode_digits(__m128i chars, int& valid_mask) {
+	const __m128i bias = _mm_set1_epi8((char)0x80);
+
+	__m128i digit = _mm_sub_epi8(chars, _mm_set1_epi8('0'));
+	__m128i is_digit = _mm_cmplt_epi8(_mm_xor_si128(digit, bias), _mm_set1_epi8((char)(0x80 + 10)));
+
+	__m128i letter = _mm_sub_epi8(_mm_or_si128(chars, _mm_set1_epi8(0x20)), _mm_set1_epi8('a'));
+	__m128i is_letter = _mm_cmplt_epi8(_mm_xor_si128(letter, bias), _mm_set1_epi8((char)(0x80 + 6)));
+
+	valid_mask = _mm_movemask_epi8(_mm_or_si128(is_digit, is_letter));
+
+	letter = _mm_add_epi8(letter, _mm_set1_epi8(10));
+	return _mm_or_si128(_mm_and_si128(is_digit, digit), _mm_and_si128(is_letter, letter));
+}
+
+// pairs of nibbles (high one first) to bytes, in low halves of 16 bit lanes
+inline __m128i
+join_nibbles(__m128i nibbles) {
+	__m128i high = _mm_slli_epi16(_mm_and_si128(nibbles, _mm_set1_epi16(0x00ff)), 4);
+	return _mm_or_si128(high, _mm_srli_epi16(nibbles, 8));
+}
+
+#else
+
+inline int
+hex_value(char c) {
+	if (c >= '0' && c <= '9') {
+		return c - '0';
+	}
+
+	if (c >= 'a' && c <= 'f') {
+		return c - 'a' + 10;
+	}
+
+	if (c >= 'A' && c <= 'F') {
+		return c - 'A' + 10;
+	}
+
+	return -1;
+}
+
+#endif // __SSE2__
+
+} // anonymous namespace
+
+bool
+message_uuid::is_nil() const {
+	for (size_t i = 0; i < SIZE; ++i) {
+		if (bytes[i] != 0) {
+			return false;
+		}
+	}
+
+	return true;
+}
+
+boost::uint64_t
+message_uuid::hash() const {
+	boost::uint64_t low = 0;
+	boost::uint64_t high = 0;
+
+	memcpy(&low, bytes, sizeof(low));
+	memcpy(&high, bytes + sizeof(low), sizeof(high));
+
+	// version and variant bits are fixed, mix them away
+	boost::uint64_t h = low ^ (high * 0x9e3779b97f4a7c15ULL);
+	h ^= h >> 32;
+	return h * 0x9e3779b97f4a7c15ULL;
+}
+
+bool
+message_uuid::parse(const char* data, size_t size) {
+	if (size != STRING_SIZE) {
+		return false;
+	}
+
+	// gather hex digits without dashes
+	char digits[DIGITS_COUNT];
+	size_t digits_offset = 0;
+
+	for (size_t i = 0; i < GROUPS_COUNT; ++i) {
+		if (i > 0 && data[group_offsets[i] - 1] != '-') {
+			return false;
+		}
+
+		memcpy(digits + digits_offset, data + group_offsets[i], group_sizes[i]);
+		digits_offset += group_sizes[i];
+	}
+
+#ifdef __SSE2__
+	int first_mask = 0;
+	int second_mask = 0;
+
+	__m128i first = decode_digits(_mm_loadu_si128((const __m128i*)digits), first_mask);
+	__m128i second = decode_digits(_mm_loadu_si128((const __m128i*)(digits + 16)), second_mask);
+
+	if ((first_mask & second_mask) != 0xffff) {
+		return false;
+	}
+
+	_mm_storeu_si128((__m128i*)bytes, _mm_packus_epi16(join_nibbles(first), join_nibbles(second)));
+#else
+	unsigned char result[SIZE];
+
+	for (size_t i = 0; i < SIZE; ++i) {
+		int high = hex_value(digits[i * 2]);
+		int low = hex_value(digits[i * 2 + 1]);
+
+		if (high < 0 || low < 0) {
+			return false;
+		}
+
+		result[i] = (unsigned char)((high << 4) | low);
+	}
+
+	memcpy(bytes, result, SIZE);
+#endif
+
+	return true;
+}
+
+bool
+message_uuid::parse(const std::string& str) {
+	return parse(str.data(), str.size());
+}
+
+void
+message_uuid::format(char* buffer) const {
+	char digits[DIGITS_COUNT];
+
+#ifdef __SSE2__
+	__m128i value = _mm_loadu_si128((const __m128i*)bytes);
+	__m128i mask = _mm_set1_epi8(0x0f);
+
+	__m128i high = _mm_and_si128(_mm_srli_epi16(value, 4), mask);
+	__m128i low = _mm_and_si128(value, mask);
+
+	// interleave nibbles into string order
+	_mm_storeu_si128((__m128i*)digits, encode_digits(_mm_unpacklo_epi8(high, low)));
+	_mm_storeu_si128((__m128i*)(digits + 16), encode_digits(_mm_unpackhi_epi8(high, low)));
+#else
+	static const char hex_digits[] = "0123456789abcdef";
+
+	for (size_t i = 0; i < SIZE; ++i) {
+		digits[i * 2] = hex_digits[bytes[i] >> 4];
+		digits[i * 2 + 1] = hex_digits[bytes[i] & 0x0f];
+	}
+#endif
+
+	size_t digits_offset = 0;
+
+	for (size_t i = 0; i < GROUPS_COUNT; ++i) {
+		if (i > 0) {
+			buffer[group_offsets[i] - 1] = '-';
+		}
+
+		memcpy(buffer + group_offsets[i], digits + digits_offset, group_sizes[i]);
+		digits_offset += group_sizes[i];
+	}
+}
+
+std::string
+message_uuid::as_string() const {
+	char buffer[STRING_SIZE];
+	format(buffer);
+
+	return std::string(buffer, STRING_SIZE);
+}
+
+message_uuid
+message_uuid::generate() {
+	if (!generator.seeded || generator.fork_generation != fork_generation) {
+		seed_generator();
+	}
+
+	boost::uint64_t step = ++generator.counter * 0x9e3779b97f4a7c15ULL;
+	boost::uint64_t high = mix(generator.key_high + step);
+	boost::uint64_t low = mix(generator.key_low + step);
+
+	message_uuid uuid;
+	memcpy(uuid.bytes, &high, sizeof(high));
+	memcpy(uuid.bytes + sizeof(high), &low, sizeof(low));
+
+	// version 4, variant 1
+	uuid.bytes[6] = (uuid.bytes[6] & 0x0f) | 0x40;
+	uuid.bytes[8] = (uuid.bytes[8] & 0x3f) | 0x80;
+
+	return uuid;
+}
+
+} // namespace lsd
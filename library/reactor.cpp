@@ -0,0 +1,224 @@
+//
+// Copyright (C) 2011 Rim Zaidullin <creator@bash.org.ru>
+//
+// Licensed under the BSD 2-Clause License (the "License");
+// you may not use this file except in compliance with the License.
+//
+// Unless required by applicable law or agreed to in writing, software
+// distributed under the License is distributed on an "AS IS" BASIS,
+// WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+// See the License for the specific language governing permissions and
+// limitations under the License.
+//
+
+#include <algorithm>
+#include <cerrno>
+
+#include <boost/current_function.hpp>
+
+#include "details/error.hpp"
+#include "details/reactor.hpp"
+
+namespace lsd {
+
+reactor::reactor(boost::shared_ptr<base_logger> logger) :
+	logger_(logger),
+	handlers_count_(0),
+	is_running_(true)
+{
+	thread_ = boost::thread(&reactor::run, this);
+}
+
+reactor::~reactor() {
+	is_running_ = false;
+	wakeup_.notify();
+	thread_.join();
+}
+
+void
+reactor::attach(reactor_handler* handler) {
+	if (!handler) {
+		throw error("empty reactor handler at " + std::string(BOOST_CURRENT_FUNCTION));
+	}
+
+	{
+		boost::mutex::scoped_lock lock(mutex_);
+		pending_handlers_.push_back(handler);
+		++handlers_count_;
+	}
+
+	wakeup_.notify();
+}
+
+void
+reactor::wait_detached(reactor_handler* handler) {
+	boost::mutex::scoped_lock lock(mutex_);
+
+	while (detached_handlers_.find(handler) == detached_handlers_.end()) {
+		detached_.wait(lock);
+	}
+
+	detached_handlers_.erase(handler);
+}
+
+size_t
+reactor::handlers_count() {
+	boost::mutex::scoped_lock lock(mutex_);
+	return handlers_count_;
+}
+
+void
+reactor::attach_pending_handlers() {
+	std::vector<reactor_handler*> handlers;
+
+	{
+		boost::mutex::scoped_lock lock(mutex_);
+		handlers.swap(pending_handlers_);
+	}
+
+	for (size_t i = 0; i < handlers.size(); ++i) {
+		try {
+			handlers[i]->dispatch_start();
+			handlers_.push_back(handlers[i]);
+		}
+		catch (const std::exception& ex) {
+			logger_->log(PLOG_ERROR, "could not start reactor handler, details: %s", ex.what());
+
+			// don't leave the owner waiting
+			boost::mutex::scoped_lock lock(mutex_);
+			detached_handlers_.insert(handlers[i]);
+			--handlers_count_;
+			detached_.notify_all();
+		}
+	}
+}
+
+void
+reactor::detach_handler(size_t index) {
+	reactor_handler* handler = handlers_[index];
+	handlers_.erase(handlers_.begin() + index);
+
+	try {
+		handler->dispatch_stop();
+	}
+	catch (const std::exception& ex) {
+		logger_->log(PLOG_ERROR, "could not stop reactor handler, details: %s", ex.what());
+	}
+
+	boost::mutex::scoped_lock lock(mutex_);
+	detached_handlers_.insert(handler);
+	--handlers_count_;
+	detached_.notify_all();
+}
+
+void
+reactor::run() {
+	std::vector<size_t> finished;
+
+	while (is_running_) {
+		attach_pending_handlers();
+
+		// wakeup signal goes first, then items of every handler
+		poll_items_.resize(1);
+		poll_items_[0].socket = NULL;
+		poll_items_[0].fd = wakeup_.fd();
+		poll_items_[0].events = ZMQ_POLLIN;
+		poll_items_[0].revents = 0;
+
+		poll_offsets_.clear();
+
+		// sleep till the earliest handler wants to wake up, or until woken up
+		long timeout = -1;
+
+		for (size_t i = 0; i < handlers_.size(); ++i) {
+			poll_offsets_.push_back(poll_items_.size());
+			handlers_[i]->fill_poll_items(poll_items_);
+
+			long handler_timeout = handlers_[i]->poll_timeout();
+			timeout = (timeout < 0) ? handler_timeout : std::min(timeout, handler_timeout);
+		}
+
+		if (timeout > 0) {
+			timeout = zmq_poll_timeout(timeout);
+		}
+
+		int socket_response = zmq_poll(&poll_items_[0], (int)poll_items_.size(), timeout);
+
+		if (socket_response < 0 && zmq_errno() != EINTR) {
+			logger_->log(PLOG_ERROR, "reactor poll failed, details: %s", zmq_strerror(zmq_errno()));
+		}
+
+		if ((ZMQ_POLLIN & poll_items_[0].revents) == ZMQ_POLLIN) {
+			wakeup_.drain();
+		}
+
+		// handlers see their own items only
+		finished.clear();
+
+		for (size_t i = 0; i < handlers_.size(); ++i) {
+			bool is_alive = true;
+
+			try {
+				is_alive = handlers_[i]->process_events(&poll_items_[poll_offsets_[i]]);
+			}
+			catch (const std::exception& ex) {
+				logger_->log(PLOG_ERROR, "reactor handler failed, details: %s", ex.what());
+			}
+
+			if (!is_alive) {
+				finished.push_back(i);
+			}
+		}
+
+		for (std::vector<size_t>::reverse_iterator it = finished.rbegin(); it != finished.rend(); ++it) {
+			detach_handler(*it);
+		}
+	}
+
+	// stop whatever is left
+	attach_pending_handlers();
+
+	while (!handlers_.empty()) {
+		detach_handler(handlers_.size() - 1);
+	}
+}
+
+reactor_pool::reactor_pool(size_t threads, boost::shared_ptr<base_logger> logger) {
+	if (threads == 0) {
+		threads = std::max(boost::thread::hardware_concurrency(), 1u);
+	}
+
+	for (size_t i = 0; i < threads; ++i) {
+		reactors_.push_back(boost::shared_ptr<reactor>(new reactor(logger)));
+	}
+}
+
+reactor_pool::~reactor_pool() {
+	reactors_.clear();
+}
+
+reactor*
+reactor_pool::assign() {
+	boost::mutex::scoped_lock lock(mutex_);
+
+	reactor* least_loaded = reactors_.front().get();
+	size_t least_count = least_loaded->handlers_count();
+
+	for (size_t i = 1; i < reactors_.size(); ++i) {
+		size_t count = reactors_[i]->handlers_count();
+
+		if (count < least_count) {
+			least_loaded = reactors_[i].get();
+			least_count = count;
+		}
+	}
+
+	return least_loaded;
+}
+
+size_t
+reactor_pool::size() const {
+	return reactors_.size();
+}
+
+} // namespace lsd
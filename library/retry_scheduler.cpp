@@ -0,0 +1,150 @@
+//
+// Copyright (C) 2011 Rim Zaidullin <creator@bash.org.ru>
+//
+// Licensed under the BSD 2-Clause License (the "License");
+// you may not use this file except in compliance with the License.
+//
+// Unless required by applicable law or agreed to in writing, software
+// distributed under the License is distributed on an "AS IS" BASIS,
+// WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+// See the License for the specific language governing permissions and
+// limitations under the License.
+//
+
+#include <algorithm>
+#include <cstdlib>
+
+#include "details/retry_scheduler.hpp"
+
+namespace lsd {
+
+retry_scheduler::retry_scheduler() :
+	sequence_(0),
+	max_rate_(0.0),
+	burst_(0.0),
+	tokens_(0.0),
+	last_refill_(0.0)
+{
+}
+
+retry_scheduler::~retry_scheduler() {
+}
+
+void
+retry_scheduler::set_rate_limit(double max_rate, double burst) {
+	max_rate_ = max_rate;
+	burst_ = std::max(burst, 1.0);
+	tokens_ = burst_;
+	last_refill_ = 0.0;
+}
+
+void
+retry_scheduler::schedule(cached_message_ptr_t message, double due_time) {
+	entry e;
+	e.due_time = due_time;
+	e.sequence = sequence_++;
+	e.message = message;
+
+	heap_.push_back(e);
+	std::push_heap(heap_.begin(), heap_.end());
+}
+
+void
+retry_scheduler::refill_tokens(double now) {
+	if (last_refill_ == 0.0 || now < last_refill_) {
+		last_refill_ = now;
+		return;
+	}
+
+	tokens_ = std::min(burst_, tokens_ + (now - last_refill_) * max_rate_);
+	last_refill_ = now;
+}
+
+size_t
+retry_scheduler::pop_due(double now, size_t max_count, message_queue_t& messages) {
+	if (heap_.empty()) {
+		return 0;
+	}
+
+	if (max_rate_ > 0.0) {
+		refill_tokens(now);
+	}
+
+	size_t count = 0;
+	while (!heap_.empty() && count < max_count && heap_.front().due_time <= now) {
+		if (max_rate_ > 0.0) {
+			if (tokens_ < 1.0) {
+				break;
+			}
+
+			tokens_ -= 1.0;
+		}
+
+		std::pop_heap(heap_.begin(), heap_.end());
+		messages.push_back(heap_.back().message);
+		heap_.pop_back();
+		++count;
+	}
+
+	return count;
+}
+
+void
+retry_scheduler::pop_all(message_queue_t& messages) {
+	// keep due order
+	std::sort_heap(heap_.begin(), heap_.end());
+
+	for (std::vector<entry>::reverse_iterator it = heap_.rbegin(); it != heap_.rend(); ++it) {
+		messages.push_back(it->message);
+	}
+
+	heap_.clear();
+}
+
+bool
+retry_scheduler::next_release_time(double now, double& release_time) const {
+	if (heap_.empty()) {
+		return false;
+	}
+
+	release_time = heap_.front().due_time;
+
+	// wait for the next token as well
+	if (max_rate_ > 0.0 && tokens_ < 1.0) {
+		double elapsed = (last_refill_ == 0.0) ? 0.0 : std::max(now - last_refill_, 0.0);
+		double missing = 1.0 - (tokens_ + elapsed * max_rate_);
+
+		if (missing > 0.0) {
+			release_time = std::max(release_time, now + missing / max_rate_);
+		}
+	}
+
+	return true;
+}
+
+size_t
+retry_scheduler::size() const {
+	return heap_.size();
+}
+
+bool
+retry_scheduler::empty() const {
+	return heap_.empty();
+}
+
+double
+retry_scheduler::backoff_delay(int attempt, double base_delay, double max_delay, unsigned int* seed) {
+	double delay = base_delay;
+
+	for (int i = 1; i < attempt && delay < max_delay; ++i) {
+		delay *= 2.0;
+	}
+
+	delay = std::min(delay, max_delay);
+
+	// spread retries of messages rejected at the same moment
+	double jitter = (double)rand_r(seed) / (double)RAND_MAX;
+	return delay / 2.0 + jitter * delay / 2.0;
+}
+
+} // namespace lsd
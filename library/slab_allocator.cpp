@@ -0,0 +1,362 @@
+//
+// Copyright (C) 2011 Rim Zaidullin <creator@bash.org.ru>
+//
+// Licensed under the BSD 2-Clause License (the "License");
+// you may not use this file except in compliance with the License.
+//
+// Unless required by applicable law or agreed to in writing, software
+// distributed under the License is distributed on an "AS IS" BASIS,
+// WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+// See the License for the specific language governing permissions and
+// limitations under the License.
+//
+
+#include <cstdlib>
+#include <cstring>
+
+#include <pthread.h>
+#include <sys/mman.h>
+
+#include <boost/current_function.hpp>
+
+#include "details/slab_allocator.hpp"
+#include "details/error.hpp"
+
+namespace lsd {
+
+const size_t slab_allocator::CLASSES_COUNT;
+const size_t slab_allocator::MIN_BLOCK_SIZE;
+const size_t slab_allocator::MAX_BLOCK_SIZE;
+const size_t slab_allocator::SLAB_SIZE;
+const size_t slab_allocator::HUGEPAGE_SIZE;
+
+namespace {
+
+const size_t CLASSES_COUNT = slab_allocator::CLASSES_COUNT;
+
+// free blocks of thread caches beyond this many bytes per class go to depot
+const size_t THREAD_CACHE_BYTES = 256 * 1024;
+const size_t MIN_THREAD_CACHE_BLOCKS = 8;
+
+const boost::uint32_t BLOCK_MAGIC = 0x534c4142; // "SLAB"
+const boost::uint32_t LARGE_HEAP = 0xfe;
+const boost::uint32_t LARGE_HUGEPAGE = 0xff;
+
+// precedes every block handed out, keeps user memory 16 byte aligned
+struct block_header {
+	boost::uint32_t magic;
+	boost::uint32_t kind;
+
+	// mapping size for hugepage allocations, requested size for heap ones
+	boost::uint64_t size;
+};
+
+struct free_block {
+	free_block* next;
+};
+
+struct block_list {
+	free_block* head;
+	size_t count;
+};
+
+inline void
+push_block(block_list& list, free_block* block) {
+	block->next = list.head;
+	list.head = block;
+	++list.count;
+}
+
+inline free_block*
+pop_block(block_list& list) {
+	free_block* block = list.head;
+	list.head = block->next;
+	--list.count;
+	return block;
+}
+
+// move up to count blocks from one list to another
+void
+move_blocks(block_list& from, block_list& to, size_t count) {
+	while (count-- > 0 && from.head) {
+		push_block(to, pop_block(from));
+	}
+}
+
+struct thread_cache {
+	block_list lists[CLASSES_COUNT];
+};
+
+// shared by all threads, a plain mutex as it is taken once per batch
+struct depot {
+	pthread_mutex_t mutex;
+	block_list lists[CLASSES_COUNT];
+	size_t slabs[CLASSES_COUNT];
+	size_t thread_blocks[CLASSES_COUNT];
+};
+
+depot shared_depot = { PTHREAD_MUTEX_INITIALIZER, {}, {}, {} };
+
+volatile size_t large_allocations = 0;
+volatile boost::uint64_t large_bytes = 0;
+volatile size_t hugepage_allocations = 0;
+volatile boost::uint64_t hugepage_bytes = 0;
+volatile bool hugepages_enabled = false;
+
+__thread thread_cache* local_cache = NULL;
+pthread_key_t cache_key;
+pthread_once_t cache_key_once = PTHREAD_ONCE_INIT;
+
+inline size_t
+block_size(size_t class_index) {
+	return slab_allocator::MIN_BLOCK_SIZE << class_index;
+}
+
+inline size_t
+thread_cache_limit(size_t class_index) {
+	size_t limit = THREAD_CACHE_BYTES / block_size(class_index);
+	return (limit < MIN_THREAD_CACHE_BLOCKS) ? MIN_THREAD_CACHE_BLOCKS : limit;
+}
+
+inline size_t
+class_for_size(size_t size) {
+	size_t class_index = 0;
+
+	while (block_size(class_index) < size) {
+		++class_index;
+	}
+
+	return class_index;
+}
+
+// thread is gone, its cached blocks go back to depot
+void
+release_thread_cache(void* ptr) {
+	thread_cache* cache = static_cast<thread_cache*>(ptr);
+	local_cache = NULL;
+
+	pthread_mutex_lock(&shared_depot.mutex);
+
+	for (size_t i = 0; i < CLASSES_COUNT; ++i) {
+		shared_depot.thread_blocks[i] -= cache->lists[i].count;
+		move_blocks(cache->lists[i], shared_depot.lists[i], cache->lists[i].count);
+	}
+
+	pthread_mutex_unlock(&shared_depot.mutex);
+	free(cache);
+}
+
+void
+create_cache_key() {
+	pthread_key_create(&cache_key, &release_thread_cache);
+}
+
+thread_cache*
+get_thread_cache() {
+	if (local_cache) {
+		return local_cache;
+	}
+
+	pthread_once(&cache_key_once, &create_cache_key);
+
+	thread_cache* cache = static_cast<thread_cache*>(calloc(1, sizeof(thread_cache)));
+
+	if (!cache) {
+		throw std::bad_alloc();
+	}
+
+	pthread_setspecific(cache_key, cache);
+	local_cache = cache;
+	return cache;
+}
+
+// depot lock must be held
+void
+carve_slab(size_t class_index) {
+	void* slab = mmap(NULL, slab_allocator::SLAB_SIZE, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+
+	if (slab == MAP_FAILED) {
+		throw std::bad_alloc();
+	}
+
+	size_t size = block_size(class_index);
+	char* end = static_cast<char*>(slab) + slab_allocator::SLAB_SIZE;
+
+	// pushed from the end, so blocks go out in address order
+	for (char* block = end - size; block >= static_cast<char*>(slab); block -= size) {
+		push_block(shared_depot.lists[class_index], reinterpret_cast<free_block*>(block));
+	}
+
+	++shared_depot.slabs[class_index];
+}
+
+void
+refill_thread_cache(block_list& list, size_t class_index) {
+	size_t batch = thread_cache_limit(class_index) / 2;
+
+	pthread_mutex_lock(&shared_depot.mutex);
+
+	try {
+		if (shared_depot.lists[class_index].count < batch) {
+			carve_slab(class_index);
+		}
+	}
+	catch (...) {
+		// whatever is left in depot will do
+		if (!shared_depot.lists[class_index].head) {
+			pthread_mutex_unlock(&shared_depot.mutex);
+			throw;
+		}
+	}
+
+	size_t count = list.count;
+	move_blocks(shared_depot.lists[class_index], list, batch);
+	shared_depot.thread_blocks[class_index] += list.count - count;
+
+	pthread_mutex_unlock(&shared_depot.mutex);
+}
+
+void
+drain_thread_cache(block_list& list, size_t class_index) {
+	size_t batch = thread_cache_limit(class_index) / 2;
+
+	pthread_mutex_lock(&shared_depot.mutex);
+
+	move_blocks(list, shared_depot.lists[class_index], batch);
+	shared_depot.thread_blocks[class_index] -= batch;
+
+	pthread_mutex_unlock(&shared_depot.mutex);
+}
+
+void*
+allocate_large(size_t size) {
+	size_t total_size = size + sizeof(block_header);
+	block_header* header = NULL;
+
+	if (hugepages_enabled && total_size >= slab_allocator::HUGEPAGE_SIZE) {
+		size_t mapping_size = (total_size + slab_allocator::HUGEPAGE_SIZE - 1) & ~(slab_allocator::HUGEPAGE_SIZE - 1);
+		void* mapping = mmap(NULL, mapping_size, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS | MAP_HUGETLB, -1, 0);
+
+		if (mapping != MAP_FAILED) {
+			header = static_cast<block_header*>(mapping);
+			header->kind = LARGE_HUGEPAGE;
+			header->size = mapping_size;
+
+			__sync_fetch_and_add(&hugepage_allocations, 1);
+			__sync_fetch_and_add(&hugepage_bytes, mapping_size);
+		}
+	}
+
+	if (!header) {
+		header = static_cast<block_header*>(malloc(total_size));
+
+		if (!header) {
+			throw std::bad_alloc();
+		}
+
+		header->kind = LARGE_HEAP;
+		header->size = size;
+
+		__sync_fetch_and_add(&large_allocations, 1);
+		__sync_fetch_and_add(&large_bytes, size);
+	}
+
+	header->magic = BLOCK_MAGIC;
+	return header + 1;
+}
+
+} // anonymous namespace
+
+void*
+slab_allocator::allocate(size_t size) {
+	if (size + sizeof(block_header) > MAX_BLOCK_SIZE) {
+		return allocate_large(size);
+	}
+
+	size_t class_index = class_for_size(size + sizeof(block_header));
+	block_list& list = get_thread_cache()->lists[class_index];
+
+	if (!list.head) {
+		refill_thread_cache(list, class_index);
+	}
+
+	block_header* header = reinterpret_cast<block_header*>(pop_block(list));
+	header->magic = BLOCK_MAGIC;
+	header->kind = (boost::uint32_t)class_index;
+	header->size = size;
+
+	return header + 1;
+}
+
+void
+slab_allocator::deallocate(void* ptr) {
+	if (!ptr) {
+		return;
+	}
+
+	block_header* header = static_cast<block_header*>(ptr) - 1;
+
+	if (header->magic != BLOCK_MAGIC) {
+		throw error("freeing memory not allocated by slab allocator at " + std::string(BOOST_CURRENT_FUNCTION));
+	}
+
+	header->magic = 0;
+
+	if (header->kind == LARGE_HUGEPAGE) {
+		size_t mapping_size = header->size;
+		munmap(header, mapping_size);
+
+		__sync_fetch_and_sub(&hugepage_allocations, 1);
+		__sync_fetch_and_sub(&hugepage_bytes, mapping_size);
+		return;
+	}
+
+	if (header->kind == LARGE_HEAP) {
+		__sync_fetch_and_sub(&large_allocations, 1);
+		__sync_fetch_and_sub(&large_bytes, header->size);
+
+		free(header);
+		return;
+	}
+
+	size_t class_index = header->kind;
+	block_list& list = get_thread_cache()->lists[class_index];
+
+	push_block(list, reinterpret_cast<free_block*>(header));
+
+	if (list.count > thread_cache_limit(class_index)) {
+		drain_thread_cache(list, class_index);
+	}
+}
+
+void
+slab_allocator::use_hugepages(bool value) {
+	hugepages_enabled = value;
+}
+
+void
+slab_allocator::get_stats(allocator_stats& stats) {
+	stats = allocator_stats();
+	stats.classes.resize(CLASSES_COUNT);
+
+	pthread_mutex_lock(&shared_depot.mutex);
+
+	for (size_t i = 0; i < CLASSES_COUNT; ++i) {
+		allocator_class_stats& class_stats = stats.classes[i];
+		class_stats.block_size = block_size(i);
+		class_stats.slabs = shared_depot.slabs[i];
+		class_stats.depot_blocks = shared_depot.lists[i].count;
+		class_stats.thread_blocks = shared_depot.thread_blocks[i];
+
+		stats.slab_bytes += (boost::uint64_t)shared_depot.slabs[i] * SLAB_SIZE;
+	}
+
+	pthread_mutex_unlock(&shared_depot.mutex);
+
+	stats.large_allocations = large_allocations;
+	stats.large_bytes = large_bytes;
+	stats.hugepage_allocations = hugepage_allocations;
+	stats.hugepage_bytes = hugepage_bytes;
+}
+
+} // namespace lsd
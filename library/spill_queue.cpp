@@ -0,0 +1,252 @@
+//
+// Copyright (C) 2011 Rim Zaidullin <creator@bash.org.ru>
+//
+// Licensed under the BSD 2-Clause License (the "License");
+// you may not use this file except in compliance with the License.
+//
+// Unless required by applicable law or agreed to in writing, software
+// distributed under the License is distributed on an "AS IS" BASIS,
+// WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+// See the License for the specific language governing permissions and
+// limitations under the License.
+//
+
+#include <cerrno>
+#include <cstdio>
+#include <cstring>
+
+#include <dirent.h>
+#include <fcntl.h>
+#include <sys/stat.h>
+#include <sys/types.h>
+#include <unistd.h>
+
+#include <boost/current_function.hpp>
+
+#include "details/spill_queue.hpp"
+#include "details/message_log.hpp"
+#include "details/error.hpp"
+
+namespace lsd {
+
+namespace {
+
+void
+write_all(int fd, const char* data, size_t size) {
+	while (size > 0) {
+		ssize_t written = ::write(fd, data, size);
+
+		if (written < 0) {
+			if (errno == EINTR) {
+				continue;
+			}
+
+			throw error("spill write failed: " + std::string(strerror(errno)) + " at " + std::string(BOOST_CURRENT_FUNCTION));
+		}
+
+		data += written;
+		size -= written;
+	}
+}
+
+void
+read_all(int fd, char* data, size_t size, boost::uint64_t offset) {
+	while (size > 0) {
+		ssize_t was_read = pread(fd, data, size, (off_t)offset);
+
+		if (was_read < 0 && errno == EINTR) {
+			continue;
+		}
+
+		if (was_read <= 0) {
+			throw error("spill read failed: " + std::string(strerror(errno)) + " at " + std::string(BOOST_CURRENT_FUNCTION));
+		}
+
+		data += was_read;
+		size -= was_read;
+		offset += was_read;
+	}
+}
+
+} // anonymous namespace
+
+spill_queue::spill_queue(const std::string& path, boost::uint64_t max_size, boost::shared_ptr<base_logger> logger) :
+	path_(path),
+	max_size_(max_size),
+	logger_(logger),
+	next_chunk_id_(0),
+	read_offset_(0),
+	disk_size_(0),
+	size_(0)
+{
+	if (path_.empty()) {
+		throw error("spill path is empty, check message_cache/spill_path in config at " + std::string(BOOST_CURRENT_FUNCTION));
+	}
+
+	if (mkdir(path_.c_str(), 0755) != 0 && errno != EEXIST) {
+		throw error("can't create spill directory " + path_ + ": " + std::string(strerror(errno)) + " at " + std::string(BOOST_CURRENT_FUNCTION));
+	}
+
+	remove_stale_chunks();
+}
+
+spill_queue::~spill_queue() {
+	while (!chunks_.empty()) {
+		close_chunk(chunks_.front());
+		chunks_.pop_front();
+	}
+}
+
+void
+spill_queue::remove_stale_chunks() {
+	DIR* dir = opendir(path_.c_str());
+	if (!dir) {
+		throw error("can't open spill directory " + path_ + " at " + std::string(BOOST_CURRENT_FUNCTION));
+	}
+
+	size_t removed = 0;
+
+	while (struct dirent* entry = readdir(dir)) {
+		unsigned int id = 0;
+		char tail = 0;
+
+		if (sscanf(entry->d_name, "spill-%08u.da%c", &id, &tail) == 2 && tail == 't') {
+			unlink((path_ + "/" + entry->d_name).c_str());
+			++removed;
+		}
+	}
+
+	closedir(dir);
+
+	if (removed > 0) {
+		logger_->log("removed %d stale spill chunks from %s", (int)removed, path_.c_str());
+	}
+}
+
+void
+spill_queue::open_chunk() {
+	char name[32];
+	snprintf(name, sizeof(name), "spill-%08u.dat", next_chunk_id_++);
+
+	chunk c;
+	c.path = path_ + "/" + name;
+	c.fd = ::open(c.path.c_str(), O_RDWR | O_CREAT | O_TRUNC | O_APPEND, 0644);
+
+	if (c.fd < 0) {
+		throw error("can't open spill chunk " + c.path + ": " + std::string(strerror(errno)) + " at " + std::string(BOOST_CURRENT_FUNCTION));
+	}
+
+	chunks_.push_back(c);
+}
+
+void
+spill_queue::close_chunk(chunk& c) {
+	if (c.fd >= 0) {
+		::close(c.fd);
+		c.fd = -1;
+	}
+
+	unlink(c.path.c_str());
+	disk_size_ -= c.size;
+}
+
+bool
+spill_queue::push(const cached_message& message) {
+	std::string body;
+	message_log::serialize_message(message, body);
+
+	boost::uint64_t record_size = sizeof(record_header) + body.size();
+
+	if (max_size_ > 0 && disk_size_ + record_size > max_size_) {
+		return false;
+	}
+
+	if (chunks_.empty() || (chunks_.back().size > 0 && chunks_.back().size + record_size > CHUNK_SIZE)) {
+		open_chunk();
+	}
+
+	record_header header;
+	header.body_size = (boost::uint32_t)body.size();
+	memcpy(header.uuid, message.binary_uuid().bytes, message_uuid::SIZE);
+
+	std::string record;
+	record.reserve(record_size);
+	record.append((const char*)&header, sizeof(header));
+	record.append(body);
+
+	chunk& tail = chunks_.back();
+	write_all(tail.fd, record.data(), record.size());
+
+	tail.size += record_size;
+	disk_size_ += record_size;
+	++size_;
+
+	return true;
+}
+
+spill_queue::cached_message_ptr_t
+spill_queue::pop() {
+	if (size_ == 0) {
+		return cached_message_ptr_t();
+	}
+
+	// chunks that are read through are gone, so the first one has data
+	chunk& head = chunks_.front();
+
+	record_header header;
+	read_all(head.fd, (char*)&header, sizeof(header), read_offset_);
+
+	std::string body(header.body_size, '\0');
+	read_all(head.fd, &body[0], body.size(), read_offset_ + sizeof(header));
+
+	message_uuid uuid;
+	memcpy(uuid.bytes, header.uuid, message_uuid::SIZE);
+
+	cached_message_ptr_t message = message_log::deserialize_message(uuid, body.data(), body.size());
+
+	if (!message) {
+		throw error("malformed record in spill chunk " + head.path + " at " + std::string(BOOST_CURRENT_FUNCTION));
+	}
+
+	read_offset_ += sizeof(header) + body.size();
+	--size_;
+
+	if (read_offset_ < head.size) {
+		return message;
+	}
+
+	read_offset_ = 0;
+
+	// last chunk is reused from the start, older ones are dropped
+	if (chunks_.size() == 1) {
+		if (ftruncate(head.fd, 0) != 0) {
+			throw error("can't truncate spill chunk " + head.path + " at " + std::string(BOOST_CURRENT_FUNCTION));
+		}
+
+		disk_size_ -= head.size;
+		head.size = 0;
+	}
+	else {
+		close_chunk(head);
+		chunks_.pop_front();
+	}
+
+	return message;
+}
+
+size_t
+spill_queue::size() const {
+	return size_;
+}
+
+bool
+spill_queue::empty() const {
+	return (size_ == 0);
+}
+
+boost::uint64_t
+spill_queue::disk_size() const {
+	return disk_size_;
+}
+
+} // namespace lsd
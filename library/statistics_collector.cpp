@@ -24,9 +24,79 @@
 #include "details/smart_logger.hpp"
 #include "lsd/structs.hpp"
 #include "details/host_info.hpp"
+#include "details/slab_allocator.hpp"
 
 namespace lsd {
 
+namespace {
+
+// non-empty buckets only, as [lower bound, count] pairs
+Json::Value
+histogram_json(const log2_histogram& histogram) {
+	Json::Value result(Json::arrayValue);
+
+	for (size_t i = 0; i < log2_histogram::BUCKETS_COUNT; ++i) {
+		if (histogram.buckets[i] == 0) {
+			continue;
+		}
+
+		Json::Value bucket(Json::arrayValue);
+		bucket.append((unsigned int)(i == 0 ? 0 : (1U << (i - 1))));
+		bucket.append((unsigned int)histogram.buckets[i]);
+		result.append(bucket);
+	}
+
+	return result;
+}
+
+void
+commit_stats_json(const commit_stats& stats, Json::Value& cache_info) {
+	if (stats.commits == 0) {
+		return;
+	}
+
+	cache_info["4 - log commits"] = (unsigned int)stats.commits;
+	cache_info["5 - log committed records"] = (unsigned int)stats.committed_records;
+	cache_info["6 - log committed bytes"] = (double)stats.committed_bytes;
+	cache_info["7 - log commit latency usec"] = histogram_json(stats.latency);
+	cache_info["8 - log commit batch size"] = histogram_json(stats.batch_size);
+}
+
+void
+allocator_stats_json(Json::Value& cache_info) {
+	allocator_stats stats;
+	slab_allocator::get_stats(stats);
+
+	Json::Value allocator_info;
+	allocator_info["1 - slab bytes"] = (double)stats.slab_bytes;
+	allocator_info["2 - large allocations"] = (unsigned int)stats.large_allocations;
+	allocator_info["3 - large bytes"] = (double)stats.large_bytes;
+	allocator_info["4 - hugepage allocations"] = (unsigned int)stats.hugepage_allocations;
+	allocator_info["5 - hugepage bytes"] = (double)stats.hugepage_bytes;
+
+	// classes that never had a slab are of no interest
+	Json::Value classes(Json::arrayValue);
+	for (size_t i = 0; i < stats.classes.size(); ++i) {
+		const allocator_class_stats& class_stats = stats.classes[i];
+
+		if (class_stats.slabs == 0) {
+			continue;
+		}
+
+		Json::Value class_info;
+		class_info["1 - block size"] = (unsigned int)class_stats.block_size;
+		class_info["2 - slabs"] = (unsigned int)class_stats.slabs;
+		class_info["3 - depot blocks"] = (unsigned int)class_stats.depot_blocks;
+		class_info["4 - thread blocks"] = (unsigned int)class_stats.thread_blocks;
+		classes.append(class_info);
+	}
+
+	allocator_info["6 - size classes"] = classes;
+	cache_info["9 - allocator"] = allocator_info;
+}
+
+} // anonymous namespace
+
 statistics_collector::statistics_collector(boost::shared_ptr<configuration> config,
 										   boost::shared_ptr<zmq::context_t> zmq_context) :
 	is_enabled_(false),
@@ -84,8 +154,6 @@ void
 statistics_collector::init() {
 	is_enabled_ = config_->is_statistics_enabled();
 
-	used_cache_size_ = 0;
-
 	if (config_->is_remote_statistics_enabled()) {
 		// run main thread
 		is_running_ = true;
@@ -232,8 +300,13 @@ statistics_collector::cache_stats_json() const {
 	Json::FastWriter writer;
 	Json::Value root;
 	root["1 - max cache size"] = (unsigned int)config()->max_message_cache_size();
-	root["2 - used bytes"] = (unsigned int)used_cache_size_;
-	root["3 - free bytes"] = (unsigned int)(config()->max_message_cache_size() - used_cache_size_);
+	size_t used_cache_size = cache_budget_ ? cache_budget_->used() : 0;
+	size_t max_cache_size = config()->max_message_cache_size();
+
+	root["2 - used bytes"] = (unsigned int)used_cache_size;
+	root["3 - free bytes"] = (unsigned int)(used_cache_size < max_cache_size ? max_cache_size - used_cache_size : 0);
+	commit_stats_json(commit_stats_, root);
+	allocator_stats_json(root);
 
 	return writer.write(root);
 }
@@ -248,8 +321,13 @@ statistics_collector::all_services_json() {
 	// cache info
 	Json::Value cache_info;
 	cache_info["1 - max cache size"] = (unsigned int)config()->max_message_cache_size();
-	cache_info["2 - used bytes"] = (unsigned int)used_cache_size_;
-	cache_info["3 - free bytes"] = (unsigned int)(config()->max_message_cache_size() - used_cache_size_);
+	size_t used_cache_size = cache_budget_ ? cache_budget_->used() : 0;
+	size_t max_cache_size = config()->max_message_cache_size();
+
+	cache_info["2 - used bytes"] = (unsigned int)used_cache_size;
+	cache_info["3 - free bytes"] = (unsigned int)(used_cache_size < max_cache_size ? max_cache_size - used_cache_size : 0);
+	commit_stats_json(commit_stats_, cache_info);
+	allocator_stats_json(cache_info);
 	root["1 - cache info"] = cache_info;
 
 	// queues totals info
@@ -332,6 +410,15 @@ statistics_collector::all_services_json() {
 						handle_info["08 - good responces"] = (unsigned int)handle_it->second.normal_responces;
 						handle_info["09 - err responces"] = (unsigned int)handle_it->second.err_responces;
 						handle_info["10 - expired"] = (unsigned int)handle_it->second.expired_responses;
+						handle_info["11 - queue retrying"] = (unsigned int)handle_it->second.queue_status.retrying;
+
+						double avg_resend_delay = 0.0;
+						if (handle_it->second.resent_messages > 0) {
+							avg_resend_delay = handle_it->second.resend_delay_sum / handle_it->second.resent_messages;
+						}
+
+						handle_info["12 - avg resend delay"] = avg_resend_delay;
+						handle_info["13 - max resend delay"] = handle_it->second.resend_delay_max;
 
 						service_handles[handles[i]] = handle_info;
 					}
@@ -456,13 +543,19 @@ statistics_collector::enable(bool value) {
 }
 
 void
-statistics_collector::update_used_cache_size(size_t used_cache_size) {
+statistics_collector::set_cache_budget(boost::shared_ptr<cache_budget> budget) {
+	boost::mutex::scoped_lock lock(mutex_);
+	cache_budget_ = budget;
+}
+
+void
+statistics_collector::update_commit_stats(const commit_stats& stats) {
 	if (!is_enabled_) {
 		return;
 	}
 
 	boost::mutex::scoped_lock lock(mutex_);
-	used_cache_size_ = used_cache_size;
+	commit_stats_ = stats;
 }
 
 void
@@ -0,0 +1,111 @@
+//
+// Copyright (C) 2011 Rim Zaidullin <creator@bash.org.ru>
+//
+// Licensed under the BSD 2-Clause License (the "License");
+// you may not use this file except in compliance with the License.
+//
+// Unless required by applicable law or agreed to in writing, software
+// distributed under the License is distributed on an "AS IS" BASIS,
+// WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+// See the License for the specific language governing permissions and
+// limitations under the License.
+//
+
+#include <cerrno>
+#include <cstring>
+#include <string>
+
+#include <fcntl.h>
+#include <unistd.h>
+
+#ifdef __linux__
+#include <sys/eventfd.h>
+#endif
+
+#include <boost/cstdint.hpp>
+#include <boost/current_function.hpp>
+
+#include "details/error.hpp"
+#include "details/wakeup_signal.hpp"
+
+namespace lsd {
+
+wakeup_signal::wakeup_signal() :
+	read_fd_(-1),
+	write_fd_(-1),
+	pending_(0)
+{
+#ifdef __linux__
+	read_fd_ = eventfd(0, EFD_NONBLOCK);
+
+	if (read_fd_ == -1) {
+		std::string error_msg = "could not create eventfd, details: ";
+		error_msg += std::string(strerror(errno)) + " at " + std::string(BOOST_CURRENT_FUNCTION);
+		throw error(error_msg);
+	}
+
+	write_fd_ = read_fd_;
+#else
+	int fds[2];
+
+	if (pipe(fds) == -1) {
+		std::string error_msg = "could not create wakeup pipe, details: ";
+		error_msg += std::string(strerror(errno)) + " at " + std::string(BOOST_CURRENT_FUNCTION);
+		throw error(error_msg);
+	}
+
+	read_fd_ = fds[0];
+	write_fd_ = fds[1];
+
+	fcntl(read_fd_, F_SETFL, fcntl(read_fd_, F_GETFL) | O_NONBLOCK);
+	fcntl(write_fd_, F_SETFL, fcntl(write_fd_, F_GETFL) | O_NONBLOCK);
+#endif
+}
+
+wakeup_signal::~wakeup_signal() {
+	if (write_fd_ != read_fd_) {
+		close(write_fd_);
+	}
+
+	close(read_fd_);
+}
+
+int
+wakeup_signal::fd() const {
+	return read_fd_;
+}
+
+void
+wakeup_signal::notify() {
+	// somebody has already signalled and the reader hasn't woken up yet
+	if (!__sync_bool_compare_and_swap(&pending_, 0, 1)) {
+		return;
+	}
+
+#ifdef __linux__
+	boost::uint64_t value = 1;
+	ssize_t res = write(write_fd_, &value, sizeof(value));
+#else
+	char value = 1;
+	ssize_t res = write(write_fd_, &value, sizeof(value));
+#endif
+
+	// full pipe or counter is as good as a successful write
+	(void)res;
+}
+
+void
+wakeup_signal::drain() {
+	char buff[64];
+	while (read(read_fd_, buff, sizeof(buff)) > 0) {
+	}
+
+	// reset flag only after fd is empty, otherwise a write of notify()
+	// racing with us could be read here and leave flag set with nothing
+	// to poll, swallowing every later notify(). notify() that comes before
+	// the reset is not written, caller re-checks its queues after drain().
+	__sync_lock_release(&pending_);
+	__sync_synchronize();
+}
+
+} // namespace lsd
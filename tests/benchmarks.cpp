@@ -0,0 +1,329 @@
+//
+// Copyright (C) 2011 Rim Zaidullin <creator@bash.org.ru>
+//
+// Licensed under the BSD 2-Clause License (the "License");
+// you may not use this file except in compliance with the License.
+//
+// Unless required by applicable law or agreed to in writing, software
+// distributed under the License is distributed on an "AS IS" BASIS,
+// WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+// See the License for the specific language governing permissions and
+// limitations under the License.
+//
+
+#include <algorithm>
+#include <cstdlib>
+#include <cstring>
+#include <iostream>
+#include <string>
+#include <vector>
+
+#include <unistd.h>
+#include <uuid/uuid.h>
+
+#include <boost/bind.hpp>
+#include <boost/make_shared.hpp>
+#include <boost/thread.hpp>
+
+#include "json/json.h"
+
+#include "details/cached_message.hpp"
+#include "details/context.hpp"
+#include "details/envelope_parser.hpp"
+#include "details/message_uuid.hpp"
+#include "details/progress_timer.hpp"
+#include "details/service.hpp"
+#include "details/slab_allocator.hpp"
+
+// response envelopes as sent by cocaine nodes
+static const char* captured_envelopes[] = {
+	"{\"completed\":false,\"uuid\":\"6e8bb3c8-3f3b-4c39-9b6a-0c1a6f2a9d14\"}\n",
+	"{\"completed\":true,\"uuid\":\"6e8bb3c8-3f3b-4c39-9b6a-0c1a6f2a9d14\"}\n",
+	"{\"code\":503,\"message\":\"the queue is full\",\"uuid\":\"0f8e0a7e-2d55-4c0a-8d7b-8a4cfa1b55c2\"}\n",
+	"{\"code\":520,\"message\":\"the job has expired\",\"uuid\":\"b7a1a3c2-99e0-4ad4-b8b5-77fd5b0f3e61\"}\n",
+	"{\"code\":500,\"message\":\"app error: \\\"bad input\\\"\",\"uuid\":\"a2b4c6d8-0000-4111-8222-933344455566\"}\n"
+};
+
+static const size_t envelopes_count = sizeof(captured_envelopes) / sizeof(captured_envelopes[0]);
+
+struct parsed_fields {
+	std::string uuid;
+	bool completed;
+	int code;
+	std::string message;
+};
+
+static void
+parse_with_jsoncpp(const std::string& data, parsed_fields& fields) {
+	// mirrors the original dispatch_responces() code path
+	std::string json_header = std::string(data.data(), data.size());
+
+	Json::Value envelope_val;
+	Json::Reader jreader;
+
+	if (jreader.parse(json_header.c_str(), envelope_val)) {
+		fields.uuid = envelope_val.get("uuid", "").asString();
+		fields.completed = envelope_val.get("completed", false).asBool();
+		fields.code = envelope_val.get("code", 0).asInt();
+		fields.message = envelope_val.get("message", "").asString();
+	}
+}
+
+static void
+parse_with_scanner(const std::string& data, parsed_fields& fields) {
+	lsd::response_envelope envelope;
+
+	if (!lsd::envelope_parser::scan_json(data.data(), data.size(), envelope)) {
+		parse_with_jsoncpp(data, fields);
+		return;
+	}
+
+	fields.uuid.assign(envelope.uuid ? envelope.uuid : "", envelope.uuid_size);
+	fields.completed = envelope.completed;
+	fields.code = envelope.code;
+
+	if (envelope.message_escaped) {
+		lsd::envelope_parser::unescape(envelope.message, envelope.message_size, fields.message);
+	}
+	else {
+		fields.message.assign(envelope.message ? envelope.message : "", envelope.message_size);
+	}
+}
+
+template <typename F> static double
+run_benchmark(const std::vector<std::string>& envelopes, size_t iterations, F parse) {
+	parsed_fields fields;
+	size_t checksum = 0;
+
+	lsd::progress_timer timer;
+
+	for (size_t i = 0; i < iterations; ++i) {
+		const std::string& data = envelopes[i % envelopes.size()];
+		parse(data, fields);
+		checksum += fields.uuid.size() + fields.code;
+	}
+
+	double elapsed = timer.elapsed().as_double();
+
+	// keep compiler from throwing the work away
+	if (checksum == 0) {
+		std::cout << "empty checksum" << std::endl;
+	}
+
+	return elapsed;
+}
+
+static size_t
+generate_with_libuuid() {
+	// mirrors the original cached_message::gen_uuid() code path
+	char buff[128];
+	memset(buff, 0, sizeof(buff));
+
+	uuid_t uuid;
+	uuid_generate(uuid);
+	uuid_unparse(uuid, buff);
+
+	std::string uuid_str = buff;
+	return uuid_str.size() + uuid[0];
+}
+
+static size_t
+generate_binary() {
+	lsd::message_uuid uuid = lsd::message_uuid::generate();
+	return uuid.bytes[0];
+}
+
+static size_t
+generate_and_format() {
+	lsd::message_uuid uuid = lsd::message_uuid::generate();
+	char buff[lsd::message_uuid::STRING_SIZE];
+	uuid.format(buff);
+	return buff[0] + uuid.bytes[0];
+}
+
+static size_t
+parse_with_libuuid(const std::string& str) {
+	uuid_t uuid;
+	return uuid_parse(str.c_str(), uuid) + uuid[0];
+}
+
+static size_t
+parse_with_message_uuid(const std::string& str) {
+	lsd::message_uuid uuid;
+	return uuid.parse(str) + uuid.bytes[0];
+}
+
+template <typename F> static double
+run_uuid_benchmark(size_t iterations, F generate) {
+	size_t checksum = 0;
+	lsd::progress_timer timer;
+
+	for (size_t i = 0; i < iterations; ++i) {
+		checksum += generate();
+	}
+
+	double elapsed = timer.elapsed().as_double();
+
+	if (checksum == 0) {
+		std::cout << "empty checksum" << std::endl;
+	}
+
+	return elapsed;
+}
+
+template <typename F> static double
+run_uuid_parse_benchmark(const std::vector<std::string>& uuids, size_t iterations, F parse) {
+	size_t checksum = 0;
+	lsd::progress_timer timer;
+
+	for (size_t i = 0; i < iterations; ++i) {
+		checksum += parse(uuids[i % uuids.size()]);
+	}
+
+	double elapsed = timer.elapsed().as_double();
+
+	if (checksum == 0) {
+		std::cout << "empty checksum" << std::endl;
+	}
+
+	return elapsed;
+}
+
+static void
+print_uuid_result(const std::string& name, double elapsed, size_t iterations) {
+	std::cout << name << ": " << elapsed << " sec, " << (elapsed * 1e9 / iterations) << " ns/uuid, ";
+	std::cout << (size_t)(iterations / elapsed) << " uuids/sec" << std::endl;
+}
+
+// one service without hosts, messages pile up in its handle cache
+static const char* send_benchmark_config =
+	"{ \"lsd_config\" : {"
+	"  \"config_version\" : 1,"
+	"  \"logger\" : { \"type\" : \"STDOUT_LOGGER\", \"flags\" : \"PLOG_NONE\" },"
+	"  \"message_cache\" : { \"max_ram_limit\" : 4096, \"type\" : \"RAM_ONLY\" },"
+	"  \"autodiscovery\" : { \"type\" : \"HTTP\" },"
+	"  \"statistics\" : { \"enabled\" : false },"
+	"  \"services\" : [ { \"name\" : \"bench\", \"description\" : \"\", \"app_name\" : \"bench\","
+	"    \"instance\" : \"default\", \"hosts_url\" : \"http://localhost\", \"control_port\" : 5000 } ]"
+	"} }";
+
+static void
+send_messages(lsd::service_t* service, const std::string* data, size_t count) {
+	lsd::message_path mpath("bench", "handle");
+	lsd::message_policy policy;
+
+	for (size_t i = 0; i < count; ++i) {
+		boost::shared_ptr<lsd::cached_message> msg =
+			boost::allocate_shared<lsd::cached_message>(lsd::slab_stl_allocator<lsd::cached_message>(),
+														mpath, policy, data->data(), data->size());
+
+		service->send_message(msg);
+	}
+}
+
+static double
+run_send_benchmark(boost::shared_ptr<lsd::context> context, size_t producers, size_t iterations) {
+	const lsd::configuration::services_list_t& services = context->config()->services_list();
+	lsd::service_t service(services.begin()->second, context);
+
+	std::vector<lsd::host_info<lsd::LT> > hosts;
+	std::vector<lsd::handle_info<lsd::LT> > handles;
+	handles.push_back(lsd::handle_info<lsd::LT>("handle", "bench", 5001));
+	service.refresh_hosts_and_handles(hosts, handles);
+
+	std::string data(512, 'x');
+	lsd::progress_timer timer;
+	boost::thread_group threads;
+
+	for (size_t i = 0; i < producers; ++i) {
+		threads.create_thread(boost::bind(&send_messages, &service, &data, iterations / producers));
+	}
+
+	threads.join_all();
+	return timer.elapsed().as_double();
+}
+
+int
+main(int argc, char** argv) {
+	size_t iterations = 1000000;
+
+	if (argc > 1) {
+		iterations = strtoul(argv[1], NULL, 10);
+	}
+
+	std::vector<std::string> envelopes(captured_envelopes, captured_envelopes + envelopes_count);
+
+	// check both paths agree before timing them
+	for (size_t i = 0; i < envelopes.size(); ++i) {
+		parsed_fields expected;
+		parsed_fields scanned;
+
+		parse_with_jsoncpp(envelopes[i], expected);
+		parse_with_scanner(envelopes[i], scanned);
+
+		if (expected.uuid != scanned.uuid || expected.completed != scanned.completed ||
+			expected.code != scanned.code || expected.message != scanned.message)
+		{
+			std::cout << "parsers disagree on envelope: " << envelopes[i];
+			return EXIT_FAILURE;
+		}
+	}
+
+	double jsoncpp_time = run_benchmark(envelopes, iterations, parse_with_jsoncpp);
+	double scanner_time = run_benchmark(envelopes, iterations, parse_with_scanner);
+
+	std::cout << "response envelope parsing, " << iterations << " envelopes" << std::endl;
+	std::cout << "jsoncpp: " << jsoncpp_time << " sec, " << (jsoncpp_time * 1e9 / iterations) << " ns/envelope" << std::endl;
+	std::cout << "scanner: " << scanner_time << " sec, " << (scanner_time * 1e9 / iterations) << " ns/envelope" << std::endl;
+
+	// uuids formatted by libuuid, check both parsers agree on them
+	std::vector<std::string> uuids;
+	for (size_t i = 0; i < 1024; ++i) {
+		char buff[128];
+		uuid_t uuid;
+		uuid_generate(uuid);
+		uuid_unparse(uuid, buff);
+
+		lsd::message_uuid parsed;
+		if (!parsed.parse(buff, strlen(buff)) || memcmp(parsed.bytes, uuid, sizeof(uuid)) != 0 || parsed.as_string() != buff) {
+			std::cout << "message_uuid disagrees with libuuid on: " << buff << std::endl;
+			return EXIT_FAILURE;
+		}
+
+		uuids.push_back(buff);
+	}
+
+	std::cout << std::endl << "uuid generation, " << iterations << " uuids" << std::endl;
+	print_uuid_result("libuuid generate + unparse", run_uuid_benchmark(iterations, generate_with_libuuid), iterations);
+	print_uuid_result("message_uuid generate", run_uuid_benchmark(iterations, generate_binary), iterations);
+	print_uuid_result("message_uuid generate + format", run_uuid_benchmark(iterations, generate_and_format), iterations);
+
+	std::cout << std::endl << "uuid parsing, " << iterations << " uuids" << std::endl;
+	print_uuid_result("libuuid", run_uuid_parse_benchmark(uuids, iterations, parse_with_libuuid), iterations);
+	print_uuid_result("message_uuid", run_uuid_parse_benchmark(uuids, iterations, parse_with_message_uuid), iterations);
+
+	// service::send_message() into handle ring and overflow queue
+	char config_path[] = "/tmp/lsd-bench-XXXXXX";
+	int config_fd = mkstemp(config_path);
+
+	if (config_fd == -1 || write(config_fd, send_benchmark_config, strlen(send_benchmark_config)) == -1) {
+		std::cout << "could not write benchmark config " << config_path << std::endl;
+		return EXIT_FAILURE;
+	}
+
+	close(config_fd);
+
+	boost::shared_ptr<lsd::context> context(new lsd::context(config_path));
+	unlink(config_path);
+
+	size_t send_iterations = std::min(iterations, (size_t)200000);
+	std::cout << std::endl << "service send, " << send_iterations << " messages of 512 bytes" << std::endl;
+
+	for (size_t producers = 1; producers <= 16; producers *= 2) {
+		double elapsed = run_send_benchmark(context, producers, send_iterations);
+		std::cout << producers << " producers: " << elapsed << " sec, ";
+		std::cout << (size_t)(send_iterations / elapsed) << " messages/sec" << std::endl;
+	}
+
+	return EXIT_SUCCESS;
+}
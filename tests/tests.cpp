@@ -13,6 +13,12 @@
 
 #define BOOST_AUTO_TEST_MAIN
 
+#include <algorithm>
+#include <set>
+
+#include <poll.h>
+
+#include <boost/bind.hpp>
 #include <boost/mpl/list.hpp>
 #include <boost/test/auto_unit_test.hpp>
 #include <boost/test/unit_test.hpp>
@@ -20,6 +26,21 @@
 #include <boost/thread.hpp>
 
 #include "details/time_value.hpp"
+#include "details/cache_budget.hpp"
+#include "details/cached_message.hpp"
+#include "details/callback_executor.hpp"
+#include "details/data_container.hpp"
+#include "details/envelope_parser.hpp"
+#include "details/message_index.hpp"
+#include "details/message_log.hpp"
+#include "details/message_scheduler.hpp"
+#include "details/mpsc_queue.hpp"
+#include "details/mpsc_ring.hpp"
+#include "details/retry_scheduler.hpp"
+#include "details/slab_allocator.hpp"
+#include "details/spill_queue.hpp"
+#include "details/timing_wheel.hpp"
+#include "details/wakeup_signal.hpp"
 
 typedef boost::mpl::list<int, long, unsigned char> test_types;
 
@@ -77,3 +98,1236 @@ BOOST_AUTO_TEST_CASE_TEMPLATE(time_value_test5, T, test_types) {
 }
 
 BOOST_AUTO_TEST_SUITE_END();
+
+BOOST_AUTO_TEST_SUITE(test_envelope_parser);
+
+BOOST_AUTO_TEST_CASE(envelope_parser_test1) {
+	std::string json = "{\"code\":503,\"completed\":false,\"message\":\"queue is full\","
+					   "\"uuid\":\"5c2a1c0e-0d4e-4c1b-a1f3-2f7c5f0c9a11\"}\n";
+
+	lsd::response_envelope envelope;
+	BOOST_CHECK_EQUAL(lsd::envelope_parser::scan_json(json.data(), json.size(), envelope), true);
+
+	BOOST_CHECK_EQUAL(std::string(envelope.uuid, envelope.uuid_size), "5c2a1c0e-0d4e-4c1b-a1f3-2f7c5f0c9a11");
+	BOOST_CHECK_EQUAL(std::string(envelope.message, envelope.message_size), "queue is full");
+	BOOST_CHECK_EQUAL(envelope.code, 503);
+	BOOST_CHECK_EQUAL(envelope.completed, false);
+	BOOST_CHECK_EQUAL(envelope.message_escaped, false);
+}
+
+BOOST_AUTO_TEST_CASE(envelope_parser_test2) {
+	std::string json = " { \"uuid\" : \"abc\", \"extra\" : { \"list\" : [1, \"}\", null] },"
+					   " \"completed\" : true, \"message\" : \"a\\\"b\\u00e9\" } ";
+
+	lsd::response_envelope envelope;
+	BOOST_CHECK_EQUAL(lsd::envelope_parser::scan_json(json.data(), json.size(), envelope), true);
+
+	BOOST_CHECK_EQUAL(std::string(envelope.uuid, envelope.uuid_size), "abc");
+	BOOST_CHECK_EQUAL(envelope.completed, true);
+	BOOST_CHECK_EQUAL(envelope.code, 0);
+	BOOST_CHECK_EQUAL(envelope.message_escaped, true);
+
+	std::string message;
+	BOOST_CHECK_EQUAL(lsd::envelope_parser::unescape(envelope.message, envelope.message_size, message), true);
+	BOOST_CHECK_EQUAL(message, "a\"b\xc3\xa9");
+}
+
+BOOST_AUTO_TEST_CASE(envelope_parser_test3) {
+	lsd::response_envelope envelope;
+
+	std::string truncated = "{\"uuid\":\"abc\",\"code\":5";
+	BOOST_CHECK_EQUAL(lsd::envelope_parser::scan_json(truncated.data(), truncated.size(), envelope), false);
+
+	std::string fractional_code = "{\"uuid\":\"abc\",\"code\":5.5}";
+	BOOST_CHECK_EQUAL(lsd::envelope_parser::scan_json(fractional_code.data(), fractional_code.size(), envelope), false);
+
+	std::string not_object = "[\"abc\"]";
+	BOOST_CHECK_EQUAL(lsd::envelope_parser::scan_json(not_object.data(), not_object.size(), envelope), false);
+}
+
+BOOST_AUTO_TEST_SUITE_END();
+
+BOOST_AUTO_TEST_SUITE(test_retry_scheduler);
+
+BOOST_AUTO_TEST_CASE(retry_scheduler_test1) {
+	lsd::retry_scheduler scheduler;
+	lsd::message_path path("service", "handle");
+	lsd::message_policy policy;
+
+	boost::shared_ptr<lsd::cached_message> msg1(new lsd::cached_message(path, policy, "1", 1));
+	boost::shared_ptr<lsd::cached_message> msg2(new lsd::cached_message(path, policy, "2", 1));
+	boost::shared_ptr<lsd::cached_message> msg3(new lsd::cached_message(path, policy, "3", 1));
+
+	scheduler.schedule(msg1, 30.0);
+	scheduler.schedule(msg2, 10.0);
+	scheduler.schedule(msg3, 20.0);
+
+	double release_time = 0.0;
+	BOOST_CHECK_EQUAL(scheduler.next_release_time(0.0, release_time), true);
+	BOOST_CHECK_EQUAL(release_time, 10.0);
+
+	lsd::retry_scheduler::message_queue_t due;
+	BOOST_CHECK_EQUAL(scheduler.pop_due(5.0, 10, due), 0u);
+	BOOST_CHECK_EQUAL(scheduler.pop_due(25.0, 10, due), 2u);
+	BOOST_CHECK_EQUAL(due[0] == msg2, true);
+	BOOST_CHECK_EQUAL(due[1] == msg3, true);
+
+	due.clear();
+	scheduler.pop_all(due);
+	BOOST_CHECK_EQUAL(due.size(), 1u);
+	BOOST_CHECK_EQUAL(due[0] == msg1, true);
+	BOOST_CHECK_EQUAL(scheduler.empty(), true);
+}
+
+BOOST_AUTO_TEST_CASE(retry_scheduler_test2) {
+	// 10 messages per second, burst of 2
+	lsd::retry_scheduler scheduler;
+	scheduler.set_rate_limit(10.0, 2.0);
+
+	lsd::message_path path("service", "handle");
+	lsd::message_policy policy;
+
+	for (int i = 0; i < 10; ++i) {
+		boost::shared_ptr<lsd::cached_message> msg(new lsd::cached_message(path, policy, "x", 1));
+		scheduler.schedule(msg, 1.0);
+	}
+
+	lsd::retry_scheduler::message_queue_t due;
+	BOOST_CHECK_EQUAL(scheduler.pop_due(100.0, 10, due), 2u);
+	BOOST_CHECK_EQUAL(scheduler.pop_due(100.05, 10, due), 0u);
+	BOOST_CHECK_EQUAL(scheduler.pop_due(100.15, 10, due), 1u);
+
+	double release_time = 0.0;
+	scheduler.next_release_time(100.15, release_time);
+	BOOST_CHECK_EQUAL(release_time > 100.15, true);
+}
+
+BOOST_AUTO_TEST_CASE(retry_scheduler_test3) {
+	unsigned int seed = 1;
+
+	for (int attempt = 1; attempt < 20; ++attempt) {
+		double delay = lsd::retry_scheduler::backoff_delay(attempt, 0.05, 5.0, &seed);
+		double expected = std::min(0.05 * (1 << (attempt - 1)), 5.0);
+
+		BOOST_CHECK_EQUAL(delay >= expected / 2.0, true);
+		BOOST_CHECK_EQUAL(delay <= expected, true);
+	}
+}
+
+BOOST_AUTO_TEST_SUITE_END();
+
+BOOST_AUTO_TEST_SUITE(test_timing_wheel);
+
+BOOST_AUTO_TEST_CASE(timing_wheel_test1) {
+	// 10 ms ticks
+	lsd::timing_wheel<int> wheel(0.01, 100.0);
+	std::vector<int> expired;
+
+	wheel.add(100.5, 1);
+	wheel.add(100.05, 2);
+	wheel.add(99.0, 3);
+
+	double expire_time = 0.0;
+	BOOST_CHECK_EQUAL(wheel.next_expiry_time(expire_time), true);
+	BOOST_CHECK_CLOSE(expire_time, 100.0, 1e-6);
+
+	// overdue timer fires right away
+	BOOST_CHECK_EQUAL(wheel.advance(100.0, expired), 1u);
+	BOOST_CHECK_EQUAL(expired[0], 3);
+
+	expired.clear();
+	BOOST_CHECK_EQUAL(wheel.advance(100.1, expired), 1u);
+	BOOST_CHECK_EQUAL(expired[0], 2);
+
+	expired.clear();
+	BOOST_CHECK_EQUAL(wheel.advance(100.4, expired), 0u);
+	BOOST_CHECK_EQUAL(wheel.advance(100.6, expired), 1u);
+	BOOST_CHECK_EQUAL(expired[0], 1);
+	BOOST_CHECK_EQUAL(wheel.empty(), true);
+}
+
+BOOST_AUTO_TEST_CASE(timing_wheel_test2) {
+	// timers beyond the first level cascade down and fire in time
+	lsd::timing_wheel<int> wheel(0.01, 0.0);
+	std::vector<int> expired;
+
+	wheel.add(5.0, 1);
+	wheel.add(600.0, 2);
+	wheel.add(200000.0, 3);
+
+	BOOST_CHECK_EQUAL(wheel.advance(4.99, expired), 0u);
+	BOOST_CHECK_EQUAL(wheel.advance(5.01, expired), 1u);
+	BOOST_CHECK_EQUAL(wheel.advance(599.98, expired), 0u);
+	BOOST_CHECK_EQUAL(wheel.advance(600.01, expired), 1u);
+	BOOST_CHECK_EQUAL(expired.size(), 2u);
+	BOOST_CHECK_EQUAL(expired[1], 2);
+
+	BOOST_CHECK_EQUAL(wheel.advance(199999.0, expired), 0u);
+	BOOST_CHECK_EQUAL(wheel.advance(200000.01, expired), 1u);
+	BOOST_CHECK_EQUAL(expired.size(), 3u);
+	BOOST_CHECK_EQUAL(expired[2], 3);
+	BOOST_CHECK_EQUAL(wheel.size(), 0u);
+}
+
+BOOST_AUTO_TEST_SUITE_END();
+
+BOOST_AUTO_TEST_SUITE(test_message_scheduler);
+
+BOOST_AUTO_TEST_CASE(message_scheduler_test1) {
+	lsd::message_scheduler scheduler;
+	lsd::message_path path("service", "handle");
+
+	lsd::message_policy normal;
+	lsd::message_policy urgent;
+	urgent.urgent = true;
+
+	lsd::message_policy late = normal;
+	late.deadline = 2000.0;
+
+	lsd::message_policy early = normal;
+	early.deadline = 1000.0;
+
+	boost::shared_ptr<lsd::cached_message> msg1(new lsd::cached_message(path, normal, "1", 1));
+	boost::shared_ptr<lsd::cached_message> msg2(new lsd::cached_message(path, late, "2", 1));
+	boost::shared_ptr<lsd::cached_message> msg3(new lsd::cached_message(path, early, "3", 1));
+	boost::shared_ptr<lsd::cached_message> msg4(new lsd::cached_message(path, urgent, "4", 1));
+
+	scheduler.push_back(msg1);
+	scheduler.push_back(msg2);
+	scheduler.push_back(msg3);
+	scheduler.push_back(msg4);
+
+	BOOST_CHECK_EQUAL(scheduler.size(), 4u);
+	BOOST_CHECK_EQUAL(scheduler.urgent_size(), 1u);
+
+	// urgent, then earliest deadline, then fifo
+	lsd::message_scheduler::message_queue_t messages;
+	scheduler.pop_all(messages);
+
+	BOOST_CHECK_EQUAL(messages.size(), 4u);
+	BOOST_CHECK_EQUAL(messages[0] == msg4, true);
+	BOOST_CHECK_EQUAL(messages[1] == msg3, true);
+	BOOST_CHECK_EQUAL(messages[2] == msg2, true);
+	BOOST_CHECK_EQUAL(messages[3] == msg1, true);
+	BOOST_CHECK_EQUAL(scheduler.empty(), true);
+}
+
+BOOST_AUTO_TEST_CASE(message_scheduler_test2) {
+	// messages put back keep their order in front of the rest
+	lsd::message_scheduler scheduler;
+	lsd::message_path path("service", "handle");
+	lsd::message_policy policy;
+
+	boost::shared_ptr<lsd::cached_message> msg1(new lsd::cached_message(path, policy, "1", 1));
+	boost::shared_ptr<lsd::cached_message> msg2(new lsd::cached_message(path, policy, "2", 1));
+	boost::shared_ptr<lsd::cached_message> msg3(new lsd::cached_message(path, policy, "3", 1));
+
+	scheduler.push_back(msg3);
+
+	lsd::message_scheduler::message_queue_t unsent;
+	unsent.push_back(msg1);
+	unsent.push_back(msg2);
+	scheduler.push_front(unsent);
+
+	BOOST_CHECK_EQUAL(scheduler.front() == msg1, true);
+	scheduler.pop_front();
+	BOOST_CHECK_EQUAL(scheduler.front() == msg2, true);
+	scheduler.pop_front();
+	BOOST_CHECK_EQUAL(scheduler.front() == msg3, true);
+	scheduler.pop_front();
+	BOOST_CHECK_EQUAL(scheduler.empty(), true);
+}
+
+BOOST_AUTO_TEST_CASE(message_scheduler_test3) {
+	// fifo message goes out once its implicit deadline is the earliest
+	lsd::message_scheduler scheduler;
+	lsd::message_path path("service", "handle");
+	double now = lsd::time_value::get_current_time().as_double();
+
+	lsd::message_policy normal;
+	normal.timeout = 5.0;
+
+	lsd::message_policy soon = normal;
+	soon.deadline = now + 1.0;
+
+	lsd::message_policy later = normal;
+	later.deadline = now + 60.0;
+
+	boost::shared_ptr<lsd::cached_message> msg1(new lsd::cached_message(path, soon, "1", 1));
+	boost::shared_ptr<lsd::cached_message> msg2(new lsd::cached_message(path, normal, "2", 1));
+	boost::shared_ptr<lsd::cached_message> msg3(new lsd::cached_message(path, later, "3", 1));
+	boost::shared_ptr<lsd::cached_message> msg4(new lsd::cached_message(path, soon, "4", 1));
+
+	scheduler.push_back(msg1);
+	scheduler.push_back(msg2);
+	scheduler.push_back(msg3);
+	scheduler.push_back(msg4);
+
+	lsd::message_scheduler::message_queue_t messages;
+	scheduler.pop_all(messages);
+
+	BOOST_REQUIRE_EQUAL(messages.size(), 4u);
+	BOOST_CHECK_EQUAL(messages[0] == msg1, true);
+	BOOST_CHECK_EQUAL(messages[1] == msg4, true);
+	BOOST_CHECK_EQUAL(messages[2] == msg2, true);
+	BOOST_CHECK_EQUAL(messages[3] == msg3, true);
+}
+
+BOOST_AUTO_TEST_SUITE_END();
+
+BOOST_AUTO_TEST_SUITE(test_mpsc_queue);
+
+static void
+push_numbers(lsd::mpsc_queue<int>* queue, int producer, int count) {
+	for (int i = 0; i < count; ++i) {
+		queue->push(producer * count + i);
+	}
+}
+
+BOOST_AUTO_TEST_CASE(mpsc_queue_test1) {
+	lsd::mpsc_queue<int> queue;
+	int value = 0;
+
+	BOOST_CHECK_EQUAL(queue.pop(value), false);
+
+	queue.push(1);
+	queue.push(2);
+
+	BOOST_CHECK_EQUAL(queue.pop(value), true);
+	BOOST_CHECK_EQUAL(value, 1);
+	BOOST_CHECK_EQUAL(queue.pop(value), true);
+	BOOST_CHECK_EQUAL(value, 2);
+	BOOST_CHECK_EQUAL(queue.pop(value), false);
+}
+
+BOOST_AUTO_TEST_CASE(mpsc_queue_test2) {
+	// every value arrives once, in order per producer
+	const int producers = 4;
+	const int count = 10000;
+
+	lsd::mpsc_queue<int> queue;
+	boost::thread_group threads;
+
+	for (int i = 0; i < producers; ++i) {
+		threads.create_thread(boost::bind(&push_numbers, &queue, i, count));
+	}
+
+	std::vector<int> last(producers, -1);
+	int received = 0;
+	int value = 0;
+
+	while (received < producers * count) {
+		if (!queue.pop(value)) {
+			continue;
+		}
+
+		int producer = value / count;
+		BOOST_REQUIRE_EQUAL(value % count, last[producer] + 1);
+		last[producer] = value % count;
+		++received;
+	}
+
+	threads.join_all();
+	BOOST_CHECK_EQUAL(queue.pop(value), false);
+}
+
+BOOST_AUTO_TEST_SUITE_END();
+
+BOOST_AUTO_TEST_SUITE(test_mpsc_ring);
+
+static void
+push_numbers_to_ring(lsd::mpsc_ring<int>* ring, int producer, int count) {
+	for (int i = 0; i < count; ++i) {
+		while (!ring->try_push(producer * count + i)) {
+			boost::this_thread::yield();
+		}
+	}
+}
+
+BOOST_AUTO_TEST_CASE(mpsc_ring_test1) {
+	// capacity is rounded up, full ring rejects values and recovers after pop
+	lsd::mpsc_ring<int> ring(3);
+	BOOST_CHECK_EQUAL(ring.capacity(), 4u);
+
+	int value = 0;
+	BOOST_CHECK_EQUAL(ring.pop(value), false);
+
+	for (int lap = 0; lap < 3; ++lap) {
+		for (int i = 0; i < 4; ++i) {
+			BOOST_CHECK_EQUAL(ring.try_push(lap * 4 + i), true);
+		}
+
+		BOOST_CHECK_EQUAL(ring.try_push(100), false);
+
+		for (int i = 0; i < 4; ++i) {
+			BOOST_CHECK_EQUAL(ring.pop(value), true);
+			BOOST_CHECK_EQUAL(value, lap * 4 + i);
+		}
+
+		BOOST_CHECK_EQUAL(ring.pop(value), false);
+	}
+}
+
+BOOST_AUTO_TEST_CASE(mpsc_ring_test2) {
+	// small ring keeps producers bumping into a full ring
+	const int producers = 4;
+	const int count = 10000;
+
+	lsd::mpsc_ring<int> ring(16);
+	boost::thread_group threads;
+
+	for (int i = 0; i < producers; ++i) {
+		threads.create_thread(boost::bind(&push_numbers_to_ring, &ring, i, count));
+	}
+
+	std::vector<int> last(producers, -1);
+	int received = 0;
+	int value = 0;
+
+	while (received < producers * count) {
+		if (!ring.pop(value)) {
+			continue;
+		}
+
+		int producer = value / count;
+		BOOST_REQUIRE_EQUAL(value % count, last[producer] + 1);
+		last[producer] = value % count;
+		++received;
+	}
+
+	threads.join_all();
+	BOOST_CHECK_EQUAL(ring.pop(value), false);
+}
+
+BOOST_AUTO_TEST_SUITE_END();
+
+BOOST_AUTO_TEST_SUITE(test_wakeup_signal);
+
+static bool
+is_readable(const lsd::wakeup_signal& signal) {
+	pollfd item;
+	item.fd = signal.fd();
+	item.events = POLLIN;
+	item.revents = 0;
+
+	return (poll(&item, 1, 0) == 1 && (item.revents & POLLIN) == POLLIN);
+}
+
+static void
+post_and_notify(lsd::wakeup_signal* signal, volatile int* posted, int count) {
+	for (int i = 0; i < count; ++i) {
+		__sync_add_and_fetch(posted, 1);
+		signal->notify();
+	}
+}
+
+BOOST_AUTO_TEST_CASE(wakeup_signal_test1) {
+	lsd::wakeup_signal signal;
+	BOOST_CHECK(!is_readable(signal));
+
+	// notifications are coalesced until drain
+	signal.notify();
+	signal.notify();
+	BOOST_CHECK(is_readable(signal));
+
+	signal.drain();
+	BOOST_CHECK(!is_readable(signal));
+
+	signal.notify();
+	BOOST_CHECK(is_readable(signal));
+}
+
+BOOST_AUTO_TEST_CASE(wakeup_signal_test2) {
+	// drained like a reactor does, only when fd is readable. notify racing
+	// with drain must never leave signal stuck with work posted
+	lsd::wakeup_signal signal;
+	volatile int posted = 0;
+	int consumed = 0;
+	const int count = 200000;
+
+	boost::thread notifier(boost::bind(&post_and_notify, &signal, &posted, count));
+
+	while (consumed < count) {
+		pollfd item;
+		item.fd = signal.fd();
+		item.events = POLLIN;
+		item.revents = 0;
+
+		if (poll(&item, 1, 1000) != 1) {
+			break;
+		}
+
+		signal.drain();
+
+		// queue is re-checked after drain
+		consumed = __sync_add_and_fetch(&posted, 0);
+	}
+
+	notifier.join();
+	BOOST_REQUIRE_EQUAL(consumed, count);
+
+	// notify issued after drain makes fd readable
+	signal.notify();
+	BOOST_CHECK(is_readable(signal));
+}
+
+BOOST_AUTO_TEST_SUITE_END();
+
+BOOST_AUTO_TEST_SUITE(test_message_index);
+
+BOOST_AUTO_TEST_CASE(message_index_test1) {
+	lsd::message_uuid uuid;
+	BOOST_CHECK_EQUAL(uuid.parse("6e8bb3c8-3f3b-4c39-9b6a-0c1a6f2a9d14"), true);
+	BOOST_CHECK_EQUAL(uuid.as_string(), "6e8bb3c8-3f3b-4c39-9b6a-0c1a6f2a9d14");
+	BOOST_CHECK_EQUAL(uuid.parse("6E8BB3C8-3F3B-4C39-9B6A-0C1A6F2A9D14"), true);
+	BOOST_CHECK_EQUAL(uuid.as_string(), "6e8bb3c8-3f3b-4c39-9b6a-0c1a6f2a9d14");
+
+	BOOST_CHECK_EQUAL(uuid.parse("6e8bb3c8-3f3b-4c39-9b6a-0c1a6f2a9d1"), false);
+	BOOST_CHECK_EQUAL(uuid.parse("6e8bb3c8_3f3b-4c39-9b6a-0c1a6f2a9d14"), false);
+	BOOST_CHECK_EQUAL(uuid.parse("6e8bb3c8-3f3b-4c39-9b6a-0c1a6f2a9d1x"), false);
+}
+
+BOOST_AUTO_TEST_CASE(message_index_test2) {
+	lsd::message_index index;
+	lsd::message_path path("service", "handle");
+	lsd::message_policy policy;
+
+	boost::shared_ptr<lsd::cached_message> msg1(new lsd::cached_message(path, policy, "1", 1));
+	boost::shared_ptr<lsd::cached_message> msg2(new lsd::cached_message(path, policy, "2", 1));
+
+	BOOST_CHECK_EQUAL(index.insert(msg1), true);
+	BOOST_CHECK_EQUAL(index.insert(msg1), false);
+	BOOST_CHECK_EQUAL(index.insert(msg2), true);
+	BOOST_CHECK_EQUAL(index.size(), 2u);
+
+	lsd::message_uuid uuid;
+	BOOST_CHECK_EQUAL(uuid.parse(msg1->uuid()), true);
+	BOOST_CHECK_EQUAL(index.find(uuid) == msg1, true);
+	BOOST_CHECK_EQUAL(index.take(uuid) == msg1, true);
+	BOOST_CHECK_EQUAL(index.find(uuid).get() == NULL, true);
+	BOOST_CHECK_EQUAL(index.find(msg2->binary_uuid()) == msg2, true);
+	BOOST_CHECK_EQUAL(index.size(), 1u);
+}
+
+BOOST_AUTO_TEST_CASE(message_index_test3) {
+	// grow past initial capacity and erase every other message
+	lsd::message_index index;
+	lsd::message_path path("service", "handle");
+	lsd::message_policy policy;
+
+	std::vector<boost::shared_ptr<lsd::cached_message> > messages;
+	for (int i = 0; i < 1000; ++i) {
+		messages.push_back(boost::shared_ptr<lsd::cached_message>(new lsd::cached_message(path, policy, "data", 4)));
+		BOOST_REQUIRE_EQUAL(index.insert(messages.back()), true);
+	}
+
+	for (size_t i = 0; i < messages.size(); i += 2) {
+		BOOST_REQUIRE_EQUAL(index.take(messages[i]->binary_uuid()) == messages[i], true);
+	}
+
+	BOOST_CHECK_EQUAL(index.size(), 500u);
+
+	for (size_t i = 0; i < messages.size(); ++i) {
+		bool found = (index.find(messages[i]->binary_uuid()) == messages[i]);
+		BOOST_REQUIRE_EQUAL(found, (i % 2 == 1));
+	}
+
+	std::vector<boost::shared_ptr<lsd::cached_message> > rest;
+	index.take_all(rest);
+	BOOST_CHECK_EQUAL(rest.size(), 500u);
+	BOOST_CHECK_EQUAL(index.empty(), true);
+}
+
+BOOST_AUTO_TEST_SUITE_END();
+
+BOOST_AUTO_TEST_SUITE(test_message_log);
+
+static std::string
+make_log_directory() {
+	char path[] = "/tmp/lsd-tests-XXXXXX";
+	BOOST_REQUIRE(mkdtemp(path) != NULL);
+	return std::string(path);
+}
+
+static void
+remove_log_directory(const std::string& path) {
+	std::string command = "rm -rf " + path;
+	BOOST_CHECK_EQUAL(system(command.c_str()), 0);
+}
+
+BOOST_AUTO_TEST_CASE(message_log_test1) {
+	// live messages survive reopen in append order, removed ones don't
+	std::string path = make_log_directory();
+	boost::shared_ptr<lsd::base_logger> logger(new lsd::smart_logger<lsd::empty_logger>);
+
+	lsd::message_path mpath("service", "handle");
+	lsd::message_policy policy;
+	policy.urgent = true;
+	policy.deadline = 12345.5;
+
+	lsd::cached_message msg1(mpath, policy, "first", 5);
+	lsd::cached_message msg2(mpath, policy, "second", 6);
+	lsd::cached_message msg3(mpath, policy, "third", 5);
+
+	{
+		lsd::message_log log(path, 0, 1.0, 0, logger);
+		log.append(msg1);
+		log.append(msg2);
+		log.append(msg3);
+		log.remove(msg2.binary_uuid());
+
+		BOOST_CHECK_EQUAL(log.live_messages_count(), 2u);
+	}
+
+	lsd::message_log log(path, 0, 1.0, 0, logger);
+	std::vector<boost::shared_ptr<lsd::cached_message> > messages;
+	log.read_recovered_messages((size_t)-1, messages);
+
+	BOOST_REQUIRE_EQUAL(messages.size(), 2u);
+	BOOST_CHECK_EQUAL(messages[0]->uuid(), msg1.uuid());
+	BOOST_CHECK_EQUAL(messages[1]->uuid(), msg3.uuid());
+	BOOST_CHECK_EQUAL(messages[1]->path() == mpath, true);
+	BOOST_CHECK_EQUAL(messages[1]->policy() == policy, true);
+	BOOST_CHECK_EQUAL(std::string((const char*)messages[1]->data().data(), messages[1]->data().size()), "third");
+
+	// removing everything lets dead segments go
+	log.remove(msg1.binary_uuid());
+	log.remove(msg3.binary_uuid());
+	BOOST_CHECK_EQUAL(log.live_messages_count(), 0u);
+	BOOST_CHECK_EQUAL(log.segments_count(), 1u);
+
+	remove_log_directory(path);
+}
+
+BOOST_AUTO_TEST_CASE(message_log_test2) {
+	// over max size oldest segments are compacted, live data only is rejected
+	std::string path = make_log_directory();
+	boost::shared_ptr<lsd::base_logger> logger(new lsd::smart_logger<lsd::empty_logger>);
+
+	lsd::message_path mpath("service", "handle");
+	lsd::message_policy policy;
+	std::string data(lsd::message_log::SEGMENT_SIZE / 4, 'x');
+
+	lsd::cached_message keep(mpath, policy, data.data(), data.size());
+
+	{
+		lsd::message_log log(path, lsd::message_log::SEGMENT_SIZE * 2, 1.0, 0, logger);
+		log.append(keep);
+
+		for (int i = 0; i < 20; ++i) {
+			lsd::cached_message msg(mpath, policy, data.data(), data.size());
+			log.append(msg);
+			log.remove(msg.binary_uuid());
+			BOOST_REQUIRE(log.disk_size() <= lsd::message_log::SEGMENT_SIZE * 2);
+		}
+
+		for (int i = 0; i < 6; ++i) {
+			lsd::cached_message msg(mpath, policy, data.data(), data.size());
+			log.append(msg);
+		}
+
+		lsd::cached_message extra(mpath, policy, data.data(), data.size());
+		BOOST_CHECK_THROW(log.append(extra), lsd::error);
+	}
+
+	lsd::message_log log(path, lsd::message_log::SEGMENT_SIZE * 2, 1.0, 0, logger);
+	std::vector<boost::shared_ptr<lsd::cached_message> > messages;
+	log.read_recovered_messages((size_t)-1, messages);
+
+	BOOST_REQUIRE_EQUAL(messages.size(), 7u);
+	BOOST_CHECK_EQUAL(messages[0]->uuid(), keep.uuid());
+
+	remove_log_directory(path);
+}
+
+BOOST_AUTO_TEST_CASE(message_log_test3) {
+	// waiting producer doesn't wait for sync interval, one sync covers all written records
+	std::string path = make_log_directory();
+	boost::shared_ptr<lsd::base_logger> logger(new lsd::smart_logger<lsd::empty_logger>);
+
+	lsd::message_path mpath("service", "handle");
+	lsd::message_policy policy;
+
+	lsd::message_log log(path, 0, 3600.0, 0, logger);
+
+	lsd::cached_message msg1(mpath, policy, "first", 5);
+	lsd::cached_message msg2(mpath, policy, "second", 6);
+	lsd::cached_message msg3(mpath, policy, "third", 5);
+
+	boost::uint64_t ticket1 = log.append(msg1);
+	log.append(msg2);
+	boost::uint64_t ticket3 = log.append(msg3);
+	BOOST_CHECK(ticket3 > ticket1);
+
+	log.wait_committed(ticket3);
+	log.wait_committed(ticket1);
+
+	lsd::commit_stats stats = log.commit_statistics();
+	BOOST_CHECK_EQUAL(stats.commits, 1u);
+	BOOST_CHECK_EQUAL(stats.committed_records, 3u);
+	BOOST_CHECK_EQUAL(stats.batch_size.buckets[2], 1u);
+
+	remove_log_directory(path);
+}
+
+BOOST_AUTO_TEST_CASE(message_log_test4) {
+	// compaction stops at a corrupted record in the middle of the log
+	std::string path = make_log_directory();
+	boost::shared_ptr<lsd::base_logger> logger(new lsd::smart_logger<lsd::empty_logger>);
+
+	lsd::message_path mpath("service", "handle");
+	lsd::message_policy policy;
+	std::string data(lsd::message_log::SEGMENT_SIZE / 4, 'x');
+
+	// three records in first segment, two in second
+	std::vector<std::string> uuids;
+	{
+		lsd::message_log log(path, 0, 1.0, 0, logger);
+
+		for (int i = 0; i < 5; ++i) {
+			lsd::cached_message msg(mpath, policy, data.data(), data.size());
+			log.append(msg);
+			uuids.push_back(msg.uuid());
+		}
+
+		BOOST_REQUIRE_EQUAL(log.segments_count(), 2u);
+	}
+
+	// all records are of the same size, break header of the second one
+	std::string segment = path + "/segment-00000000.log";
+	FILE* file = fopen(segment.c_str(), "r+");
+	BOOST_REQUIRE(file != NULL);
+	BOOST_REQUIRE_EQUAL(fseek(file, 0, SEEK_END), 0);
+	long record_size = ftell(file) / 3;
+
+	std::string garbage(64, (char)0xff);
+	BOOST_REQUIRE_EQUAL(fseek(file, record_size, SEEK_SET), 0);
+	BOOST_REQUIRE_EQUAL(fwrite(garbage.data(), 1, garbage.size(), file), garbage.size());
+	fclose(file);
+
+	{
+		lsd::message_log log(path, lsd::message_log::SEGMENT_SIZE * 2, 1.0, 0, logger);
+		BOOST_CHECK_EQUAL(log.live_messages_count(), 3u);
+
+		// pushes first segment out through compaction
+		boost::uint64_t ticket = 0;
+		for (int i = 0; i < 3; ++i) {
+			lsd::cached_message msg(mpath, policy, data.data(), data.size());
+			ticket = log.append(msg);
+			uuids.push_back(msg.uuid());
+		}
+
+		BOOST_CHECK_EQUAL(log.live_messages_count(), 6u);
+
+		// compacted segment goes away once moved records are committed
+		log.wait_committed(ticket);
+		BOOST_CHECK(access(segment.c_str(), F_OK) != 0);
+	}
+
+	lsd::message_log log(path, 0, 1.0, 0, logger);
+	std::vector<boost::shared_ptr<lsd::cached_message> > messages;
+	log.read_recovered_messages((size_t)-1, messages);
+
+	BOOST_REQUIRE_EQUAL(messages.size(), 6u);
+	BOOST_CHECK_EQUAL(messages[0]->uuid(), uuids[0]);
+	BOOST_CHECK_EQUAL(messages[1]->uuid(), uuids[3]);
+	BOOST_CHECK_EQUAL(messages[5]->uuid(), uuids[7]);
+
+	remove_log_directory(path);
+}
+
+BOOST_AUTO_TEST_CASE(message_log_test5) {
+	// backlog in more segments than cores comes back in append order, batch by batch
+	std::string path = make_log_directory();
+	boost::shared_ptr<lsd::base_logger> logger(new lsd::smart_logger<lsd::empty_logger>);
+
+	lsd::message_path mpath("service", "handle");
+	lsd::message_policy policy;
+	std::string data(1000, 'x');
+
+	const boost::uint64_t segment_size = 4096;
+	size_t segments_count = 0;
+	std::vector<std::string> uuids;
+
+	{
+		lsd::message_log log(path, 0, 1.0, 0, logger, segment_size);
+		size_t min_segments = std::max(boost::thread::hardware_concurrency(), 1u) * 2 + 1;
+
+		for (int i = 0; log.segments_count() <= min_segments; ++i) {
+			lsd::cached_message msg(mpath, policy, data.data(), data.size());
+			log.append(msg);
+
+			// every third message is completed
+			if (i % 3 == 1) {
+				log.remove(msg.binary_uuid());
+			}
+			else {
+				uuids.push_back(msg.uuid());
+			}
+		}
+
+		segments_count = log.segments_count();
+	}
+
+	lsd::message_log log(path, 0, 1.0, 0, logger, segment_size);
+	BOOST_CHECK_EQUAL(log.segments_count(), segments_count);
+	BOOST_CHECK_EQUAL(log.recovered_messages_count(), uuids.size());
+
+	// completed before requeued, skipped
+	lsd::message_uuid removed;
+	BOOST_REQUIRE(removed.parse(uuids[5]));
+	log.remove(removed);
+
+	std::vector<boost::shared_ptr<lsd::cached_message> > messages;
+	size_t batches = 0;
+
+	while (log.recovered_messages_count() > 0) {
+		size_t count = messages.size();
+		log.read_recovered_messages(3000, messages);
+		BOOST_REQUIRE(messages.size() - count <= 3);
+		++batches;
+	}
+
+	BOOST_CHECK(batches > 1);
+	BOOST_REQUIRE_EQUAL(messages.size(), uuids.size() - 1);
+
+	for (size_t i = 0, j = 0; i < messages.size(); ++i, ++j) {
+		if (j == 5) {
+			++j;
+		}
+
+		BOOST_REQUIRE_EQUAL(messages[i]->uuid(), uuids[j]);
+		BOOST_REQUIRE_EQUAL(messages[i]->data().size(), data.size());
+	}
+
+	remove_log_directory(path);
+}
+
+BOOST_AUTO_TEST_SUITE_END();
+
+BOOST_AUTO_TEST_SUITE(test_spill_queue);
+
+BOOST_AUTO_TEST_CASE(spill_queue_test1) {
+	// messages come back in order across chunks, read through chunks are dropped
+	std::string path = test_message_log::make_log_directory();
+	boost::shared_ptr<lsd::base_logger> logger(new lsd::smart_logger<lsd::empty_logger>);
+
+	lsd::message_path mpath("service", "handle");
+	lsd::message_policy policy;
+	std::string data(lsd::spill_queue::CHUNK_SIZE / 8, 'x');
+
+	lsd::spill_queue spill(path + "/spill", lsd::spill_queue::CHUNK_SIZE * 2, logger);
+	std::vector<std::string> uuids;
+
+	while (true) {
+		lsd::cached_message msg(mpath, policy, data.data(), data.size());
+
+		if (!spill.push(msg)) {
+			break;
+		}
+
+		uuids.push_back(msg.uuid());
+	}
+
+	BOOST_REQUIRE(uuids.size() > 8);
+	BOOST_CHECK_EQUAL(spill.size(), uuids.size());
+	BOOST_CHECK(spill.disk_size() <= lsd::spill_queue::CHUNK_SIZE * 2);
+
+	for (size_t i = 0; i < uuids.size(); ++i) {
+		boost::shared_ptr<lsd::cached_message> msg = spill.pop();
+		BOOST_REQUIRE(msg);
+		BOOST_CHECK_EQUAL(msg->uuid(), uuids[i]);
+		BOOST_CHECK_EQUAL(msg->data().size(), data.size());
+	}
+
+	BOOST_CHECK(spill.empty());
+	BOOST_CHECK(!spill.pop());
+	BOOST_CHECK_EQUAL(spill.disk_size(), 0u);
+
+	test_message_log::remove_log_directory(path);
+}
+
+BOOST_AUTO_TEST_SUITE_END();
+
+BOOST_AUTO_TEST_SUITE(test_cache_budget);
+
+static void
+release_later(lsd::cache_budget* budget, size_t size) {
+	boost::this_thread::sleep(boost::posix_time::milliseconds(50));
+	budget->release(size);
+}
+
+static void
+record_watermark(std::vector<int>* events, enum lsd::cache_watermark_event event, size_t) {
+	events->push_back((int)event);
+}
+
+BOOST_AUTO_TEST_CASE(cache_budget_test1) {
+	// try fails fast, timed gives up, waiting producer gets room once released
+	lsd::cache_budget budget(100);
+
+	BOOST_CHECK(budget.try_reserve(60));
+	BOOST_CHECK(!budget.try_reserve(60));
+	BOOST_CHECK(!budget.reserve(60, 0.01));
+	BOOST_CHECK(!budget.reserve(200, -1.0));
+	BOOST_CHECK_EQUAL(budget.used(), 60u);
+
+	boost::thread releaser(boost::bind(&release_later, &budget, 60));
+	BOOST_CHECK(budget.reserve(60, -1.0));
+	releaser.join();
+
+	BOOST_CHECK_EQUAL(budget.used(), 60u);
+
+	budget.force_reserve(100);
+	BOOST_CHECK_EQUAL(budget.used(), 160u);
+	budget.release(160);
+	BOOST_CHECK_EQUAL(budget.used(), 0u);
+}
+
+BOOST_AUTO_TEST_CASE(cache_budget_test2) {
+	// watermark callback fires once per crossing
+	lsd::cache_budget budget(100);
+	std::vector<int> events;
+
+	budget.set_watermarks(80, 20, boost::bind(&record_watermark, &events, _1, _2));
+
+	budget.try_reserve(50);
+	budget.try_reserve(30);
+	budget.try_reserve(10);
+	budget.release(40);
+	budget.release(30);
+	budget.try_reserve(60);
+	budget.try_reserve(10);
+
+	BOOST_REQUIRE_EQUAL(events.size(), 3u);
+	BOOST_CHECK_EQUAL(events[0], (int)lsd::CACHE_HIGH_WATERMARK_REACHED);
+	BOOST_CHECK_EQUAL(events[1], (int)lsd::CACHE_LOW_WATERMARK_REACHED);
+	BOOST_CHECK_EQUAL(events[2], (int)lsd::CACHE_HIGH_WATERMARK_REACHED);
+}
+
+BOOST_AUTO_TEST_SUITE_END();
+
+BOOST_AUTO_TEST_SUITE(test_slab_allocator);
+
+static void
+free_blocks(std::vector<void*>* blocks) {
+	for (size_t i = 0; i < blocks->size(); ++i) {
+		lsd::slab_allocator::deallocate((*blocks)[i]);
+	}
+}
+
+BOOST_AUTO_TEST_CASE(slab_allocator_test1) {
+	// blocks of every class and large ones, freed by another thread
+	std::vector<void*> blocks;
+	size_t sizes[] = {1, 48, 100, 4000, 65000, 100000};
+
+	for (size_t i = 0; i < 1000; ++i) {
+		size_t size = sizes[i % (sizeof(sizes) / sizeof(sizes[0]))];
+		void* block = lsd::slab_allocator::allocate(size);
+
+		BOOST_REQUIRE(block != NULL);
+		BOOST_CHECK_EQUAL((size_t)block % 16, 0u);
+		memset(block, (int)i, size);
+		blocks.push_back(block);
+	}
+
+	lsd::allocator_stats stats;
+	lsd::slab_allocator::get_stats(stats);
+
+	BOOST_REQUIRE_EQUAL(stats.classes.size(), lsd::slab_allocator::CLASSES_COUNT);
+	BOOST_CHECK_EQUAL(stats.classes[0].block_size, lsd::slab_allocator::MIN_BLOCK_SIZE);
+	BOOST_CHECK(stats.slab_bytes > 0);
+	BOOST_CHECK(stats.large_allocations >= 166u);
+
+	boost::thread releaser(boost::bind(&free_blocks, &blocks));
+	releaser.join();
+
+	lsd::slab_allocator::get_stats(stats);
+	BOOST_CHECK_EQUAL(stats.large_allocations, 0u);
+	BOOST_CHECK_EQUAL(stats.large_bytes, 0u);
+
+	// every carved block is either in depot or owned by some thread
+	for (size_t i = 0; i < stats.classes.size(); ++i) {
+		const lsd::allocator_class_stats& class_stats = stats.classes[i];
+		size_t blocks_count = class_stats.slabs * (lsd::slab_allocator::SLAB_SIZE / class_stats.block_size);
+		BOOST_CHECK_EQUAL(class_stats.depot_blocks + class_stats.thread_blocks, blocks_count);
+	}
+
+	// data containers keep payload in slabs
+	lsd::data_container dc1(sizes, sizeof(sizes));
+	lsd::data_container dc2(dc1);
+	BOOST_CHECK(dc1 == dc2);
+}
+
+BOOST_AUTO_TEST_SUITE_END();
+
+BOOST_AUTO_TEST_SUITE(test_data_container);
+
+BOOST_AUTO_TEST_CASE(data_container_test1) {
+	// copies share payload, frame reference outlives containers
+	const char payload[] = "some message payload";
+	void* frame_data = NULL;
+	void* frame_ref = NULL;
+
+	{
+		lsd::data_container dc1(payload, sizeof(payload));
+		lsd::data_container dc2(dc1);
+		lsd::data_container dc3;
+
+		BOOST_CHECK(dc3.empty());
+		dc3 = dc2;
+
+		BOOST_CHECK_EQUAL(dc1.data(), dc3.data());
+		BOOST_CHECK_EQUAL(dc3.size(), sizeof(payload));
+		BOOST_CHECK(dc1 == dc3);
+
+		dc2.clear();
+		BOOST_CHECK(dc2.empty());
+		BOOST_CHECK(dc2 != dc1);
+
+		frame_data = dc1.data();
+		frame_ref = dc1.add_reference();
+		BOOST_REQUIRE(frame_ref != NULL);
+	}
+
+	BOOST_CHECK_EQUAL(memcmp(frame_data, payload, sizeof(payload)), 0);
+	lsd::data_container::release_reference(frame_data, frame_ref);
+}
+
+BOOST_AUTO_TEST_CASE(data_container_test2) {
+	// xxh64 reference values
+	BOOST_CHECK_EQUAL(lsd::data_container::hash_data("", 0), 0xef46db3751d8e999ULL);
+	BOOST_CHECK_EQUAL(lsd::data_container::hash_data("abc", 3), 0x44bc2cf5ad770999ULL);
+
+	const char* text = "Nobody inspects the spammish repetition";
+	BOOST_CHECK_EQUAL(lsd::data_container::hash_data(text, strlen(text)), 0xfbcea83c8a378bf1ULL);
+
+	// big equal payloads share one buffer once dedup is on
+	std::vector<char> payload(2 * 1024 * 1024, 'x');
+	lsd::data_container::set_dedup_min_size(1024 * 1024);
+
+	lsd::data_container dc1(&payload[0], payload.size());
+	lsd::data_container dc2(&payload[0], payload.size());
+	BOOST_CHECK_EQUAL(dc1.data(), dc2.data());
+
+	payload[100] = 'y';
+	lsd::data_container dc3(&payload[0], payload.size());
+	BOOST_CHECK(dc3.data() != dc1.data());
+	BOOST_CHECK(dc3 != dc1);
+	BOOST_CHECK(dc3.fingerprint() != dc1.fingerprint());
+
+	// released buffers leave the store
+	dc1.clear();
+	dc2.clear();
+	lsd::data_container dc4(&payload[0], payload.size());
+	lsd::data_container dc5(dc3);
+	dc3.clear();
+	BOOST_CHECK_EQUAL(dc4.data(), dc5.data());
+
+	lsd::data_container::set_dedup_min_size(0);
+	lsd::data_container dc6(&payload[0], payload.size());
+	BOOST_CHECK(dc6.data() != dc4.data());
+	BOOST_CHECK(dc6 == dc4);
+	BOOST_CHECK_EQUAL(dc6.fingerprint(), dc4.fingerprint());
+}
+
+BOOST_AUTO_TEST_SUITE_END();
+
+BOOST_AUTO_TEST_SUITE(test_message_uuid);
+
+BOOST_AUTO_TEST_CASE(message_uuid_test1) {
+	// generated uuids are version 4 and survive string round trip
+	std::set<std::string> uuids;
+
+	for (int i = 0; i < 10000; ++i) {
+		lsd::message_uuid uuid = lsd::message_uuid::generate();
+		BOOST_REQUIRE_EQUAL(uuid.bytes[6] >> 4, 4);
+		BOOST_REQUIRE_EQUAL(uuid.bytes[8] >> 6, 2);
+
+		std::string str = uuid.as_string();
+		BOOST_REQUIRE_EQUAL(str[14], '4');
+		uuids.insert(str);
+
+		lsd::message_uuid parsed;
+		BOOST_REQUIRE_EQUAL(parsed.parse(str), true);
+		BOOST_REQUIRE_EQUAL(parsed == uuid, true);
+	}
+
+	BOOST_CHECK_EQUAL(uuids.size(), 10000u);
+}
+
+BOOST_AUTO_TEST_SUITE_END();
+
+BOOST_AUTO_TEST_SUITE(test_cached_message);
+
+BOOST_AUTO_TEST_CASE(cached_message_test1) {
+	// only hosts waited for complete, each of them once
+	lsd::message_path path("service", "handle");
+	lsd::message_policy policy;
+	policy.send_to_all_hosts = true;
+	lsd::cached_message msg(path, policy, "data", 4);
+
+	std::vector<lsd::LT::ip_addr> hosts;
+	hosts.push_back(1);
+	hosts.push_back(2);
+	hosts.push_back(3);
+	msg.start_broadcast(hosts);
+
+	BOOST_CHECK(!msg.is_broadcast_completed());
+	BOOST_CHECK(!msg.complete_broadcast_host(4, 0, ""));
+	BOOST_CHECK(msg.complete_broadcast_host(2, 0, ""));
+	BOOST_CHECK(!msg.complete_broadcast_host(2, 0, ""));
+	BOOST_CHECK(msg.complete_broadcast_host(1, 0, ""));
+	BOOST_CHECK(!msg.is_broadcast_completed());
+	BOOST_CHECK(msg.complete_broadcast_host(3, 0, ""));
+	BOOST_CHECK(msg.is_broadcast_completed());
+
+	// all hosts succeeded
+	int error_code = 0;
+	std::string error_message;
+	BOOST_CHECK(!msg.broadcast_error(error_code, error_message));
+	BOOST_CHECK_EQUAL(msg.broadcast().failed_hosts, 0u);
+	BOOST_CHECK_EQUAL(msg.broadcast().hosts_count, 3u);
+}
+
+BOOST_AUTO_TEST_CASE(cached_message_test2) {
+	// mixed result keeps the last error
+	lsd::message_path path("service", "handle");
+	lsd::message_policy policy;
+	policy.send_to_all_hosts = true;
+	lsd::cached_message msg(path, policy, "data", 4);
+
+	std::vector<lsd::LT::ip_addr> hosts;
+	hosts.push_back(1);
+	hosts.push_back(2);
+	hosts.push_back(3);
+	msg.start_broadcast(hosts);
+
+	BOOST_CHECK(msg.complete_broadcast_host(1, 503, "queue is full"));
+	BOOST_CHECK(msg.complete_broadcast_host(2, 0, ""));
+	BOOST_CHECK(msg.complete_broadcast_host(3, 520, "job has expired"));
+	BOOST_CHECK(msg.is_broadcast_completed());
+
+	int error_code = 0;
+	std::string error_message;
+	BOOST_REQUIRE(msg.broadcast_error(error_code, error_message));
+	BOOST_CHECK_EQUAL(error_code, 520);
+	BOOST_CHECK_EQUAL(error_message, "failed on 2 of 3 hosts, last error: job has expired");
+
+	// restarting broadcast forgets previous results
+	msg.start_broadcast(hosts);
+	BOOST_CHECK(!msg.broadcast_error(error_code, error_message));
+	BOOST_CHECK(!msg.is_broadcast_completed());
+}
+
+BOOST_AUTO_TEST_SUITE_END();
+
+BOOST_AUTO_TEST_SUITE(test_callback_executor);
+
+static void
+append_value(std::vector<int>* values, int value) {
+	values->push_back(value);
+}
+
+static void
+set_flag(boost::mutex* mutex, boost::condition_variable* cond, bool* flag) {
+	boost::mutex::scoped_lock lock(*mutex);
+	*flag = true;
+	cond->notify_all();
+}
+
+static void
+wait_released(boost::mutex* mutex, boost::condition_variable* cond, bool* started, bool* released) {
+	boost::mutex::scoped_lock lock(*mutex);
+	*started = true;
+	cond->notify_all();
+
+	while (!*released) {
+		cond->wait(lock);
+	}
+}
+
+BOOST_AUTO_TEST_CASE(callback_executor_test1) {
+	// tasks of one queue run in posting order, one at a time
+	boost::shared_ptr<lsd::base_logger> logger(new lsd::smart_logger<lsd::empty_logger>);
+	std::vector<std::vector<int> > values(4);
+
+	{
+		lsd::callback_executor executor(3, logger);
+		std::vector<lsd::callback_executor::queue_ptr_t> queues;
+
+		for (size_t i = 0; i < values.size(); ++i) {
+			queues.push_back(executor.create_queue());
+		}
+
+		for (int i = 0; i < 10000; ++i) {
+			for (size_t j = 0; j < queues.size(); ++j) {
+				executor.post(queues[j], boost::bind(&append_value, &values[j], i));
+			}
+		}
+	}
+
+	for (size_t i = 0; i < values.size(); ++i) {
+		BOOST_REQUIRE_EQUAL(values[i].size(), 10000u);
+
+		for (int j = 0; j < 10000; ++j) {
+			BOOST_REQUIRE_EQUAL(values[i][j], j);
+		}
+	}
+}
+
+BOOST_AUTO_TEST_CASE(callback_executor_test2) {
+	// blocked callback holds up neither the posting reactor thread nor other queues
+	boost::shared_ptr<lsd::base_logger> logger(new lsd::smart_logger<lsd::empty_logger>);
+	lsd::callback_executor executor(2, logger);
+
+	lsd::callback_executor::queue_ptr_t blocked = executor.create_queue();
+	lsd::callback_executor::queue_ptr_t other = executor.create_queue();
+
+	boost::mutex mutex;
+	boost::condition_variable cond;
+	bool started = false;
+	bool released = false;
+
+	executor.post(blocked, boost::bind(&wait_released, &mutex, &cond, &started, &released));
+
+	{
+		boost::mutex::scoped_lock lock(mutex);
+		while (!started) {
+			cond.wait(lock);
+		}
+	}
+
+	std::vector<int> blocked_values;
+	std::vector<int> other_values;
+
+	for (int i = 0; i < 100; ++i) {
+		executor.post(blocked, boost::bind(&append_value, &blocked_values, i));
+		executor.post(other, boost::bind(&append_value, &other_values, i));
+	}
+
+	// other queue drains while first one is still blocked
+	bool other_done = false;
+	executor.post(other, boost::bind(&set_flag, &mutex, &cond, &other_done));
+
+	{
+		boost::mutex::scoped_lock lock(mutex);
+		while (!other_done) {
+			cond.wait(lock);
+		}
+
+		BOOST_CHECK_EQUAL(other_values.size(), 100u);
+		BOOST_CHECK(blocked_values.empty());
+
+		released = true;
+		cond.notify_all();
+	}
+
+	// close waits for running task, pending ones are dropped with later posts
+	executor.close(blocked);
+	executor.post(blocked, boost::bind(&append_value, &blocked_values, -1));
+	BOOST_CHECK(blocked_values.size() <= 100u);
+	BOOST_CHECK(std::find(blocked_values.begin(), blocked_values.end(), -1) == blocked_values.end());
+}
+
+BOOST_AUTO_TEST_SUITE_END();